@@ -77,12 +77,27 @@ pub fn build(b: *std.Build) void {
     const run_unit_tests = b.addRunArtifact(main_tests);
     run_unit_tests.has_side_effects = true;
 
+    const bench_tests = b.addTest(.{
+        .name = "aindex-bench-tests",
+        .root_source_file = b.path("src/bench.zig"),
+        .target = target,
+        .optimize = optimize,
+    });
+
+    bench_tests.root_module.addImport("httpz", httpz.module("httpz"));
+    bench_tests.root_module.addImport("metrics", metrics.module("metrics"));
+    bench_tests.root_module.addImport("zul", zul.module("zul"));
+    bench_tests.root_module.addImport("msgpack", msgpack.module("msgpack"));
+
+    const run_bench_tests = b.addRunArtifact(bench_tests);
+
     const run_integration_tests = b.addSystemCommand(&[_][]const u8{ "pytest", "-vv", "tests/" });
     run_integration_tests.step.dependOn(b.getInstallStep());
     run_integration_tests.has_side_effects = true;
 
     var unit_tests_step = b.step("unit-tests", "Run unit tests");
     unit_tests_step.dependOn(&run_unit_tests.step);
+    unit_tests_step.dependOn(&run_bench_tests.step);
 
     var e2e_tests_step = b.step("e2e-tests", "Run e2e tests");
     e2e_tests_step.dependOn(&run_integration_tests.step);
@@ -90,4 +105,24 @@ pub fn build(b: *std.Build) void {
     const test_step = b.step("test", "Run all tests");
     test_step.dependOn(unit_tests_step);
     test_step.dependOn(e2e_tests_step);
+
+    const bench_exe = b.addExecutable(.{
+        .name = "fpindex-bench",
+        .root_source_file = b.path("src/bench.zig"),
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+
+    bench_exe.root_module.addImport("httpz", httpz.module("httpz"));
+    bench_exe.root_module.addImport("metrics", metrics.module("metrics"));
+    bench_exe.root_module.addImport("zul", zul.module("zul"));
+    bench_exe.root_module.addImport("msgpack", msgpack.module("msgpack"));
+
+    const run_bench = b.addRunArtifact(bench_exe);
+    if (b.args) |args| {
+        run_bench.addArgs(args);
+    }
+
+    const bench_step = b.step("bench", "Run benchmarks");
+    bench_step.dependOn(&run_bench.step);
 }
@@ -0,0 +1,219 @@
+const std = @import("std");
+const log = std.log.scoped(.block_cache);
+
+const Item = @import("segment.zig").Item;
+const SharedPtr = @import("utils/shared_ptr.zig").SharedPtr;
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+// Cache of decoded segment blocks, shared by all file segments.
+//
+// The cache is split into shards, each with its own lock and LRU list, so that
+// concurrent searches don't fight over a single mutex. Blocks are reference counted,
+// an evicted block stays alive until the last search using it releases it.
+
+pub const Options = struct {
+    // Memory budget for decoded items, in bytes.
+    max_size: usize,
+    num_shards: usize = 16,
+};
+
+pub const Key = struct {
+    segment_id: u64,
+    block_no: usize,
+};
+
+pub const Block = struct {
+    items: []Item,
+
+    fn deinit(self: *Block, allocator: std.mem.Allocator) void {
+        allocator.free(self.items);
+    }
+};
+
+pub const Handle = SharedPtr(Block);
+
+const Entry = struct {
+    key: Key,
+    block: Handle,
+    size: usize,
+};
+
+const Shard = struct {
+    lock: std.Thread.Mutex = .{},
+    entries: std.AutoHashMapUnmanaged(Key, *LruList.Node) = .{},
+    lru: LruList = .{},
+    size: usize = 0,
+};
+
+const LruList = std.DoublyLinkedList(Entry);
+
+var next_segment_id = std.atomic.Value(u64).init(1);
+
+// Returns a process-wide unique id, used to distinguish segments in cache keys.
+pub fn nextSegmentId() u64 {
+    return next_segment_id.fetchAdd(1, .monotonic);
+}
+
+allocator: std.mem.Allocator,
+shards: []Shard,
+max_shard_size: usize,
+
+pub fn init(allocator: std.mem.Allocator, options: Options) !Self {
+    std.debug.assert(options.num_shards > 0);
+
+    const shards = try allocator.alloc(Shard, options.num_shards);
+    for (shards) |*shard| {
+        shard.* = .{};
+    }
+
+    return .{
+        .allocator = allocator,
+        .shards = shards,
+        .max_shard_size = options.max_size / options.num_shards,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    for (self.shards) |*shard| {
+        while (shard.lru.pop()) |node| {
+            self.destroyNode(node);
+        }
+        shard.entries.deinit(self.allocator);
+    }
+    self.allocator.free(self.shards);
+}
+
+fn getShard(self: *Self, key: Key) *Shard {
+    const hash = std.hash.Wyhash.hash(0, std.mem.asBytes(&key));
+    return &self.shards[hash % self.shards.len];
+}
+
+fn destroyNode(self: *Self, node: *LruList.Node) void {
+    self.release(&node.data.block);
+    self.allocator.destroy(node);
+}
+
+// Returns the cached block, the caller must release it.
+pub fn get(self: *Self, key: Key) ?Handle {
+    const shard = self.getShard(key);
+
+    shard.lock.lock();
+    defer shard.lock.unlock();
+
+    const node = shard.entries.get(key) orelse {
+        metrics.blockCacheMiss();
+        return null;
+    };
+
+    shard.lru.remove(node);
+    shard.lru.prepend(node);
+
+    metrics.blockCacheHit();
+    return node.data.block.acquire();
+}
+
+// Checks if the block is cached, without counting it as a hit or miss.
+pub fn contains(self: *Self, key: Key) bool {
+    const shard = self.getShard(key);
+
+    shard.lock.lock();
+    defer shard.lock.unlock();
+
+    return shard.entries.contains(key);
+}
+
+// Adds decoded items to the cache, taking ownership of them, and returns a handle
+// to the cached block, the caller must release it.
+pub fn put(self: *Self, key: Key, items: []Item) !Handle {
+    var block = Handle.create(self.allocator, .{ .items = items }) catch |err| {
+        self.allocator.free(items);
+        return err;
+    };
+    const size = items.len * @sizeOf(Item) + @sizeOf(LruList.Node);
+    if (size > self.max_shard_size) {
+        return block;
+    }
+
+    const node = self.allocator.create(LruList.Node) catch {
+        return block;
+    };
+
+    const shard = self.getShard(key);
+
+    shard.lock.lock();
+    defer shard.lock.unlock();
+
+    const gop = shard.entries.getOrPut(self.allocator, key) catch {
+        self.allocator.destroy(node);
+        return block;
+    };
+    if (gop.found_existing) {
+        // another search decoded the same block in the meantime
+        self.allocator.destroy(node);
+        self.release(&block);
+        return gop.value_ptr.*.data.block.acquire();
+    }
+
+    node.data = .{ .key = key, .block = block.acquire(), .size = size };
+    gop.value_ptr.* = node;
+    shard.lru.prepend(node);
+    shard.size += size;
+
+    while (shard.size > self.max_shard_size) {
+        const last = shard.lru.pop() orelse break;
+        _ = shard.entries.remove(last.data.key);
+        shard.size -= last.data.size;
+        metrics.blockCacheEviction();
+        self.destroyNode(last);
+    }
+
+    return block;
+}
+
+pub fn release(self: *Self, block: *Handle) void {
+    block.release(self.allocator, Block.deinit, .{self.allocator});
+}
+
+fn testItems(allocator: std.mem.Allocator, n: usize) ![]Item {
+    const items = try allocator.alloc(Item, n);
+    for (items, 0..) |*item, i| {
+        item.* = .{ .hash = @intCast(i), .id = 1 };
+    }
+    return items;
+}
+
+test "BlockCache put/get" {
+    var cache = try Self.init(std.testing.allocator, .{ .max_size = 1024 * 1024, .num_shards = 2 });
+    defer cache.deinit();
+
+    const key: Key = .{ .segment_id = 1, .block_no = 0 };
+
+    try std.testing.expect(cache.get(key) == null);
+
+    var block1 = try cache.put(key, try testItems(std.testing.allocator, 10));
+    defer cache.release(&block1);
+
+    var block2 = cache.get(key) orelse return error.NotCached;
+    defer cache.release(&block2);
+
+    try std.testing.expectEqual(block1.value, block2.value);
+    try std.testing.expectEqual(10, block2.value.items.len);
+}
+
+test "BlockCache eviction" {
+    const block_size = 100 * @sizeOf(Item) + @sizeOf(LruList.Node);
+    var cache = try Self.init(std.testing.allocator, .{ .max_size = 2 * block_size, .num_shards = 1 });
+    defer cache.deinit();
+
+    for (0..3) |i| {
+        var block = try cache.put(.{ .segment_id = 1, .block_no = i }, try testItems(std.testing.allocator, 100));
+        cache.release(&block);
+    }
+
+    try std.testing.expect(cache.get(.{ .segment_id = 1, .block_no = 0 }) == null);
+
+    var block = cache.get(.{ .segment_id = 1, .block_no = 2 }) orelse return error.NotCached;
+    cache.release(&block);
+}
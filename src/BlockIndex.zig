@@ -0,0 +1,177 @@
+const std = @import("std");
+
+const Self = @This();
+
+// Index of the first hash in each block of a file segment.
+//
+// On top of the sorted list of hashes, we keep a few levels of samples, every
+// `fanout`-th entry of the level below, until the top level fits in a single node.
+// A lookup scans one node per level, instead of jumping all over the full array
+// like a binary search does. For sorted query hashes, lookupFrom() first gallops
+// from the previous position, which is cheap when the hashes are close together.
+
+pub const fanout = 16;
+pub const max_levels = 8;
+
+// Galloping beyond this distance falls back to the top-down lookup.
+const max_gallop_distance = fanout * fanout;
+
+items: std.ArrayListUnmanaged(u32) = .{},
+levels: [max_levels]std.ArrayListUnmanaged(u32) = [_]std.ArrayListUnmanaged(u32){.{}} ** max_levels,
+num_levels: usize = 0,
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    self.items.deinit(allocator);
+    for (&self.levels) |*level| {
+        level.deinit(allocator);
+    }
+}
+
+pub fn getMemoryUsage(self: Self) usize {
+    var result = self.items.capacity * @sizeOf(u32);
+    for (self.levels) |level| {
+        result += level.capacity * @sizeOf(u32);
+    }
+    return result;
+}
+
+pub fn count(self: Self) usize {
+    return self.items.items.len;
+}
+
+pub fn get(self: Self, block_no: usize) u32 {
+    return self.items.items[block_no];
+}
+
+pub fn ensureTotalCapacity(self: *Self, allocator: std.mem.Allocator, num_blocks: usize) !void {
+    try self.items.ensureTotalCapacity(allocator, num_blocks);
+}
+
+pub fn appendAssumeCapacity(self: *Self, hash: u32) void {
+    std.debug.assert(self.items.items.len == 0 or self.items.items[self.items.items.len - 1] <= hash);
+    self.items.appendAssumeCapacity(hash);
+}
+
+// Builds the sampled levels, must be called after all blocks were added.
+pub fn build(self: *Self, allocator: std.mem.Allocator) !void {
+    var prev = self.items.items;
+    self.num_levels = 0;
+    while (prev.len > fanout and self.num_levels < max_levels) {
+        const level = &self.levels[self.num_levels];
+        level.clearRetainingCapacity();
+        try level.ensureTotalCapacity(allocator, (prev.len + fanout - 1) / fanout);
+        var i: usize = 0;
+        while (i < prev.len) : (i += fanout) {
+            level.appendAssumeCapacity(prev[i]);
+        }
+        prev = level.items;
+        self.num_levels += 1;
+    }
+}
+
+fn getLevel(self: *const Self, n: usize) []const u32 {
+    if (n == 0) {
+        return self.items.items;
+    }
+    return self.levels[n - 1].items;
+}
+
+// Given the number of samples smaller than hash, returns the number of entries
+// smaller than hash in the level below.
+fn refine(level: []const u32, num_smaller_samples: usize, hash: u32) usize {
+    if (num_smaller_samples == 0) {
+        return 0;
+    }
+    var i = (num_smaller_samples - 1) * fanout + 1;
+    const end = @min(num_smaller_samples * fanout, level.len);
+    while (i < end and level[i] < hash) : (i += 1) {}
+    return i;
+}
+
+// Returns the first block whose first hash is not smaller than hash,
+// same as std.sort.lowerBound on the items.
+pub fn lookup(self: *const Self, hash: u32) usize {
+    const top = self.getLevel(self.num_levels);
+    var pos: usize = 0;
+    while (pos < top.len and top[pos] < hash) : (pos += 1) {}
+
+    var n = self.num_levels;
+    while (n > 0) : (n -= 1) {
+        pos = refine(self.getLevel(n - 1), pos, hash);
+    }
+    return pos;
+}
+
+// Same as lookup, but assumes the result is not smaller than start,
+// which is true for sorted query hashes.
+pub fn lookupFrom(self: *const Self, start: usize, hash: u32) usize {
+    const items = self.items.items;
+    if (start >= items.len or items[start] >= hash) {
+        return start;
+    }
+
+    // items[lo] < hash
+    var lo = start;
+    var step: usize = 1;
+    while (step <= max_gallop_distance) : (step *= 2) {
+        const hi = lo + step;
+        if (hi >= items.len or items[hi] >= hash) {
+            const end = @min(hi, items.len);
+            return lo + 1 + std.sort.lowerBound(u32, hash, items[lo + 1 .. end], {}, std.sort.asc(u32));
+        }
+        lo = hi;
+    }
+
+    return self.lookup(hash);
+}
+
+fn testIndex(allocator: std.mem.Allocator, num_blocks: usize, seed: u64) !Self {
+    var prng = std.Random.DefaultPrng.init(seed);
+    const rand = prng.random();
+
+    var index: Self = .{};
+    errdefer index.deinit(allocator);
+
+    try index.ensureTotalCapacity(allocator, num_blocks);
+    var hash: u32 = 0;
+    for (0..num_blocks) |_| {
+        hash += rand.intRangeAtMost(u32, 0, 100);
+        index.appendAssumeCapacity(hash);
+    }
+    try index.build(allocator);
+    return index;
+}
+
+test "lookup matches lowerBound" {
+    const allocator = std.testing.allocator;
+
+    for ([_]usize{ 0, 1, 15, 16, 17, 256, 1000, 10000 }) |num_blocks| {
+        var index = try testIndex(allocator, num_blocks, num_blocks);
+        defer index.deinit(allocator);
+
+        const max_hash = if (num_blocks > 0) index.get(num_blocks - 1) + 10 else 10;
+
+        var pos: usize = 0;
+        var hash: u32 = 0;
+        while (hash <= max_hash) : (hash += 1) {
+            const expected = std.sort.lowerBound(u32, hash, index.items.items, {}, std.sort.asc(u32));
+            try std.testing.expectEqual(expected, index.lookup(hash));
+            pos = index.lookupFrom(pos, hash);
+            try std.testing.expectEqual(expected, pos);
+        }
+    }
+}
+
+test "lookupFrom with large gaps" {
+    const allocator = std.testing.allocator;
+
+    var index = try testIndex(allocator, 100000, 1);
+    defer index.deinit(allocator);
+
+    var pos: usize = 0;
+    for ([_]u32{ 5, 100, 50000, 50001, 1000000, 4000000, 5000000, std.math.maxInt(u32) }) |hash| {
+        const expected = std.sort.lowerBound(u32, hash, index.items.items, {}, std.sort.asc(u32));
+        pos = index.lookupFrom(pos, hash);
+        try std.testing.expectEqual(expected, pos);
+    }
+}
@@ -0,0 +1,453 @@
+const std = @import("std");
+const log = std.log.scoped(.bulk_import);
+
+const Item = @import("segment.zig").Item;
+const SegmentInfo = @import("segment.zig").SegmentInfo;
+const MergedSegmentInfo = @import("segment_merger.zig").MergedSegmentInfo;
+const Insert = @import("change.zig").Insert;
+const filefmt = @import("filefmt.zig");
+const Index = @import("Index.zig");
+const Scheduler = @import("utils/Scheduler.zig");
+
+const Self = @This();
+
+// Offline import of documents, without the oplog, memory segments and merges. Items are
+// buffered up to a memory limit, sorted in parallel and written to temporary run files,
+// which are then merged straight into final-size file segments. The new segments are
+// added to the manifest after all existing ones, documents imported again replace the
+// old versions, like with normal updates.
+
+pub const Options = struct {
+    // Memory for buffering items before they are sorted and written to run files.
+    max_memory: usize = 1024 * 1024 * 1024,
+    // Number of items in one segment, the last segment can be smaller.
+    max_segment_size: usize = 750_000_000,
+    // Threads sorting and writing run files.
+    threads: usize = 4,
+};
+
+const run_file_prefix = "import.run.";
+const max_run_file_name_size = run_file_prefix.len + 20;
+const run_file_buffer_size = 64 * 1024;
+
+allocator: std.mem.Allocator,
+dir: std.fs.Dir,
+options: Options,
+
+pool: std.Thread.Pool = undefined,
+runs_in_progress: std.Thread.WaitGroup = .{},
+// limits the number of run buffers in memory
+free_buffers: std.Thread.Semaphore = .{},
+run_size: usize,
+run_error_lock: std.Thread.Mutex = .{},
+run_error: ?anyerror = null,
+
+next_version: u64,
+segments: std.ArrayListUnmanaged(SegmentInfo) = .{},
+
+// the segment that is being built
+segment: MergedSegmentInfo = .{},
+num_items: usize = 0,
+buffer: std.ArrayListUnmanaged(Item) = .{},
+run_ids: std.ArrayListUnmanaged(u64) = .{},
+next_run_id: u64 = 0,
+
+pub fn init(allocator: std.mem.Allocator, dir: std.fs.Dir, first_version: u64, options: Options) !Self {
+    const threads = @max(options.threads, 1);
+    var self = Self{
+        .allocator = allocator,
+        .dir = dir,
+        .options = options,
+        // one buffer being filled, and one being sorted and written by each thread
+        .run_size = @max(options.max_memory / ((threads + 1) * @sizeOf(Item)), 1024),
+        .next_version = first_version,
+        .free_buffers = .{ .permits = threads },
+    };
+    try self.pool.init(.{ .allocator = allocator, .n_jobs = @intCast(threads) });
+    return self;
+}
+
+pub fn deinit(self: *Self) void {
+    self.runs_in_progress.wait();
+    self.pool.deinit();
+
+    self.deleteRunFiles();
+    self.run_ids.deinit(self.allocator);
+    self.buffer.deinit(self.allocator);
+    self.segment.deinit(self.allocator);
+    self.segments.deinit(self.allocator);
+}
+
+pub fn addDoc(self: *Self, id: u32, hashes: []const u32) !void {
+    if (id == 0) {
+        return error.InvalidDocId;
+    }
+
+    // a newer version of the doc goes to the next segment
+    if (self.segment.docs.contains(id)) {
+        try self.finishSegment();
+    }
+    if (self.num_items > 0 and self.num_items + hashes.len > self.options.max_segment_size) {
+        try self.finishSegment();
+    }
+
+    try self.segment.docs.put(self.allocator, id, true);
+    if (self.segment.min_doc_id == 0 or id < self.segment.min_doc_id) {
+        self.segment.min_doc_id = id;
+    }
+    if (id > self.segment.max_doc_id) {
+        self.segment.max_doc_id = id;
+    }
+
+    for (hashes) |hash| {
+        if (self.buffer.items.len >= self.run_size) {
+            try self.flushRun();
+        }
+        if (self.buffer.capacity == 0) {
+            try self.buffer.ensureTotalCapacityPrecise(self.allocator, self.run_size);
+        }
+        self.buffer.appendAssumeCapacity(.{ .id = id, .hash = hash });
+    }
+    self.num_items += hashes.len;
+}
+
+// Returns the infos of all new segments.
+pub fn finish(self: *Self) ![]const SegmentInfo {
+    if (self.segment.docs.count() > 0) {
+        try self.finishSegment();
+    }
+    return self.segments.items;
+}
+
+fn buildRunFileName(buf: []u8, run_id: u64) []const u8 {
+    return std.fmt.bufPrint(buf, run_file_prefix ++ "{d}", .{run_id}) catch unreachable;
+}
+
+fn flushRun(self: *Self) !void {
+    if (self.buffer.items.len == 0) {
+        return;
+    }
+
+    try self.run_ids.ensureUnusedCapacity(self.allocator, 1);
+
+    const items = try self.buffer.toOwnedSlice(self.allocator);
+    const run_id = self.next_run_id;
+    self.next_run_id += 1;
+    self.run_ids.appendAssumeCapacity(run_id);
+
+    self.free_buffers.wait();
+    self.pool.spawnWg(&self.runs_in_progress, writeRunTask, .{ self, items, run_id });
+}
+
+fn writeRunTask(self: *Self, items: []Item, run_id: u64) void {
+    defer self.free_buffers.post();
+    defer self.allocator.free(items);
+
+    self.writeRun(items, run_id) catch |err| {
+        self.run_error_lock.lock();
+        defer self.run_error_lock.unlock();
+
+        if (self.run_error == null) {
+            self.run_error = err;
+        }
+    };
+}
+
+fn writeRun(self: *Self, items: []Item, run_id: u64) !void {
+    std.sort.pdq(Item, items, {}, Item.cmp);
+
+    var file_name_buf: [max_run_file_name_size]u8 = undefined;
+    var file = try self.dir.createFile(buildRunFileName(&file_name_buf, run_id), .{});
+    defer file.close();
+
+    try file.writeAll(std.mem.sliceAsBytes(items));
+}
+
+fn deleteRunFiles(self: *Self) void {
+    for (self.run_ids.items) |run_id| {
+        var file_name_buf: [max_run_file_name_size]u8 = undefined;
+        self.dir.deleteFile(buildRunFileName(&file_name_buf, run_id)) catch |err| {
+            if (err != error.FileNotFound) {
+                log.warn("failed to delete run file {}: {}", .{ run_id, err });
+            }
+        };
+    }
+    self.run_ids.clearRetainingCapacity();
+}
+
+fn finishSegment(self: *Self) !void {
+    try self.flushRun();
+    self.runs_in_progress.wait();
+    self.runs_in_progress.reset();
+
+    if (self.run_error) |err| {
+        return err;
+    }
+
+    self.segment.info = .{ .version = self.next_version };
+    try self.segments.ensureUnusedCapacity(self.allocator, 1);
+
+    log.info("writing segment {} (docs = {}, items = {}, runs = {})", .{ self.segment.info.version, self.segment.docs.count(), self.num_items, self.run_ids.items.len });
+
+    {
+        var reader = try MergeReader.init(self.allocator, self.dir, &self.segment, self.run_ids.items);
+        defer reader.deinit();
+
+        try filefmt.writeSegmentFile(self.allocator, self.dir, &reader, .{});
+
+        if (reader.err) |err| {
+            return err;
+        }
+    }
+
+    self.segments.appendAssumeCapacity(self.segment.info);
+    self.next_version += 1;
+
+    self.deleteRunFiles();
+    self.segment.deinit(self.allocator);
+    self.segment = .{};
+    self.num_items = 0;
+}
+
+const RunReader = struct {
+    file: std.fs.File,
+    buffered: std.io.BufferedReader(run_file_buffer_size, std.fs.File.Reader),
+    current: ?Item = null,
+
+    fn next(self: *RunReader) !void {
+        var buf: [@sizeOf(Item)]u8 = undefined;
+        const n = try self.buffered.reader().readAll(&buf);
+        if (n == 0) {
+            self.current = null;
+            return;
+        }
+        if (n < buf.len) {
+            return error.InvalidRunFile;
+        }
+        self.current = std.mem.bytesToValue(Item, &buf);
+    }
+};
+
+fn compareRuns(runs: []RunReader, a: usize, b: usize) std.math.Order {
+    const xa: u64 = @bitCast(runs[a].current.?);
+    const xb: u64 = @bitCast(runs[b].current.?);
+    return std.math.order(xa, xb);
+}
+
+// Merges sorted run files, it has the interface that writeSegmentFile expects.
+const MergeReader = struct {
+    segment: *const MergedSegmentInfo,
+    allocator: std.mem.Allocator,
+    runs: []RunReader,
+    queue: std.PriorityQueue(usize, []RunReader, compareRuns),
+    // reading errors are reported after the segment is written
+    err: ?anyerror = null,
+
+    fn init(allocator: std.mem.Allocator, dir: std.fs.Dir, segment: *const MergedSegmentInfo, run_ids: []const u64) !MergeReader {
+        const runs = try allocator.alloc(RunReader, run_ids.len);
+        var num_open: usize = 0;
+        errdefer {
+            for (runs[0..num_open]) |*run| run.file.close();
+            allocator.free(runs);
+        }
+
+        for (run_ids, runs) |run_id, *run| {
+            var file_name_buf: [max_run_file_name_size]u8 = undefined;
+            const file = try dir.openFile(buildRunFileName(&file_name_buf, run_id), .{});
+            run.* = .{ .file = file, .buffered = std.io.bufferedReaderSize(run_file_buffer_size, file.reader()) };
+            num_open += 1;
+        }
+
+        var queue = std.PriorityQueue(usize, []RunReader, compareRuns).init(allocator, runs);
+        errdefer queue.deinit();
+        try queue.ensureTotalCapacity(runs.len);
+
+        for (runs, 0..) |*run, i| {
+            try run.next();
+            if (run.current != null) {
+                queue.add(i) catch unreachable;
+            }
+        }
+
+        return .{
+            .segment = segment,
+            .allocator = allocator,
+            .runs = runs,
+            .queue = queue,
+        };
+    }
+
+    fn deinit(self: *MergeReader) void {
+        self.queue.deinit();
+        for (self.runs) |*run| {
+            run.file.close();
+        }
+        self.allocator.free(self.runs);
+    }
+
+    pub fn read(self: *MergeReader) !?Item {
+        if (self.err) |err| {
+            return err;
+        }
+        const i = self.queue.peek() orelse return null;
+        return self.runs[i].current.?;
+    }
+
+    pub fn advance(self: *MergeReader) void {
+        const i = self.queue.removeOrNull() orelse return;
+        self.runs[i].next() catch |err| {
+            self.err = err;
+            return;
+        };
+        if (self.runs[i].current != null) {
+            // the capacity is reserved in init
+            self.queue.add(i) catch unreachable;
+        }
+    }
+};
+
+pub const ImportStats = struct {
+    docs: usize = 0,
+    segments: usize = 0,
+};
+
+const max_line_size = 16 * 1024 * 1024;
+
+// Imports documents from JSON lines, e.g. {"id": 1, "hashes": [100, 200, 300]}, into the index.
+// The index is created if it doesn't exist. It must not be open by a running server.
+// The imported segments take commit ids that are not in the oplog, replicas reading the
+// oplog across them get error.CommitNotAvailable and copy the index again.
+pub fn importIndex(allocator: std.mem.Allocator, scheduler: *Scheduler, parent_dir: std.fs.Dir, name: []const u8, index_options: Index.Options, options: Options, input: anytype) !ImportStats {
+    // everything that's only in the oplog goes to segments first, the new segments come after it
+    {
+        var index = try Index.init(allocator, scheduler, parent_dir, name, index_options);
+        defer index.deinit();
+
+        try index.open(true);
+        try index.waitForReady(std.math.maxInt(u32));
+        try index.shutdown();
+    }
+
+    var dir = try parent_dir.openDir(name, .{ .iterate = true });
+    defer dir.close();
+
+    const manifest = try filefmt.readManifestFile(dir, allocator);
+    defer allocator.free(manifest);
+
+    var first_version: u64 = 1;
+    if (manifest.len > 0) {
+        first_version = manifest[manifest.len - 1].getLastCommitId() + 1;
+    }
+
+    var importer = try Self.init(allocator, dir, first_version, options);
+    defer importer.deinit();
+
+    var stats: ImportStats = .{};
+
+    var line = std.ArrayList(u8).init(allocator);
+    defer line.deinit();
+
+    while (true) {
+        line.clearRetainingCapacity();
+        input.streamUntilDelimiter(line.writer(), '\n', max_line_size) catch |err| {
+            if (err != error.EndOfStream) {
+                return err;
+            }
+            if (line.items.len == 0) {
+                break;
+            }
+        };
+
+        const trimmed = std.mem.trim(u8, line.items, " \r\t");
+        if (trimmed.len == 0) {
+            continue;
+        }
+
+        const doc = try std.json.parseFromSlice(Insert, allocator, trimmed, .{});
+        defer doc.deinit();
+
+        try importer.addDoc(doc.value.id, doc.value.hashes);
+        stats.docs += 1;
+    }
+
+    const new_segments = try importer.finish();
+    stats.segments = new_segments.len;
+
+    const segments = try std.mem.concat(allocator, SegmentInfo, &.{ manifest, new_segments });
+    defer allocator.free(segments);
+
+    // the new segments are visible only after this
+    try filefmt.writeManifestFile(dir, segments);
+
+    log.info("imported {} docs into index {s} ({} new segments)", .{ stats.docs, name, stats.segments });
+    return stats;
+}
+
+test "importIndex" {
+    const Change = @import("change.zig").Change;
+    const SearchResults = @import("common.zig").SearchResults;
+    const SearchResult = @import("common.zig").SearchResult;
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    // existing data, only in the oplog
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+        defer index.deinit();
+
+        try index.open(true);
+        try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = &.{ 1, 2, 3 } } }});
+        try index.update(&[_]Change{.{ .insert = .{ .id = 2, .hashes = &.{ 7, 8, 9 } } }});
+    }
+
+    var input = std.ArrayList(u8).init(std.testing.allocator);
+    defer input.deinit();
+
+    for (3..1003) |id| {
+        try input.writer().print("{{\"id\": {d}, \"hashes\": [{d}, {d}, {d}]}}\n", .{ id, id * 3, id * 3 + 1, id * 3 + 2 });
+    }
+    // replaces the doc from the oplog
+    try input.writer().print("{{\"id\": 1, \"hashes\": [10, 20, 30]}}\n", .{});
+
+    var stream = std.io.fixedBufferStream(input.items);
+
+    const stats = try importIndex(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{}, .{
+        .max_memory = 16 * 1024,
+        .max_segment_size = 1000,
+        .threads = 2,
+    }, stream.reader());
+
+    try std.testing.expectEqual(1001, stats.docs);
+    try std.testing.expectEqual(4, stats.segments);
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(false);
+    try index.waitForReady(10000);
+
+    const queries = [_]struct { hashes: [3]u32, expected: []const SearchResult }{
+        .{ .hashes = .{ 1, 2, 3 }, .expected = &.{} },
+        .{ .hashes = .{ 10, 20, 30 }, .expected = &.{.{ .id = 1, .score = 3 }} },
+        .{ .hashes = .{ 7, 8, 9 }, .expected = &.{.{ .id = 2, .score = 3 }} },
+        .{ .hashes = .{ 1500, 1501, 1502 }, .expected = &.{.{ .id = 500, .score = 3 }} },
+    };
+    for (queries) |query| {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        var hashes = query.hashes;
+        try index.search(&hashes, &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, query.expected, collector.getResults());
+    }
+
+    // updates continue after the imported segments
+    try index.update(&[_]Change{.{ .insert = .{ .id = 3, .hashes = &.{ 1, 2, 3 } } }});
+}
@@ -0,0 +1,199 @@
+const std = @import("std");
+
+const Self = @This();
+
+// Table of documents in a file segment, sorted doc ids and a bitset
+// with their status (set = active, unset = deleted).
+//
+// The encoded table can be used directly from the mmaped segment file, so loading
+// a segment doesn't need to allocate anything per document. Tables for segments in
+// the legacy format are decoded into a heap buffer with the same layout.
+//
+// The API mirrors the subset of std.AutoHashMapUnmanaged(u32, bool) used by the
+// generic segment code.
+
+ids: []const u8 = &.{},
+statuses: []const u8 = &.{},
+owned_data: ?[]u8 = null,
+
+const id_size = @sizeOf(u32);
+
+pub fn encodedSize(num_docs: usize) usize {
+    return num_docs * id_size + (num_docs + 7) / 8;
+}
+
+// Returns a table using the given data, which needs to outlive the table.
+pub fn fromBytes(data: []const u8, num_docs: usize) !Self {
+    if (data.len < encodedSize(num_docs)) {
+        return error.InvalidDocTable;
+    }
+    const ids_size = num_docs * id_size;
+    return .{
+        .ids = data[0..ids_size],
+        .statuses = data[ids_size..encodedSize(num_docs)],
+    };
+}
+
+// Builds a table from a hash map of doc id -> status.
+pub fn fromHashMap(allocator: std.mem.Allocator, docs: std.AutoHashMapUnmanaged(u32, bool)) !Self {
+    const num_docs = docs.count();
+
+    const data = try allocator.alloc(u8, encodedSize(num_docs));
+    errdefer allocator.free(data);
+
+    var stream = std.io.fixedBufferStream(data);
+    try encode(allocator, docs, stream.writer());
+
+    var self = try fromBytes(data, num_docs);
+    self.owned_data = data;
+    return self;
+}
+
+// Writes the table for a hash map of doc id -> status.
+pub fn encode(allocator: std.mem.Allocator, docs: std.AutoHashMapUnmanaged(u32, bool), writer: anytype) !void {
+    const ids = try allocator.alloc(u32, docs.count());
+    defer allocator.free(ids);
+
+    var i: usize = 0;
+    var iter = docs.keyIterator();
+    while (iter.next()) |key_ptr| : (i += 1) {
+        ids[i] = key_ptr.*;
+    }
+    std.sort.pdq(u32, ids, {}, std.sort.asc(u32));
+
+    for (ids) |id| {
+        try writer.writeInt(u32, id, .little);
+    }
+
+    var byte: u8 = 0;
+    for (ids, 0..) |id, j| {
+        if (docs.get(id) orelse unreachable) {
+            byte |= @as(u8, 1) << @intCast(j % 8);
+        }
+        if (j % 8 == 7) {
+            try writer.writeByte(byte);
+            byte = 0;
+        }
+    }
+    if (ids.len % 8 != 0) {
+        try writer.writeByte(byte);
+    }
+}
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    if (self.owned_data) |data| {
+        allocator.free(data);
+    }
+    self.* = .{};
+}
+
+pub fn count(self: Self) u32 {
+    return @intCast(self.ids.len / id_size);
+}
+
+pub fn getId(self: Self, index: usize) u32 {
+    return std.mem.readInt(u32, self.ids[index * id_size ..][0..id_size], .little);
+}
+
+pub fn getStatus(self: Self, index: usize) bool {
+    return (self.statuses[index / 8] >> @intCast(index % 8)) & 1 != 0;
+}
+
+pub fn getMinDocId(self: Self) u32 {
+    return if (self.count() > 0) self.getId(0) else 0;
+}
+
+pub fn getMaxDocId(self: Self) u32 {
+    return if (self.count() > 0) self.getId(self.count() - 1) else 0;
+}
+
+fn find(self: Self, doc_id: u32) ?usize {
+    var lo: usize = 0;
+    var hi: usize = self.count();
+    while (lo < hi) {
+        const mid = lo + (hi - lo) / 2;
+        const id = self.getId(mid);
+        if (id == doc_id) {
+            return mid;
+        } else if (id < doc_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return null;
+}
+
+pub fn get(self: Self, doc_id: u32) ?bool {
+    const index = self.find(doc_id) orelse return null;
+    return self.getStatus(index);
+}
+
+pub fn contains(self: Self, doc_id: u32) bool {
+    return self.find(doc_id) != null;
+}
+
+const status_values = [2]bool{ false, true };
+
+pub const Entry = struct {
+    key_ptr: *const u32,
+    value_ptr: *const bool,
+};
+
+pub const Iterator = struct {
+    table: *const Self,
+    index: usize = 0,
+    key: u32 = 0,
+
+    pub fn next(self: *Iterator) ?Entry {
+        if (self.index >= self.table.count()) {
+            return null;
+        }
+        self.key = self.table.getId(self.index);
+        const status = self.table.getStatus(self.index);
+        self.index += 1;
+        return .{
+            .key_ptr = &self.key,
+            .value_ptr = &status_values[@intFromBool(status)],
+        };
+    }
+};
+
+pub fn iterator(self: *const Self) Iterator {
+    return .{ .table = self };
+}
+
+test "DocTable" {
+    const allocator = std.testing.allocator;
+
+    var docs: std.AutoHashMapUnmanaged(u32, bool) = .{};
+    defer docs.deinit(allocator);
+
+    for (1..20) |i| {
+        try docs.put(allocator, @intCast(i * 10), i % 3 != 0);
+    }
+
+    var table = try fromHashMap(allocator, docs);
+    defer table.deinit(allocator);
+
+    try std.testing.expectEqual(19, table.count());
+    try std.testing.expectEqual(10, table.getMinDocId());
+    try std.testing.expectEqual(190, table.getMaxDocId());
+
+    try std.testing.expectEqual(true, table.get(10));
+    try std.testing.expectEqual(false, table.get(30));
+    try std.testing.expectEqual(null, table.get(35));
+    try std.testing.expect(table.contains(190));
+    try std.testing.expect(!table.contains(200));
+
+    var num_docs: usize = 0;
+    var prev_id: u32 = 0;
+    var iter = table.iterator();
+    while (iter.next()) |entry| {
+        try std.testing.expect(entry.key_ptr.* > prev_id);
+        try std.testing.expectEqual(docs.get(entry.key_ptr.*).?, entry.value_ptr.*);
+        prev_id = entry.key_ptr.*;
+        num_docs += 1;
+    }
+    try std.testing.expectEqual(19, num_docs);
+}
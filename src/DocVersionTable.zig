@@ -0,0 +1,429 @@
+const std = @import("std");
+
+const RefCounter = @import("utils/shared_ptr.zig").RefCounter;
+const DocInfo = @import("common.zig").DocInfo;
+
+const Self = @This();
+
+// Latest version (commit id) and status of every document in the index.
+//
+// It's a radix tree over the doc id, four levels of small inner nodes and leaves
+// with 256 documents each. Nodes are reference counted and shared between snapshots.
+// Cloning only takes a reference to the root, an update copies the nodes on the path
+// to the changed documents that are still shared with other snapshots, nodes with
+// refcount one are modified in place.
+//
+// Leaves store versions relative to a base version in 32 bits, commit ids of one
+// index rarely span more than that. Leaves that need a wider range are converted
+// to 64-bit entries.
+
+const leaf_bits = 8;
+const inner_bits = 6;
+const num_inner_levels = (@bitSizeOf(u32) - leaf_bits) / inner_bits;
+
+comptime {
+    std.debug.assert(leaf_bits + num_inner_levels * inner_bits == @bitSizeOf(u32));
+}
+
+const leaf_size = 1 << leaf_bits;
+const inner_size = 1 << inner_bits;
+
+// Wide entries are (version << 1) | deleted, zero means the document is not known.
+// Narrow entries are ((version - base + 1) << 1) | deleted, zero means the same.
+const WideEntry = u64;
+const NarrowEntry = u32;
+
+const WideEntries = [leaf_size]WideEntry;
+
+const max_narrow_delta = (1 << (@bitSizeOf(NarrowEntry) - 1)) - 2;
+
+const Leaf = struct {
+    refs: RefCounter(u32),
+    base: u64,
+    narrow: [leaf_size]NarrowEntry,
+    wide: ?*WideEntries = null,
+
+    fn getEntry(self: *const Leaf, i: usize) WideEntry {
+        if (self.wide) |wide| {
+            return wide[i];
+        }
+        const entry = self.narrow[i];
+        if (entry == 0) {
+            return 0;
+        }
+        const version = (entry >> 1) - 1 + self.base;
+        return (version << 1) | (entry & 1);
+    }
+
+    fn setEntry(self: *Leaf, nodes: anytype, i: usize, version: u64, deleted: bool) !void {
+        if (self.wide == null and (version < self.base or version - self.base > max_narrow_delta)) {
+            try self.widen(nodes);
+        }
+        if (self.wide) |wide| {
+            wide[i] = (version << 1) | @intFromBool(deleted);
+        } else {
+            self.narrow[i] = @intCast(((version - self.base + 1) << 1) | @intFromBool(deleted));
+        }
+    }
+
+    fn widen(self: *Leaf, nodes: anytype) !void {
+        const wide = try nodes.create(WideEntries);
+        for (wide, 0..) |*entry, i| {
+            entry.* = self.getEntry(i);
+        }
+        self.wide = wide;
+    }
+};
+
+fn Inner(comptime Child: type) type {
+    return struct {
+        refs: RefCounter(u32),
+        children: [inner_size]?*Child,
+
+        pub const ChildType = Child;
+    };
+}
+
+const Inner1 = Inner(Leaf);
+const Inner2 = Inner(Inner1);
+const Inner3 = Inner(Inner2);
+const Root = Inner(Inner3);
+
+root: ?*Root = null,
+
+// Nodes come either from the heap, or from a reservation made before the update.
+const HeapNodes = struct {
+    allocator: std.mem.Allocator,
+
+    fn create(self: HeapNodes, comptime T: type) !*T {
+        return self.allocator.create(T);
+    }
+};
+
+const node_types = .{ Leaf, Inner1, Inner2, Inner3, Root, WideEntries };
+
+fn nodeTypeIndex(comptime T: type) usize {
+    inline for (node_types, 0..) |U, i| {
+        if (U == T) {
+            return i;
+        }
+    }
+    @compileError("not a node type");
+}
+
+// Nodes allocated in advance, so that applying an update to the table can't fail
+// after the update was committed, see reserve() and setReserved().
+pub const Reservation = struct {
+    allocator: std.mem.Allocator,
+    nodes: [node_types.len]std.ArrayListUnmanaged(*anyopaque) = [_]std.ArrayListUnmanaged(*anyopaque){.{}} ** node_types.len,
+
+    pub fn deinit(self: *Reservation) void {
+        inline for (node_types, 0..) |T, i| {
+            for (self.nodes[i].items) |ptr| {
+                self.allocator.destroy(@as(*T, @ptrCast(@alignCast(ptr))));
+            }
+            self.nodes[i].deinit(self.allocator);
+        }
+    }
+
+    fn add(self: *Reservation, comptime T: type, count: usize) !void {
+        const list = &self.nodes[nodeTypeIndex(T)];
+        try list.ensureUnusedCapacity(self.allocator, count);
+        for (0..count) |_| {
+            list.appendAssumeCapacity(try self.allocator.create(T));
+        }
+    }
+
+    fn create(self: *Reservation, comptime T: type) !*T {
+        const list = &self.nodes[nodeTypeIndex(T)];
+        std.debug.assert(list.items.len > 0);
+        return @ptrCast(@alignCast(list.pop()));
+    }
+};
+
+// Reserves all nodes that setting the given documents can need, in the worst case
+// where none of the nodes on their paths can be modified in place.
+pub fn reserve(allocator: std.mem.Allocator, sorted_doc_ids: []const u32) !Reservation {
+    var reservation = Reservation{ .allocator = allocator };
+    errdefer reservation.deinit();
+
+    if (sorted_doc_ids.len > 0) {
+        try reservation.add(Root, 1);
+    }
+    inline for (.{ Leaf, Inner1, Inner2, Inner3 }, 0..) |T, level| {
+        const shift = leaf_bits + level * inner_bits;
+        var count: usize = 0;
+        for (sorted_doc_ids, 0..) |doc_id, i| {
+            if (i == 0 or (sorted_doc_ids[i - 1] >> shift) != (doc_id >> shift)) {
+                count += 1;
+            }
+        }
+        try reservation.add(T, count);
+        if (T == Leaf) {
+            // a copied or widened leaf needs at most one wide array
+            try reservation.add(WideEntries, count);
+        }
+    }
+    return reservation;
+}
+
+fn isShared(refs: *RefCounter(u32)) bool {
+    return refs.refs.load(.acquire) > 1;
+}
+
+fn release(comptime T: type, allocator: std.mem.Allocator, node: *T) void {
+    if (!node.refs.decr()) {
+        return;
+    }
+    if (T == Leaf) {
+        if (node.wide) |wide| {
+            allocator.destroy(wide);
+        }
+    } else {
+        for (node.children) |maybe_child| {
+            if (maybe_child) |child| {
+                release(T.ChildType, allocator, child);
+            }
+        }
+    }
+    allocator.destroy(node);
+}
+
+fn createNode(comptime T: type, nodes: anytype, base: u64) !*T {
+    const node = try nodes.create(T);
+    if (T == Leaf) {
+        node.* = .{ .refs = RefCounter(u32).init(), .base = base, .narrow = [_]NarrowEntry{0} ** leaf_size };
+    } else {
+        node.* = .{ .refs = RefCounter(u32).init(), .children = [_]?*T.ChildType{null} ** inner_size };
+    }
+    return node;
+}
+
+fn copyNode(comptime T: type, nodes: anytype, node: *const T) !*T {
+    const copy = try nodes.create(T);
+    errdefer nodes.allocator.destroy(copy);
+    if (T == Leaf) {
+        copy.* = .{ .refs = RefCounter(u32).init(), .base = node.base, .narrow = node.narrow };
+        if (node.wide) |wide| {
+            const wide_copy = try nodes.create(WideEntries);
+            wide_copy.* = wide.*;
+            copy.wide = wide_copy;
+        }
+    } else {
+        copy.* = .{ .refs = RefCounter(u32).init(), .children = node.children };
+        for (copy.children) |maybe_child| {
+            if (maybe_child) |child| {
+                child.refs.incr();
+            }
+        }
+    }
+    return copy;
+}
+
+// Returns the node in ptr, copied if it's shared with other snapshots, or a new one.
+fn getMutable(comptime T: type, nodes: anytype, ptr: *?*T, base: u64) !*T {
+    if (ptr.*) |node| {
+        if (!isShared(&node.refs)) {
+            return node;
+        }
+        const copy = try copyNode(T, nodes, node);
+        release(T, nodes.allocator, node);
+        ptr.* = copy;
+        return copy;
+    }
+    const node = try createNode(T, nodes, base);
+    ptr.* = node;
+    return node;
+}
+
+fn childIndex(doc_id: u32, comptime level: usize) usize {
+    return (doc_id >> (leaf_bits + level * inner_bits)) & (inner_size - 1);
+}
+
+pub fn deinit(self: *Self, allocator: std.mem.Allocator) void {
+    if (self.root) |root| {
+        release(Root, allocator, root);
+    }
+    self.* = .{};
+}
+
+// Returns a new snapshot sharing all nodes with this one.
+pub fn clone(self: *const Self) Self {
+    if (self.root) |root| {
+        root.refs.incr();
+    }
+    return .{ .root = self.root };
+}
+
+fn getLeaf(self: *const Self, doc_id: u32) ?*const Leaf {
+    const root = self.root orelse return null;
+    const inner3 = root.children[childIndex(doc_id, 3)] orelse return null;
+    const inner2 = inner3.children[childIndex(doc_id, 2)] orelse return null;
+    const inner1 = inner2.children[childIndex(doc_id, 1)] orelse return null;
+    return inner1.children[childIndex(doc_id, 0)];
+}
+
+fn getEntry(self: *const Self, doc_id: u32) WideEntry {
+    const leaf = self.getLeaf(doc_id) orelse return 0;
+    return leaf.getEntry(doc_id & (leaf_size - 1));
+}
+
+// Returns the latest version of the document, or zero if it's not known.
+pub fn getVersion(self: *const Self, doc_id: u32) u64 {
+    return self.getEntry(doc_id) >> 1;
+}
+
+pub fn get(self: *const Self, doc_id: u32) ?DocInfo {
+    const entry = self.getEntry(doc_id);
+    if (entry == 0) {
+        return null;
+    }
+    return .{ .version = entry >> 1, .deleted = entry & 1 != 0 };
+}
+
+fn getMutableLeaf(self: *Self, nodes: anytype, doc_id: u32, version: u64) !*Leaf {
+    const root = try getMutable(Root, nodes, &self.root, version);
+    const inner3 = try getMutable(Inner3, nodes, &root.children[childIndex(doc_id, 3)], version);
+    const inner2 = try getMutable(Inner2, nodes, &inner3.children[childIndex(doc_id, 2)], version);
+    const inner1 = try getMutable(Inner1, nodes, &inner2.children[childIndex(doc_id, 1)], version);
+    return getMutable(Leaf, nodes, &inner1.children[childIndex(doc_id, 0)], version);
+}
+
+fn setWith(self: *Self, nodes: anytype, doc_id: u32, version: u64, deleted: bool) !void {
+    std.debug.assert(version > 0 and version < (1 << 63));
+    const leaf = try self.getMutableLeaf(nodes, doc_id, version);
+    try leaf.setEntry(nodes, doc_id & (leaf_size - 1), version, deleted);
+}
+
+// Sets the document version. Must not be called on a snapshot that is visible to readers.
+pub fn set(self: *Self, allocator: std.mem.Allocator, doc_id: u32, version: u64, deleted: bool) !void {
+    try self.setWith(HeapNodes{ .allocator = allocator }, doc_id, version, deleted);
+}
+
+// Same as set(), but never fails, the document must be in the reservation.
+pub fn setReserved(self: *Self, reservation: *Reservation, doc_id: u32, version: u64, deleted: bool) void {
+    self.setWith(reservation, doc_id, version, deleted) catch unreachable;
+}
+
+// Fills a new table, e.g. from segment doc tables on load. Documents should come in doc id
+// order, consecutive documents in the same leaf then don't need to walk the tree.
+pub const Builder = struct {
+    table: *Self,
+    allocator: std.mem.Allocator,
+    leaf: ?*Leaf = null,
+    leaf_doc_id: u32 = 0,
+
+    pub fn set(self: *Builder, doc_id: u32, version: u64, deleted: bool) !void {
+        std.debug.assert(version > 0 and version < (1 << 63));
+        const leaf_doc_id = doc_id & ~@as(u32, leaf_size - 1);
+        if (self.leaf == null or self.leaf_doc_id != leaf_doc_id) {
+            self.leaf = try self.table.getMutableLeaf(HeapNodes{ .allocator = self.allocator }, doc_id, version);
+            self.leaf_doc_id = leaf_doc_id;
+        }
+        try self.leaf.?.setEntry(HeapNodes{ .allocator = self.allocator }, doc_id & (leaf_size - 1), version, deleted);
+    }
+};
+
+pub fn builder(self: *Self, allocator: std.mem.Allocator) Builder {
+    return .{ .table = self, .allocator = allocator };
+}
+
+test "DocVersionTable" {
+    const allocator = std.testing.allocator;
+
+    var table1: Self = .{};
+    defer table1.deinit(allocator);
+
+    try table1.set(allocator, 1, 10, false);
+    try table1.set(allocator, 1000000, 11, false);
+    try table1.set(allocator, std.math.maxInt(u32), 12, true);
+
+    var table2 = table1.clone();
+    defer table2.deinit(allocator);
+
+    try table2.set(allocator, 1, 20, true);
+    try table2.set(allocator, 2, 21, false);
+
+    try std.testing.expectEqual(DocInfo{ .version = 10, .deleted = false }, table1.get(1).?);
+    try std.testing.expectEqual(null, table1.get(2));
+    try std.testing.expectEqual(DocInfo{ .version = 11, .deleted = false }, table1.get(1000000).?);
+    try std.testing.expectEqual(DocInfo{ .version = 12, .deleted = true }, table1.get(std.math.maxInt(u32)).?);
+
+    try std.testing.expectEqual(DocInfo{ .version = 20, .deleted = true }, table2.get(1).?);
+    try std.testing.expectEqual(DocInfo{ .version = 21, .deleted = false }, table2.get(2).?);
+    try std.testing.expectEqual(DocInfo{ .version = 11, .deleted = false }, table2.get(1000000).?);
+    try std.testing.expectEqual(21, table2.getVersion(2));
+    try std.testing.expectEqual(0, table2.getVersion(3));
+}
+
+test "DocVersionTable only copies touched nodes" {
+    const allocator = std.testing.allocator;
+
+    var table1: Self = .{};
+    defer table1.deinit(allocator);
+
+    try table1.set(allocator, 1, 10, false);
+    try table1.set(allocator, 1000000, 11, false);
+
+    var table2 = table1.clone();
+    defer table2.deinit(allocator);
+
+    try std.testing.expectEqual(table1.root, table2.root);
+
+    try table2.set(allocator, 2, 12, false);
+
+    // the path to doc 1 and 2 was copied, the one to doc 1000000 is shared
+    try std.testing.expect(table1.root.? != table2.root.?);
+    try std.testing.expect(table1.getLeaf(1).? != table2.getLeaf(2).?);
+    try std.testing.expectEqual(table1.getLeaf(1000000).?, table2.getLeaf(1000000).?);
+}
+
+test "DocVersionTable wide versions" {
+    const allocator = std.testing.allocator;
+
+    var table: Self = .{};
+    defer table.deinit(allocator);
+
+    var b = table.builder(allocator);
+    try b.set(1, 1000, false);
+    try b.set(2, 1001, true);
+
+    // older than the leaf base, and too far from it
+    try table.set(allocator, 3, 5, false);
+    try table.set(allocator, 4, 1 << 40, true);
+
+    try std.testing.expectEqual(DocInfo{ .version = 1000, .deleted = false }, table.get(1).?);
+    try std.testing.expectEqual(DocInfo{ .version = 1001, .deleted = true }, table.get(2).?);
+    try std.testing.expectEqual(DocInfo{ .version = 5, .deleted = false }, table.get(3).?);
+    try std.testing.expectEqual(DocInfo{ .version = 1 << 40, .deleted = true }, table.get(4).?);
+    try std.testing.expectEqual(null, table.get(5));
+}
+
+test "DocVersionTable reservation" {
+    const allocator = std.testing.allocator;
+
+    var table1: Self = .{};
+    defer table1.deinit(allocator);
+
+    try table1.set(allocator, 1, 10, false);
+    try table1.set(allocator, 300, 10, false);
+
+    var table2 = table1.clone();
+    defer table2.deinit(allocator);
+
+    // every node on the paths is shared, so all of them are copied
+    const doc_ids = [_]u32{ 1, 2, 1000000 };
+    var reservation = try reserve(allocator, &doc_ids);
+    defer reservation.deinit();
+
+    table2.setReserved(&reservation, 1, 20, true);
+    table2.setReserved(&reservation, 2, 20, false);
+    table2.setReserved(&reservation, 1000000, 20, false);
+
+    try std.testing.expectEqual(DocInfo{ .version = 10, .deleted = false }, table1.get(1).?);
+    try std.testing.expectEqual(null, table1.get(1000000));
+    try std.testing.expectEqual(DocInfo{ .version = 20, .deleted = true }, table2.get(1).?);
+    try std.testing.expectEqual(DocInfo{ .version = 20, .deleted = false }, table2.get(2).?);
+    try std.testing.expectEqual(DocInfo{ .version = 10, .deleted = false }, table2.get(300).?);
+    try std.testing.expectEqual(DocInfo{ .version = 20, .deleted = false }, table2.get(1000000).?);
+}
@@ -5,6 +5,7 @@ const assert = std.debug.assert;
 const common = @import("common.zig");
 const SearchResults = common.SearchResults;
 const KeepOrDelete = common.KeepOrDelete;
+const MemoryUsage = common.MemoryUsage;
 const Deadline = @import("utils/Deadline.zig");
 
 const Item = @import("segment.zig").Item;
@@ -13,35 +14,92 @@ const SegmentStatus = @import("segment.zig").SegmentStatus;
 const metrics = @import("metrics.zig");
 
 const filefmt = @import("filefmt.zig");
+const BlockCache = @import("BlockCache.zig");
+const BlockIndex = @import("BlockIndex.zig");
+const DocTable = @import("DocTable.zig");
+const HashStats = @import("HashStats.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
+const SearchProfile = @import("SearchProfile.zig");
+const BatchReader = @import("utils/BatchReader.zig");
+const mapped_memory = @import("utils/mapped_memory.zig");
 
 const Self = @This();
 
+// How blocks are read. With mmap, searches use the mapped file and the page cache decides
+// what stays in memory. With pread, only the header, doc table and block index are used
+// from the mapping, the blocks a search needs are read from the file in one batch and
+// decoded blocks can be kept in the block cache. That works better for indexes much larger
+// than RAM, where page faults would block searches one block at a time.
+pub const IoMode = enum { mmap, pread };
+
+// Blocks read at once by sequential readers in pread mode.
+pub const read_ahead_blocks = 64;
+
 pub const Options = struct {
     dir: std.fs.Dir,
+    block_cache: ?*BlockCache = null,
+    // If disabled, load() only validates the header and footer, and verify() needs to be called later.
+    verify_checksum_on_load: bool = true,
+    // Throttling of segment file writes, see filefmt.WriteSegmentFileOptions.
+    write_rate_limiter: ?*RateLimiter = null,
+    drop_cache_on_write: bool = false,
+    // Ask for transparent huge pages for the mapped file.
+    huge_pages: bool = false,
+    io_mode: IoMode = .mmap,
+    // Optional reader for the batched block reads in pread mode, can be shared by all segments.
+    batch_reader: ?*BatchReader = null,
 };
 
 allocator: std.mem.Allocator,
 dir: std.fs.Dir,
+block_cache: ?*BlockCache,
+cache_id: u64,
+verify_checksum_on_load: bool,
+write_rate_limiter: ?*RateLimiter,
+drop_cache_on_write: bool,
+huge_pages: bool,
+io_mode: IoMode,
+batch_reader: ?*BatchReader,
 info: SegmentInfo = .{},
 status: SegmentStatus = .{},
 attributes: std.StringHashMapUnmanaged(u64) = .{},
-docs: std.AutoHashMapUnmanaged(u32, bool) = .{},
+docs: DocTable = .{},
 min_doc_id: u32 = 0,
 max_doc_id: u32 = 0,
-index: std.ArrayListUnmanaged(u32) = .{},
+index: BlockIndex = .{},
+hash_stats: HashStats = .{},
 block_size: usize = 0,
+block_format: filefmt.BlockFormat = .v1,
 blocks: []const u8,
+// position of the first block in the file
+blocks_offset: u64 = 0,
 merged: u32 = 0,
 num_items: usize = 0,
 delete_in_deinit: bool = false,
 
+// checksum of all blocks, as stored in the footer
+checksum: u64 = 0,
+verified: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+// set when the checksum doesn't match, the segment is then excluded from searches and merges
+quarantined: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+
 mmaped_file: ?std.fs.File = null,
 mmaped_data: ?[]align(std.mem.page_size) u8 = null,
+// the mapped file is locked in memory
+memory_locked: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
 
 pub fn init(allocator: std.mem.Allocator, options: Options) Self {
     return Self{
         .allocator = allocator,
         .dir = options.dir,
+        .block_cache = options.block_cache,
+        .cache_id = BlockCache.nextSegmentId(),
+        .verify_checksum_on_load = options.verify_checksum_on_load,
+        .write_rate_limiter = options.write_rate_limiter,
+        .drop_cache_on_write = options.drop_cache_on_write,
+        .huge_pages = options.huge_pages,
+        .io_mode = options.io_mode,
+        .batch_reader = options.batch_reader,
         .blocks = undefined,
     };
 }
@@ -68,16 +126,290 @@ pub fn deinit(self: *Self, delete_file: KeepOrDelete) void {
     }
 }
 
+// Contents of the whole segment file, as mapped in memory.
+pub fn getFileData(self: Self) ?[]const u8 {
+    return self.mmaped_data;
+}
+
+// Locks or unlocks the mapped file in memory. Locking can fail, e.g. because of RLIMIT_MEMLOCK,
+// the segment then stays unlocked. Unmapping the file releases the lock. In pread mode, blocks
+// are not used from the mapping, so there is nothing to lock. Returns whether the segment is
+// locked afterwards. Not thread-safe, the index serializes the calls.
+pub fn setMemoryLocked(self: *Self, locked: bool) bool {
+    if (self.io_mode == .pread) {
+        return false;
+    }
+    const data = self.mmaped_data orelse return false;
+    if (self.memory_locked.load(.acquire) == locked) {
+        return locked;
+    }
+    if (locked) {
+        mapped_memory.lock(data) catch |err| {
+            log.warn("failed to lock segment {}:{} in memory: {}", .{ self.info.version, self.info.merges, err });
+            return false;
+        };
+    } else {
+        mapped_memory.unlock(data);
+    }
+    self.memory_locked.store(locked, .release);
+    return locked;
+}
+
+pub fn isMemoryLocked(self: *const Self) bool {
+    return self.memory_locked.load(.acquire);
+}
+
+// Size of the mapped file that is currently in the page cache.
+pub fn getResidentSize(self: Self) usize {
+    const data = self.mmaped_data orelse return 0;
+    return mapped_memory.getResidentSize(data) catch 0;
+}
+
+// Only for the mmap mode, see readBlocks for pread.
 pub fn getBlockData(self: Self, block: usize) []const u8 {
     return self.blocks[block * self.block_size .. (block + 1) * self.block_size];
 }
 
+// Reads consecutive blocks from the file, the buffer size decides how many.
+pub fn readBlocks(self: Self, first_block: usize, buffer: []u8) !void {
+    assert(buffer.len % self.block_size == 0);
+    try BatchReader.readAllWithPread(&.{.{
+        .file = self.mmaped_file.?,
+        .offset = self.blocks_offset + first_block * self.block_size,
+        .buffer = buffer,
+    }});
+    metrics.segmentBlockReads(1, buffer.len / self.block_size);
+}
+
+// Blocks read for one search in pread mode, sorted by block number.
+const PrefetchedBlocks = struct {
+    block_nos: std.ArrayListUnmanaged(usize) = .{},
+    data: []u8 = &.{},
+
+    fn deinit(self: *PrefetchedBlocks, allocator: std.mem.Allocator) void {
+        self.block_nos.deinit(allocator);
+        allocator.free(self.data);
+    }
+
+    fn get(self: *const PrefetchedBlocks, block_no: usize, block_size: usize) ?[]const u8 {
+        const i = std.sort.binarySearch(usize, block_no, self.block_nos.items, {}, orderBlockNo) orelse return null;
+        return self.data[i * block_size .. (i + 1) * block_size];
+    }
+
+    fn orderBlockNo(_: void, a: usize, b: usize) std.math.Order {
+        return std.math.order(a, b);
+    }
+};
+
+// Reads all blocks the search can need, except the ones in the block cache, in one batch.
+// Contiguous blocks are read together. The lookup is the same as in search(), but without
+// the cut-off after max_docs_per_hash, so a few blocks can be read for nothing.
+fn prefetchBlocks(self: *const Self, sorted_hashes: []const u32, blocks: *PrefetchedBlocks) !void {
+    var prev_block_range_start: usize = 0;
+    var next_block_no: usize = 0;
+    for (sorted_hashes) |hash| {
+        var block_no = self.index.lookupFrom(prev_block_range_start, hash);
+        if (block_no > 0) {
+            block_no -= 1;
+        }
+        prev_block_range_start = block_no;
+
+        block_no = @max(block_no, next_block_no);
+        while (block_no < self.index.count() and self.index.get(block_no) <= hash) : (block_no += 1) {
+            if (self.block_cache) |cache| {
+                if (cache.contains(.{ .segment_id = self.cache_id, .block_no = block_no })) {
+                    continue;
+                }
+            }
+            try blocks.block_nos.append(self.allocator, block_no);
+        }
+        next_block_no = block_no;
+    }
+
+    const block_nos = blocks.block_nos.items;
+    if (block_nos.len == 0) {
+        return;
+    }
+
+    blocks.data = try self.allocator.alloc(u8, block_nos.len * self.block_size);
+
+    var requests = std.ArrayList(BatchReader.Request).init(self.allocator);
+    defer requests.deinit();
+
+    var i: usize = 0;
+    while (i < block_nos.len) {
+        var j = i + 1;
+        while (j < block_nos.len and block_nos[j] == block_nos[j - 1] + 1) {
+            j += 1;
+        }
+        try requests.append(.{
+            .file = self.mmaped_file.?,
+            .offset = self.blocks_offset + block_nos[i] * self.block_size,
+            .buffer = blocks.data[i * self.block_size .. j * self.block_size],
+        });
+        i = j;
+    }
+
+    if (self.batch_reader) |batch_reader| {
+        try batch_reader.readAll(requests.items);
+    } else {
+        try BatchReader.readAllWithPread(requests.items);
+    }
+    metrics.segmentBlockReads(requests.items.len, block_nos.len);
+}
+
+// Finds items matching hashes in one block at a time. Without a cache, items are
+// decoded lazily, only up to the hash we are looking for. With a cache, the whole
+// block is decoded once and shared with other searches.
+const BlockSearcher = struct {
+    segment: *const Self,
+    block_no: usize = std.math.maxInt(usize),
+    cursor: filefmt.BlockCursor = undefined,
+    cached: ?BlockCache.Handle = null,
+    cached_pos: usize = 0,
+    decode_stats: metrics.BlockDecodeStats = .{},
+    num_opened: u64 = 0,
+    // decoding is only timed for profiled searches, it's too expensive for every block
+    timed: bool = false,
+    // pread mode, blocks that were not prefetched are read into the buffer
+    prefetched: ?*const PrefetchedBlocks = null,
+    buffer: [filefmt.max_block_size]u8 = undefined,
+
+    fn deinit(self: *BlockSearcher) void {
+        self.releaseCached();
+        metrics.blockDecode(self.segment.block_format, self.decode_stats);
+    }
+
+    fn releaseCached(self: *BlockSearcher) void {
+        if (self.cached) |*block| {
+            self.segment.block_cache.?.release(block);
+            self.cached = null;
+        }
+    }
+
+    fn startTimer(self: *const BlockSearcher) ?std.time.Timer {
+        if (!self.timed) {
+            return null;
+        }
+        return std.time.Timer.start() catch null;
+    }
+
+    fn readTimer(timer: *?std.time.Timer) ?u64 {
+        if (timer.*) |*t| {
+            return t.read();
+        }
+        return null;
+    }
+
+    fn getBlockData(self: *BlockSearcher, block_no: usize) ![]const u8 {
+        const segment = self.segment;
+        if (segment.io_mode == .mmap) {
+            return segment.getBlockData(block_no);
+        }
+        if (self.prefetched) |prefetched| {
+            if (prefetched.get(block_no, segment.block_size)) |block_data| {
+                return block_data;
+            }
+        }
+        // evicted from the block cache after prefetching
+        const block_data = self.buffer[0..segment.block_size];
+        try segment.readBlocks(block_no, block_data);
+        return block_data;
+    }
+
+    fn open(self: *BlockSearcher, block_no: usize) !void {
+        self.releaseCached();
+        self.block_no = block_no;
+        self.num_opened += 1;
+
+        const segment = self.segment;
+
+        if (segment.block_cache) |cache| {
+            const key: BlockCache.Key = .{ .segment_id = segment.cache_id, .block_no = block_no };
+            self.cached = cache.get(key) orelse blk: {
+                const block_data = try self.getBlockData(block_no);
+                var items = std.ArrayList(Item).init(cache.allocator);
+                defer items.deinit();
+                var timer = self.startTimer();
+                try filefmt.readBlock(segment.block_format, block_data, &items, segment.min_doc_id);
+                self.decode_stats.add(items.items.len, readTimer(&timer));
+                break :blk try cache.put(key, try items.toOwnedSlice());
+            };
+            self.cached_pos = 0;
+        } else {
+            const block_data = try self.getBlockData(block_no);
+            self.cursor = try filefmt.BlockCursor.init(segment.block_format, block_data, segment.min_doc_id);
+        }
+    }
+
+    // Counts all items matching the hash. The position stays right after them,
+    // so the next call must use a greater hash.
+    fn collect(self: *BlockSearcher, hash: u32, multiplicity: usize, results: *SearchResults) !usize {
+        const version = self.segment.info.getLastCommitId();
+        if (self.cached) |block| {
+            const items = block.value.items[self.cached_pos..];
+            const matches = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, items, {}, Item.cmpByHash);
+            for (items[matches[0]..matches[1]]) |item| {
+                for (0..multiplicity) |_| {
+                    try results.incr(item.id, version);
+                }
+            }
+            self.cached_pos += matches[1];
+            return matches[1] - matches[0];
+        }
+
+        var timer = self.startTimer();
+        const start_index = self.cursor.index;
+        defer self.decode_stats.add(self.cursor.index - start_index, readTimer(&timer));
+
+        try self.cursor.skipTo(hash);
+        var num_matches: usize = 0;
+        while (self.cursor.peek()) |item| {
+            if (item.hash != hash) {
+                break;
+            }
+            for (0..multiplicity) |_| {
+                try results.incr(item.id, version);
+            }
+            num_matches += 1;
+            try self.cursor.advance();
+        }
+        return num_matches;
+    }
+};
+
+// Returns the number of items with the hash, if it's frequent in this segment, zero otherwise.
+pub fn getHashFrequency(self: Self, hash: u32) u32 {
+    return self.hash_stats.getFrequency(hash);
+}
+
 pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
-    var prev_block_no: usize = std.math.maxInt(usize);
+    if (self.quarantined.load(.acquire)) {
+        return;
+    }
+
     var prev_block_range_start: usize = 0;
 
-    var block_items = std.ArrayList(Item).init(results.allocator);
-    defer block_items.deinit();
+    var searcher = BlockSearcher{ .segment = &self, .timed = results.profile != null };
+    defer searcher.deinit();
+
+    var prefetched: PrefetchedBlocks = .{};
+    defer prefetched.deinit(self.allocator);
+
+    if (self.io_mode == .pread) {
+        try self.prefetchBlocks(sorted_hashes, &prefetched);
+        searcher.prefetched = &prefetched;
+    }
+
+    var profile = SearchProfile.SegmentScope.begin(results.profile, .file, self.info);
+    defer {
+        if (profile.enabled()) {
+            profile.segment.blocks = searcher.num_opened;
+            profile.segment.decoded_items = searcher.decode_stats.items;
+            profile.segment.decode_ns = searcher.decode_stats.nanoseconds;
+        }
+        profile.end();
+    }
 
     // Let's say we have blocks like this:
     //
@@ -88,8 +420,20 @@ pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, d
     // We want to find hash=7, lowerBound returns block=2 (9), but block=1 could still contain hash=6, so we go one back.
     // We want to find hash=10, lowerBound returns block=3 (EOF), but block=2 could still contain hash=6, so we go one back.
 
-    for (sorted_hashes, 1..) |hash, i| {
-        var block_no = std.sort.lowerBound(u32, hash, self.index.items[prev_block_range_start..], {}, std.sort.asc(u32)) + prev_block_range_start;
+    var num_hashes: usize = 0;
+    var i: usize = 0;
+    while (i < sorted_hashes.len) {
+        const hash = sorted_hashes[i];
+
+        // Duplicate query hashes are counted multiple times, but the block
+        // searcher can only move forward, so we need to process them at once.
+        var multiplicity: usize = 1;
+        while (i + multiplicity < sorted_hashes.len and sorted_hashes[i + multiplicity] == hash) {
+            multiplicity += 1;
+        }
+        i += multiplicity;
+
+        var block_no = self.index.lookupFrom(prev_block_range_start, hash);
         if (block_no > 0) {
             block_no -= 1;
         }
@@ -97,19 +441,15 @@ pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, d
 
         var num_docs: usize = 0;
         var num_blocks: u64 = 0;
-        while (block_no < self.index.items.len and self.index.items[block_no] <= hash) : (block_no += 1) {
-            if (block_no != prev_block_no) {
-                prev_block_no = block_no;
-                const block_data = self.getBlockData(block_no);
-                try filefmt.readBlock(block_data, &block_items, self.min_doc_id);
+        var cut_off = false;
+        while (block_no < self.index.count() and self.index.get(block_no) <= hash) : (block_no += 1) {
+            if (block_no != searcher.block_no) {
+                try searcher.open(block_no);
             }
-            const matches = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, block_items.items, {}, Item.cmpByHash);
-            for (matches[0]..matches[1]) |j| {
-                try results.incr(block_items.items[j].id, self.info.version);
-            }
-            num_docs += matches[1] - matches[0];
-            if (num_docs > 1000) {
-                break; // XXX explain why
+            num_docs += try searcher.collect(hash, multiplicity, results);
+            if (num_docs > results.options.max_docs_per_hash) {
+                cut_off = true;
+                break; // see SearchOptions.max_docs_per_hash
             }
             num_blocks += 1;
         }
@@ -117,14 +457,60 @@ pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, d
         metrics.scannedDocsPerHash(num_docs);
         metrics.scannedBlocksPerHash(num_blocks);
 
-        if (i % 10 == 0) {
+        if (profile.enabled()) {
+            profile.segment.hashes += 1;
+            profile.segment.postings += num_docs;
+            profile.segment.hashes_cut_off += @intFromBool(cut_off);
+        }
+
+        num_hashes += multiplicity;
+        if (num_hashes >= 10) {
+            num_hashes = 0;
             try deadline.check();
         }
     }
 }
 
 pub fn load(self: *Self, info: SegmentInfo) !void {
-    try filefmt.readSegmentFile(self.dir, info, self);
+    try filefmt.readSegmentFile(self.dir, info, self, .{
+        .verify_checksum = self.verify_checksum_on_load,
+        .huge_pages = self.huge_pages,
+        .release_blocks = self.io_mode == .pread,
+    });
+}
+
+// Computes the checksum of all blocks and compares it with the one from the footer.
+// On mismatch, the segment is quarantined.
+pub fn verify(self: *Self) !void {
+    if (self.verified.load(.acquire)) {
+        return;
+    }
+
+    var crc = std.hash.crc.Crc64Xz.init();
+    if (self.io_mode == .pread) {
+        const buffer = try self.allocator.alloc(u8, read_ahead_blocks * self.block_size);
+        defer self.allocator.free(buffer);
+
+        var block_no: usize = 0;
+        while (block_no < self.index.count()) {
+            const num_blocks = @min(read_ahead_blocks, self.index.count() - block_no);
+            const block_data = buffer[0 .. num_blocks * self.block_size];
+            try self.readBlocks(block_no, block_data);
+            crc.update(block_data);
+            block_no += num_blocks;
+        }
+    } else {
+        for (0..self.index.count()) |block_no| {
+            crc.update(self.getBlockData(block_no));
+        }
+    }
+
+    if (crc.final() != self.checksum) {
+        self.quarantined.store(true, .release);
+        return error.InvalidSegment;
+    }
+
+    self.verified.store(true, .release);
 }
 
 pub fn delete(self: *Self) void {
@@ -152,7 +538,10 @@ pub fn build(self: *Self, source: anytype) !void {
     var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
     const file_name = filefmt.buildSegmentFileName(&file_name_buf, source.segment.info);
 
-    try filefmt.writeSegmentFile(self.dir, source);
+    try filefmt.writeSegmentFile(self.allocator, self.dir, source, .{
+        .rate_limiter = self.write_rate_limiter,
+        .drop_cache = self.drop_cache_on_write,
+    });
 
     errdefer self.dir.deleteFile(file_name) catch |err| {
         if (err != error.FileNotFound) {
@@ -160,7 +549,10 @@ pub fn build(self: *Self, source: anytype) !void {
         }
     };
 
-    try filefmt.readSegmentFile(self.dir, source.segment.info, self);
+    try filefmt.readSegmentFile(self.dir, source.segment.info, self, .{
+        .huge_pages = self.huge_pages,
+        .release_blocks = self.io_mode == .pread,
+    });
 }
 
 test "build" {
@@ -191,13 +583,242 @@ test "build" {
 
     try std.testing.expectEqualDeep(SegmentInfo{ .version = 1, .merges = 0 }, segment.info);
     try std.testing.expectEqual(1, segment.docs.count());
-    try std.testing.expectEqual(1, segment.index.items.len);
+    try std.testing.expectEqual(1, segment.index.count());
+}
+
+fn testSearch(block_cache: ?*BlockCache, io_mode: IoMode) !void {
+    const MemorySegment = @import("MemorySegment.zig");
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var source = MemorySegment.init(std.testing.allocator, .{});
+    defer source.deinit(.delete);
+
+    source.info = .{ .version = 1 };
+    source.status.frozen = true;
+    try source.build(&.{
+        .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 1, 2, 3 } } },
+        .{ .insert = .{ .id = 2, .hashes = &[_]u32{ 2, 3, 4 } } },
+    });
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    var batch_reader = BatchReader.init(std.testing.allocator, .{});
+    defer batch_reader.deinit();
+
+    var segment = Self.init(std.testing.allocator, .{
+        .dir = tmp_dir.dir,
+        .block_cache = block_cache,
+        .io_mode = io_mode,
+        .batch_reader = &batch_reader,
+    });
+    defer segment.deinit(.delete);
+
+    try segment.build(&source_reader);
+
+    for (0..2) |_| {
+        var results = SearchResults.init(std.testing.allocator, .{});
+        defer results.deinit();
+
+        try segment.search(&[_]u32{ 1, 3, 3, 4 }, &results, .{});
+
+        try std.testing.expectEqual(common.SearchResult{ .id = 1, .score = 3 }, results.get(1).?);
+        try std.testing.expectEqual(common.SearchResult{ .id = 2, .score = 3 }, results.get(2).?);
+    }
+}
+
+test "search" {
+    try testSearch(null, .mmap);
+}
+
+test "search with block cache" {
+    var block_cache = try BlockCache.init(std.testing.allocator, .{ .max_size = 1024 * 1024 });
+    defer block_cache.deinit();
+
+    try testSearch(&block_cache, .mmap);
+}
+
+test "search in pread mode" {
+    try testSearch(null, .pread);
+}
+
+test "search in pread mode with block cache" {
+    var block_cache = try BlockCache.init(std.testing.allocator, .{ .max_size = 1024 * 1024 });
+    defer block_cache.deinit();
+
+    try testSearch(&block_cache, .pread);
+}
+
+test "reader in pread mode" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Change = @import("change.zig").Change;
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var source = MemorySegment.init(std.testing.allocator, .{});
+    defer source.deinit(.delete);
+
+    // enough items for more blocks than are read ahead at once
+    const hashes_per_doc = 100;
+    var changes: [1000]Change = undefined;
+    const hashes = try std.testing.allocator.alloc(u32, changes.len * hashes_per_doc);
+    defer std.testing.allocator.free(hashes);
+    for (hashes, 0..) |*hash, i| {
+        hash.* = @intCast(i * 1000);
+    }
+    for (&changes, 0..) |*change, i| {
+        change.* = .{ .insert = .{ .id = @intCast(i + 1), .hashes = hashes[i * hashes_per_doc .. (i + 1) * hashes_per_doc] } };
+    }
+
+    source.info = .{ .version = 1 };
+    source.status.frozen = true;
+    try source.build(&changes);
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    var segment = Self.init(std.testing.allocator, .{ .dir = tmp_dir.dir, .io_mode = .pread, .verify_checksum_on_load = false });
+    defer segment.deinit(.keep);
+
+    try segment.build(&source_reader);
+    try std.testing.expect(segment.index.count() > read_ahead_blocks);
+
+    var segment2 = Self.init(std.testing.allocator, .{ .dir = tmp_dir.dir, .io_mode = .pread, .verify_checksum_on_load = false });
+    defer segment2.deinit(.keep);
+
+    try segment2.load(segment.info);
+    try segment2.verify();
+
+    var reader2 = segment2.reader();
+    defer reader2.close();
+
+    var num_items: usize = 0;
+    while (try reader2.read()) |item| {
+        try std.testing.expectEqual(hashes[num_items], item.hash);
+        num_items += 1;
+        reader2.advance();
+    }
+    try std.testing.expectEqual(hashes.len, num_items);
+}
+
+test "hash stats" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Change = @import("change.zig").Change;
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var source = MemorySegment.init(std.testing.allocator, .{});
+    defer source.deinit(.delete);
+
+    // hash 1 is in all docs, hash 2 only in the first one
+    var changes: [HashStats.min_items + 50]Change = undefined;
+    for (&changes, 0..) |*change, i| {
+        change.* = .{ .insert = .{ .id = @intCast(i + 1), .hashes = if (i == 0) &[_]u32{ 1, 2 } else &[_]u32{1} } };
+    }
+
+    source.info = .{ .version = 1 };
+    source.status.frozen = true;
+    try source.build(&changes);
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    var segment = Self.init(std.testing.allocator, .{ .dir = tmp_dir.dir });
+    defer segment.deinit(.delete);
+
+    try segment.build(&source_reader);
+
+    try std.testing.expectEqual(changes.len, segment.getHashFrequency(1));
+    try std.testing.expectEqual(0, segment.getHashFrequency(2));
+
+    var results = SearchResults.init(std.testing.allocator, .{});
+    defer results.deinit();
+
+    try segment.search(&[_]u32{ 1, 2 }, &results, .{});
+
+    try std.testing.expectEqual(common.SearchResult{ .id = 1, .score = 2 }, results.get(1).?);
+    try std.testing.expectEqual(changes.len, results.count());
+}
+
+test "deferred checksum verification" {
+    const MemorySegment = @import("MemorySegment.zig");
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var source = MemorySegment.init(std.testing.allocator, .{});
+    defer source.deinit(.delete);
+
+    source.info = .{ .version = 1 };
+    try source.build(&.{
+        .{ .insert = .{ .id = 1, .hashes = &[_]u32{ 1, 2, 3 } } },
+    });
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    const options: Options = .{ .dir = tmp_dir.dir, .verify_checksum_on_load = false };
+
+    var segment = Self.init(std.testing.allocator, options);
+    defer segment.deinit(.keep);
+
+    try segment.build(&source_reader);
+    try std.testing.expect(segment.verified.load(.acquire));
+
+    var segment2 = Self.init(std.testing.allocator, options);
+    defer segment2.deinit(.keep);
+
+    try segment2.load(segment.info);
+    try std.testing.expect(!segment2.verified.load(.acquire));
+    try segment2.verify();
+    try std.testing.expect(segment2.verified.load(.acquire));
+
+    // corrupt the unused tail of the first block, the block still decodes fine
+    const offset = @intFromPtr(segment.blocks.ptr) - @intFromPtr(segment.mmaped_data.?.ptr) + segment.block_size - 1;
+    {
+        var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+        const file_name = filefmt.buildSegmentFileName(&file_name_buf, segment.info);
+        var file = try tmp_dir.dir.openFile(file_name, .{ .mode = .read_write });
+        defer file.close();
+        try file.pwriteAll(&[_]u8{0xff}, offset);
+    }
+
+    var segment3 = Self.init(std.testing.allocator, options);
+    defer segment3.deinit(.keep);
+
+    try segment3.load(segment.info);
+    try std.testing.expectError(error.InvalidSegment, segment3.verify());
+    try std.testing.expect(segment3.quarantined.load(.acquire));
+
+    var results = SearchResults.init(std.testing.allocator, .{});
+    defer results.deinit();
+    try segment3.search(&[_]u32{ 1, 2, 3 }, &results, .{});
+    try std.testing.expectEqual(0, results.count());
+
+    var segment4 = Self.init(std.testing.allocator, .{ .dir = tmp_dir.dir });
+    defer segment4.deinit(.keep);
+
+    try std.testing.expectError(error.InvalidSegment, segment4.load(segment.info));
 }
 
 pub fn getSize(self: Self) usize {
     return self.num_items;
 }
 
+// Mapped blocks are counted as if they were all in the page cache. In pread mode, blocks
+// are only in the block cache, which is counted separately.
+pub fn addMemoryUsage(self: Self, usage: *MemoryUsage) void {
+    if (self.io_mode == .mmap) {
+        usage.file_segment_blocks += self.blocks.len;
+    }
+    usage.file_segment_docs += self.docs.ids.len + self.docs.statuses.len;
+    usage.block_index += self.index.getMemoryUsage();
+}
+
 pub fn reader(self: *const Self) Reader {
     return .{
         .segment = self,
@@ -210,21 +831,45 @@ pub const Reader = struct {
     items: std.ArrayList(Item),
     index: usize = 0,
     block_no: usize = 0,
+    // pread mode, blocks are read ahead into the buffer
+    buffer: []u8 = &.{},
+    buffer_block_no: usize = 0,
+    buffer_num_blocks: usize = 0,
 
     pub fn close(self: *Reader) void {
         self.items.deinit();
+        self.segment.allocator.free(self.buffer);
+    }
+
+    fn getBlockData(self: *Reader, block_no: usize) ![]const u8 {
+        const segment = self.segment;
+        if (segment.io_mode == .mmap) {
+            return segment.getBlockData(block_no);
+        }
+        if (block_no < self.buffer_block_no or block_no >= self.buffer_block_no + self.buffer_num_blocks) {
+            if (self.buffer.len == 0) {
+                self.buffer = try segment.allocator.alloc(u8, read_ahead_blocks * segment.block_size);
+            }
+            const num_blocks = @min(read_ahead_blocks, segment.index.count() - block_no);
+            self.buffer_num_blocks = 0;
+            try segment.readBlocks(block_no, self.buffer[0 .. num_blocks * segment.block_size]);
+            self.buffer_block_no = block_no;
+            self.buffer_num_blocks = num_blocks;
+        }
+        const offset = (block_no - self.buffer_block_no) * segment.block_size;
+        return self.buffer[offset .. offset + segment.block_size];
     }
 
     pub fn read(self: *Reader) !?Item {
         while (self.index >= self.items.items.len) {
-            if (self.block_no >= self.segment.index.items.len) {
+            if (self.block_no >= self.segment.index.count()) {
                 return null;
             }
             self.items.clearRetainingCapacity();
             self.index = 0;
-            const block_data = self.segment.getBlockData(self.block_no);
+            const block_data = try self.getBlockData(self.block_no);
             self.block_no += 1;
-            try filefmt.readBlock(block_data, &self.items, self.segment.min_doc_id);
+            try filefmt.readBlock(self.segment.block_format, block_data, &self.items, self.segment.min_doc_id);
         }
         return self.items.items[self.index];
     }
@@ -234,4 +879,13 @@ pub const Reader = struct {
             self.index += 1;
         }
     }
+
+    // Returns the remaining items of the current block, or the next decoded block.
+    // The returned slice is valid until the next call.
+    pub fn readBatch(self: *Reader) !?[]const Item {
+        _ = try self.read() orelse return null;
+        const batch = self.items.items[self.index..];
+        self.index = self.items.items.len;
+        return batch;
+    }
 };
@@ -0,0 +1,143 @@
+const std = @import("std");
+
+const Self = @This();
+
+// Table of frequent hashes in a file segment, sorted hashes and the number of
+// items with each of them.
+//
+// Only hashes with at least min_items items in the segment are included, for
+// all other hashes getFrequency returns zero. Like DocTable, the encoded table
+// can be used directly from the mmaped segment file.
+
+pub const min_items = 100;
+
+hashes: []const u8 = &.{},
+counts: []const u8 = &.{},
+
+const value_size = @sizeOf(u32);
+
+pub fn encodedSize(num_hashes: usize) usize {
+    return 2 * num_hashes * value_size;
+}
+
+// Returns a table using the given data, which needs to outlive the table.
+pub fn fromBytes(data: []const u8, num_hashes: usize) !Self {
+    if (data.len < encodedSize(num_hashes)) {
+        return error.InvalidHashStats;
+    }
+    const hashes_size = num_hashes * value_size;
+    return .{
+        .hashes = data[0..hashes_size],
+        .counts = data[hashes_size..encodedSize(num_hashes)],
+    };
+}
+
+pub fn count(self: Self) u32 {
+    return @intCast(self.hashes.len / value_size);
+}
+
+fn getHash(self: Self, index: usize) u32 {
+    return std.mem.readInt(u32, self.hashes[index * value_size ..][0..value_size], .little);
+}
+
+fn getCount(self: Self, index: usize) u32 {
+    return std.mem.readInt(u32, self.counts[index * value_size ..][0..value_size], .little);
+}
+
+// Returns the number of items with the hash, or zero if the hash is not frequent.
+pub fn getFrequency(self: Self, hash: u32) u32 {
+    var lo: usize = 0;
+    var hi: usize = self.count();
+    while (lo < hi) {
+        const mid = lo + (hi - lo) / 2;
+        const h = self.getHash(mid);
+        if (h == hash) {
+            return self.getCount(mid);
+        } else if (h < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0;
+}
+
+// Collects frequent hashes while items are being written, in sorted order.
+pub const Builder = struct {
+    allocator: std.mem.Allocator,
+    hashes: std.ArrayListUnmanaged(u32) = .{},
+    counts: std.ArrayListUnmanaged(u32) = .{},
+    last_hash: u32 = 0,
+    last_count: u32 = 0,
+
+    pub fn init(allocator: std.mem.Allocator) Builder {
+        return .{ .allocator = allocator };
+    }
+
+    pub fn deinit(self: *Builder) void {
+        self.hashes.deinit(self.allocator);
+        self.counts.deinit(self.allocator);
+    }
+
+    pub fn add(self: *Builder, hash: u32) !void {
+        if (self.last_count > 0 and hash == self.last_hash) {
+            self.last_count += 1;
+            return;
+        }
+        try self.flush();
+        self.last_hash = hash;
+        self.last_count = 1;
+    }
+
+    fn flush(self: *Builder) !void {
+        if (self.last_count >= min_items) {
+            try self.hashes.append(self.allocator, self.last_hash);
+            try self.counts.append(self.allocator, self.last_count);
+        }
+        self.last_count = 0;
+    }
+
+    // Returns the number of frequent hashes, must be called after the last item.
+    pub fn finish(self: *Builder) !u32 {
+        try self.flush();
+        return @intCast(self.hashes.items.len);
+    }
+
+    pub fn encode(self: *const Builder, writer: anytype) !void {
+        for (self.hashes.items) |hash| {
+            try writer.writeInt(u32, hash, .little);
+        }
+        for (self.counts.items) |n| {
+            try writer.writeInt(u32, n, .little);
+        }
+    }
+};
+
+test "HashStats" {
+    const allocator = std.testing.allocator;
+
+    var builder = Builder.init(allocator);
+    defer builder.deinit();
+
+    for (1..10) |hash| {
+        for (0..hash * 30) |_| {
+            try builder.add(@intCast(hash));
+        }
+    }
+    try std.testing.expectEqual(6, try builder.finish());
+
+    var data = std.ArrayList(u8).init(allocator);
+    defer data.deinit();
+
+    try builder.encode(data.writer());
+    try std.testing.expectEqual(encodedSize(6), data.items.len);
+
+    const stats = try fromBytes(data.items, 6);
+
+    try std.testing.expectEqual(6, stats.count());
+    try std.testing.expectEqual(0, stats.getFrequency(1));
+    try std.testing.expectEqual(0, stats.getFrequency(3));
+    try std.testing.expectEqual(120, stats.getFrequency(4));
+    try std.testing.expectEqual(270, stats.getFrequency(9));
+    try std.testing.expectEqual(0, stats.getFrequency(10));
+}
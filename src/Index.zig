@@ -3,14 +3,22 @@ const Allocator = std.mem.Allocator;
 const log = std.log.scoped(.index);
 
 const zul = @import("zul");
+const msgpack = @import("msgpack");
 
 const Deadline = @import("utils/Deadline.zig");
 const Scheduler = @import("utils/Scheduler.zig");
+const ConcurrencyLimit = @import("utils/ConcurrencyLimit.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
+const MemoryLimit = @import("utils/MemoryLimit.zig");
+const BatchReader = @import("utils/BatchReader.zig");
 const Change = @import("change.zig").Change;
+const Transaction = @import("change.zig").Transaction;
 const SearchResult = @import("common.zig").SearchResult;
 const SearchResults = @import("common.zig").SearchResults;
+const SearchOptions = @import("common.zig").SearchOptions;
 const SegmentInfo = @import("segment.zig").SegmentInfo;
 const DocInfo = @import("common.zig").DocInfo;
+const MemoryUsage = @import("common.zig").MemoryUsage;
 
 const Oplog = @import("Oplog.zig");
 
@@ -33,13 +41,72 @@ const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
 const TieredMergePolicy = @import("segment_merge_policy.zig").TieredMergePolicy;
 
 const filefmt = @import("filefmt.zig");
+const BlockCache = @import("BlockCache.zig");
+const ResultCache = @import("ResultCache.zig");
+const DocVersionTable = @import("DocVersionTable.zig");
+const Memtable = @import("Memtable.zig");
 
 const metrics = @import("metrics.zig");
 const Self = @This();
 
-const Options = struct {
+pub const Options = struct {
     min_segment_size: usize = 500_000,
     max_segment_size: usize = 750_000_000,
+    // Optional thread pool for searching segments in parallel.
+    search_pool: ?*std.Thread.Pool = null,
+    // Maximum number of threads a single search can use.
+    max_search_parallelism: usize = 4,
+    // Optional cache of decoded file segment blocks, can be shared by multiple indexes.
+    block_cache: ?*BlockCache = null,
+    // Keep the latest version of each document in memory, instead of looking it up in segments.
+    doc_version_table: bool = true,
+    // Group commit settings for the oplog.
+    oplog: Oplog.Options = .{},
+    // Maximum number of scheduler threads loading segments of one index at startup.
+    max_load_parallelism: usize = 4,
+    // Verify segment checksums before the index is ready. If disabled, the index is ready
+    // as soon as headers and footers are valid and checksums are verified in background.
+    verify_segments_on_load: bool = true,
+    // Maximum number of file segment merges running at the same time in this index.
+    max_concurrent_file_merges: usize = 2,
+    // Optional limit on file segment merges, can be shared by multiple indexes.
+    file_merge_limit: ?*ConcurrencyLimit = null,
+    // Throttling of checkpoint and merge writes for this index, the rate adapts to the search load.
+    write_rate: RateLimiter.Options = .{},
+    // Optional limit on checkpoint and merge writes, can be shared by multiple indexes.
+    global_write_rate_limiter: ?*RateLimiter = null,
+    // Drop written segment data from the page cache while writing.
+    drop_cache_on_write: bool = false,
+    // Lock file segments in memory, so that searches never wait for them to be read from disk.
+    // Either the newest N segments, or all segments up to the given size in bytes, or both.
+    // Zero disables each of them.
+    mlock_newest_segments: usize = 0,
+    mlock_max_segment_size: usize = 0,
+    // Ask for transparent huge pages for mapped segment files.
+    huge_pages: bool = false,
+    // How file segment blocks are read, see FileSegment.IoMode. The pread mode should be used
+    // together with the block cache.
+    segment_io: FileSegment.IoMode = .mmap,
+    // Optional reader for batched block reads in pread mode, can be shared by multiple indexes.
+    batch_reader: ?*BatchReader = null,
+    // Memory budget of the search result cache in bytes, zero disables the cache.
+    result_cache_size: usize = 0,
+    // Defaults for searches in this index, see SearchOptions.
+    max_docs_per_hash: u32 = 1000,
+    max_hash_frequency: u32 = 0,
+    // Small updates are collected in a mutable memtable, instead of creating a memory segment
+    // for each of them. It's frozen into a memory segment once it has this many items, or
+    // on the first update after it's older than memtable_max_age_ms. Zero disables it.
+    memtable_size: usize = 64 * 1024,
+    memtable_max_age_ms: i64 = 1000,
+    // Pinned snapshots are released automatically if they are not used for this long.
+    snapshot_max_idle_ms: i64 = 10 * std.time.ms_per_min,
+    // Limits on memory used by the memtable and memory segments of this index. Above the soft
+    // limit, memory segments are checkpointed before they reach min_segment_size. Above the hard
+    // limit, updates wait for checkpoints and fail with error.MemoryLimitExceeded if it takes too long.
+    memory_limit: MemoryLimit.Options = .{},
+    // Optional limits on memory used by all indexes.
+    global_memory_limit: ?*MemoryLimit = null,
 };
 
 options: Options,
@@ -51,6 +118,24 @@ dir: std.fs.Dir,
 
 oplog: Oplog,
 
+write_rate_limiter: ?*RateLimiter = null,
+
+memory_limit: MemoryLimit,
+// write buffer size last reported to memory_limit
+memory_usage_lock: std.Thread.Mutex = .{},
+write_buffer_size: usize = 0,
+
+// Updates are written to the oplog concurrently, so that they can be synced
+// in one group, but they are applied to the segments in the commit order.
+apply_lock: std.Thread.Mutex = .{},
+apply_cond: std.Thread.Condition = .{},
+last_applied_commit_id: u64 = 0,
+// Set if a committed update could not be applied. This is a deliberate fail-stop, the later
+// commits can't be applied without it, so the index stops accepting updates and reports
+// itself as failed in the health check and metrics. The update is in the oplog, so it's
+// applied again when the index is reopened, e.g. after a restart.
+apply_error: ?anyerror = null,
+
 open_lock: std.Thread.Mutex = .{},
 is_ready: std.Thread.ResetEvent = .{},
 load_task: ?Scheduler.Task = null,
@@ -58,10 +143,37 @@ load_task: ?Scheduler.Task = null,
 segments_lock: std.Thread.RwLock = .{},
 memory_segments: SegmentListManager(MemorySegment),
 file_segments: SegmentListManager(FileSegment),
+doc_versions: ?SharedPtr(DocVersionTable) = null,
+// only changed by updates, in the commit order
+memtable: ?SharedPtr(Memtable) = null,
+// Memtables allocated before the oplog write, at least one for each update in progress,
+// so that starting a new memtable can't fail after the commit.
+spare_memtables_lock: std.Thread.Mutex = .{},
+spare_memtables: std.ArrayListUnmanaged(SharedPtr(Memtable)) = .{},
+reserved_memtables: usize = 0,
 
 checkpoint_task: ?Scheduler.Task = null,
-file_segment_merge_task: ?Scheduler.Task = null,
+file_segment_merge_tasks: std.ArrayListUnmanaged(Scheduler.Task) = .{},
+// notified when a merge skipped because of file_merge_limit can run
+file_merge_waiter: ConcurrencyLimit.WaiterNode = .{ .data = .{ .callback = onFileMergeSlotReleased, .ctx = undefined } },
 memory_segment_merge_task: ?Scheduler.Task = null,
+verify_task: ?Scheduler.Task = null,
+// segment lists change in the background, one update of the locks runs at a time
+memory_locks_lock: std.Thread.Mutex = .{},
+
+result_cache: ?ResultCache = null,
+
+// File segments pinned for copying the index to another server, e.g. a new replica.
+// The segment files and the oplog after the snapshot are kept until it's released.
+const PinnedSnapshot = struct {
+    segments: SharedPtr(FileSegmentList),
+    last_commit_id: u64,
+    last_used_at: i64,
+};
+
+snapshots_lock: std.Thread.Mutex = .{},
+snapshots: std.AutoHashMapUnmanaged(u64, PinnedSnapshot) = .{},
+next_snapshot_id: u64 = 1,
 
 fn getFileSegmentSize(segment: SharedPtr(FileSegment)) usize {
     return segment.value.getSize();
@@ -75,9 +187,16 @@ pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, parent_dir: std
     var dir = try parent_dir.makeOpenPath(path, .{ .iterate = true });
     errdefer dir.close();
 
-    var oplog = try Oplog.init(allocator, dir);
+    var oplog = try Oplog.init(allocator, dir, options.oplog);
     errdefer oplog.deinit();
 
+    var write_rate_limiter: ?*RateLimiter = null;
+    if (options.write_rate.bytes_per_second > 0 or options.global_write_rate_limiter != null) {
+        write_rate_limiter = try allocator.create(RateLimiter);
+        write_rate_limiter.?.* = RateLimiter.init(options.write_rate, options.global_write_rate_limiter);
+    }
+    errdefer if (write_rate_limiter) |limiter| allocator.destroy(limiter);
+
     const memory_segments = try SegmentListManager(MemorySegment).init(
         allocator,
         .{},
@@ -94,6 +213,12 @@ pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, parent_dir: std
         allocator,
         .{
             .dir = dir,
+            .block_cache = options.block_cache,
+            .write_rate_limiter = write_rate_limiter,
+            .drop_cache_on_write = options.drop_cache_on_write,
+            .huge_pages = options.huge_pages,
+            .io_mode = options.segment_io,
+            .batch_reader = options.batch_reader,
         },
         .{
             .min_segment_size = options.min_segment_size,
@@ -110,34 +235,87 @@ pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, parent_dir: std
         .dir = dir,
         .name = path,
         .oplog = oplog,
+        .write_rate_limiter = write_rate_limiter,
+        .memory_limit = MemoryLimit.init(options.memory_limit, options.global_memory_limit),
+        .result_cache = if (options.result_cache_size > 0) ResultCache.init(allocator, .{ .max_size = options.result_cache_size }) else null,
         .segments_lock = .{},
         .memory_segments = memory_segments,
         .file_segments = file_segments,
     };
 }
 
-pub fn deinit(self: *Self) void {
-    log.info("closing index {}", .{@intFromPtr(self)});
-
+// Waits for running background tasks to finish and removes them from the scheduler.
+fn destroyTasks(self: *Self) void {
     if (self.load_task) |task| {
         self.scheduler.destroyTask(task);
+        self.load_task = null;
     }
 
     if (self.checkpoint_task) |task| {
         self.scheduler.destroyTask(task);
+        self.checkpoint_task = null;
     }
 
     if (self.memory_segment_merge_task) |task| {
         self.scheduler.destroyTask(task);
+        self.memory_segment_merge_task = null;
+    }
+
+    // before the merge tasks, so that nothing schedules them while they are destroyed
+    if (self.options.file_merge_limit) |limit| {
+        limit.cancelNotify(&self.file_merge_waiter);
+    }
+
+    for (self.file_segment_merge_tasks.items) |task| {
+        self.scheduler.destroyTask(task);
     }
+    self.file_segment_merge_tasks.clearRetainingCapacity();
 
-    if (self.file_segment_merge_task) |task| {
+    if (self.verify_task) |task| {
         self.scheduler.destroyTask(task);
+        self.verify_task = null;
+    }
+}
+
+pub fn deinit(self: *Self) void {
+    log.info("closing index {}", .{@intFromPtr(self)});
+
+    self.destroyTasks();
+    self.file_segment_merge_tasks.deinit(self.allocator);
+
+    // before the segment lists, so that pinned segments are not deleted
+    var snapshots_iter = self.snapshots.valueIterator();
+    while (snapshots_iter.next()) |snapshot| {
+        FileSegmentList.destroySegments(self.allocator, &snapshot.segments);
     }
+    self.snapshots.deinit(self.allocator);
 
     self.memory_segments.deinit(self.allocator, .keep);
     self.file_segments.deinit(self.allocator, .keep);
 
+    if (self.doc_versions) |*doc_versions| {
+        destroyDocVersions(self.allocator, doc_versions);
+    }
+
+    if (self.memtable) |*memtable| {
+        destroyMemtable(self.allocator, memtable);
+    }
+
+    for (self.spare_memtables.items) |*memtable| {
+        destroyMemtable(self.allocator, memtable);
+    }
+    self.spare_memtables.deinit(self.allocator);
+
+    if (self.write_rate_limiter) |limiter| {
+        self.allocator.destroy(limiter);
+    }
+
+    self.memory_limit.update(self.write_buffer_size, 0);
+
+    if (self.result_cache) |*result_cache| {
+        result_cache.deinit();
+    }
+
     self.oplog.deinit();
     self.dir.close();
 }
@@ -148,7 +326,7 @@ fn checkpoint(self: *Self) !bool {
 
     // build new file segment
 
-    var target = try FileSegmentList.createSegment(self.allocator, .{ .dir = self.dir });
+    var target = try FileSegmentList.createSegment(self.allocator, self.file_segments.options);
     defer FileSegmentList.destroySegment(self.allocator, &target);
 
     var reader = source.value.reader();
@@ -173,11 +351,12 @@ fn checkpoint(self: *Self) !bool {
 
     try self.updateManifestFile(file_segments_update.segments.value);
 
-    defer self.oplog.truncate(target.value.info.getLastCommitId()) catch |err| {
+    defer self.oplog.truncate(self.getOplogTruncateCommitId(target.value.info.getLastCommitId())) catch |err| {
         log.warn("failed to truncate oplog: {}", .{err});
     };
 
-    defer self.updateDocsMetrics();
+    defer self.updateStats();
+    defer self.updateMemoryLocks();
 
     // commit updated lists
 
@@ -194,11 +373,110 @@ fn checkpoint(self: *Self) !bool {
     return true;
 }
 
-fn updateDocsMetrics(self: *Self) void {
+// Stops background tasks and checkpoints everything that is only in memory, so that the index
+// can be opened again without replaying the oplog. Used before closing idle indexes, there must
+// be no updates running and the index can't be used for anything but deinit afterwards.
+pub fn shutdown(self: *Self) !void {
+    try self.checkReady();
+
+    self.destroyTasks();
+
+    // safe outside of the commit order, because there are no updates
+    try self.freezeMemtable();
+
+    self.memory_segments.freezeAll();
+    while (try self.checkpoint()) {}
+}
+
+fn shouldLockSegment(self: *Self, segment: *const FileSegment, position_from_newest: usize) bool {
+    if (position_from_newest < self.options.mlock_newest_segments) {
+        return true;
+    }
+    if (self.options.mlock_max_segment_size > 0) {
+        const data = segment.getFileData() orelse return false;
+        return data.len <= self.options.mlock_max_segment_size;
+    }
+    return false;
+}
+
+// Locks the hot file segments in memory, after the list of segments changes.
+fn updateMemoryLocks(self: *Self) void {
+    if (self.options.mlock_newest_segments == 0 and self.options.mlock_max_segment_size == 0) {
+        return;
+    }
+
+    // the segments are acquired under the lock, so the last update always sees the newest list
+    self.memory_locks_lock.lock();
+    defer self.memory_locks_lock.unlock();
+
+    var segments = blk: {
+        self.segments_lock.lockShared();
+        defer self.segments_lock.unlockShared();
+        break :blk self.file_segments.segments.acquire();
+    };
+    defer FileSegmentList.destroySegments(self.allocator, &segments);
+
+    const nodes = segments.value.nodes.items;
+    for (nodes, 0..) |node, i| {
+        _ = node.value.setMemoryLocked(self.shouldLockSegment(node.value, nodes.len - 1 - i));
+    }
+}
+
+pub const Residency = struct {
+    resident_size: usize = 0,
+    total_size: usize = 0,
+};
+
+pub const ResidencyStats = struct {
+    locked: Residency = .{},
+    unlocked: Residency = .{},
+};
+
+// Checks how much of the mapped file segments is in the page cache.
+pub fn getResidencyStats(self: *Self) !ResidencyStats {
+    try self.checkReady();
+
+    var segments = blk: {
+        self.segments_lock.lockShared();
+        defer self.segments_lock.unlockShared();
+        break :blk self.file_segments.segments.acquire();
+    };
+    defer FileSegmentList.destroySegments(self.allocator, &segments);
+
+    var stats: ResidencyStats = .{};
+    for (segments.value.nodes.items) |node| {
+        const data = node.value.getFileData() orelse continue;
+        const residency = if (node.value.isMemoryLocked()) &stats.locked else &stats.unlocked;
+        residency.resident_size += node.value.getResidentSize();
+        residency.total_size += data.len;
+    }
+    return stats;
+}
+
+// Updates metrics and memory accounting after the segments changed.
+fn updateStats(self: *Self) void {
+    // snapshots taken in order, so that an older one never overwrites the write buffer size
+    self.memory_usage_lock.lock();
+    defer self.memory_usage_lock.unlock();
+
     var snapshot = self.acquireReader() catch return;
     defer self.releaseReader(&snapshot);
 
     metrics.docs(self.name, snapshot.getNumDocs());
+
+    var usage = snapshot.getMemoryUsage();
+    if (self.result_cache) |*result_cache| {
+        usage.result_cache = result_cache.getSize();
+    }
+    metrics.memoryUsage(self.name, usage);
+
+    const write_buffer_size = usage.getWriteBufferSize();
+    self.memory_limit.update(self.write_buffer_size, write_buffer_size);
+    self.write_buffer_size = write_buffer_size;
+
+    if (self.memory_limit.isOverSoftLimit()) {
+        self.expediteCheckpoint();
+    }
 }
 
 fn checkpointTask(self: *Self) void {
@@ -214,9 +492,27 @@ fn memorySegmentMergeTask(self: *Self) void {
 }
 
 fn fileSegmentMergeTask(self: *Self) void {
-    _ = self.maybeMergeFileSegments() catch |err| {
+    if (self.options.file_merge_limit) |limit| {
+        if (!limit.tryAcquireOrNotify(&self.file_merge_waiter)) {
+            log.debug("too many file segment merges running, skipping until one finishes", .{});
+            return;
+        }
+    }
+    defer if (self.options.file_merge_limit) |limit| limit.release();
+
+    const merged = self.maybeMergeFileSegments() catch |err| {
         log.err("file segment merge failed: {}", .{err});
+        return;
     };
+    if (merged) {
+        // there might be more to merge, now that these segments are done
+        self.maybeScheduleFileSegmentMerge();
+    }
+}
+
+fn onFileMergeSlotReleased(ctx: *anyopaque) void {
+    const self: *Self = @ptrCast(@alignCast(ctx));
+    self.maybeScheduleFileSegmentMerge();
 }
 
 fn updateManifestFile(self: *Self, segments: *FileSegmentList) !void {
@@ -231,12 +527,13 @@ fn updateManifestFile(self: *Self, segments: *FileSegmentList) !void {
 }
 
 fn maybeMergeFileSegments(self: *Self) !bool {
-    var upd = try self.file_segments.prepareMerge(self.allocator) orelse return false;
+    var upd = try self.file_segments.prepareMerge(self.allocator, self) orelse return false;
     defer self.file_segments.cleanupAfterUpdate(self.allocator, &upd);
 
     try self.updateManifestFile(upd.segments.value);
 
-    defer self.updateDocsMetrics();
+    defer self.updateStats();
+    defer self.updateMemoryLocks();
 
     self.segments_lock.lock();
     defer self.segments_lock.unlock();
@@ -248,6 +545,15 @@ fn maybeMergeFileSegments(self: *Self) !bool {
     return true;
 }
 
+// Sources can be merged before the verify task gets to them, so they are verified before the
+// merge, the merged segment would have a valid checksum even with corrupt blocks copied into it.
+pub fn checkMergeSource(self: *Self, node: FileSegmentNode) !void {
+    node.value.verify() catch |err| {
+        self.quarantineSegment(node, err);
+        return err;
+    };
+}
+
 fn fileSegmentMergeThreadFn(self: *Self) void {
     while (!self.stopping.load(.acquire)) {
         if (self.maybeMergeFileSegments()) |successful| {
@@ -263,10 +569,10 @@ fn fileSegmentMergeThreadFn(self: *Self) void {
 }
 
 fn maybeMergeMemorySegments(self: *Self) !bool {
-    var upd = try self.memory_segments.prepareMerge(self.allocator) orelse return false;
+    var upd = try self.memory_segments.prepareMerge(self.allocator, {}) orelse return false;
     defer self.memory_segments.cleanupAfterUpdate(self.allocator, &upd);
 
-    defer self.updateDocsMetrics();
+    defer self.updateStats();
 
     self.segments_lock.lock();
     defer self.segments_lock.unlock();
@@ -309,29 +615,274 @@ pub fn open(self: *Self, create: bool) !void {
     self.scheduler.scheduleTask(self.load_task.?);
 }
 
+fn destroyDocVersions(allocator: Allocator, doc_versions: *SharedPtr(DocVersionTable)) void {
+    doc_versions.release(allocator, DocVersionTable.deinit, .{allocator});
+}
+
+fn destroyMemtable(allocator: Allocator, memtable: *SharedPtr(Memtable)) void {
+    memtable.release(allocator, Memtable.deinit, .{});
+}
+
+// Rebuilds the document version table from file segments, oldest first. We don't know
+// the exact commit of each document, but the segment's last commit id is good enough,
+// search hits are versioned the same way.
+fn loadDocVersions(self: *Self) !void {
+    var table: DocVersionTable = .{};
+    errdefer table.deinit(self.allocator);
+
+    // doc tables are sorted, so this fills one leaf of the table after another
+    for (self.file_segments.segments.value.nodes.items) |node| {
+        const version = node.value.info.getLastCommitId();
+        var builder = table.builder(self.allocator);
+        var iter = node.value.docs.iterator();
+        while (iter.next()) |entry| {
+            try builder.set(entry.key_ptr.*, version, !entry.value_ptr.*);
+        }
+    }
+
+    self.doc_versions = try SharedPtr(DocVersionTable).create(self.allocator, table);
+}
+
 fn load(self: *Self, manifest: []SegmentInfo) !void {
     defer self.allocator.free(manifest);
 
     log.info("found {} segments in manifest", .{manifest.len});
 
-    try self.file_segments.segments.value.nodes.ensureTotalCapacity(self.allocator, manifest.len);
+    var timer = std.time.Timer.start() catch unreachable;
+
+    try self.loadFileSegments(manifest);
+    self.updateMemoryLocks();
+
     var last_commit_id: u64 = 0;
-    for (manifest, 1..) |segment_id, i| {
-        const node = try FileSegmentList.loadSegment(self.allocator, segment_id, .{ .dir = self.dir });
-        self.file_segments.segments.value.nodes.appendAssumeCapacity(node);
+    if (self.file_segments.segments.value.getLast()) |node| {
         last_commit_id = node.value.info.getLastCommitId();
-        log.info("loaded segment {} ({}/{})", .{ last_commit_id, i, manifest.len });
+    }
+
+    if (self.options.doc_version_table) {
+        try self.loadDocVersions();
     }
 
     self.memory_segment_merge_task = try self.scheduler.createTask(.high, memorySegmentMergeTask, .{self});
     self.checkpoint_task = try self.scheduler.createTask(.medium, checkpointTask, .{self});
-    self.file_segment_merge_task = try self.scheduler.createTask(.low, fileSegmentMergeTask, .{self});
+    try self.file_segment_merge_tasks.ensureTotalCapacity(self.allocator, @max(self.options.max_concurrent_file_merges, 1));
+    for (0..@max(self.options.max_concurrent_file_merges, 1)) |_| {
+        const task = try self.scheduler.createTask(.low, fileSegmentMergeTask, .{self});
+        self.file_segment_merge_tasks.appendAssumeCapacity(task);
+    }
+    self.file_merge_waiter.data.ctx = self;
 
-    try self.oplog.open(last_commit_id + 1, updateInternal, self);
+    var replay = OplogReplay.init(self);
+    defer replay.deinit();
 
-    log.info("index loaded", .{});
+    try self.oplog.open(last_commit_id + 1, OplogReplay.receive, &replay);
+    try replay.flush();
+
+    self.last_applied_commit_id = self.oplog.next_commit_id - 1;
+
+    self.maybeScheduleMemorySegmentMerge();
+    self.maybeScheduleCheckpoint();
+
+    if (!self.options.verify_segments_on_load and manifest.len > 0) {
+        self.verify_task = try self.scheduler.createTask(.low, verifyTask, .{self});
+        self.scheduler.scheduleTask(self.verify_task.?);
+    }
+
+    const load_time = timer.read();
+    metrics.indexLoadDuration(self.name, load_time);
+    metrics.indexFailed(self.name, false);
+    log.info("index loaded in {d:.3}s", .{@as(f64, @floatFromInt(load_time)) / std.time.ns_per_s});
 
     self.is_ready.set();
+
+    // replayed memory segments count towards the memory limits
+    self.updateStats();
+}
+
+// Replays the oplog into large memory segments, instead of creating one segment
+// per transaction and going through the regular update path.
+const OplogReplay = struct {
+    index: *Self,
+    segment: ?MemorySegmentNode = null,
+    builder: ?MemorySegment.Builder = null,
+    timer: std.time.Timer,
+    num_transactions: u64 = 0,
+
+    fn init(index: *Self) OplogReplay {
+        return .{
+            .index = index,
+            .timer = std.time.Timer.start() catch unreachable,
+        };
+    }
+
+    fn deinit(self: *OplogReplay) void {
+        if (self.builder) |*builder| {
+            builder.deinit();
+        }
+        if (self.segment) |*segment| {
+            MemorySegmentList.destroySegment(self.index.allocator, segment);
+        }
+    }
+
+    fn receive(self: *OplogReplay, changes: []const Change, commit_id: u64) !void {
+        if (self.builder == null) {
+            self.segment = try MemorySegmentList.createSegment(self.index.allocator, .{});
+            self.builder = MemorySegment.Builder.init(self.segment.?.value);
+        }
+        try self.builder.?.add(changes, commit_id);
+
+        self.num_transactions += 1;
+        metrics.oplogReplay(changes.len);
+
+        if (self.builder.?.getSize() > self.index.options.min_segment_size) {
+            try self.flush();
+        }
+    }
+
+    fn flush(self: *OplogReplay) !void {
+        var builder = self.builder orelse return;
+        self.builder = null;
+        defer builder.deinit();
+
+        builder.finish();
+
+        var segment = self.segment.?;
+        self.segment = null;
+        errdefer MemorySegmentList.destroySegment(self.index.allocator, &segment);
+
+        try self.index.applyReplayedSegment(segment);
+
+        const elapsed = @as(f64, @floatFromInt(self.timer.read())) / std.time.ns_per_s;
+        log.info("replayed {} transactions from oplog ({d:.0} per second)", .{
+            self.num_transactions,
+            @as(f64, @floatFromInt(self.num_transactions)) / @max(elapsed, 0.001),
+        });
+    }
+};
+
+fn applyReplayedSegment(self: *Self, node: MemorySegmentNode) !void {
+    if (self.doc_versions) |table| {
+        const version = node.value.info.getLastCommitId();
+        var iter = node.value.docs.iterator();
+        while (iter.next()) |entry| {
+            try table.value.set(self.allocator, entry.key_ptr.*, version, !entry.value_ptr.*);
+        }
+    }
+    try self.memory_segments.appendSegmentOnLoad(self.allocator, node);
+}
+
+// Loads segments from the manifest in parallel. Workers are scheduler tasks, the calling
+// thread works as well, so we make progress even if all scheduler threads are busy.
+const SegmentLoader = struct {
+    index: *Self,
+    manifest: []const SegmentInfo,
+    options: FileSegment.Options,
+    nodes: []?FileSegmentNode,
+    next: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+    num_loaded: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+    failed: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+    err_lock: std.Thread.Mutex = .{},
+    err: ?anyerror = null,
+
+    fn run(self: *SegmentLoader) void {
+        while (!self.failed.load(.acquire)) {
+            const i = self.next.fetchAdd(1, .monotonic);
+            if (i >= self.manifest.len) {
+                break;
+            }
+            self.nodes[i] = FileSegmentList.loadSegment(self.index.allocator, self.manifest[i], self.options) catch |err| {
+                self.setError(err);
+                break;
+            };
+            const num_loaded = self.num_loaded.fetchAdd(1, .monotonic) + 1;
+            log.info("loaded segment {} ({}/{})", .{ self.manifest[i].getLastCommitId(), num_loaded, self.manifest.len });
+        }
+    }
+
+    fn setError(self: *SegmentLoader, err: anyerror) void {
+        self.err_lock.lock();
+        defer self.err_lock.unlock();
+
+        if (self.err == null) {
+            self.err = err;
+        }
+        self.failed.store(true, .release);
+    }
+};
+
+fn loadFileSegments(self: *Self, manifest: []const SegmentInfo) !void {
+    var options = self.file_segments.options;
+    options.verify_checksum_on_load = self.options.verify_segments_on_load;
+
+    const nodes = try self.allocator.alloc(?FileSegmentNode, manifest.len);
+    defer self.allocator.free(nodes);
+    @memset(nodes, null);
+
+    var loader = SegmentLoader{
+        .index = self,
+        .manifest = manifest,
+        .options = options,
+        .nodes = nodes,
+    };
+
+    {
+        const num_workers = @min(self.options.max_load_parallelism, manifest.len) -| 1;
+
+        var workers = try std.ArrayList(Scheduler.Task).initCapacity(self.allocator, num_workers);
+        defer workers.deinit();
+
+        defer for (workers.items) |task| {
+            self.scheduler.destroyTask(task);
+        };
+
+        for (0..num_workers) |_| {
+            const task = self.scheduler.createTask(.high, SegmentLoader.run, .{&loader}) catch break;
+            workers.appendAssumeCapacity(task);
+            self.scheduler.scheduleTask(task);
+        }
+
+        loader.run();
+    }
+
+    errdefer for (nodes) |*maybe_node| {
+        if (maybe_node.*) |*node| {
+            FileSegmentList.destroySegment(self.allocator, node);
+        }
+    };
+
+    if (loader.err) |err| {
+        return err;
+    }
+
+    try self.file_segments.segments.value.nodes.ensureTotalCapacity(self.allocator, manifest.len);
+    for (nodes) |*maybe_node| {
+        self.file_segments.segments.value.nodes.appendAssumeCapacity(maybe_node.*.?);
+        maybe_node.* = null;
+    }
+}
+
+// Verifies checksums of segments that were loaded without it, the ones that fail are quarantined.
+fn verifyTask(self: *Self) void {
+    var segments = blk: {
+        self.segments_lock.lockShared();
+        defer self.segments_lock.unlockShared();
+        break :blk self.file_segments.segments.acquire();
+    };
+    defer FileSegmentList.destroySegments(self.allocator, &segments);
+
+    for (segments.value.nodes.items) |node| {
+        node.value.verify() catch |err| {
+            self.quarantineSegment(node, err);
+        };
+    }
+}
+
+fn quarantineSegment(self: *Self, node: FileSegmentNode, err: anyerror) void {
+    log.err("segment {} failed verification, quarantining it: {}", .{ node.value.info.getLastCommitId(), err });
+    metrics.segmentQuarantined();
+
+    self.file_segments.status_update_lock.lock();
+    defer self.file_segments.status_update_lock.unlock();
+    node.value.status.frozen = true;
 }
 
 fn loadTask(self: *Self, manifest: []SegmentInfo) void {
@@ -354,13 +905,37 @@ fn maybeScheduleMemorySegmentMerge(self: *Self) void {
 
 fn maybeScheduleFileSegmentMerge(self: *Self) void {
     if (self.file_segments.needsMerge()) {
-        if (self.file_segment_merge_task) |task| {
-            log.debug("too many file segments, scheduling merging", .{});
+        log.debug("too many file segments, scheduling merging", .{});
+        // each task picks a different set of segments, if there is any left
+        for (self.file_segment_merge_tasks.items) |task| {
             self.scheduler.scheduleTask(task);
         }
     }
 }
 
+// Checkpoints the oldest memory segment even if it's still small, to free memory.
+fn expediteCheckpoint(self: *Self) void {
+    if (self.memory_segments.freezeFirst()) {
+        if (self.checkpoint_task) |task| {
+            log.debug("memory limit exceeded, scheduling checkpoint", .{});
+            self.scheduler.scheduleTask(task);
+        }
+    }
+}
+
+// Waits for checkpoints while the write buffers use more memory than the hard limit.
+fn waitForMemory(self: *Self) !void {
+    if (!self.memory_limit.isOverHardLimit()) {
+        return;
+    }
+    metrics.memoryLimitWait();
+    self.expediteCheckpoint();
+    self.memory_limit.waitForMemory() catch |err| {
+        metrics.memoryLimitRejection();
+        return err;
+    };
+}
+
 fn maybeScheduleCheckpoint(self: *Self) void {
     if (self.memory_segments.segments.value.getFirst()) |first_node| {
         if (first_node.value.getSize() >= self.options.min_segment_size) {
@@ -373,7 +948,7 @@ fn maybeScheduleCheckpoint(self: *Self) void {
 }
 
 pub fn waitForReady(self: *Self, timeout_ms: u32) !void {
-    try self.is_ready.timedWait(timeout_ms * std.time.us_per_ms);
+    try self.is_ready.timedWait(@as(u64, timeout_ms) * std.time.ns_per_ms);
 }
 
 pub fn checkReady(self: *Self) !void {
@@ -382,23 +957,132 @@ pub fn checkReady(self: *Self) !void {
     }
 }
 
+// Estimated memory usage of the index data, zero if the index is not loaded yet.
+pub fn getMemoryUsage(self: *Self) usize {
+    var reader = self.acquireReader() catch return 0;
+    defer self.releaseReader(&reader);
+
+    return reader.getMemoryUsage().getTotal();
+}
+
 pub fn update(self: *Self, changes: []const Change) !void {
     try self.checkReady();
-    try self.updateInternal(changes, null);
+    try self.checkNotFailed();
+    try self.updateInternal(changes);
+}
+
+pub fn checkNotFailed(self: *Self) !void {
+    self.apply_lock.lock();
+    defer self.apply_lock.unlock();
+
+    if (self.apply_error != null) {
+        return error.IndexFailed;
+    }
+}
+
+// Reads committed transactions for replicas, see Oplog.read.
+pub fn readTransactions(self: *Self, arena: Allocator, first_commit_id: u64, options: Oplog.ReadOptions) !Oplog.ReadResult {
+    try self.checkReady();
+    return self.oplog.read(arena, first_commit_id, options);
+}
+
+// Returns the commit id that the next update is going to get, if nothing else is writing.
+pub fn getNextCommitId(self: *Self) u64 {
+    self.apply_lock.lock();
+    defer self.apply_lock.unlock();
+
+    return self.last_applied_commit_id + 1;
+}
+
+// Applies a transaction received from the primary. Replicas don't accept any other updates,
+// so the local oplog assigns the same commit ids as the primary, as long as there are no gaps.
+pub fn applyReplicated(self: *Self, txn: Transaction) !void {
+    try self.checkReady();
+    try self.checkNotFailed();
+
+    if (txn.id != self.getNextCommitId()) {
+        return error.UnexpectedCommitId;
+    }
+
+    try self.updateInternal(txn.changes);
+}
+
+fn waitForCommitTurn(self: *Self, commit_id: u64) !void {
+    self.apply_lock.lock();
+    defer self.apply_lock.unlock();
+
+    while (self.last_applied_commit_id + 1 < commit_id) {
+        if (self.apply_error != null) {
+            return error.IndexFailed;
+        }
+        self.apply_cond.wait(&self.apply_lock);
+    }
+    if (self.apply_error != null) {
+        return error.IndexFailed;
+    }
+}
+
+fn finishCommitTurn(self: *Self, commit_id: u64) void {
+    self.apply_lock.lock();
+    defer self.apply_lock.unlock();
+
+    self.last_applied_commit_id = commit_id;
+    self.apply_cond.broadcast();
+}
+
+fn failCommitTurn(self: *Self, commit_id: u64, err: anyerror) void {
+    self.apply_lock.lock();
+    defer self.apply_lock.unlock();
+
+    log.err("failed to apply commit {} to index {s}: {}", .{ commit_id, self.name, err });
+    self.apply_error = err;
+    self.apply_cond.broadcast();
+    metrics.indexFailed(self.name, true);
+}
+
+fn getMemtableOptions(self: *Self) Memtable.Options {
+    return .{ .max_items = self.options.memtable_size };
 }
 
-fn updateInternal(self: *Self, changes: []const Change, commit_id: ?u64) !void {
+fn updateInternal(self: *Self, changes: []const Change) !void {
+    try self.waitForMemory();
+
+    if (self.options.memtable_size > 0 and Memtable.accepts(self.getMemtableOptions(), changes)) {
+        return self.updateMemtable(changes);
+    }
+
     var target = try MemorySegmentList.createSegment(self.allocator, .{});
     defer MemorySegmentList.destroySegment(self.allocator, &target);
 
     try target.value.build(changes);
 
+    var doc_versions = try self.prepareDocVersions(changes);
+    defer if (doc_versions) |*prepared| self.destroyPreparedDocVersions(prepared);
+
+    const version = try self.oplog.write(changes);
+    target.value.info.version = version;
+
+    try self.waitForCommitTurn(version);
+    self.applySegment(target, changes, version, &doc_versions) catch |err| {
+        self.failCommitTurn(version, err);
+        return err;
+    };
+    self.finishCommitTurn(version);
+}
+
+fn applySegment(self: *Self, target: MemorySegmentNode, changes: []const Change, version: u64, doc_versions: *?PreparedDocVersions) !void {
+    // memory segments must stay ordered by version, so the memtable goes first
+    try self.freezeMemtable();
+
     var upd = try self.memory_segments.beginUpdate(self.allocator);
     defer self.memory_segments.cleanupAfterUpdate(self.allocator, &upd);
 
-    target.value.info.version = commit_id orelse try self.oplog.write(changes);
+    // the commit order also serializes updates of the doc version table
+    if (doc_versions.*) |*prepared| {
+        self.applyDocVersions(prepared, changes, version);
+    }
 
-    defer self.updateDocsMetrics();
+    defer self.updateStats();
 
     self.segments_lock.lock();
     defer self.segments_lock.unlock();
@@ -407,10 +1091,318 @@ fn updateInternal(self: *Self, changes: []const Change, commit_id: ?u64) !void {
 
     self.memory_segments.commitUpdate(&upd);
 
+    if (doc_versions.*) |*prepared| {
+        self.doc_versions.?.swap(&prepared.table);
+    }
+
     self.maybeScheduleMemorySegmentMerge();
     self.maybeScheduleCheckpoint();
 }
 
+// Adds the changes to the memtable in place, readers see them once they are published.
+fn updateMemtable(self: *Self, changes: []const Change) !void {
+    try self.reserveMemtable();
+    defer self.releaseMemtableReservation();
+
+    var doc_versions = try self.prepareDocVersions(changes);
+    defer if (doc_versions) |*prepared| self.destroyPreparedDocVersions(prepared);
+
+    const version = try self.oplog.write(changes);
+
+    try self.waitForCommitTurn(version);
+    self.applyMemtable(changes, version, &doc_versions) catch |err| {
+        self.failCommitTurn(version, err);
+        return err;
+    };
+    self.finishCommitTurn(version);
+}
+
+fn applyMemtable(self: *Self, changes: []const Change, version: u64, doc_versions: *?PreparedDocVersions) !void {
+    if (self.memtable) |current| {
+        if (!current.value.canAdd(changes) or current.value.isExpired(self.options.memtable_max_age_ms)) {
+            try self.freezeMemtable();
+        }
+    }
+
+    const new_memtable = if (self.memtable == null) self.takeSpareMemtable() else null;
+
+    // the commit order also serializes updates of the doc version table
+    if (doc_versions.*) |*prepared| {
+        self.applyDocVersions(prepared, changes, version);
+    }
+
+    const memtable = if (new_memtable) |ptr| ptr.value else self.memtable.?.value;
+    memtable.add(changes, version);
+
+    defer self.updateStats();
+
+    self.segments_lock.lock();
+    defer self.segments_lock.unlock();
+
+    memtable.publish();
+
+    if (new_memtable) |ptr| {
+        self.memtable = ptr;
+    }
+
+    if (doc_versions.*) |*prepared| {
+        self.doc_versions.?.swap(&prepared.table);
+    }
+}
+
+fn reserveMemtable(self: *Self) !void {
+    self.spare_memtables_lock.lock();
+    defer self.spare_memtables_lock.unlock();
+
+    try self.spare_memtables.ensureTotalCapacity(self.allocator, self.reserved_memtables + 1);
+    while (self.spare_memtables.items.len <= self.reserved_memtables) {
+        var memtable = try Memtable.init(self.allocator, self.getMemtableOptions());
+        errdefer memtable.deinit();
+        self.spare_memtables.appendAssumeCapacity(try SharedPtr(Memtable).create(self.allocator, memtable));
+    }
+    self.reserved_memtables += 1;
+}
+
+// Only called by updates holding a reservation, so there is always a spare memtable.
+fn takeSpareMemtable(self: *Self) SharedPtr(Memtable) {
+    self.spare_memtables_lock.lock();
+    defer self.spare_memtables_lock.unlock();
+
+    const memtable = self.spare_memtables.pop();
+    memtable.value.created_at = std.time.milliTimestamp();
+    return memtable;
+}
+
+fn releaseMemtableReservation(self: *Self) void {
+    self.spare_memtables_lock.lock();
+    defer self.spare_memtables_lock.unlock();
+
+    self.reserved_memtables -= 1;
+
+    // keep one for the next update
+    while (self.spare_memtables.items.len > @max(self.reserved_memtables, 1)) {
+        var memtable = self.spare_memtables.pop();
+        destroyMemtable(self.allocator, &memtable);
+    }
+}
+
+// Replaces the memtable with an equivalent memory segment. Must be called in the commit
+// order, so that nothing is added to the memtable while it's being frozen.
+fn freezeMemtable(self: *Self) !void {
+    var memtable = self.memtable orelse return;
+
+    var frozen = try MemorySegmentList.createSegment(self.allocator, .{});
+    defer MemorySegmentList.destroySegment(self.allocator, &frozen);
+
+    try memtable.value.freeze(frozen.value);
+
+    var upd = try self.memory_segments.beginUpdate(self.allocator);
+    defer self.memory_segments.cleanupAfterUpdate(self.allocator, &upd);
+
+    defer destroyMemtable(self.allocator, &memtable);
+
+    self.segments_lock.lock();
+    defer self.segments_lock.unlock();
+
+    upd.appendSegment(frozen);
+
+    self.memory_segments.commitUpdate(&upd);
+    self.memtable = null;
+
+    metrics.memtableFreeze();
+
+    self.maybeScheduleMemorySegmentMerge();
+    self.maybeScheduleCheckpoint();
+}
+
+// A new doc version table, and all nodes that applying the changes to it can need.
+const PreparedDocVersions = struct {
+    table: SharedPtr(DocVersionTable),
+    reservation: DocVersionTable.Reservation,
+};
+
+// Allocates everything for updating the doc version table before the commit,
+// so that applying the changes can't fail after the commit. Null if the table is disabled.
+fn prepareDocVersions(self: *Self, changes: []const Change) !?PreparedDocVersions {
+    if (self.doc_versions == null) {
+        return null;
+    }
+
+    var doc_ids = std.ArrayList(u32).init(self.allocator);
+    defer doc_ids.deinit();
+
+    for (changes) |change| {
+        switch (change) {
+            .insert => |op| try doc_ids.append(op.id),
+            .delete => |op| try doc_ids.append(op.id),
+            .set_attribute => {},
+        }
+    }
+    std.sort.pdq(u32, doc_ids.items, {}, std.sort.asc(u32));
+
+    var reservation = try DocVersionTable.reserve(self.allocator, doc_ids.items);
+    errdefer reservation.deinit();
+
+    // the table is filled in by applyDocVersions
+    const table = try SharedPtr(DocVersionTable).create(self.allocator, .{});
+
+    return .{ .table = table, .reservation = reservation };
+}
+
+fn applyDocVersions(self: *Self, prepared: *PreparedDocVersions, changes: []const Change, version: u64) void {
+    prepared.table.value.* = self.doc_versions.?.value.clone();
+
+    for (changes) |change| {
+        switch (change) {
+            .insert => |op| prepared.table.value.setReserved(&prepared.reservation, op.id, version, false),
+            .delete => |op| prepared.table.value.setReserved(&prepared.reservation, op.id, version, true),
+            .set_attribute => {},
+        }
+    }
+}
+
+fn destroyPreparedDocVersions(self: *Self, prepared: *PreparedDocVersions) void {
+    prepared.reservation.deinit();
+    destroyDocVersions(self.allocator, &prepared.table);
+}
+
+pub const SnapshotFile = struct {
+    name: []const u8,
+    size: u64,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+pub const SnapshotInfo = struct {
+    id: u64,
+    // everything up to this commit is in the segment files, the rest is in the oplog
+    last_commit_id: u64,
+    segments: []const SegmentInfo,
+    files: []const SnapshotFile,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+// Oplog entries needed by pinned snapshots are not truncated.
+fn getOplogTruncateCommitId(self: *Self, commit_id: u64) u64 {
+    self.snapshots_lock.lock();
+    defer self.snapshots_lock.unlock();
+
+    var result = commit_id;
+    var iter = self.snapshots.valueIterator();
+    while (iter.next()) |snapshot| {
+        result = @min(result, snapshot.last_commit_id + 1);
+    }
+    return result;
+}
+
+fn expireSnapshots(self: *Self, now: i64) void {
+    var iter = self.snapshots.iterator();
+    while (iter.next()) |entry| {
+        if (now - entry.value_ptr.last_used_at > self.options.snapshot_max_idle_ms) {
+            log.info("releasing unused snapshot {}", .{entry.key_ptr.*});
+            FileSegmentList.destroySegments(self.allocator, &entry.value_ptr.segments);
+            self.snapshots.removeByPtr(entry.key_ptr);
+            // the iterator is invalidated by removal
+            iter = self.snapshots.iterator();
+        }
+    }
+}
+
+// Pins the current file segments, so that they can be copied to another server.
+// The snapshot info is allocated in the arena.
+pub fn createSnapshot(self: *Self, arena: Allocator) !SnapshotInfo {
+    try self.checkReady();
+
+    // The segments can't change until the snapshot is registered, otherwise a checkpoint
+    // could truncate the oplog after our last commit before it sees the pin.
+    self.segments_lock.lockShared();
+    defer self.segments_lock.unlockShared();
+
+    var segments = self.file_segments.segments.acquire();
+    errdefer FileSegmentList.destroySegments(self.allocator, &segments);
+
+    const nodes = segments.value.nodes.items;
+    const infos = try arena.alloc(SegmentInfo, nodes.len);
+    const files = try arena.alloc(SnapshotFile, nodes.len);
+    for (nodes, infos, files) |node, *info, *file| {
+        var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+        const data = node.value.getFileData() orelse return error.SegmentNotMapped;
+        info.* = node.value.info;
+        file.* = .{
+            .name = try arena.dupe(u8, filefmt.buildSegmentFileName(&file_name_buf, node.value.info)),
+            .size = data.len,
+        };
+    }
+
+    const last_commit_id = if (segments.value.getLast()) |node| node.value.info.getLastCommitId() else 0;
+
+    self.snapshots_lock.lock();
+    defer self.snapshots_lock.unlock();
+
+    const now = std.time.milliTimestamp();
+    self.expireSnapshots(now);
+
+    const id = self.next_snapshot_id;
+    try self.snapshots.put(self.allocator, id, .{
+        .segments = segments,
+        .last_commit_id = last_commit_id,
+        .last_used_at = now,
+    });
+    self.next_snapshot_id += 1;
+
+    log.info("pinned snapshot {} (segments = {}, last commit = {})", .{ id, nodes.len, last_commit_id });
+
+    return .{
+        .id = id,
+        .last_commit_id = last_commit_id,
+        .segments = infos,
+        .files = files,
+    };
+}
+
+// Returns a reference to a segment file from a pinned snapshot, release it with releaseSnapshotSegment.
+pub fn acquireSnapshotSegment(self: *Self, snapshot_id: u64, file_name: []const u8) !FileSegmentNode {
+    self.snapshots_lock.lock();
+    defer self.snapshots_lock.unlock();
+
+    const snapshot = self.snapshots.getPtr(snapshot_id) orelse return error.SnapshotNotFound;
+    snapshot.last_used_at = std.time.milliTimestamp();
+
+    for (snapshot.segments.value.nodes.items) |node| {
+        var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+        if (std.mem.eql(u8, filefmt.buildSegmentFileName(&file_name_buf, node.value.info), file_name)) {
+            return node.acquire();
+        }
+    }
+    return error.SegmentNotFound;
+}
+
+pub fn releaseSnapshotSegment(self: *Self, node: *FileSegmentNode) void {
+    FileSegmentList.destroySegment(self.allocator, node);
+}
+
+pub fn hasPinnedSnapshots(self: *Self) bool {
+    self.snapshots_lock.lock();
+    defer self.snapshots_lock.unlock();
+
+    return self.snapshots.count() > 0;
+}
+
+pub fn releaseSnapshot(self: *Self, snapshot_id: u64) !void {
+    self.snapshots_lock.lock();
+    defer self.snapshots_lock.unlock();
+
+    var entry = self.snapshots.fetchRemove(snapshot_id) orelse return error.SnapshotNotFound;
+    FileSegmentList.destroySegments(self.allocator, &entry.value.segments);
+
+    log.info("released snapshot {}", .{snapshot_id});
+}
+
 pub fn acquireReader(self: *Self) !IndexReader {
     try self.checkReady();
 
@@ -420,21 +1412,139 @@ pub fn acquireReader(self: *Self) !IndexReader {
     return IndexReader{
         .file_segments = self.file_segments.segments.acquire(),
         .memory_segments = self.memory_segments.segments.acquire(),
+        .doc_versions = if (self.doc_versions) |ptr| ptr.acquire() else null,
+        .memtable = if (self.memtable) |ptr| ptr.acquire() else null,
+        .memtable_snapshot = if (self.memtable) |ptr| ptr.value.snapshot() else .{},
     };
 }
 
 pub fn releaseReader(self: *Self, reader: *IndexReader) void {
     MemorySegmentList.destroySegments(self.allocator, &reader.memory_segments);
     FileSegmentList.destroySegments(self.allocator, &reader.file_segments);
+    if (reader.doc_versions) |*doc_versions| {
+        destroyDocVersions(self.allocator, doc_versions);
+    }
+    if (reader.memtable) |*memtable| {
+        destroyMemtable(self.allocator, memtable);
+    }
 }
 
 pub fn search(self: *Self, hashes: []u32, results: *SearchResults, deadline: Deadline) !void {
+    return self.searchWithCache(hashes, results, deadline, true);
+}
+
+// Same as search, but the result cache can be bypassed.
+pub fn searchWithCache(self: *Self, hashes: []u32, results: *SearchResults, deadline: Deadline, use_cache: bool) !void {
     var reader = try self.acquireReader();
     defer self.releaseReader(&reader);
 
+    // background writes back off when searches get slow
+    var timer = std.time.Timer.start() catch unreachable;
+    if (self.write_rate_limiter) |limiter| limiter.beginSearch();
+    defer if (self.write_rate_limiter) |limiter| limiter.endSearch(timer.read() / std.time.ns_per_us);
+
+    if (use_cache) {
+        try self.searchReaderCached(&reader, hashes, results, deadline);
+    } else {
+        try self.searchReader(&reader, hashes, results, deadline);
+    }
+}
+
+// Cached results stay valid for newer readers, if we can prove that the changes
+// since the cached version don't affect them, otherwise we search again.
+fn searchReaderCached(self: *Self, reader: *IndexReader, hashes: []u32, results: *SearchResults, deadline: Deadline) !void {
+    const cache = if (self.result_cache) |*result_cache| result_cache else {
+        return self.searchReader(reader, hashes, results, deadline);
+    };
+
+    std.sort.pdq(u32, hashes, {}, std.sort.asc(u32));
+
+    const key: ResultCache.Key = .{ .hashes = hashes, .options = results.options };
+    const version = reader.getVersion();
+
+    switch (try cache.get(key, version, results)) {
+        .hit => return,
+        .stale => |old_version| {
+            if (try reader.isUnchangedSince(self.allocator, old_version, hashes, results.getResults(), deadline)) {
+                cache.refresh(key, old_version, version);
+                return;
+            }
+            cache.invalidate(key, old_version);
+            results.reset(results.options);
+        },
+        .miss => {},
+    }
+
+    // the search prunes frequent hashes in place, the key must stay the original query
+    const query = try self.allocator.dupe(u32, hashes);
+    defer self.allocator.free(query);
+
+    try self.searchReader(reader, query, results, deadline);
+    try cache.put(key, version, results.getResults());
+}
+
+fn searchReader(self: *Self, reader: *IndexReader, hashes: []u32, results: *SearchResults, deadline: Deadline) !void {
+    if (self.options.search_pool) |pool| {
+        if (self.options.max_search_parallelism > 1) {
+            return reader.searchParallel(hashes, results, deadline, .{
+                .pool = pool,
+                .allocator = self.allocator,
+                .max_threads = self.options.max_search_parallelism,
+            });
+        }
+    }
+
     try reader.search(hashes, results, deadline);
 }
 
+pub const MultiSearchQuery = struct {
+    hashes: []u32,
+    options: SearchOptions,
+    // the deadline starts when the query does, not when the batch does, zero means no timeout
+    timeout_ms: i64 = 0,
+    use_cache: bool = true,
+
+    // filled in by multiSearch, allocated using the allocator passed to it
+    results: []SearchResult = &.{},
+    timed_out: bool = false,
+};
+
+// Runs a batch of queries against a single snapshot of the index. The queries are
+// executed one by one, each with its own deadline, a query that runs out of time
+// is marked as timed out and does not affect the rest of the batch. The scoring
+// accumulator is reused between the queries, so after the first one, there are
+// almost no allocations on the search path.
+pub fn multiSearch(self: *Self, allocator: std.mem.Allocator, queries: []MultiSearchQuery) !void {
+    var reader = try self.acquireReader();
+    defer self.releaseReader(&reader);
+
+    var collector = SearchResults.init(allocator, .{});
+    defer collector.deinit();
+
+    for (queries) |*query| {
+        collector.reset(query.options);
+        const deadline = Deadline.init(query.timeout_ms);
+
+        // each query is one sample for the write rate limiter, like a single search
+        var timer = std.time.Timer.start() catch unreachable;
+        if (self.write_rate_limiter) |limiter| limiter.beginSearch();
+        const result = if (query.use_cache)
+            self.searchReaderCached(&reader, query.hashes, &collector, deadline)
+        else
+            self.searchReader(&reader, query.hashes, &collector, deadline);
+        if (self.write_rate_limiter) |limiter| limiter.endSearch(timer.read() / std.time.ns_per_us);
+
+        result catch |err| {
+            if (err == error.Timeout) {
+                query.timed_out = true;
+                continue;
+            }
+            return err;
+        };
+        query.results = try allocator.dupe(SearchResult, collector.getResults());
+    }
+}
+
 test {
     _ = @import("index_tests.zig");
 }
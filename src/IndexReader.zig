@@ -4,10 +4,12 @@ const Self = @This();
 
 const metrics = @import("metrics.zig");
 const Deadline = @import("utils/Deadline.zig");
+const SearchResult = @import("common.zig").SearchResult;
 const SearchResults = @import("common.zig").SearchResults;
 const SearchOptions = @import("common.zig").SearchOptions;
 const SharedPtr = @import("utils/shared_ptr.zig").SharedPtr;
 const DocInfo = @import("common.zig").DocInfo;
+const MemoryUsage = @import("common.zig").MemoryUsage;
 
 const SegmentList = @import("segment_list.zig").SegmentList;
 
@@ -17,6 +19,9 @@ const FileSegmentList = SegmentList(FileSegment);
 const MemorySegment = @import("MemorySegment.zig");
 const MemorySegmentList = SegmentList(MemorySegment);
 
+const DocVersionTable = @import("DocVersionTable.zig");
+const Memtable = @import("Memtable.zig");
+
 const segment_lists = [_][]const u8{
     "file_segments",
     "memory_segments",
@@ -24,23 +29,192 @@ const segment_lists = [_][]const u8{
 
 file_segments: SharedPtr(FileSegmentList),
 memory_segments: SharedPtr(MemorySegmentList),
+doc_versions: ?SharedPtr(DocVersionTable) = null,
+// keeps the memtable alive, the snapshot only covers what was published when the reader was created
+memtable: ?SharedPtr(Memtable) = null,
+memtable_snapshot: Memtable.Snapshot = .{},
 
+// Versions are commit ids, search hits use the last commit id of the segment.
 pub fn hasNewerVersion(self: *const Self, doc_id: u32, version: u64) bool {
+    if (self.doc_versions) |doc_versions| {
+        return doc_versions.value.getVersion(doc_id) > version;
+    }
     inline for (segment_lists) |n| {
         const segments = @field(self, n);
         if (segments.value.hasNewerVersion(doc_id, version)) {
             return true;
         }
     }
-    return false;
+    return self.memtable_snapshot.hasNewerVersion(doc_id, version);
+}
+
+// Removes query hashes that are too frequent in the index, see SearchOptions.max_hash_frequency.
+// Only file segments have hash stats, memory segments are small enough not to matter.
+fn pruneFrequentHashes(self: *Self, sorted_hashes: []u32, results: *SearchResults) []u32 {
+    const options = results.options;
+    if (options.max_hash_frequency == 0) {
+        return sorted_hashes;
+    }
+    var num_kept: usize = 0;
+    var i: usize = 0;
+    while (i < sorted_hashes.len) {
+        const hash = sorted_hashes[i];
+        var j = i + 1;
+        while (j < sorted_hashes.len and sorted_hashes[j] == hash) {
+            j += 1;
+        }
+        if (self.file_segments.value.getHashFrequency(hash) <= options.max_hash_frequency) {
+            for (i..j) |_| {
+                sorted_hashes[num_kept] = hash;
+                num_kept += 1;
+            }
+        }
+        i = j;
+    }
+    metrics.searchPrunedHashes(sorted_hashes.len - num_kept);
+    if (results.profile) |profile| {
+        profile.hashes_pruned = sorted_hashes.len - num_kept;
+    }
+    return sorted_hashes[0..num_kept];
+}
+
+// Each query hash adds at most one point to the score of a doc, so if there are fewer
+// hashes than the minimum score, nothing can be found.
+fn canMatch(query: []const u32, options: SearchOptions) bool {
+    return query.len >= options.min_score;
 }
 
 pub fn search(self: *Self, hashes: []u32, results: *SearchResults, deadline: Deadline) !void {
     std.sort.pdq(u32, hashes, {}, std.sort.asc(u32));
 
+    const query = self.pruneFrequentHashes(hashes, results);
+    if (!canMatch(query, results.options)) {
+        return results.finish(self);
+    }
+
+    try results.setDocIdRange(self.getMinDocId(), self.getMaxDocId());
+
+    try self.memtable_snapshot.search(query, results, deadline);
+
     inline for (segment_lists) |n| {
         const segments = @field(self, n);
-        try segments.value.search(hashes, results, deadline);
+        try segments.value.search(query, results, deadline);
+    }
+
+    try results.finish(self);
+}
+
+pub const Parallelism = struct {
+    pool: *std.Thread.Pool,
+    allocator: std.mem.Allocator,
+    max_threads: usize,
+};
+
+const SearchPartition = struct {
+    reader: *const Self,
+    hashes: []const u32,
+    results: *SearchResults,
+    deadline: Deadline,
+    offset: usize,
+    stride: usize,
+    err: ?anyerror = null,
+
+    fn run(self: *SearchPartition) void {
+        self.searchSegments() catch |err| {
+            self.err = err;
+        };
+    }
+
+    fn runInPool(self: *SearchPartition, wait_group: *std.Thread.WaitGroup) void {
+        defer wait_group.finish();
+        self.run();
+    }
+
+    fn searchSegments(self: *SearchPartition) !void {
+        if (self.offset == 0) {
+            try self.reader.memtable_snapshot.search(self.hashes, self.results, self.deadline);
+        }
+        inline for (segment_lists) |n| {
+            const segments = @field(self.reader, n);
+            try segments.value.searchStriped(self.hashes, self.results, self.deadline, self.offset, self.stride);
+        }
+    }
+};
+
+// Same as search, but splits the segments between up to max_threads threads.
+// The calling thread searches one partition itself, the rest runs in the pool,
+// each partition collects hits into its own SearchResults, which are merged
+// before calling finish.
+pub fn searchParallel(self: *Self, hashes: []u32, results: *SearchResults, deadline: Deadline, parallelism: Parallelism) !void {
+    const num_partitions = @min(parallelism.max_threads, self.getNumSegments());
+    if (num_partitions <= 1) {
+        return self.search(hashes, results, deadline);
+    }
+
+    std.sort.pdq(u32, hashes, {}, std.sort.asc(u32));
+
+    const query = self.pruneFrequentHashes(hashes, results);
+    if (!canMatch(query, results.options)) {
+        return results.finish(self);
+    }
+
+    const allocator = parallelism.allocator;
+
+    const min_doc_id = self.getMinDocId();
+    const max_doc_id = self.getMaxDocId();
+    try results.setDocIdRange(min_doc_id, max_doc_id);
+
+    // the first partition uses the caller's results, so we only need n-1 partial results
+    const partial_results = try allocator.alloc(SearchResults, num_partitions - 1);
+    defer allocator.free(partial_results);
+
+    for (partial_results) |*partial| {
+        partial.* = SearchResults.init(allocator, results.options);
+        partial.profile = results.profile;
+    }
+    defer {
+        for (partial_results) |*partial| {
+            partial.deinit();
+        }
+    }
+    for (partial_results) |*partial| {
+        try partial.setDocIdRange(min_doc_id, max_doc_id);
+    }
+
+    const partitions = try allocator.alloc(SearchPartition, num_partitions);
+    defer allocator.free(partitions);
+
+    for (partitions, 0..) |*partition, i| {
+        partition.* = .{
+            .reader = self,
+            .hashes = query,
+            .results = if (i == 0) results else &partial_results[i - 1],
+            .deadline = deadline,
+            .offset = i,
+            .stride = num_partitions,
+        };
+    }
+
+    var wait_group: std.Thread.WaitGroup = .{};
+    for (partitions[1..]) |*partition| {
+        wait_group.start();
+        parallelism.pool.spawn(SearchPartition.runInPool, .{ partition, &wait_group }) catch {
+            wait_group.finish();
+            partition.run();
+        };
+    }
+    partitions[0].run();
+    // this can run on a pool thread too (sharded searches), so it helps instead of blocking one
+    parallelism.pool.waitAndWork(&wait_group);
+
+    for (partitions) |partition| {
+        if (partition.err) |err| {
+            return err;
+        }
+    }
+
+    for (partial_results) |*partial| {
+        try results.merge(partial);
     }
 
     try results.finish(self);
@@ -52,10 +226,16 @@ pub fn getNumDocs(self: *Self) u32 {
         const segments = @field(self, n);
         result += segments.value.getNumDocs();
     }
+    result += self.memtable_snapshot.getNumDocs();
     return result;
 }
 
 pub fn getDocInfo(self: *Self, doc_id: u32) !?DocInfo {
+    if (self.doc_versions) |doc_versions| {
+        const info = doc_versions.value.get(doc_id) orelse return null;
+        return if (info.deleted) null else info;
+    }
+
     // TODO optimize, read from the end
     var result: ?DocInfo = null;
     inline for (segment_lists) |n| {
@@ -64,6 +244,9 @@ pub fn getDocInfo(self: *Self, doc_id: u32) !?DocInfo {
             result = res;
         }
     }
+    if (self.memtable_snapshot.getDocInfo(doc_id)) |res| {
+        result = res;
+    }
     if (result) |res| {
         if (!res.deleted) {
             return res;
@@ -73,11 +256,11 @@ pub fn getDocInfo(self: *Self, doc_id: u32) !?DocInfo {
 }
 
 pub fn getMinDocId(self: *Self) u32 {
-    var result: u32 = 0;
+    var result: u32 = self.memtable_snapshot.getMinDocId();
     inline for (segment_lists) |n| {
         const segments = @field(self, n);
         const doc_id = segments.value.getMinDocId();
-        if (result == 0 or doc_id < result) {
+        if (doc_id != 0 and (result == 0 or doc_id < result)) {
             result = doc_id;
         }
     }
@@ -85,7 +268,7 @@ pub fn getMinDocId(self: *Self) u32 {
 }
 
 pub fn getMaxDocId(self: *Self) u32 {
-    var result: u32 = 0;
+    var result: u32 = self.memtable_snapshot.getMaxDocId();
     inline for (segment_lists) |n| {
         const segments = @field(self, n);
         const doc_id = segments.value.getMaxDocId();
@@ -96,18 +279,80 @@ pub fn getMaxDocId(self: *Self) u32 {
     return result;
 }
 
+// Returns the last commit id included in this snapshot. Merged segments start at
+// the first commit id they contain, so we need to look at the end of the range.
 pub fn getVersion(self: *Self) u64 {
+    if (!self.memtable_snapshot.isEmpty()) {
+        return self.memtable_snapshot.getVersion();
+    }
     if (self.memory_segments.value.getLast()) |node| {
-        return node.value.info.version;
+        return node.value.info.getLastCommitId();
     }
     if (self.file_segments.value.getLast()) |node| {
-        return node.value.info.version;
+        return node.value.info.getLastCommitId();
     }
     return 0;
 }
 
+// Checks if results of a search done with an older snapshot, at the given version,
+// are still valid for this one. That's the case if none of the segments added since
+// then contain any of the hashes and none of the found docs was updated or deleted.
+// Returns false if the newer segments can't be separated from the older ones,
+// e.g. when they were merged together.
+pub fn isUnchangedSince(self: *Self, allocator: std.mem.Allocator, version: u64, sorted_hashes: []const u32, results: []const SearchResult, deadline: Deadline) !bool {
+    var delta_results = SearchResults.init(allocator, .{});
+    defer delta_results.deinit();
+
+    inline for (segment_lists) |n| {
+        const segments = @field(self, n);
+        for (segments.value.nodes.items) |node| {
+            const info = node.value.info;
+            if (info.getLastCommitId() <= version) {
+                continue;
+            }
+            if (info.version <= version) {
+                return false;
+            }
+            try node.value.search(sorted_hashes, &delta_results, deadline);
+            if (delta_results.count() > 0) {
+                return false;
+            }
+        }
+    }
+
+    // hits in the memtable have exact versions, so it can always be searched for newer changes only
+    try self.memtable_snapshot.searchNewerThan(sorted_hashes, &delta_results, deadline, version);
+    if (delta_results.count() > 0) {
+        return false;
+    }
+
+    for (results) |result| {
+        if (self.hasNewerVersion(result.id, version)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rough estimate of memory used by the segments in this snapshot.
+pub fn getMemoryUsage(self: *Self) MemoryUsage {
+    var result: MemoryUsage = .{};
+    inline for (segment_lists) |n| {
+        const segments = @field(self, n);
+        for (segments.value.nodes.items) |node| {
+            node.value.addMemoryUsage(&result);
+        }
+    }
+    if (self.memtable) |memtable| {
+        memtable.value.addMemoryUsage(&result);
+    }
+    return result;
+}
+
+// The memtable counts as a segment, if there is anything in it.
 pub fn getNumSegments(self: *Self) usize {
-    return self.memory_segments.value.count() + self.file_segments.value.count();
+    const num_memtables: usize = if (self.memtable_snapshot.isEmpty()) 0 else 1;
+    return self.memory_segments.value.count() + self.file_segments.value.count() + num_memtables;
 }
 
 pub fn getAttributes(self: *Self, allocator: std.mem.Allocator) !std.StringHashMapUnmanaged(u64) {
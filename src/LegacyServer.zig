@@ -0,0 +1,437 @@
+const std = @import("std");
+const log = std.log.scoped(.legacy_server);
+
+const MultiIndex = @import("MultiIndex.zig");
+const Index = @import("Index.zig");
+const Change = @import("change.zig").Change;
+const SearchResults = @import("common.zig").SearchResults;
+const Deadline = @import("utils/Deadline.zig");
+const server = @import("server.zig");
+
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+// Server for the line-based protocol of the old acoustid-index, which used to be translated
+// to the HTTP API by legacy-proxy. Each line is one command and gets one "OK <response>" or
+// "ERR <message>" line back. Commands on a connection are handled in order, clients can send
+// more commands without waiting for the responses, they are flushed when no more commands
+// are buffered.
+//
+//   echo <text>                       returns the text
+//   search <h1,h2,...>                returns "<id>:<score>" pairs separated by spaces
+//   begin, rollback                   starts or discards a transaction
+//   insert <id> <h1,h2,...>           adds a fingerprint to the transaction
+//   commit                            applies the transaction
+//   get [attribute] <name>            returns the attribute value, zero if not set
+//   set [attribute] <name> <value>    sets the attribute
+
+pub const Options = struct {
+    address: []const u8 = "127.0.0.1",
+    port: u16 = 6080,
+    // All commands use this index, it's created on start if it doesn't exist.
+    index_name: []const u8 = "main",
+    // Reject updates, e.g. on read replicas.
+    read_only: bool = false,
+    max_line_size: usize = 16 * 1024 * 1024,
+    // Each connection has its own thread, new connections over the limit are refused.
+    max_connections: usize = 1024,
+};
+
+const read_buffer_size = 64 * 1024;
+const write_buffer_size = 64 * 1024;
+
+allocator: std.mem.Allocator,
+indexes: *MultiIndex,
+// the same limits as for the HTTP API
+admission: server.AdmissionControllers,
+options: Options,
+
+listener: ?std.net.Server = null,
+accept_thread: ?std.Thread = null,
+stopping: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+
+// open connections, so that they can be closed on stop
+connections_lock: std.Thread.Mutex = .{},
+connection_closed: std.Thread.Condition = .{},
+connections: std.AutoHashMapUnmanaged(std.posix.socket_t, void) = .{},
+
+pub fn init(allocator: std.mem.Allocator, indexes: *MultiIndex, admission: server.AdmissionControllers, options: Options) Self {
+    return .{
+        .allocator = allocator,
+        .indexes = indexes,
+        .admission = admission,
+        .options = options,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.stop();
+    self.connections.deinit(self.allocator);
+}
+
+pub fn start(self: *Self) !void {
+    if (!self.options.read_only) {
+        try self.indexes.createIndex(self.options.index_name);
+    }
+
+    const address = try std.net.Address.parseIp(self.options.address, self.options.port);
+    self.listener = try address.listen(.{ .reuse_address = true });
+    errdefer {
+        self.listener.?.deinit();
+        self.listener = null;
+    }
+
+    self.stopping.store(false, .release);
+    self.accept_thread = try std.Thread.spawn(.{}, acceptLoop, .{self});
+
+    log.info("legacy protocol listening on {s}:{d}", .{ self.options.address, self.options.port });
+}
+
+// Stops accepting connections, and waits for open connections to finish their current command.
+pub fn stop(self: *Self) void {
+    self.stopping.store(true, .release);
+
+    if (self.listener) |listener| {
+        // wakes up accept()
+        std.posix.shutdown(listener.stream.handle, .both) catch {};
+    }
+    if (self.accept_thread) |thread| {
+        thread.join();
+        self.accept_thread = null;
+    }
+    if (self.listener) |*listener| {
+        listener.deinit();
+        self.listener = null;
+    }
+
+    self.connections_lock.lock();
+    defer self.connections_lock.unlock();
+
+    // both directions, a connection can be blocked on writing to a client that doesn't read
+    var iter = self.connections.keyIterator();
+    while (iter.next()) |handle| {
+        std.posix.shutdown(handle.*, .both) catch {};
+    }
+    while (self.connections.count() > 0) {
+        self.connection_closed.wait(&self.connections_lock);
+    }
+}
+
+fn acceptLoop(self: *Self) void {
+    while (!self.stopping.load(.acquire)) {
+        const conn = self.listener.?.accept() catch |err| {
+            if (self.stopping.load(.acquire)) {
+                break;
+            }
+            log.warn("failed to accept connection: {}", .{err});
+            // e.g. too many open files, don't spin
+            std.time.sleep(10 * std.time.ns_per_ms);
+            continue;
+        };
+        self.startConnection(conn.stream) catch |err| {
+            if (err == error.TooManyConnections) {
+                conn.stream.writeAll("ERR too many connections\r\n") catch {};
+            } else {
+                log.warn("failed to start connection: {}", .{err});
+            }
+            conn.stream.close();
+        };
+    }
+}
+
+fn startConnection(self: *Self, stream: std.net.Stream) !void {
+    {
+        self.connections_lock.lock();
+        defer self.connections_lock.unlock();
+
+        if (self.connections.count() >= self.options.max_connections) {
+            return error.TooManyConnections;
+        }
+        try self.connections.put(self.allocator, stream.handle, {});
+    }
+    errdefer self.removeConnection(stream.handle);
+
+    const thread = try std.Thread.spawn(.{}, handleConnection, .{ self, stream });
+    thread.detach();
+}
+
+fn removeConnection(self: *Self, handle: std.posix.socket_t) void {
+    self.connections_lock.lock();
+    defer self.connections_lock.unlock();
+
+    _ = self.connections.remove(handle);
+    self.connection_closed.broadcast();
+}
+
+fn handleConnection(self: *Self, stream: std.net.Stream) void {
+    defer stream.close();
+    // before closing, so that the handle can't be reused by another connection in the meantime
+    defer self.removeConnection(stream.handle);
+
+    var conn = Connection.init(self);
+    defer conn.deinit();
+
+    conn.run(stream) catch |err| {
+        log.debug("connection failed: {}", .{err});
+    };
+}
+
+const Connection = struct {
+    parent: *Self,
+    allocator: std.mem.Allocator,
+    line: std.ArrayList(u8),
+    response: std.ArrayListUnmanaged(u8) = .{},
+    // parsed query hashes, reused by all searches
+    hashes: std.ArrayListUnmanaged(u32) = .{},
+    // memory for one command
+    arena: std.heap.ArenaAllocator,
+    // changes of the current transaction
+    transaction: std.heap.ArenaAllocator,
+    changes: std.ArrayListUnmanaged(Change) = .{},
+
+    fn init(parent: *Self) Connection {
+        return .{
+            .parent = parent,
+            .allocator = parent.allocator,
+            .line = std.ArrayList(u8).init(parent.allocator),
+            .arena = std.heap.ArenaAllocator.init(parent.allocator),
+            .transaction = std.heap.ArenaAllocator.init(parent.allocator),
+        };
+    }
+
+    fn deinit(self: *Connection) void {
+        self.line.deinit();
+        self.response.deinit(self.allocator);
+        self.hashes.deinit(self.allocator);
+        self.arena.deinit();
+        self.transaction.deinit();
+    }
+
+    fn run(self: *Connection, stream: std.net.Stream) !void {
+        var buffered_reader = std.io.bufferedReaderSize(read_buffer_size, stream.reader());
+        var buffered_writer = std.io.BufferedWriter(write_buffer_size, std.net.Stream.Writer){ .unbuffered_writer = stream.writer() };
+
+        const reader = buffered_reader.reader();
+        const writer = buffered_writer.writer();
+
+        while (true) {
+            self.line.clearRetainingCapacity();
+            reader.streamUntilDelimiter(self.line.writer(), '\n', self.parent.options.max_line_size) catch |err| {
+                switch (err) {
+                    error.EndOfStream => {},
+                    error.StreamTooLong => {
+                        try writer.writeAll("ERR line too long\r\n");
+                    },
+                    else => return err,
+                }
+                // an incomplete command at the end is ignored
+                return buffered_writer.flush();
+            };
+
+            try self.handleCommand(self.line.items, writer);
+
+            // more pipelined commands are waiting, respond to them together
+            if (buffered_reader.start == buffered_reader.end) {
+                try buffered_writer.flush();
+            }
+        }
+    }
+
+    fn handleCommand(self: *Connection, line: []const u8, writer: anytype) !void {
+        defer _ = self.arena.reset(.retain_capacity);
+        self.response.clearRetainingCapacity();
+
+        self.execute(line) catch |err| {
+            const message = switch (err) {
+                error.InvalidCommand, error.InvalidCharacter, error.Overflow => "invalid command",
+                error.IndexNotFound => "index not found",
+                error.IndexNotReady => "index not ready",
+                error.IndexFailed => "index failed",
+                error.ReadOnlyReplica => "read-only replica",
+                error.MemoryLimitExceeded => "memory limit exceeded",
+                error.Timeout => "timeout",
+                error.TooManyRequests, error.DeadlineTooShort, error.DeadlineExpired, error.QueueTimeout => "too many requests",
+                else => blk: {
+                    log.err("error in command {s}: {}", .{ line, err });
+                    break :blk "internal error";
+                },
+            };
+            return writer.print("ERR {s}\r\n", .{message});
+        };
+
+        try writer.print("OK {s}\r\n", .{self.response.items});
+    }
+
+    fn execute(self: *Connection, line: []const u8) anyerror!void {
+        var args_iter = std.mem.tokenizeAny(u8, line, " \t\r");
+
+        const command = args_iter.next() orelse return error.InvalidCommand;
+
+        // the old server took up to three arguments for attribute commands
+        var args_buf: [3][]const u8 = undefined;
+        var num_args: usize = 0;
+        while (args_iter.next()) |arg| {
+            if (num_args < args_buf.len) {
+                args_buf[num_args] = arg;
+            }
+            num_args += 1;
+        }
+        const args = args_buf[0..@min(num_args, args_buf.len)];
+
+        if (std.mem.eql(u8, command, "echo")) {
+            var words = std.mem.tokenizeAny(u8, line, " \t\r");
+            _ = words.next();
+            while (words.next()) |word| {
+                if (self.response.items.len > 0) {
+                    try self.response.append(self.allocator, ' ');
+                }
+                try self.response.appendSlice(self.allocator, word);
+            }
+            return;
+        }
+
+        if (std.mem.eql(u8, command, "search")) {
+            if (args.len < 1) {
+                return error.InvalidCommand;
+            }
+            return self.search(args[0]);
+        }
+
+        if (std.mem.eql(u8, command, "begin") or std.mem.eql(u8, command, "rollback")) {
+            self.resetTransaction();
+            return;
+        }
+
+        if (std.mem.eql(u8, command, "commit")) {
+            if (self.changes.items.len > 0) {
+                try self.update(self.changes.items);
+            }
+            self.resetTransaction();
+            return;
+        }
+
+        if (std.mem.eql(u8, command, "insert")) {
+            if (args.len < 2) {
+                return error.InvalidCommand;
+            }
+            const id = try std.fmt.parseInt(u32, args[0], 10);
+            try self.parseHashes(args[1]);
+            const hashes = try self.transaction.allocator().dupe(u32, self.hashes.items);
+            try self.changes.append(self.transaction.allocator(), .{ .insert = .{ .id = id, .hashes = hashes } });
+            return;
+        }
+
+        if (std.mem.eql(u8, command, "get")) {
+            if (num_args == 2 and std.mem.eql(u8, args[0], "attribute")) {
+                return self.getAttribute(args[1]);
+            } else if (num_args == 1) {
+                return self.getAttribute(args[0]);
+            }
+        }
+
+        if (std.mem.eql(u8, command, "set")) {
+            if (num_args == 3 and std.mem.eql(u8, args[0], "attribute")) {
+                return self.setAttribute(args[1], args[2]);
+            } else if (num_args == 2) {
+                return self.setAttribute(args[0], args[1]);
+            }
+        }
+
+        return error.InvalidCommand;
+    }
+
+    fn resetTransaction(self: *Connection) void {
+        self.changes = .{};
+        _ = self.transaction.reset(.retain_capacity);
+    }
+
+    // Parses comma-separated hashes into the reusable buffer. Like the old server, negative
+    // values are accepted as the signed representation of the hash.
+    fn parseHashes(self: *Connection, text: []const u8) !void {
+        self.hashes.clearRetainingCapacity();
+        var iter = std.mem.splitScalar(u8, text, ',');
+        while (iter.next()) |value| {
+            const hash = try std.fmt.parseInt(i64, value, 10);
+            try self.hashes.append(self.allocator, @truncate(@as(u64, @bitCast(hash))));
+        }
+    }
+
+    fn acquireIndex(self: *Connection) !*Index {
+        return self.parent.indexes.getIndex(self.parent.options.index_name);
+    }
+
+    fn releaseIndex(self: *Connection, index: *Index) void {
+        self.parent.indexes.releaseIndex(index);
+    }
+
+    fn search(self: *Connection, query: []const u8) !void {
+        const start_time = std.time.milliTimestamp();
+        defer metrics.searchDuration(std.time.milliTimestamp() - start_time);
+
+        try self.parseHashes(query);
+
+        const deadline = Deadline.init(server.default_search_timeout);
+
+        var admission = try server.Admission.acquire(self.parent.admission.search, deadline);
+        defer admission.release();
+
+        const index = try self.acquireIndex();
+        defer self.releaseIndex(index);
+
+        metrics.search();
+
+        const arena = self.arena.allocator();
+
+        var collector = SearchResults.init(arena, server.getSearchOptions(index.options, self.hashes.items.len, server.default_search_limit));
+        try index.searchWithCache(self.hashes.items, &collector, deadline, true);
+
+        const results = collector.getResults();
+        if (results.len == 0) {
+            metrics.searchMiss();
+        } else {
+            metrics.searchHit();
+        }
+
+        const response_writer = self.response.writer(self.allocator);
+        for (results, 0..) |result, i| {
+            if (i > 0) {
+                try response_writer.writeByte(' ');
+            }
+            try response_writer.print("{d}:{d}", .{ result.id, result.score });
+        }
+    }
+
+    fn update(self: *Connection, changes: []const Change) !void {
+        if (self.parent.options.read_only) {
+            return error.ReadOnlyReplica;
+        }
+
+        var admission = try server.Admission.acquire(self.parent.admission.update, .{});
+        defer admission.release();
+
+        const index = try self.acquireIndex();
+        defer self.releaseIndex(index);
+
+        metrics.update(changes.len);
+
+        try index.update(changes);
+    }
+
+    fn getAttribute(self: *Connection, name: []const u8) !void {
+        const index = try self.acquireIndex();
+        defer self.releaseIndex(index);
+
+        var reader = try index.acquireReader();
+        defer index.releaseReader(&reader);
+
+        const attributes = try reader.getAttributes(self.arena.allocator());
+
+        try self.response.writer(self.allocator).print("{d}", .{attributes.get(name) orelse 0});
+    }
+
+    fn setAttribute(self: *Connection, name: []const u8, value_str: []const u8) !void {
+        const value = try std.fmt.parseInt(u64, value_str, 10);
+        try self.update(&.{.{ .set_attribute = .{ .name = name, .value = value } }});
+    }
+};
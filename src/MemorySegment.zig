@@ -4,6 +4,7 @@ const log = std.log;
 const common = @import("common.zig");
 const SearchResults = common.SearchResults;
 const KeepOrDelete = common.KeepOrDelete;
+const MemoryUsage = common.MemoryUsage;
 const SegmentInfo = @import("segment.zig").SegmentInfo;
 const SegmentStatus = @import("segment.zig").SegmentStatus;
 const Item = @import("segment.zig").Item;
@@ -11,6 +12,7 @@ const Item = @import("segment.zig").Item;
 const Change = @import("change.zig").Change;
 
 const Deadline = @import("utils/Deadline.zig");
+const SearchProfile = @import("SearchProfile.zig");
 
 const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
 
@@ -47,13 +49,20 @@ pub fn deinit(self: *Self, delete_file: KeepOrDelete) void {
 }
 
 pub fn search(self: Self, sorted_hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+    var profile = SearchProfile.SegmentScope.begin(results.profile, .memory, self.info);
+    defer profile.end();
+
     var items = self.items.items;
     for (sorted_hashes) |hash| {
         const matches = std.sort.equalRange(Item, Item{ .hash = hash, .id = 0 }, items, {}, Item.cmpByHash);
         for (matches[0]..matches[1]) |i| {
-            try results.incr(items[i].id, self.info.version);
+            try results.incr(items[i].id, self.info.getLastCommitId());
         }
         items = items[matches[1]..];
+        if (profile.enabled()) {
+            profile.segment.hashes += 1;
+            profile.segment.postings += matches[1] - matches[0];
+        }
     }
     _ = deadline;
 }
@@ -62,6 +71,12 @@ pub fn getSize(self: Self) usize {
     return self.items.items.len;
 }
 
+pub fn addMemoryUsage(self: Self, usage: *MemoryUsage) void {
+    usage.memory_segment_items += self.items.capacity * @sizeOf(Item);
+    usage.memory_segment_docs += self.docs.capacity() * (@sizeOf(u32) + @sizeOf(bool)) +
+        self.attributes.capacity() * (@sizeOf([]const u8) + @sizeOf(u64));
+}
+
 pub fn build(self: *Self, changes: []const Change) !void {
     var num_attributes: u32 = 0;
     var num_docs: u32 = 0;
@@ -134,6 +149,154 @@ pub fn build(self: *Self, changes: []const Change) !void {
     std.sort.pdq(Item, self.items.items, {}, Item.cmp);
 }
 
+// Builds a segment from a stream of transactions, used for replaying the oplog.
+// Changes are added in the commit order, later changes of a document replace the
+// earlier ones, so the result is the same as merging segments built from the
+// individual transactions.
+pub const Builder = struct {
+    segment: *Self,
+    // sequence number of the last change of each document
+    doc_changes: std.AutoHashMapUnmanaged(u32, u64) = .{},
+    // sequence number of the change that added each item
+    item_changes: std.ArrayListUnmanaged(u64) = .{},
+    num_changes: u64 = 0,
+    num_transactions: u64 = 0,
+
+    pub fn init(segment: *Self) Builder {
+        return .{ .segment = segment };
+    }
+
+    pub fn deinit(self: *Builder) void {
+        self.doc_changes.deinit(self.segment.allocator);
+        self.item_changes.deinit(self.segment.allocator);
+    }
+
+    // Number of items added so far, including items of replaced documents.
+    pub fn getSize(self: Builder) usize {
+        return self.segment.items.items.len;
+    }
+
+    fn updateDocIdRange(segment: *Self, id: u32) void {
+        if (segment.min_doc_id == 0 or id < segment.min_doc_id) {
+            segment.min_doc_id = id;
+        }
+        if (segment.max_doc_id == 0 or id > segment.max_doc_id) {
+            segment.max_doc_id = id;
+        }
+    }
+
+    pub fn add(self: *Builder, changes: []const Change, commit_id: u64) !void {
+        const segment = self.segment;
+        const allocator = segment.allocator;
+
+        if (self.num_transactions == 0) {
+            segment.info = .{ .version = commit_id };
+        } else {
+            std.debug.assert(commit_id > segment.info.getLastCommitId());
+            segment.info.merges = commit_id - segment.info.version;
+        }
+        self.num_transactions += 1;
+
+        for (changes) |change| {
+            self.num_changes += 1;
+            switch (change) {
+                .insert => |op| {
+                    try segment.docs.put(allocator, op.id, true);
+                    try self.doc_changes.put(allocator, op.id, self.num_changes);
+                    try segment.items.ensureUnusedCapacity(allocator, op.hashes.len);
+                    try self.item_changes.ensureUnusedCapacity(allocator, op.hashes.len);
+                    for (op.hashes) |hash| {
+                        segment.items.appendAssumeCapacity(.{ .hash = hash, .id = op.id });
+                        self.item_changes.appendAssumeCapacity(self.num_changes);
+                    }
+                    updateDocIdRange(segment, op.id);
+                },
+                .delete => |op| {
+                    try segment.docs.put(allocator, op.id, false);
+                    try self.doc_changes.put(allocator, op.id, self.num_changes);
+                    updateDocIdRange(segment, op.id);
+                },
+                .set_attribute => |op| {
+                    const result = try segment.attributes.getOrPut(allocator, op.name);
+                    if (!result.found_existing) {
+                        errdefer segment.attributes.removeByPtr(result.key_ptr);
+                        result.key_ptr.* = try allocator.dupe(u8, op.name);
+                    }
+                    result.value_ptr.* = op.value;
+                },
+            }
+        }
+    }
+
+    // Removes items of replaced and deleted documents and sorts the rest.
+    pub fn finish(self: *Builder) void {
+        const items = self.segment.items.items;
+        var n: usize = 0;
+        for (items, self.item_changes.items) |item, change| {
+            if (self.doc_changes.get(item.id) == change) {
+                items[n] = item;
+                n += 1;
+            }
+        }
+        self.segment.items.shrinkRetainingCapacity(n);
+
+        std.sort.pdq(Item, self.segment.items.items, {}, Item.cmp);
+    }
+};
+
+test "Builder gives the same result as build" {
+    const allocator = std.testing.allocator;
+
+    const txns = [_][]const Change{
+        &.{
+            .{ .insert = .{ .id = 1, .hashes = &.{ 1, 2, 3 } } },
+            .{ .insert = .{ .id = 2, .hashes = &.{ 4, 5 } } },
+            .{ .set_attribute = .{ .name = "foo", .value = 1 } },
+        },
+        &.{
+            .{ .insert = .{ .id = 1, .hashes = &.{ 6, 7 } } },
+            .{ .delete = .{ .id = 3 } },
+        },
+        &.{
+            .{ .insert = .{ .id = 3, .hashes = &.{ 8, 9 } } },
+            .{ .insert = .{ .id = 3, .hashes = &.{10} } },
+            .{ .delete = .{ .id = 2 } },
+            .{ .set_attribute = .{ .name = "foo", .value = 2 } },
+        },
+    };
+
+    var built = Self.init(allocator, .{});
+    defer built.deinit(.delete);
+
+    var all_changes = std.ArrayList(Change).init(allocator);
+    defer all_changes.deinit();
+    for (txns) |txn| {
+        try all_changes.appendSlice(txn);
+    }
+    try built.build(all_changes.items);
+
+    var streamed = Self.init(allocator, .{});
+    defer streamed.deinit(.delete);
+
+    var builder = Builder.init(&streamed);
+    defer builder.deinit();
+    for (txns, 10..) |txn, commit_id| {
+        try builder.add(txn, commit_id);
+    }
+    builder.finish();
+
+    try std.testing.expectEqual(SegmentInfo{ .version = 10, .merges = 2 }, streamed.info);
+    try std.testing.expectEqualSlices(Item, built.items.items, streamed.items.items);
+    try std.testing.expectEqual(built.docs.count(), streamed.docs.count());
+    var iter = built.docs.iterator();
+    while (iter.next()) |entry| {
+        try std.testing.expectEqual(entry.value_ptr.*, streamed.docs.get(entry.key_ptr.*).?);
+    }
+    try std.testing.expectEqual(2, streamed.attributes.get("foo").?);
+    try std.testing.expectEqual(built.min_doc_id, streamed.min_doc_id);
+    try std.testing.expectEqual(built.max_doc_id, streamed.max_doc_id);
+}
+
 pub fn cleanup(self: *Self) void {
     _ = self;
 }
@@ -149,6 +312,7 @@ pub fn merge(self: *Self, merger: *SegmentMerger(Self)) !void {
     self.docs.deinit(self.allocator);
     self.docs = merger.segment.docs.move();
 
+    self.min_doc_id = merger.segment.min_doc_id;
     self.max_doc_id = merger.segment.max_doc_id;
 
     self.items.clearRetainingCapacity();
@@ -188,4 +352,15 @@ pub const Reader = struct {
             self.index += 1;
         }
     }
+
+    // Returns all remaining items at once.
+    pub fn readBatch(self: *Reader) !?[]const Item {
+        const items = self.segment.items.items;
+        if (self.index >= items.len) {
+            return null;
+        }
+        const batch = items[self.index..];
+        self.index = items.len;
+        return batch;
+    }
 };
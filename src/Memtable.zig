@@ -0,0 +1,558 @@
+const std = @import("std");
+
+const common = @import("common.zig");
+const SearchResults = common.SearchResults;
+const DocInfo = common.DocInfo;
+const MemoryUsage = common.MemoryUsage;
+const Item = @import("segment.zig").Item;
+const SegmentInfo = @import("segment.zig").SegmentInfo;
+const Change = @import("change.zig").Change;
+const MemorySegment = @import("MemorySegment.zig");
+const Deadline = @import("utils/Deadline.zig");
+const SearchProfile = @import("SearchProfile.zig");
+
+const Self = @This();
+
+// Mutable write buffer for small updates, in front of the memory segments.
+//
+// All storage is allocated upfront and entries are only ever appended, so adding
+// changes doesn't need to allocate and never moves data that readers might be
+// looking at. Items and docs are linked into hash chains, newest first, the chain
+// heads are the only thing that readers and the writer access at the same time.
+//
+// There is a single writer, serialized by the index commit order. The writer adds
+// changes and then publishes them, publishing and taking snapshots is done with
+// the index segments lock held, so a snapshot always covers whole transactions.
+// Once full, the memtable is frozen into a sorted memory segment and replaced.
+
+pub const Options = struct {
+    // Maximum number of items, there is room for max_items / 8 doc changes.
+    max_items: usize = 64 * 1024,
+};
+
+const empty = std.math.maxInt(u32);
+
+const Doc = struct {
+    id: u32,
+    version: u64,
+    deleted: bool,
+    // replaced by a later change in the same transaction
+    superseded: bool = false,
+    // number of distinct docs in entries up to this one
+    num_distinct: u32,
+};
+
+pub const State = struct {
+    info: SegmentInfo = .{},
+    num_items: usize = 0,
+    num_docs: usize = 0,
+    min_doc_id: u32 = 0,
+    max_doc_id: u32 = 0,
+};
+
+allocator: std.mem.Allocator,
+created_at: i64,
+
+items: []Item,
+item_docs: []u32,
+item_next: []u32,
+item_heads: []std.atomic.Value(u32),
+
+docs: []Doc,
+doc_next: []u32,
+doc_heads: []std.atomic.Value(u32),
+
+bucket_shift: u5,
+
+// written by the writer, not visible to readers until published
+pending: State = .{},
+published: State = .{},
+
+fn getMaxItems(options: Options) usize {
+    return @max(options.max_items, 64);
+}
+
+fn getMaxDocs(options: Options) usize {
+    return getMaxItems(options) / 8;
+}
+
+pub fn init(allocator: std.mem.Allocator, options: Options) !Self {
+    const max_items = getMaxItems(options);
+    const max_docs = getMaxDocs(options);
+    const num_buckets = std.math.ceilPowerOfTwoAssert(usize, max_items);
+
+    const items = try allocator.alloc(Item, max_items);
+    errdefer allocator.free(items);
+
+    const item_docs = try allocator.alloc(u32, max_items);
+    errdefer allocator.free(item_docs);
+
+    const item_next = try allocator.alloc(u32, max_items);
+    errdefer allocator.free(item_next);
+
+    const item_heads = try allocator.alloc(std.atomic.Value(u32), num_buckets);
+    errdefer allocator.free(item_heads);
+
+    const docs = try allocator.alloc(Doc, max_docs);
+    errdefer allocator.free(docs);
+
+    const doc_next = try allocator.alloc(u32, max_docs);
+    errdefer allocator.free(doc_next);
+
+    const doc_heads = try allocator.alloc(std.atomic.Value(u32), num_buckets);
+    errdefer allocator.free(doc_heads);
+
+    @memset(item_heads, std.atomic.Value(u32).init(empty));
+    @memset(doc_heads, std.atomic.Value(u32).init(empty));
+
+    return .{
+        .allocator = allocator,
+        .created_at = std.time.milliTimestamp(),
+        .items = items,
+        .item_docs = item_docs,
+        .item_next = item_next,
+        .item_heads = item_heads,
+        .docs = docs,
+        .doc_next = doc_next,
+        .doc_heads = doc_heads,
+        .bucket_shift = @intCast(32 - std.math.log2_int(usize, num_buckets)),
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.allocator.free(self.items);
+    self.allocator.free(self.item_docs);
+    self.allocator.free(self.item_next);
+    self.allocator.free(self.item_heads);
+    self.allocator.free(self.docs);
+    self.allocator.free(self.doc_next);
+    self.allocator.free(self.doc_heads);
+}
+
+fn bucket(self: *const Self, value: u32) usize {
+    return (value *% 0x9E3779B1) >> self.bucket_shift;
+}
+
+pub fn getSize(self: *const Self) usize {
+    return self.pending.num_items;
+}
+
+// All storage is allocated upfront, so this doesn't depend on how full the memtable is.
+pub fn addMemoryUsage(self: *const Self, usage: *MemoryUsage) void {
+    usage.memtable += self.items.len * (@sizeOf(Item) + 2 * @sizeOf(u32)) +
+        self.docs.len * (@sizeOf(Doc) + @sizeOf(u32)) +
+        (self.item_heads.len + self.doc_heads.len) * @sizeOf(u32);
+}
+
+pub fn isEmpty(self: *const Self) bool {
+    return self.pending.info.version == 0;
+}
+
+pub fn isExpired(self: *const Self, max_age_ms: i64) bool {
+    return std.time.milliTimestamp() - self.created_at >= max_age_ms;
+}
+
+const ChangesSize = struct {
+    num_items: usize = 0,
+    num_docs: usize = 0,
+};
+
+// Attributes are not supported, transactions with them need to go to a memory segment.
+fn getChangesSize(changes: []const Change) ?ChangesSize {
+    var size: ChangesSize = .{};
+    for (changes) |change| {
+        switch (change) {
+            .insert => |op| {
+                size.num_items += op.hashes.len;
+                size.num_docs += 1;
+            },
+            .delete => {
+                size.num_docs += 1;
+            },
+            .set_attribute => return null,
+        }
+    }
+    return size;
+}
+
+// Checks if the transaction would fit into an empty memtable.
+pub fn accepts(options: Options, changes: []const Change) bool {
+    const size = getChangesSize(changes) orelse return false;
+    return size.num_items <= getMaxItems(options) and size.num_docs <= getMaxDocs(options);
+}
+
+pub fn canAdd(self: *const Self, changes: []const Change) bool {
+    const size = getChangesSize(changes) orelse return false;
+    return self.pending.num_items + size.num_items <= self.items.len and self.pending.num_docs + size.num_docs <= self.docs.len;
+}
+
+fn addDoc(self: *Self, id: u32, version: u64, deleted: bool) u32 {
+    const state = &self.pending;
+    const head = &self.doc_heads[self.bucket(id)];
+
+    var is_new = true;
+    var k = head.load(.monotonic);
+    while (k != empty) : (k = self.doc_next[k]) {
+        if (self.docs[k].id == id) {
+            is_new = false;
+            // entries with the current version are not published yet, so we can still change them
+            if (self.docs[k].version == version) {
+                self.docs[k].superseded = true;
+            }
+            break;
+        }
+    }
+
+    const i: u32 = @intCast(state.num_docs);
+    const num_distinct = if (i > 0) self.docs[i - 1].num_distinct else 0;
+    self.docs[i] = .{
+        .id = id,
+        .version = version,
+        .deleted = deleted,
+        .num_distinct = num_distinct + @intFromBool(is_new),
+    };
+    self.doc_next[i] = head.load(.monotonic);
+    head.store(i, .release);
+    state.num_docs += 1;
+
+    if (state.min_doc_id == 0 or id < state.min_doc_id) {
+        state.min_doc_id = id;
+    }
+    if (state.max_doc_id == 0 or id > state.max_doc_id) {
+        state.max_doc_id = id;
+    }
+    return i;
+}
+
+// Adds a transaction, canAdd must be checked first. The changes are not
+// visible to readers until publish is called.
+pub fn add(self: *Self, changes: []const Change, commit_id: u64) void {
+    std.debug.assert(self.canAdd(changes));
+
+    const state = &self.pending;
+    if (state.info.version == 0) {
+        state.info = .{ .version = commit_id };
+    } else {
+        std.debug.assert(commit_id > state.info.getLastCommitId());
+        state.info.merges = commit_id - state.info.version;
+    }
+
+    for (changes) |change| {
+        switch (change) {
+            .insert => |op| {
+                const doc = self.addDoc(op.id, commit_id, false);
+                for (op.hashes) |hash| {
+                    const i: u32 = @intCast(state.num_items);
+                    const head = &self.item_heads[self.bucket(hash)];
+                    self.items[i] = .{ .hash = hash, .id = op.id };
+                    self.item_docs[i] = doc;
+                    self.item_next[i] = head.load(.monotonic);
+                    head.store(i, .release);
+                    state.num_items += 1;
+                }
+            },
+            .delete => |op| {
+                _ = self.addDoc(op.id, commit_id, true);
+            },
+            .set_attribute => unreachable,
+        }
+    }
+}
+
+pub fn publish(self: *Self) void {
+    self.published = self.pending;
+}
+
+pub fn snapshot(self: *const Self) Snapshot {
+    return .{ .memtable = self, .state = self.published };
+}
+
+// Builds a sorted memory segment with the latest version of each doc.
+// Must not run concurrently with add.
+pub fn freeze(self: *const Self, segment: *MemorySegment) !void {
+    const allocator = segment.allocator;
+    const state = self.published;
+
+    segment.info = state.info;
+    segment.min_doc_id = state.min_doc_id;
+    segment.max_doc_id = state.max_doc_id;
+
+    var live = try std.DynamicBitSetUnmanaged.initEmpty(allocator, state.num_docs);
+    defer live.deinit(allocator);
+
+    const num_distinct = if (state.num_docs > 0) self.docs[state.num_docs - 1].num_distinct else 0;
+    try segment.docs.ensureTotalCapacity(allocator, num_distinct);
+
+    var i = state.num_docs;
+    while (i > 0) {
+        i -= 1;
+        const doc = self.docs[i];
+        const result = segment.docs.getOrPutAssumeCapacity(doc.id);
+        if (!result.found_existing) {
+            result.value_ptr.* = !doc.deleted;
+            if (!doc.deleted) {
+                live.set(i);
+            }
+        }
+    }
+
+    var num_items: usize = 0;
+    for (self.item_docs[0..state.num_items]) |doc| {
+        num_items += @intFromBool(live.isSet(doc));
+    }
+
+    try segment.items.ensureTotalCapacity(allocator, num_items);
+    for (self.items[0..state.num_items], self.item_docs[0..state.num_items]) |item, doc| {
+        if (live.isSet(doc)) {
+            segment.items.appendAssumeCapacity(item);
+        }
+    }
+
+    std.sort.pdq(Item, segment.items.items, {}, Item.cmp);
+}
+
+// Consistent view of the published part of a memtable. Search hits use the exact
+// commit id of each doc, so hits from replaced versions are dropped by SearchResults.
+pub const Snapshot = struct {
+    memtable: ?*const Self = null,
+    state: State = .{},
+
+    pub fn isEmpty(self: Snapshot) bool {
+        return self.state.info.version == 0;
+    }
+
+    pub fn getInfo(self: Snapshot) SegmentInfo {
+        return self.state.info;
+    }
+
+    pub fn getVersion(self: Snapshot) u64 {
+        return if (self.isEmpty()) 0 else self.state.info.getLastCommitId();
+    }
+
+    pub fn getMinDocId(self: Snapshot) u32 {
+        return self.state.min_doc_id;
+    }
+
+    pub fn getMaxDocId(self: Snapshot) u32 {
+        return self.state.max_doc_id;
+    }
+
+    pub fn getNumDocs(self: Snapshot) u32 {
+        const memtable = self.memtable orelse return 0;
+        if (self.state.num_docs == 0) {
+            return 0;
+        }
+        return memtable.docs[self.state.num_docs - 1].num_distinct;
+    }
+
+    pub fn getDocInfo(self: Snapshot, doc_id: u32) ?DocInfo {
+        const memtable = self.memtable orelse return null;
+        var k = memtable.doc_heads[memtable.bucket(doc_id)].load(.acquire);
+        while (k != empty) : (k = memtable.doc_next[k]) {
+            if (k >= self.state.num_docs) {
+                continue;
+            }
+            const doc = memtable.docs[k];
+            if (doc.id == doc_id) {
+                return .{ .version = doc.version, .deleted = doc.deleted };
+            }
+        }
+        return null;
+    }
+
+    pub fn hasNewerVersion(self: Snapshot, doc_id: u32, version: u64) bool {
+        if (self.getVersion() <= version) {
+            return false;
+        }
+        const info = self.getDocInfo(doc_id) orelse return false;
+        return info.version > version;
+    }
+
+    pub fn search(self: Snapshot, sorted_hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+        return self.searchNewerThan(sorted_hashes, results, deadline, 0);
+    }
+
+    // Only collects hits from changes committed after the given version.
+    pub fn searchNewerThan(self: Snapshot, sorted_hashes: []const u32, results: *SearchResults, deadline: Deadline, min_version: u64) !void {
+        const memtable = self.memtable orelse return;
+        if (self.state.num_items == 0) {
+            return;
+        }
+
+        var profile = SearchProfile.SegmentScope.begin(results.profile, .memory, self.state.info);
+        defer profile.end();
+
+        for (sorted_hashes, 0..) |hash, j| {
+            if (j > 0 and sorted_hashes[j - 1] == hash) {
+                continue;
+            }
+
+            var num_matches: usize = 0;
+            var i = memtable.item_heads[memtable.bucket(hash)].load(.acquire);
+            while (i != empty) : (i = memtable.item_next[i]) {
+                if (i >= self.state.num_items) {
+                    continue;
+                }
+                const item = memtable.items[i];
+                if (item.hash != hash) {
+                    continue;
+                }
+                const doc = memtable.docs[memtable.item_docs[i]];
+                if (doc.superseded or doc.version <= min_version) {
+                    continue;
+                }
+                try results.incr(item.id, doc.version);
+                num_matches += 1;
+            }
+            if (profile.enabled()) {
+                profile.segment.hashes += 1;
+                profile.segment.postings += num_matches;
+            }
+        }
+        _ = deadline;
+    }
+};
+
+const MockCollection = struct {
+    snapshot: Snapshot,
+
+    pub fn hasNewerVersion(self: MockCollection, doc_id: u32, version: u64) bool {
+        return self.snapshot.hasNewerVersion(doc_id, version);
+    }
+};
+
+test "Memtable search" {
+    var memtable = try Self.init(std.testing.allocator, .{ .max_items = 100 });
+    defer memtable.deinit();
+
+    memtable.add(&.{
+        .{ .insert = .{ .id = 1, .hashes = &.{ 1, 2, 3 } } },
+        .{ .insert = .{ .id = 2, .hashes = &.{ 3, 4 } } },
+    }, 1);
+    memtable.publish();
+
+    const before = memtable.snapshot();
+
+    memtable.add(&.{
+        .{ .insert = .{ .id = 1, .hashes = &.{ 5, 6 } } },
+        .{ .delete = .{ .id = 2 } },
+        .{ .insert = .{ .id = 3, .hashes = &.{ 8, 9 } } },
+        .{ .insert = .{ .id = 3, .hashes = &.{ 1, 2, 3 } } },
+    }, 2);
+
+    // unpublished changes are not visible
+    try std.testing.expectEqual(SegmentInfo{ .version = 1 }, memtable.snapshot().getInfo());
+
+    memtable.publish();
+    const after = memtable.snapshot();
+
+    try std.testing.expectEqual(SegmentInfo{ .version = 1, .merges = 1 }, after.getInfo());
+    try std.testing.expectEqual(3, after.getNumDocs());
+    try std.testing.expectEqual(DocInfo{ .version = 2, .deleted = true }, after.getDocInfo(2).?);
+
+    {
+        var results = SearchResults.init(std.testing.allocator, .{});
+        defer results.deinit();
+
+        try before.search(&.{ 1, 2, 3 }, &results, .{});
+        try results.finish(MockCollection{ .snapshot = before });
+
+        try std.testing.expectEqualSlices(common.SearchResult, &.{
+            .{ .id = 1, .score = 3 },
+            .{ .id = 2, .score = 1 },
+        }, results.getResults());
+    }
+
+    {
+        var results = SearchResults.init(std.testing.allocator, .{});
+        defer results.deinit();
+
+        try after.search(&.{ 1, 2, 3 }, &results, .{});
+        try results.finish(MockCollection{ .snapshot = after });
+
+        try std.testing.expectEqualSlices(common.SearchResult, &.{
+            .{ .id = 3, .score = 3 },
+        }, results.getResults());
+    }
+
+    {
+        var results = SearchResults.init(std.testing.allocator, .{});
+        defer results.deinit();
+
+        try after.searchNewerThan(&.{ 4, 5, 6 }, &results, .{}, 1);
+        try std.testing.expectEqual(common.SearchResult{ .id = 1, .score = 2 }, results.get(1).?);
+        try std.testing.expectEqual(null, results.get(2));
+    }
+}
+
+test "Memtable freeze gives the same result as build" {
+    const allocator = std.testing.allocator;
+
+    const txns = [_][]const Change{
+        &.{
+            .{ .insert = .{ .id = 1, .hashes = &.{ 1, 2, 3 } } },
+            .{ .insert = .{ .id = 2, .hashes = &.{ 4, 5 } } },
+        },
+        &.{
+            .{ .insert = .{ .id = 1, .hashes = &.{ 6, 7 } } },
+            .{ .delete = .{ .id = 3 } },
+        },
+        &.{
+            .{ .insert = .{ .id = 3, .hashes = &.{ 8, 9 } } },
+            .{ .insert = .{ .id = 3, .hashes = &.{10} } },
+            .{ .delete = .{ .id = 2 } },
+        },
+    };
+
+    var built = MemorySegment.init(allocator, .{});
+    defer built.deinit(.delete);
+
+    var all_changes = std.ArrayList(Change).init(allocator);
+    defer all_changes.deinit();
+    for (txns) |txn| {
+        try all_changes.appendSlice(txn);
+    }
+    try built.build(all_changes.items);
+
+    var memtable = try Self.init(allocator, .{ .max_items = 100 });
+    defer memtable.deinit();
+
+    for (txns, 10..) |txn, commit_id| {
+        try std.testing.expect(memtable.canAdd(txn));
+        memtable.add(txn, commit_id);
+        memtable.publish();
+    }
+
+    var frozen = MemorySegment.init(allocator, .{});
+    defer frozen.deinit(.delete);
+
+    try memtable.freeze(&frozen);
+
+    try std.testing.expectEqual(SegmentInfo{ .version = 10, .merges = 2 }, frozen.info);
+    try std.testing.expectEqualSlices(Item, built.items.items, frozen.items.items);
+    try std.testing.expectEqual(built.docs.count(), frozen.docs.count());
+    var iter = built.docs.iterator();
+    while (iter.next()) |entry| {
+        try std.testing.expectEqual(entry.value_ptr.*, frozen.docs.get(entry.key_ptr.*).?);
+    }
+    try std.testing.expectEqual(built.min_doc_id, frozen.min_doc_id);
+    try std.testing.expectEqual(built.max_doc_id, frozen.max_doc_id);
+}
+
+test "Memtable capacity" {
+    var memtable = try Self.init(std.testing.allocator, .{ .max_items = 64 });
+    defer memtable.deinit();
+
+    const hashes = [_]u32{1} ** 40;
+    const changes = [_]Change{.{ .insert = .{ .id = 1, .hashes = &hashes } }};
+
+    try std.testing.expect(memtable.canAdd(&changes));
+    memtable.add(&changes, 1);
+    try std.testing.expect(!memtable.canAdd(&changes));
+    try std.testing.expect(!memtable.canAdd(&.{.{ .set_attribute = .{ .name = "foo", .value = 1 } }}));
+
+    try std.testing.expect(accepts(.{ .max_items = 64 }, &changes));
+
+    const too_many_hashes = [_]u32{1} ** 65;
+    try std.testing.expect(!accepts(.{ .max_items = 64 }, &.{.{ .insert = .{ .id = 1, .hashes = &too_many_hashes } }}));
+}
@@ -5,13 +5,29 @@ const assert = std.debug.assert;
 const Index = @import("Index.zig");
 const Scheduler = @import("utils/Scheduler.zig");
 
+const metrics = @import("metrics.zig");
+
 const Self = @This();
 
+pub const Options = struct {
+    // Close indexes that were not used for this long, zero disables it.
+    max_idle_time_ms: i64 = 0,
+    // Close the least recently used indexes while the estimated memory usage of all
+    // open indexes is above this, zero disables it.
+    max_memory_usage: usize = 0,
+    // How often to look for indexes to close.
+    eviction_interval_ms: u64 = 10 * std.time.ms_per_s,
+    // How often to check how much of the segment files is in the page cache, zero disables it.
+    residency_sample_interval_ms: u64 = 0,
+};
+
 pub const IndexRef = struct {
     index: Index,
     name: []const u8,
     references: usize = 0,
     last_used_at: i64 = std.math.minInt(i64),
+    // being closed because it's idle, can't be acquired until it's removed
+    closing: bool = false,
 
     pub fn deinit(self: *IndexRef, allocator: std.mem.Allocator) void {
         allocator.free(self.name);
@@ -32,12 +48,23 @@ pub const IndexRef = struct {
 };
 
 lock: std.Thread.Mutex = .{},
+// signaled when an index that was being closed is removed
+closed: std.Thread.Condition = .{},
+// signaled when the last reference to an index is released
+released: std.Thread.Condition = .{},
 allocator: std.mem.Allocator,
 scheduler: *Scheduler,
 dir: std.fs.Dir,
-indexes: std.StringHashMap(IndexRef),
+index_options: Index.Options,
+options: Options,
+// refs are allocated separately, indexes must not move, their background tasks point to them
+indexes: std.StringHashMap(*IndexRef),
+
+evictor_thread: ?std.Thread = null,
+residency_sampler_thread: ?std.Thread = null,
+stopping: std.Thread.ResetEvent = .{},
 
-fn isValidName(name: []const u8) bool {
+pub fn isValidName(name: []const u8) bool {
     for (name, 0..) |c, i| {
         if (i == 0) {
             switch (c) {
@@ -65,27 +92,188 @@ test "isValidName" {
     try std.testing.expect(!isValidName(".foo"));
 }
 
-pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, dir: std.fs.Dir) Self {
+pub fn init(allocator: std.mem.Allocator, scheduler: *Scheduler, dir: std.fs.Dir, index_options: Index.Options, options: Options) Self {
     return .{
         .allocator = allocator,
         .scheduler = scheduler,
         .dir = dir,
-        .indexes = std.StringHashMap(IndexRef).init(allocator),
+        .index_options = index_options,
+        .options = options,
+        .indexes = std.StringHashMap(*IndexRef).init(allocator),
     };
 }
 
 pub fn deinit(self: *Self) void {
+    self.stop();
+
     self.lock.lock();
     defer self.lock.unlock();
 
-    var iter = self.indexes.iterator();
-    while (iter.next()) |entry| {
-        self.allocator.free(entry.key_ptr.*);
-        entry.value_ptr.index.deinit();
+    var iter = self.indexes.valueIterator();
+    while (iter.next()) |index_ref| {
+        index_ref.*.deinit(self.allocator);
+        self.allocator.destroy(index_ref.*);
     }
     self.indexes.deinit();
 }
 
+// Starts closing idle indexes and sampling page cache residency in background, if enabled in options.
+pub fn start(self: *Self) !void {
+    errdefer self.stop();
+
+    self.stopping.reset();
+    if (self.options.max_idle_time_ms > 0 or self.options.max_memory_usage > 0) {
+        self.evictor_thread = try std.Thread.spawn(.{}, evictorThreadFn, .{self});
+    }
+    if (self.options.residency_sample_interval_ms > 0) {
+        self.residency_sampler_thread = try std.Thread.spawn(.{}, residencySamplerThreadFn, .{self});
+    }
+}
+
+pub fn stop(self: *Self) void {
+    self.stopping.set();
+    if (self.evictor_thread) |thread| {
+        thread.join();
+        self.evictor_thread = null;
+    }
+    if (self.residency_sampler_thread) |thread| {
+        thread.join();
+        self.residency_sampler_thread = null;
+    }
+}
+
+fn residencySamplerThreadFn(self: *Self) void {
+    while (true) {
+        self.stopping.timedWait(self.options.residency_sample_interval_ms * std.time.ns_per_ms) catch {
+            self.sampleResidency() catch |err| {
+                log.warn("failed to sample page cache residency: {}", .{err});
+            };
+            continue;
+        };
+        break;
+    }
+}
+
+// Exports how much of the segment files of each open index is in the page cache.
+pub fn sampleResidency(self: *Self) !void {
+    var index_refs = std.ArrayList(*IndexRef).init(self.allocator);
+    defer index_refs.deinit();
+
+    {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        try index_refs.ensureTotalCapacity(self.indexes.count());
+
+        var iter = self.indexes.valueIterator();
+        while (iter.next()) |ptr| {
+            const index_ref = ptr.*;
+            if (index_ref.closing or !index_ref.index.is_ready.isSet()) {
+                continue;
+            }
+            index_refs.appendAssumeCapacity(index_ref);
+            // not using incRef, sampling doesn't count as using the index
+            index_ref.references += 1;
+        }
+    }
+    defer {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        for (index_refs.items) |index_ref| {
+            index_ref.references -= 1;
+            if (index_ref.references == 0) {
+                self.released.broadcast();
+            }
+        }
+    }
+
+    for (index_refs.items) |index_ref| {
+        const stats = index_ref.index.getResidencyStats() catch continue;
+        metrics.segmentResidency(index_ref.name, "locked", stats.locked.resident_size, stats.locked.total_size);
+        metrics.segmentResidency(index_ref.name, "unlocked", stats.unlocked.resident_size, stats.unlocked.total_size);
+    }
+}
+
+fn evictorThreadFn(self: *Self) void {
+    while (true) {
+        self.stopping.timedWait(self.options.eviction_interval_ms * std.time.ns_per_ms) catch {
+            self.evictIndexes();
+            continue;
+        };
+        break;
+    }
+}
+
+// Closes indexes that are idle, and then the least recently used ones while we are over
+// the memory limit. Only indexes with no references are closed, they are opened again
+// on the next use.
+pub fn evictIndexes(self: *Self) void {
+    while (self.pickIndexToEvict(std.time.milliTimestamp())) |index_ref| {
+        self.closeIndexRef(index_ref);
+    }
+}
+
+fn pickIndexToEvict(self: *Self, now: i64) ?*IndexRef {
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    var total_memory_usage: usize = 0;
+    var least_recently_used: ?*IndexRef = null;
+
+    var iter = self.indexes.valueIterator();
+    while (iter.next()) |ptr| {
+        const index_ref = ptr.*;
+        if (index_ref.closing) {
+            continue;
+        }
+        if (self.options.max_memory_usage > 0) {
+            total_memory_usage += index_ref.index.getMemoryUsage();
+        }
+        if (index_ref.references > 0 or !index_ref.index.is_ready.isSet()) {
+            continue;
+        }
+        // a copy to another server is in progress
+        if (index_ref.index.hasPinnedSnapshots()) {
+            continue;
+        }
+        if (self.options.max_idle_time_ms > 0 and now -| index_ref.last_used_at >= self.options.max_idle_time_ms) {
+            index_ref.closing = true;
+            return index_ref;
+        }
+        if (least_recently_used == null or index_ref.last_used_at < least_recently_used.?.last_used_at) {
+            least_recently_used = index_ref;
+        }
+    }
+
+    if (self.options.max_memory_usage > 0 and total_memory_usage > self.options.max_memory_usage) {
+        if (least_recently_used) |index_ref| {
+            index_ref.closing = true;
+            return index_ref;
+        }
+    }
+
+    return null;
+}
+
+fn closeIndexRef(self: *Self, index_ref: *IndexRef) void {
+    log.info("closing idle index {s}", .{index_ref.name});
+
+    // nobody can acquire the index now, it's safe to checkpoint it without the lock
+    index_ref.index.shutdown() catch |err| {
+        // the changes are still in the oplog, they will be replayed on the next open
+        log.warn("failed to checkpoint index {s} before closing: {}", .{ index_ref.name, err });
+    };
+
+    metrics.indexEviction();
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    self.removeIndex(index_ref.name);
+    self.closed.broadcast();
+}
+
 fn deleteIndexFiles(self: *Self, name: []const u8) !void {
     const tmp_name = try std.mem.concat(self.allocator, u8, &[_][]const u8{ name, ".delete" });
     defer self.allocator.free(tmp_name);
@@ -99,17 +287,30 @@ fn deleteIndexFiles(self: *Self, name: []const u8) !void {
 }
 
 fn removeIndex(self: *Self, name: []const u8) void {
-    if (self.indexes.getEntry(name)) |entry| {
-        entry.value_ptr.deinit(self.allocator);
-        self.indexes.removeByPtr(entry.key_ptr);
+    if (self.indexes.fetchRemove(name)) |entry| {
+        entry.value.deinit(self.allocator);
+        self.allocator.destroy(entry.value);
+    }
+}
+
+// Waits until the index is not being closed, must be called with the lock held.
+fn waitUntilNotClosing(self: *Self, name: []const u8) ?*IndexRef {
+    while (self.indexes.get(name)) |index_ref| {
+        if (!index_ref.closing) {
+            return index_ref;
+        }
+        self.closed.wait(&self.lock);
     }
+    return null;
 }
 
 fn releaseIndexRef(self: *Self, index_ref: *IndexRef) void {
     self.lock.lock();
     defer self.lock.unlock();
 
-    _ = index_ref.decRef();
+    if (index_ref.decRef()) {
+        self.released.broadcast();
+    }
 }
 
 pub fn releaseIndex(self: *Self, index: *Index) void {
@@ -124,26 +325,31 @@ fn acquireIndex(self: *Self, name: []const u8, create: bool) !*IndexRef {
     self.lock.lock();
     defer self.lock.unlock();
 
-    var result = try self.indexes.getOrPutAdapted(name, self.indexes.ctx);
-    if (result.found_existing) {
-        result.value_ptr.incRef();
-        return result.value_ptr;
+    if (self.waitUntilNotClosing(name)) |index_ref| {
+        index_ref.incRef();
+        return index_ref;
     }
-    errdefer self.indexes.removeByPtr(result.key_ptr);
 
-    result.key_ptr.* = try self.allocator.dupe(u8, name);
-    errdefer self.allocator.free(result.key_ptr.*);
+    try self.indexes.ensureUnusedCapacity(1);
+
+    const index_ref = try self.allocator.create(IndexRef);
+    errdefer self.allocator.destroy(index_ref);
 
-    result.value_ptr.* = .{
-        .index = try Index.init(self.allocator, self.scheduler, self.dir, result.key_ptr.*, .{}),
-        .name = result.key_ptr.*,
+    const name_copy = try self.allocator.dupe(u8, name);
+    errdefer self.allocator.free(name_copy);
+
+    index_ref.* = .{
+        .index = try Index.init(self.allocator, self.scheduler, self.dir, name_copy, self.index_options),
+        .name = name_copy,
     };
-    errdefer result.value_ptr.index.deinit();
+    errdefer index_ref.index.deinit();
+
+    try index_ref.index.open(create);
 
-    try result.value_ptr.index.open(create);
+    self.indexes.putAssumeCapacityNoClobber(name_copy, index_ref);
 
-    result.value_ptr.incRef();
-    return result.value_ptr;
+    index_ref.incRef();
+    return index_ref;
 }
 
 pub fn getIndex(self: *Self, name: []const u8) !*Index {
@@ -170,11 +376,111 @@ pub fn deleteIndex(self: *Self, name: []const u8) !void {
     self.lock.lock();
     defer self.lock.unlock();
 
-    if (self.indexes.getEntry(name)) |entry| {
-        entry.value_ptr.index.deinit();
-        self.allocator.free(entry.key_ptr.*);
-        self.indexes.removeByPtr(entry.key_ptr);
+    // others can still be using the index, e.g. a search while a replica deletes it to copy it again,
+    // nobody can acquire it once it's closing, so we only wait for the current references
+    if (self.waitUntilNotClosing(name)) |index_ref| {
+        index_ref.closing = true;
+        while (index_ref.references > 0) {
+            self.released.wait(&self.lock);
+        }
+        self.removeIndex(name);
+        self.closed.broadcast();
     }
 
     try self.deleteIndexFiles(name);
 }
+
+test "MultiIndex closes idle indexes" {
+    const Change = @import("change.zig").Change;
+    const SearchResults = @import("common.zig").SearchResults;
+    const SearchResult = @import("common.zig").SearchResult;
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var indexes = Self.init(std.testing.allocator, &scheduler, tmp_dir.dir, .{}, .{ .max_idle_time_ms = 1 });
+    defer indexes.deinit();
+
+    try indexes.createIndex("foo");
+
+    var hashes = [_]u32{ 1, 2, 3 };
+
+    {
+        const index = try indexes.getIndex("foo");
+        defer indexes.releaseIndex(index);
+
+        try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = &hashes } }});
+
+        // referenced indexes are never closed
+        std.time.sleep(2 * std.time.ns_per_ms);
+        indexes.evictIndexes();
+        try std.testing.expectEqual(1, indexes.indexes.count());
+    }
+
+    std.time.sleep(2 * std.time.ns_per_ms);
+    indexes.evictIndexes();
+    try std.testing.expectEqual(0, indexes.indexes.count());
+
+    // opened again on the next use, from the checkpointed file segment
+    const index = try indexes.getIndex("foo");
+    defer indexes.releaseIndex(index);
+
+    try index.waitForReady(10_000);
+
+    var reader = try index.acquireReader();
+    defer index.releaseReader(&reader);
+
+    try std.testing.expectEqual(1, reader.file_segments.value.count());
+    try std.testing.expectEqual(0, reader.memory_segments.value.count());
+
+    var collector = SearchResults.init(std.testing.allocator, .{});
+    defer collector.deinit();
+
+    try index.search(&hashes, &collector, .{});
+
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = 3 }}, collector.getResults());
+}
+
+test "MultiIndex deletes indexes after they are released" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var indexes = Self.init(std.testing.allocator, &scheduler, tmp_dir.dir, .{}, .{});
+    defer indexes.deinit();
+
+    try indexes.createIndex("foo");
+
+    const index = try indexes.getIndex("foo");
+
+    const Deleter = struct {
+        fn run(multi_index: *Self, deleted: *std.atomic.Value(bool)) void {
+            multi_index.deleteIndex("foo") catch return;
+            deleted.store(true, .release);
+        }
+    };
+
+    var deleted = std.atomic.Value(bool).init(false);
+    const thread = try std.Thread.spawn(.{}, Deleter.run, .{ &indexes, &deleted });
+
+    // still in use, the index must stay open
+    std.time.sleep(10 * std.time.ns_per_ms);
+    try std.testing.expect(!deleted.load(.acquire));
+    try std.testing.expectEqualStrings("foo", index.name);
+
+    indexes.releaseIndex(index);
+    thread.join();
+
+    try std.testing.expect(deleted.load(.acquire));
+    try std.testing.expectEqual(0, indexes.indexes.count());
+    try std.testing.expectError(error.FileNotFound, tmp_dir.dir.access("foo", .{}));
+}
@@ -6,9 +6,21 @@ const msgpack = @import("msgpack");
 
 const Change = @import("change.zig").Change;
 const Transaction = @import("change.zig").Transaction;
+const metrics = @import("metrics.zig");
 
 const Self = @This();
 
+// Concurrent writes are committed in groups. Each writer encodes its transaction into
+// a shared buffer, one of them becomes the leader, writes the whole buffer to the file
+// and calls fsync once for the group, the others wait until their commit is durable.
+pub const Options = struct {
+    // Maximum number of transactions in one group.
+    max_batch_size: usize = 1000,
+    // How long the leader waits for more transactions before writing the group,
+    // zero means it only takes what has been queued while the previous group was syncing.
+    max_batch_delay_us: u64 = 0,
+};
+
 pub const FileInfo = struct {
     id: u64 = 0,
 
@@ -19,8 +31,31 @@ pub const FileInfo = struct {
 
 allocator: std.mem.Allocator,
 dir: std.fs.Dir,
+options: Options,
 
+// protects the pending group and commit ids
 write_lock: std.Thread.Mutex = .{},
+// signaled when a group was synced
+synced: std.Thread.Condition = .{},
+// signaled when the pending group is full
+batch_full: std.Thread.Condition = .{},
+
+pending: std.ArrayListUnmanaged(u8) = .{},
+pending_count: usize = 0,
+flushing: bool = false,
+last_synced_commit_id: u64 = 0,
+// After a group fails, the file is rolled back and its commit ids are given out again.
+// Until every writer that was waiting for one of the discarded ids got the error,
+// no new writes are accepted, so nobody can mistake a reused id for its own commit.
+discarding: bool = false,
+discard_from: u64 = 0,
+discard_count: usize = 0,
+discard_error: anyerror = error.Unexpected,
+// if the file can't be rolled back, we don't know what's on disk, so all further writes fail
+write_error: ?anyerror = null,
+
+// protects the files, only one thread at a time does file I/O
+file_lock: std.Thread.Mutex = .{},
 
 files: std.ArrayList(FileInfo),
 
@@ -30,13 +65,25 @@ max_file_size: usize = 16 * 1024 * 1024,
 
 next_commit_id: u64 = 1,
 
-pub fn init(allocator: std.mem.Allocator, parent_dir: std.fs.Dir) !Self {
+// Where the last read stopped, so that the next poll of a replica doesn't need to decode
+// the file from the start.
+const ReadHint = struct {
+    commit_id: u64 = 0,
+    file_id: u64 = 0,
+    offset: u64 = 0,
+};
+
+read_hint_lock: std.Thread.Mutex = .{},
+read_hint: ReadHint = .{},
+
+pub fn init(allocator: std.mem.Allocator, parent_dir: std.fs.Dir, options: Options) !Self {
     var dir = try parent_dir.makeOpenPath("oplog", .{ .iterate = true });
     errdefer dir.close();
 
     return Self{
         .allocator = allocator,
         .dir = dir,
+        .options = options,
         .files = std.ArrayList(FileInfo).init(allocator),
     };
 }
@@ -45,11 +92,15 @@ pub fn deinit(self: *Self) void {
     self.write_lock.lock();
     defer self.write_lock.unlock();
 
+    self.file_lock.lock();
+    defer self.file_lock.unlock();
+
     log.info("closing oplog", .{});
 
     self.closeCurrentFile();
 
     self.files.deinit();
+    self.pending.deinit(self.allocator);
 
     self.dir.close();
 }
@@ -58,6 +109,9 @@ pub fn open(self: *Self, first_commit_id: u64, receiver: anytype, ctx: anytype)
     self.write_lock.lock();
     defer self.write_lock.unlock();
 
+    self.file_lock.lock();
+    defer self.file_lock.unlock();
+
     log.info("opening oplog", .{});
 
     var it = self.dir.iterate();
@@ -81,7 +135,9 @@ pub fn open(self: *Self, first_commit_id: u64, receiver: anytype, ctx: anytype)
         max_commit_id = @max(max_commit_id, txn.id);
         try receiver(ctx, txn.changes, txn.id);
     }
-    self.next_commit_id = max_commit_id + 1;
+    // never go back below the commits that are already in segments, even if the oplog was empty
+    self.next_commit_id = @max(max_commit_id + 1, first_commit_id);
+    self.last_synced_commit_id = self.next_commit_id - 1;
 }
 
 fn parseFileName(file_name: []const u8) !u64 {
@@ -196,33 +252,282 @@ fn truncateNoLock(self: *Self, commit_id: u64) !void {
 }
 
 pub fn truncate(self: *Self, commit_id: u64) !void {
+    self.file_lock.lock();
+    defer self.file_lock.unlock();
+
+    try self.truncateNoLock(commit_id);
+}
+
+pub const ReadOptions = struct {
+    max_transactions: usize = 1000,
+    // how long to wait for new commits, if there is nothing to return yet
+    timeout_ns: u64 = 0,
+};
+
+// Committed transactions starting at some commit id, e.g. for a replica.
+pub const ReadResult = struct {
+    transactions: []const Transaction,
+    // the last durable commit id when the transactions were read
+    last_commit_id: u64,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+// Waits until the commit is durable, or the timeout expires. Returns the last durable commit id.
+fn waitForCommit(self: *Self, commit_id: u64, timeout_ns: u64) u64 {
     self.write_lock.lock();
     defer self.write_lock.unlock();
 
-    try self.truncateNoLock(commit_id);
+    if (timeout_ns > 0) {
+        var timer = std.time.Timer.start() catch unreachable;
+        while (self.last_synced_commit_id < commit_id and self.write_error == null) {
+            const elapsed = timer.read();
+            if (elapsed >= timeout_ns) {
+                break;
+            }
+            self.synced.timedWait(&self.write_lock, timeout_ns - elapsed) catch break;
+        }
+    }
+
+    return self.last_synced_commit_id;
+}
+
+fn cloneTransaction(allocator: std.mem.Allocator, txn: Transaction) !Transaction {
+    const changes = try allocator.alloc(Change, txn.changes.len);
+    for (txn.changes, changes) |src, *dest| {
+        dest.* = switch (src) {
+            .insert => |op| .{ .insert = .{ .id = op.id, .hashes = try allocator.dupe(u32, op.hashes) } },
+            .delete => |op| .{ .delete = op },
+            .set_attribute => |op| .{ .set_attribute = .{ .name = try allocator.dupe(u8, op.name), .value = op.value } },
+        };
+    }
+    return .{ .id = txn.id, .changes = changes };
+}
+
+// Reads durable transactions starting at first_commit_id, they are allocated in the given
+// arena allocator. If there is nothing new, it waits up to the timeout
+// for new commits. Fails with error.CommitNotAvailable if the oplog was already truncated
+// past first_commit_id.
+pub fn read(self: *Self, allocator: std.mem.Allocator, first_commit_id: u64, options: ReadOptions) !ReadResult {
+    const last_commit_id = self.waitForCommit(first_commit_id, options.timeout_ns);
+    if (first_commit_id > last_commit_id) {
+        return .{ .transactions = &.{}, .last_commit_id = last_commit_id };
+    }
+
+    var files = blk: {
+        self.file_lock.lock();
+        defer self.file_lock.unlock();
+
+        break :blk try self.files.clone();
+    };
+    defer files.deinit();
+
+    if (files.items.len == 0 or files.items[0].id > first_commit_id) {
+        return error.CommitNotAvailable;
+    }
+
+    // skip files that only have older commits
+    const pos = std.sort.upperBound(FileInfo, FileInfo{ .id = first_commit_id }, files.items, {}, FileInfo.cmp);
+    files.replaceRangeAssumeCapacity(0, pos - 1, &.{});
+
+    var transactions = std.ArrayList(Transaction).init(allocator);
+
+    var oplog_it = OplogIterator.init(self.allocator, self.dir, files, first_commit_id);
+    defer oplog_it.deinit();
+
+    const hint = self.getReadHint();
+    if (hint.commit_id == first_commit_id and files.items[0].id == hint.file_id) {
+        oplog_it.first_file_offset = hint.offset;
+    }
+
+    var position: ?OplogIterator.Position = null;
+    while (transactions.items.len < options.max_transactions) {
+        position = oplog_it.getPosition() catch null;
+        // the file can be removed by a checkpoint in the meantime
+        const maybe_txn = oplog_it.next() catch |err| {
+            if (err == error.FileNotFound) {
+                return error.CommitNotAvailable;
+            }
+            return err;
+        };
+        const txn = maybe_txn orelse break;
+        // anything after the last durable commit can be only partially written
+        if (txn.id > last_commit_id) {
+            break;
+        }
+        try transactions.append(try cloneTransaction(allocator, txn));
+    } else {
+        position = oplog_it.getPosition() catch null;
+    }
+
+    // the commit is durable, but not in the oplog, e.g. it's a segment from a bulk import
+    if (options.max_transactions > 0 and (transactions.items.len == 0 or transactions.items[0].id != first_commit_id)) {
+        return error.CommitNotAvailable;
+    }
+
+    if (position) |p| {
+        const next_commit_id = if (transactions.items.len > 0) transactions.items[transactions.items.len - 1].id + 1 else first_commit_id;
+        self.setReadHint(.{ .commit_id = next_commit_id, .file_id = p.file_id, .offset = p.offset });
+    }
+
+    return .{ .transactions = transactions.items, .last_commit_id = last_commit_id };
 }
 
+fn getReadHint(self: *Self) ReadHint {
+    self.read_hint_lock.lock();
+    defer self.read_hint_lock.unlock();
+
+    return self.read_hint;
+}
+
+fn setReadHint(self: *Self, hint: ReadHint) void {
+    self.read_hint_lock.lock();
+    defer self.read_hint_lock.unlock();
+
+    self.read_hint = hint;
+}
+
+// Returns the commit id, once the transaction is durable.
 pub fn write(self: *Self, changes: []const Change) !u64 {
     self.write_lock.lock();
     defer self.write_lock.unlock();
 
-    const commit_id = self.next_commit_id;
+    // wait for room in the pending group
+    while (self.discarding or self.pending_count >= self.options.max_batch_size) {
+        if (self.write_error) |err| {
+            return err;
+        }
+        self.synced.wait(&self.write_lock);
+    }
+
+    if (self.write_error) |err| {
+        return err;
+    }
 
-    const file = try self.getFile(commit_id);
-    var counting_writer = std.io.countingWriter(file.writer());
-    var bufferred_writer = std.io.bufferedWriter(counting_writer.writer());
-    const writer = bufferred_writer.writer();
+    const commit_id = self.next_commit_id;
 
-    try msgpack.encode(Transaction{
+    const pending_size = self.pending.items.len;
+    msgpack.encode(Transaction{
         .id = commit_id,
         .changes = changes,
-    }, writer);
-
-    try bufferred_writer.flush();
+    }, self.pending.writer(self.allocator)) catch |err| {
+        self.pending.shrinkRetainingCapacity(pending_size);
+        return err;
+    };
 
-    self.current_file_size += counting_writer.bytes_written;
     self.next_commit_id += 1;
+    self.pending_count += 1;
+
+    if (self.pending_count >= self.options.max_batch_size) {
+        self.batch_full.signal();
+    }
+
+    while (true) {
+        if (self.discarding and commit_id >= self.discard_from) {
+            self.discard_count -= 1;
+            if (self.discard_count == 0) {
+                self.discarding = false;
+                self.synced.broadcast();
+            }
+            return self.discard_error;
+        }
+        if (self.last_synced_commit_id >= commit_id) {
+            return commit_id;
+        }
+        if (self.write_error) |err| {
+            return err;
+        }
+        if (self.flushing) {
+            self.synced.wait(&self.write_lock);
+            continue;
+        }
+        self.flushPending();
+    }
+}
+
+// Called by the group leader with write_lock held, the lock is released during I/O.
+fn flushPending(self: *Self) void {
+    self.flushing = true;
+    defer {
+        self.flushing = false;
+        self.synced.broadcast();
+    }
+
+    if (self.options.max_batch_delay_us > 0) {
+        var timer = std.time.Timer.start() catch unreachable;
+        const max_delay_ns = self.options.max_batch_delay_us * std.time.ns_per_us;
+        while (self.pending_count < self.options.max_batch_size) {
+            const elapsed = timer.read();
+            if (elapsed >= max_delay_ns) {
+                break;
+            }
+            self.batch_full.timedWait(&self.write_lock, max_delay_ns - elapsed) catch break;
+        }
+    }
+
+    var data = self.pending;
+    self.pending = .{};
+    defer data.deinit(self.allocator);
+
+    const first_commit_id = self.next_commit_id - self.pending_count;
+    const last_commit_id = self.next_commit_id - 1;
+    const batch_size = self.pending_count;
+    self.pending_count = 0;
 
+    self.write_lock.unlock();
+    const result = self.writeAndSync(data.items, first_commit_id);
+    self.write_lock.lock();
+
+    result catch |err| {
+        log.err("failed to write oplog: {}", .{err});
+        if (err == error.OplogRollbackFailed) {
+            self.write_error = err;
+        }
+        // the group that was queued in the meantime has commit ids after the failed one,
+        // so it's discarded as well
+        self.discarding = true;
+        self.discard_from = first_commit_id;
+        self.discard_count = batch_size + self.pending_count;
+        self.discard_error = err;
+        self.next_commit_id = first_commit_id;
+        self.pending.clearRetainingCapacity();
+        self.pending_count = 0;
+        return;
+    };
+
+    metrics.oplogBatch(batch_size);
+    self.last_synced_commit_id = last_commit_id;
+
+    // reuse the buffer for the next group, if nobody has started a new one
+    if (self.pending.capacity == 0) {
+        data.clearRetainingCapacity();
+        self.pending = data;
+        data = .{};
+    }
+}
+
+fn writeAndSync(self: *Self, data: []const u8, first_commit_id: u64) !void {
+    self.file_lock.lock();
+    defer self.file_lock.unlock();
+
+    const file = try self.getFile(first_commit_id);
+    writeAndSyncFile(file, data) catch |err| {
+        // remove the partially written group, so that it's not replayed on the next start
+        rollbackFile(file, self.current_file_size) catch |rollback_err| {
+            log.err("failed to roll back oplog file: {}", .{rollback_err});
+            return error.OplogRollbackFailed;
+        };
+        return err;
+    };
+    self.current_file_size += data.len;
+}
+
+fn writeAndSyncFile(file: std.fs.File, data: []const u8) !void {
+    try file.writeAll(data);
+
+    var timer = std.time.Timer.start() catch unreachable;
     file.sync() catch |err| {
         if (err == error.InputOutput) {
             // FIXME: maybe we try to reload the oplog from disk, there is no other way to know what happened
@@ -230,15 +535,20 @@ pub fn write(self: *Self, changes: []const Change) !u64 {
         }
         return err;
     };
+    metrics.oplogSyncDuration(timer.read());
+}
 
-    return commit_id;
+fn rollbackFile(file: std.fs.File, file_size: usize) !void {
+    try file.setEndPos(file_size);
+    try file.seekTo(file_size);
+    try file.sync();
 }
 
 test "write entries" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
 
-    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir);
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
     defer oplog.deinit();
 
     const Updater = struct {
@@ -273,14 +583,127 @@ test "write entries" {
     try std.testing.expectEqualDeep(&changes, txn.changes);
 }
 
+test "group commit" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{ .max_batch_size = 10, .max_batch_delay_us = 1000 });
+    defer oplog.deinit();
+
+    const Updater = struct {
+        pub fn receive(self: *@This(), changes: []const Change, commit_id: u64) !void {
+            _ = self;
+            _ = changes;
+            _ = commit_id;
+        }
+    };
+
+    var updater: Updater = .{};
+
+    try oplog.open(1, Updater.receive, &updater);
+
+    const num_threads = 8;
+    const num_writes = 20;
+
+    const Writer = struct {
+        fn run(target: *Self, thread_no: usize, commit_ids: *[num_writes]u64) void {
+            for (commit_ids, 0..) |*commit_id, i| {
+                const changes = [_]Change{.{ .insert = .{
+                    .id = @intCast(thread_no * num_writes + i + 1),
+                    .hashes = &[_]u32{ 1, 2, 3 },
+                } }};
+                commit_id.* = target.write(&changes) catch 0;
+            }
+        }
+    };
+
+    var commit_ids: [num_threads][num_writes]u64 = undefined;
+    var threads: [num_threads]std.Thread = undefined;
+    for (&threads, 0..) |*thread, i| {
+        thread.* = try std.Thread.spawn(.{}, Writer.run, .{ &oplog, i, &commit_ids[i] });
+    }
+    for (threads) |thread| {
+        thread.join();
+    }
+
+    // every write got a unique commit id, and they are increasing within each thread
+    var seen = std.StaticBitSet(num_threads * num_writes + 1).initEmpty();
+    for (commit_ids) |ids| {
+        for (ids, 0..) |id, i| {
+            try std.testing.expect(id >= 1 and id <= num_threads * num_writes);
+            try std.testing.expect(!seen.isSet(id));
+            seen.set(id);
+            if (i > 0) {
+                try std.testing.expect(id > ids[i - 1]);
+            }
+        }
+    }
+
+    // all transactions are in the file, in the commit order
+    var iter = OplogIterator.init(std.testing.allocator, oplog.dir, oplog.files, 1);
+    defer iter.deinit();
+
+    var expected_id: u64 = 1;
+    while (try iter.next()) |txn| : (expected_id += 1) {
+        try std.testing.expectEqual(expected_id, txn.id);
+    }
+    try std.testing.expectEqual(num_threads * num_writes + 1, expected_id);
+}
+
+test "failed write" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    const Updater = struct {
+        pub fn receive(self: *@This(), changes: []const Change, commit_id: u64) !void {
+            _ = self;
+            _ = changes;
+            _ = commit_id;
+        }
+    };
+
+    var updater: Updater = .{};
+
+    try oplog.open(1, Updater.receive, &updater);
+
+    const changes = [_]Change{.{ .insert = .{
+        .id = 1,
+        .hashes = &[_]u32{ 1, 2, 3 },
+    } }};
+
+    try std.testing.expectEqual(1, try oplog.write(&changes));
+
+    // the next file can't be created
+    oplog.current_file_size = oplog.max_file_size;
+    var file = try tmp_dir.dir.createFile("oplog/0000000000000002.xlog", .{});
+    file.close();
+
+    try std.testing.expectError(error.PathAlreadyExists, oplog.write(&changes));
+
+    // the failure is not sticky, and the commit id is given out again
+    try tmp_dir.dir.deleteFile("oplog/0000000000000002.xlog");
+    try std.testing.expectEqual(2, try oplog.write(&changes));
+    try std.testing.expectEqual(3, try oplog.write(&changes));
+}
+
 pub const OplogIterator = struct {
     allocator: std.mem.Allocator,
     dir: std.fs.Dir,
     files: std.ArrayList(FileInfo),
     first_commit_id: u64,
+    // where to start reading the first file, if it's known where the first commit is
+    first_file_offset: u64 = 0,
     current_iterator: ?OplogFileIterator = null,
     current_file_index: usize = 0,
 
+    pub const Position = struct {
+        file_id: u64,
+        offset: u64,
+    };
+
     pub fn init(allocator: std.mem.Allocator, dir: std.fs.Dir, files: std.ArrayList(FileInfo), first_commit_id: u64) OplogIterator {
         return OplogIterator{
             .allocator = allocator,
@@ -296,6 +719,17 @@ pub const OplogIterator = struct {
         }
     }
 
+    // Position of the next transaction, if a file is open.
+    pub fn getPosition(self: *OplogIterator) !?Position {
+        if (self.current_iterator) |*iterator| {
+            return .{
+                .file_id = self.files.items[self.current_file_index].id,
+                .offset = try iterator.getOffset(),
+            };
+        }
+        return null;
+    }
+
     pub fn next(self: *OplogIterator) !?Transaction {
         while (true) {
             if (self.current_iterator) |*iterator| {
@@ -314,8 +748,14 @@ pub const OplogIterator = struct {
             }
             var buf: [file_name_size]u8 = undefined;
             const file_name = try generateFileName(&buf, self.files.items[self.current_file_index].id);
-            log.info("reading oplog file {s}", .{file_name});
+            log.debug("reading oplog file {s}", .{file_name});
             const file = try self.dir.openFile(file_name, .{});
+            if (self.current_file_index == 0 and self.first_file_offset > 0) {
+                file.seekTo(self.first_file_offset) catch |err| {
+                    file.close();
+                    return err;
+                };
+            }
             self.current_iterator = OplogFileIterator.init(self.allocator, file);
         }
         unreachable;
@@ -340,6 +780,12 @@ pub const OplogFileIterator = struct {
         self.arena.deinit();
     }
 
+    // Offset of the next transaction, the file position minus what's still buffered.
+    pub fn getOffset(self: *OplogFileIterator) !u64 {
+        const pos = try self.file.getPos();
+        return pos - (self.buffered_reader.end - self.buffered_reader.start);
+    }
+
     pub fn next(self: *OplogFileIterator) !?Transaction {
         _ = self.arena.reset(.retain_capacity);
 
@@ -351,3 +797,110 @@ pub const OplogFileIterator = struct {
         };
     }
 };
+
+test "read transactions" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    const Updater = struct {
+        pub fn receive(self: *@This(), changes: []const Change, commit_id: u64) !void {
+            _ = self;
+            _ = changes;
+            _ = commit_id;
+        }
+    };
+
+    var updater: Updater = .{};
+
+    try oplog.open(1, Updater.receive, &updater);
+
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    {
+        const result = try oplog.read(arena.allocator(), 1, .{ .timeout_ns = std.time.ns_per_ms });
+        try std.testing.expectEqual(0, result.transactions.len);
+        try std.testing.expectEqual(0, result.last_commit_id);
+    }
+
+    for (1..11) |i| {
+        _ = try oplog.write(&[_]Change{.{ .insert = .{ .id = @intCast(i), .hashes = &[_]u32{ 1, 2, 3 } } }});
+        if (i == 5) {
+            // start a new file
+            oplog.current_file_size = oplog.max_file_size;
+        }
+    }
+
+    {
+        const result = try oplog.read(arena.allocator(), 7, .{ .max_transactions = 2 });
+        try std.testing.expectEqual(10, result.last_commit_id);
+        try std.testing.expectEqual(2, result.transactions.len);
+        try std.testing.expectEqual(7, result.transactions[0].id);
+        try std.testing.expectEqual(8, result.transactions[1].id);
+        try std.testing.expectEqual(8, result.transactions[1].changes[0].insert.id);
+    }
+
+    {
+        // continues from where the previous read stopped
+        try std.testing.expectEqual(9, oplog.read_hint.commit_id);
+        const result = try oplog.read(arena.allocator(), 9, .{});
+        try std.testing.expectEqual(2, result.transactions.len);
+        try std.testing.expectEqual(9, result.transactions[0].id);
+        try std.testing.expectEqual(10, result.transactions[1].id);
+    }
+
+    try oplog.truncate(7);
+
+    try std.testing.expectError(error.CommitNotAvailable, oplog.read(arena.allocator(), 3, .{}));
+
+    {
+        const result = try oplog.read(arena.allocator(), 6, .{});
+        try std.testing.expectEqual(5, result.transactions.len);
+    }
+}
+
+test "read transactions after a gap" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    const Updater = struct {
+        pub fn receive(self: *@This(), changes: []const Change, commit_id: u64) !void {
+            _ = self;
+            _ = changes;
+            _ = commit_id;
+        }
+    };
+
+    var updater: Updater = .{};
+
+    {
+        var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+        defer oplog.deinit();
+
+        try oplog.open(1, Updater.receive, &updater);
+        for (1..4) |i| {
+            _ = try oplog.write(&[_]Change{.{ .insert = .{ .id = @intCast(i), .hashes = &[_]u32{ 1, 2, 3 } } }});
+        }
+    }
+
+    // commits 4-7 were added without the oplog, like segments from a bulk import
+    var oplog = try Self.init(std.testing.allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    try oplog.open(8, Updater.receive, &updater);
+
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    try std.testing.expectError(error.CommitNotAvailable, oplog.read(arena.allocator(), 4, .{}));
+
+    _ = try oplog.write(&[_]Change{.{ .insert = .{ .id = 8, .hashes = &[_]u32{ 1, 2, 3 } } }});
+    try std.testing.expectError(error.CommitNotAvailable, oplog.read(arena.allocator(), 4, .{}));
+
+    const result = try oplog.read(arena.allocator(), 8, .{});
+    try std.testing.expectEqual(1, result.transactions.len);
+    try std.testing.expectEqual(8, result.transactions[0].id);
+}
@@ -0,0 +1,487 @@
+const std = @import("std");
+const log = std.log.scoped(.replica);
+
+const msgpack = @import("msgpack");
+
+const MultiIndex = @import("MultiIndex.zig");
+const Index = @import("Index.zig");
+const Oplog = @import("Oplog.zig");
+const filefmt = @import("filefmt.zig");
+
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+// Read replica of indexes on a primary server. Each replicated index has a thread that
+// long-polls /:index/_replicate on the primary and applies the transactions in the commit
+// order, so the local index ends up with the same commit ids. If the index doesn't exist
+// locally, the segment files are first downloaded from a snapshot pinned on the primary and
+// the replication continues from the oplog after the snapshot. The same happens when the
+// local index can't continue from the primary's oplog, e.g. it was truncated, or there is a gap
+// in the commit ids.
+
+pub const Options = struct {
+    // base URL of the primary server, e.g. http://127.0.0.1:6081
+    primary_url: []const u8,
+    // how long the primary holds a request if there are no new commits
+    poll_wait_ms: u32 = 5000,
+    max_batch_size: usize = 1000,
+    retry_delay_ms: u64 = 1000,
+};
+
+pub const Status = struct {
+    last_applied_commit_id: u64 = 0,
+    // the last commit id known to the primary, as of the last successful request
+    primary_commit_id: u64 = 0,
+    // the last time the replica had all commits known to the primary
+    caught_up_at: i64 = 0,
+
+    pub fn getLagCommits(self: Status) u64 {
+        return self.primary_commit_id -| self.last_applied_commit_id;
+    }
+
+    // While polls are returning, a caught up replica has no lag. If the primary doesn't
+    // respond, the lag grows from the last time we were caught up.
+    pub fn getLagMs(self: Status, now: i64, max_silence_ms: i64) i64 {
+        const elapsed = now -| self.caught_up_at;
+        if (self.getLagCommits() == 0 and elapsed <= max_silence_ms) {
+            return 0;
+        }
+        return elapsed;
+    }
+};
+
+const max_response_size = 256 * 1024 * 1024;
+const max_header_size = 4096;
+
+const Replicator = struct {
+    replica: *Self,
+    name: []const u8,
+    // null while the index is being copied from the primary
+    index: ?*Index,
+    // set once the index is open and can be searched, read by request handlers
+    ready: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+    thread: ?std.Thread = null,
+    status_lock: std.Thread.Mutex = .{},
+    status: Status = .{},
+    // snapshot on the primary that we bootstrapped from, released after the first poll
+    snapshot_id: ?u64 = null,
+
+    fn run(self: *Replicator) void {
+        var client = std.http.Client{ .allocator = self.replica.allocator };
+        defer client.deinit();
+
+        while (!self.replica.stopping.isSet()) {
+            self.step(&client) catch |err| {
+                log.err("replication of index {s} failed: {}", .{ self.name, err });
+                self.updateMetrics();
+                self.replica.stopping.timedWait(self.replica.options.retry_delay_ms * std.time.ns_per_ms) catch {};
+                continue;
+            };
+            self.updateMetrics();
+        }
+    }
+
+    fn step(self: *Replicator, client: *std.http.Client) !void {
+        if (self.index == null) {
+            try self.bootstrap(client);
+        }
+        self.poll(client, self.index.?) catch |err| {
+            if (err == error.CommitNotAvailable or err == error.UnexpectedCommitId) {
+                log.warn("index {s} can't continue from the primary's oplog, copying it again", .{self.name});
+                try self.deleteLocalIndex(client);
+            }
+            return err;
+        };
+    }
+
+    // Copies the index from a snapshot, if it doesn't exist locally, and opens it.
+    fn bootstrap(self: *Replicator, client: *std.http.Client) !void {
+        if (!self.replica.hasLocalIndex(self.name)) {
+            self.snapshot_id = try self.replica.copyIndex(client, self.name);
+        }
+
+        try self.replica.indexes.createIndex(self.name);
+
+        const index = try self.replica.indexes.getIndex(self.name);
+        errdefer self.replica.indexes.releaseIndex(index);
+
+        try index.waitForReady(std.math.maxInt(u32));
+
+        self.index = index;
+        self.setStatus(index.getNextCommitId() - 1, 0);
+        self.ready.store(true, .release);
+    }
+
+    fn deleteLocalIndex(self: *Replicator, client: *std.http.Client) !void {
+        self.ready.store(false, .release);
+        if (self.index) |index| {
+            self.replica.indexes.releaseIndex(index);
+            self.index = null;
+        }
+        if (self.snapshot_id) |snapshot_id| {
+            self.replica.releaseSnapshot(client, self.name, snapshot_id);
+            self.snapshot_id = null;
+        }
+        try self.replica.indexes.deleteIndex(self.name);
+    }
+
+    fn poll(self: *Replicator, client: *std.http.Client, index: *Index) !void {
+        var arena = std.heap.ArenaAllocator.init(self.replica.allocator);
+        defer arena.deinit();
+
+        const options = self.replica.options;
+        const first_commit_id = index.getNextCommitId();
+
+        const url = try std.fmt.allocPrint(arena.allocator(), "{s}/{s}/_replicate?from={d}&limit={d}&wait={d}", .{
+            std.mem.trimRight(u8, options.primary_url, "/"),
+            self.name,
+            first_commit_id,
+            options.max_batch_size,
+            options.poll_wait_ms,
+        });
+
+        var header_buf: [max_header_size]u8 = undefined;
+        var req = try client.open(.GET, try std.Uri.parse(url), .{
+            .server_header_buffer = &header_buf,
+            .extra_headers = &.{
+                .{ .name = "accept", .value = "application/vnd.msgpack" },
+            },
+        });
+        defer req.deinit();
+
+        try req.send();
+        try req.finish();
+        try req.wait();
+
+        if (req.response.status == .gone) {
+            log.err("primary doesn't have commit {} of index {s} anymore", .{ first_commit_id, self.name });
+            return error.CommitNotAvailable;
+        }
+        if (req.response.status != .ok) {
+            log.warn("primary returned status {d} for index {s}", .{ @intFromEnum(req.response.status), self.name });
+            return error.ReplicationRequestFailed;
+        }
+
+        const body = try req.reader().readAllAlloc(arena.allocator(), max_response_size);
+        const result = try msgpack.decodeFromSliceLeaky(Oplog.ReadResult, arena.allocator(), body);
+
+        for (result.transactions) |txn| {
+            try index.applyReplicated(txn);
+            self.setStatus(txn.id, result.last_commit_id);
+        }
+        self.setStatus(first_commit_id - 1 + result.transactions.len, result.last_commit_id);
+
+        if (self.snapshot_id) |snapshot_id| {
+            self.replica.releaseSnapshot(client, self.name, snapshot_id);
+            self.snapshot_id = null;
+        }
+    }
+
+    fn setStatus(self: *Replicator, last_applied_commit_id: u64, primary_commit_id: u64) void {
+        self.status_lock.lock();
+        defer self.status_lock.unlock();
+
+        self.status.last_applied_commit_id = last_applied_commit_id;
+        self.status.primary_commit_id = @max(self.status.primary_commit_id, primary_commit_id);
+        if (self.status.getLagCommits() == 0) {
+            self.status.caught_up_at = std.time.milliTimestamp();
+        }
+    }
+
+    fn getStatus(self: *Replicator) Status {
+        self.status_lock.lock();
+        defer self.status_lock.unlock();
+
+        return self.status;
+    }
+
+    fn updateMetrics(self: *Replicator) void {
+        const status = self.getStatus();
+        const lag_ms = status.getLagMs(std.time.milliTimestamp(), self.replica.getMaxSilenceMs());
+        metrics.replicationLag(self.name, status.getLagCommits(), lag_ms);
+    }
+};
+
+allocator: std.mem.Allocator,
+indexes: *MultiIndex,
+options: Options,
+// only changed before start
+replicators: std.ArrayListUnmanaged(*Replicator) = .{},
+stopping: std.Thread.ResetEvent = .{},
+
+pub fn init(allocator: std.mem.Allocator, indexes: *MultiIndex, options: Options) Self {
+    return .{
+        .allocator = allocator,
+        .indexes = indexes,
+        .options = options,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.stop();
+
+    for (self.replicators.items) |replicator| {
+        if (replicator.index) |index| {
+            self.indexes.releaseIndex(index);
+        }
+        self.allocator.free(replicator.name);
+        self.allocator.destroy(replicator);
+    }
+    self.replicators.deinit(self.allocator);
+}
+
+// Opens the local index and keeps it open for replication. If the index doesn't exist locally,
+// it's copied from the primary by the replication thread, it's not ready until then.
+pub fn addIndex(self: *Self, name: []const u8) !void {
+    try self.replicators.ensureUnusedCapacity(self.allocator, 1);
+
+    var index: ?*Index = null;
+    if (self.hasLocalIndex(name)) {
+        index = try self.indexes.getIndex(name);
+    }
+    errdefer if (index) |ptr| self.indexes.releaseIndex(ptr);
+
+    const replicator = try self.allocator.create(Replicator);
+    errdefer self.allocator.destroy(replicator);
+
+    replicator.* = .{
+        .replica = self,
+        .name = try self.allocator.dupe(u8, name),
+        .index = index,
+    };
+
+    self.replicators.appendAssumeCapacity(replicator);
+}
+
+fn hasLocalIndex(self: *Self, name: []const u8) bool {
+    var dir = self.indexes.dir.openDir(name, .{}) catch return false;
+    defer dir.close();
+
+    dir.access(filefmt.manifest_file_name, .{}) catch return false;
+    return true;
+}
+
+// Downloads the segment files of the index from a snapshot on the primary and writes
+// the local manifest, the rest comes from the oplog. Returns the snapshot id, or null
+// if the primary doesn't have the index yet.
+fn copyIndex(self: *Self, client: *std.http.Client, name: []const u8) !?u64 {
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+
+    const base_url = std.mem.trimRight(u8, self.options.primary_url, "/");
+
+    const url = try std.fmt.allocPrint(arena.allocator(), "{s}/{s}/_snapshot", .{ base_url, name });
+
+    var header_buf: [max_header_size]u8 = undefined;
+    var req = try client.open(.POST, try std.Uri.parse(url), .{
+        .server_header_buffer = &header_buf,
+        .extra_headers = &.{
+            .{ .name = "accept", .value = "application/vnd.msgpack" },
+        },
+    });
+    defer req.deinit();
+
+    req.transfer_encoding = .{ .content_length = 0 };
+    try req.send();
+    try req.finish();
+    try req.wait();
+
+    if (req.response.status == .not_found) {
+        log.info("index {s} doesn't exist on the primary, starting empty", .{name});
+        return null;
+    }
+    if (req.response.status != .ok) {
+        log.warn("primary returned status {d} for snapshot of index {s}", .{ @intFromEnum(req.response.status), name });
+        return error.ReplicationRequestFailed;
+    }
+
+    const body = try req.reader().readAllAlloc(arena.allocator(), max_response_size);
+    const snapshot = try msgpack.decodeFromSliceLeaky(Index.SnapshotInfo, arena.allocator(), body);
+    errdefer self.releaseSnapshot(client, name, snapshot.id);
+
+    if (snapshot.segments.len != snapshot.files.len) {
+        return error.InvalidSnapshot;
+    }
+
+    log.info("copying index {s} from snapshot {} (segments = {}, last commit = {})", .{ name, snapshot.id, snapshot.segments.len, snapshot.last_commit_id });
+
+    var dir = try self.indexes.dir.makeOpenPath(name, .{ .iterate = true });
+    defer dir.close();
+
+    for (snapshot.segments, snapshot.files) |info, file| {
+        // don't trust the file names from the response, they are used as local paths
+        var file_name_buf: [filefmt.max_file_name_size]u8 = undefined;
+        const file_name = filefmt.buildSegmentFileName(&file_name_buf, info);
+        if (!std.mem.eql(u8, file_name, file.name)) {
+            return error.InvalidSnapshot;
+        }
+        const file_url = try std.fmt.allocPrint(arena.allocator(), "{s}/{s}/_snapshot/{d}/{s}", .{ base_url, name, snapshot.id, file_name });
+        try downloadFile(client, dir, file_url, file_name, file.size);
+    }
+
+    // the index exists locally only once the manifest is written
+    try filefmt.writeManifestFile(dir, snapshot.segments);
+
+    deletePartialFiles(dir);
+
+    return snapshot.id;
+}
+
+const partial_file_ext = ".part";
+
+// Interrupted downloads are resumed from where they stopped.
+fn downloadFile(client: *std.http.Client, dir: std.fs.Dir, url: []const u8, file_name: []const u8, size: u64) !void {
+    var part_name_buf: [filefmt.max_file_name_size + partial_file_ext.len]u8 = undefined;
+    const part_name = try std.fmt.bufPrint(&part_name_buf, "{s}{s}", .{ file_name, partial_file_ext });
+
+    var file = try dir.createFile(part_name, .{ .truncate = false });
+    defer file.close();
+
+    var offset = try file.getEndPos();
+    if (offset > size) {
+        try file.setEndPos(0);
+        offset = 0;
+    }
+
+    if (offset < size) {
+        log.info("downloading {s} ({} of {} bytes done)", .{ file_name, offset, size });
+
+        var range_buf: [64]u8 = undefined;
+        const range = try std.fmt.bufPrint(&range_buf, "bytes={d}-", .{offset});
+
+        var header_buf: [max_header_size]u8 = undefined;
+        var req = try client.open(.GET, try std.Uri.parse(url), .{
+            .server_header_buffer = &header_buf,
+            .extra_headers = &.{
+                .{ .name = "range", .value = range },
+            },
+        });
+        defer req.deinit();
+
+        try req.send();
+        try req.finish();
+        try req.wait();
+
+        if (req.response.status != .partial_content) {
+            log.warn("primary returned status {d} for {s}", .{ @intFromEnum(req.response.status), url });
+            return error.ReplicationRequestFailed;
+        }
+
+        try file.seekTo(offset);
+
+        var buf: [64 * 1024]u8 = undefined;
+        while (true) {
+            const n = try req.reader().read(&buf);
+            if (n == 0) break;
+            try file.writeAll(buf[0..n]);
+        }
+    }
+
+    if (try file.getEndPos() != size) {
+        return error.IncompleteDownload;
+    }
+    try file.sync();
+
+    try dir.rename(part_name, file_name);
+}
+
+fn deletePartialFiles(dir: std.fs.Dir) void {
+    var iter = dir.iterate();
+    while (iter.next() catch return) |entry| {
+        if (entry.kind == .file and std.mem.endsWith(u8, entry.name, partial_file_ext)) {
+            dir.deleteFile(entry.name) catch |err| {
+                log.warn("failed to delete {s}: {}", .{ entry.name, err });
+            };
+        }
+    }
+}
+
+// Lets the primary delete the pinned segment files, errors are ignored, the snapshot expires anyway.
+fn releaseSnapshot(self: *Self, client: *std.http.Client, name: []const u8, snapshot_id: u64) void {
+    var url_buf: [1024]u8 = undefined;
+    const url = std.fmt.bufPrint(&url_buf, "{s}/{s}/_snapshot/{d}", .{ std.mem.trimRight(u8, self.options.primary_url, "/"), name, snapshot_id }) catch return;
+
+    const uri = std.Uri.parse(url) catch return;
+
+    var header_buf: [max_header_size]u8 = undefined;
+    var req = client.open(.DELETE, uri, .{ .server_header_buffer = &header_buf }) catch |err| {
+        log.warn("failed to release snapshot {} of index {s}: {}", .{ snapshot_id, name, err });
+        return;
+    };
+    defer req.deinit();
+
+    req.send() catch return;
+    req.finish() catch return;
+    req.wait() catch return;
+
+    log.info("released snapshot {} of index {s}", .{ snapshot_id, name });
+}
+
+pub fn start(self: *Self) !void {
+    errdefer self.stop();
+
+    self.stopping.reset();
+    for (self.replicators.items) |replicator| {
+        if (replicator.index) |index| {
+            try index.waitForReady(std.math.maxInt(u32));
+            replicator.status.last_applied_commit_id = index.getNextCommitId() - 1;
+            replicator.ready.store(true, .release);
+        }
+        replicator.thread = try std.Thread.spawn(.{}, Replicator.run, .{replicator});
+        log.info("replicating index {s} from {s}", .{ replicator.name, self.options.primary_url });
+    }
+}
+
+// Waits for requests that are in progress, it can take up to poll_wait_ms.
+pub fn stop(self: *Self) void {
+    self.stopping.set();
+    for (self.replicators.items) |replicator| {
+        if (replicator.thread) |thread| {
+            thread.join();
+            replicator.thread = null;
+        }
+    }
+}
+
+fn getMaxSilenceMs(self: *const Self) i64 {
+    return @intCast(self.options.poll_wait_ms + self.options.retry_delay_ms);
+}
+
+// False while a replicated index is being copied from the primary.
+pub fn isIndexReady(self: *Self, name: []const u8) bool {
+    for (self.replicators.items) |replicator| {
+        if (std.mem.eql(u8, replicator.name, name)) {
+            return replicator.ready.load(.acquire);
+        }
+    }
+    return true;
+}
+
+pub const IndexStatus = struct {
+    lag_commits: u64,
+    lag_ms: i64,
+};
+
+pub fn getIndexStatus(self: *Self, name: []const u8) ?IndexStatus {
+    for (self.replicators.items) |replicator| {
+        if (std.mem.eql(u8, replicator.name, name)) {
+            const status = replicator.getStatus();
+            return .{
+                .lag_commits = status.getLagCommits(),
+                .lag_ms = status.getLagMs(std.time.milliTimestamp(), self.getMaxSilenceMs()),
+            };
+        }
+    }
+    return null;
+}
+
+test "Status lag" {
+    var status = Status{ .last_applied_commit_id = 10, .primary_commit_id = 15, .caught_up_at = 1000 };
+    try std.testing.expectEqual(5, status.getLagCommits());
+    try std.testing.expectEqual(500, status.getLagMs(1500, 6000));
+
+    status.last_applied_commit_id = 15;
+    try std.testing.expectEqual(0, status.getLagMs(1500, 6000));
+    try std.testing.expectEqual(9000, status.getLagMs(10000, 6000));
+}
@@ -0,0 +1,257 @@
+const std = @import("std");
+
+const common = @import("common.zig");
+const SearchResult = common.SearchResult;
+const SearchResults = common.SearchResults;
+const SearchOptions = common.SearchOptions;
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+// Cache of final search results of one index.
+//
+// Entries are keyed by the sorted query hashes and the search options, and tagged
+// with the version of the index reader that produced them. A lookup with a newer
+// reader returns the entry as stale, the caller can either prove that the changes
+// since then don't affect the results and refresh the entry, or search again.
+
+pub const Options = struct {
+    // Memory budget for cached queries and results, in bytes.
+    max_size: usize,
+};
+
+pub const Key = struct {
+    hashes: []const u32,
+    options: SearchOptions,
+
+    fn hash(self: Key) u64 {
+        var hasher = std.hash.Wyhash.init(0);
+        hasher.update(std.mem.sliceAsBytes(self.hashes));
+        hasher.update(std.mem.asBytes(&self.options));
+        return hasher.final();
+    }
+
+    fn eql(self: Key, other: Key) bool {
+        return std.meta.eql(self.options, other.options) and std.mem.eql(u32, self.hashes, other.hashes);
+    }
+};
+
+pub const Lookup = union(enum) {
+    miss,
+    hit,
+    // results were copied, but they were produced by an older version of the index
+    stale: u64,
+};
+
+const Entry = struct {
+    key_hash: u64,
+    key: Key,
+    version: u64,
+    results: []SearchResult,
+    size: usize,
+};
+
+const LruList = std.DoublyLinkedList(Entry);
+
+allocator: std.mem.Allocator,
+max_size: usize,
+lock: std.Thread.Mutex = .{},
+entries: std.AutoHashMapUnmanaged(u64, *LruList.Node) = .{},
+lru: LruList = .{},
+size: usize = 0,
+
+pub fn init(allocator: std.mem.Allocator, options: Options) Self {
+    return .{
+        .allocator = allocator,
+        .max_size = options.max_size,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    while (self.lru.pop()) |node| {
+        self.destroyNode(node);
+    }
+    self.entries.deinit(self.allocator);
+}
+
+fn destroyNode(self: *Self, node: *LruList.Node) void {
+    self.allocator.free(node.data.key.hashes);
+    self.allocator.free(node.data.results);
+    self.allocator.destroy(node);
+}
+
+fn removeNode(self: *Self, node: *LruList.Node) void {
+    _ = self.entries.remove(node.data.key_hash);
+    self.lru.remove(node);
+    self.size -= node.data.size;
+    self.destroyNode(node);
+}
+
+// Copies cached results for the key into the collector. On a stale lookup,
+// the returned version can be passed to refresh, if the results are still valid.
+pub fn get(self: *Self, key: Key, version: u64, results: *SearchResults) !Lookup {
+    const key_hash = key.hash();
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    const node = self.entries.get(key_hash) orelse {
+        metrics.resultCacheMiss();
+        return .miss;
+    };
+    if (!node.data.key.eql(key) or node.data.version > version) {
+        metrics.resultCacheMiss();
+        return .miss;
+    }
+
+    self.lru.remove(node);
+    self.lru.prepend(node);
+
+    try results.setResults(node.data.results);
+
+    if (node.data.version < version) {
+        return .{ .stale = node.data.version };
+    }
+    metrics.resultCacheHit();
+    return .hit;
+}
+
+// Marks a stale entry as valid for a newer version.
+pub fn refresh(self: *Self, key: Key, old_version: u64, new_version: u64) void {
+    const key_hash = key.hash();
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    const node = self.entries.get(key_hash) orelse return;
+    if (node.data.version == old_version and node.data.key.eql(key)) {
+        node.data.version = new_version;
+        metrics.resultCacheHit();
+        metrics.resultCacheRefresh();
+    }
+}
+
+// Removes a stale entry, the caller is going to search again.
+pub fn invalidate(self: *Self, key: Key, old_version: u64) void {
+    const key_hash = key.hash();
+
+    metrics.resultCacheMiss();
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    const node = self.entries.get(key_hash) orelse return;
+    if (node.data.version == old_version and node.data.key.eql(key)) {
+        self.removeNode(node);
+    }
+}
+
+pub fn put(self: *Self, key: Key, version: u64, results: []const SearchResult) !void {
+    const size = key.hashes.len * @sizeOf(u32) + results.len * @sizeOf(SearchResult) + @sizeOf(LruList.Node);
+    if (size > self.max_size) {
+        return;
+    }
+
+    const node = try self.allocator.create(LruList.Node);
+    errdefer self.allocator.destroy(node);
+
+    const hashes = try self.allocator.dupe(u32, key.hashes);
+    errdefer self.allocator.free(hashes);
+
+    const results_copy = try self.allocator.dupe(SearchResult, results);
+    errdefer self.allocator.free(results_copy);
+
+    const key_hash = key.hash();
+    node.data = .{
+        .key_hash = key_hash,
+        .key = .{ .hashes = hashes, .options = key.options },
+        .version = version,
+        .results = results_copy,
+        .size = size,
+    };
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    const gop = try self.entries.getOrPut(self.allocator, key_hash);
+    if (gop.found_existing) {
+        const existing = gop.value_ptr.*;
+        if (existing.data.version > version) {
+            // a search with a newer reader got here first
+            self.destroyNode(node);
+            return;
+        }
+        self.lru.remove(existing);
+        self.size -= existing.data.size;
+        self.destroyNode(existing);
+    }
+
+    gop.value_ptr.* = node;
+    self.lru.prepend(node);
+    self.size += size;
+
+    while (self.size > self.max_size) {
+        const last = self.lru.last orelse break;
+        metrics.resultCacheEviction();
+        self.removeNode(last);
+    }
+}
+
+pub fn getSize(self: *Self) usize {
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    return self.size;
+}
+
+pub fn count(self: *Self) usize {
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    return self.entries.count();
+}
+
+test "ResultCache put/get" {
+    var cache = Self.init(std.testing.allocator, .{ .max_size = 1024 * 1024 });
+    defer cache.deinit();
+
+    var collector = SearchResults.init(std.testing.allocator, .{});
+    defer collector.deinit();
+
+    const key: Key = .{ .hashes = &.{ 1, 2, 3 }, .options = .{} };
+
+    try std.testing.expectEqual(Lookup.miss, try cache.get(key, 1, &collector));
+
+    try cache.put(key, 1, &.{.{ .id = 1, .score = 3 }});
+
+    try std.testing.expectEqual(Lookup.hit, try cache.get(key, 1, &collector));
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = 3 }}, collector.getResults());
+
+    // different options are a different query
+    try std.testing.expectEqual(Lookup.miss, try cache.get(.{ .hashes = key.hashes, .options = .{ .max_results = 1 } }, 1, &collector));
+
+    try std.testing.expectEqual(Lookup{ .stale = 1 }, try cache.get(key, 2, &collector));
+    cache.refresh(key, 1, 2);
+    try std.testing.expectEqual(Lookup.hit, try cache.get(key, 2, &collector));
+
+    cache.invalidate(key, 2);
+    try std.testing.expectEqual(Lookup.miss, try cache.get(key, 2, &collector));
+}
+
+test "ResultCache eviction" {
+    const entry_size = 3 * @sizeOf(u32) + @sizeOf(SearchResult) + @sizeOf(LruList.Node);
+    var cache = Self.init(std.testing.allocator, .{ .max_size = 2 * entry_size });
+    defer cache.deinit();
+
+    var collector = SearchResults.init(std.testing.allocator, .{});
+    defer collector.deinit();
+
+    for (0..3) |i| {
+        const id: u32 = @intCast(i);
+        try cache.put(.{ .hashes = &.{ id, id + 1, id + 2 }, .options = .{} }, 1, &.{.{ .id = id, .score = 3 }});
+    }
+
+    try std.testing.expectEqual(2, cache.count());
+    try std.testing.expectEqual(Lookup.miss, try cache.get(.{ .hashes = &.{ 0, 1, 2 }, .options = .{} }, 1, &collector));
+    try std.testing.expectEqual(Lookup.hit, try cache.get(.{ .hashes = &.{ 2, 3, 4 }, .options = .{} }, 1, &collector));
+}
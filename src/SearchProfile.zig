@@ -0,0 +1,100 @@
+const std = @import("std");
+
+const SegmentInfo = @import("segment.zig").SegmentInfo;
+
+const Self = @This();
+
+// Breakdown of where a single search spent its time. It's only collected if the
+// search results have a profile attached, otherwise all the hooks are just null checks.
+// Segments searched in parallel add their entries under the lock.
+
+pub const SegmentType = enum {
+    memory,
+    file,
+};
+
+pub const Segment = struct {
+    type: SegmentType,
+    info: SegmentInfo,
+    duration_ns: u64 = 0,
+    // distinct query hashes looked up in the segment
+    hashes: u64 = 0,
+    // hashes that stopped early because of max_docs_per_hash
+    hashes_cut_off: u64 = 0,
+    blocks: u64 = 0,
+    postings: u64 = 0,
+    decoded_items: u64 = 0,
+    decode_ns: u64 = 0,
+};
+
+allocator: std.mem.Allocator,
+lock: std.Thread.Mutex = .{},
+segments: std.ArrayListUnmanaged(Segment) = .{},
+// query hashes dropped because of max_hash_frequency
+hashes_pruned: u64 = 0,
+// docs with at least one hit, before filtering by score and version
+candidates: u64 = 0,
+dense_accumulator: bool = false,
+finish_ns: u64 = 0,
+timed_out: bool = false,
+
+pub fn init(allocator: std.mem.Allocator) Self {
+    return .{ .allocator = allocator };
+}
+
+pub fn deinit(self: *Self) void {
+    self.segments.deinit(self.allocator);
+}
+
+pub fn addSegment(self: *Self, segment: Segment) void {
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    // profiling should not fail the search
+    self.segments.append(self.allocator, segment) catch {};
+}
+
+// Measures search in one segment, does nothing if profiling is off.
+pub const SegmentScope = struct {
+    profile: ?*Self,
+    segment: Segment,
+    timer: std.time.Timer = undefined,
+
+    pub fn begin(profile: ?*Self, segment_type: SegmentType, info: SegmentInfo) SegmentScope {
+        var scope = SegmentScope{
+            .profile = profile,
+            .segment = .{ .type = segment_type, .info = info },
+        };
+        if (profile != null) {
+            scope.timer = std.time.Timer.start() catch unreachable;
+        }
+        return scope;
+    }
+
+    pub inline fn enabled(self: *const SegmentScope) bool {
+        return self.profile != null;
+    }
+
+    pub fn end(self: *SegmentScope) void {
+        if (self.profile) |profile| {
+            self.segment.duration_ns = self.timer.read();
+            profile.addSegment(self.segment);
+        }
+    }
+};
+
+test "SearchProfile" {
+    var profile = Self.init(std.testing.allocator);
+    defer profile.deinit();
+
+    var disabled = SegmentScope.begin(null, .memory, .{ .version = 1 });
+    disabled.end();
+
+    var scope = SegmentScope.begin(&profile, .file, .{ .version = 2 });
+    scope.segment.hashes += 3;
+    scope.end();
+
+    try std.testing.expectEqual(1, profile.segments.items.len);
+    try std.testing.expectEqual(.file, profile.segments.items[0].type);
+    try std.testing.expectEqual(3, profile.segments.items[0].hashes);
+}
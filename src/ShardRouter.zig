@@ -0,0 +1,615 @@
+const std = @import("std");
+const log = std.log.scoped(.shard_router);
+
+const msgpack = @import("msgpack");
+
+const MultiIndex = @import("MultiIndex.zig");
+const common = @import("common.zig");
+const SearchResults = common.SearchResults;
+const SearchResult = common.SearchResult;
+const SearchOptions = common.SearchOptions;
+const Change = @import("change.zig").Change;
+const Deadline = @import("utils/Deadline.zig");
+
+const metrics = @import("metrics.zig");
+
+const Self = @This();
+
+// Sharded indexes are virtual indexes, the documents are partitioned by id between
+// shards, which are either local indexes or indexes on other servers. Updates are routed
+// to the shards owning the documents, searches go to all shards in parallel and the
+// results are merged.
+//
+// Shards are configured with a spec like this, multiple indexes are separated by ";":
+//
+//   catalog=hash:catalog_0,catalog_1,http://10.0.0.2:6081/catalog_2
+//   catalog=range:catalog_0@1,http://10.0.0.2:6081/catalog_1@5000000
+//
+// With range partitioning, each shard has the first doc id it owns, in ascending order.
+
+pub const Partitioning = enum {
+    hash,
+    range,
+};
+
+pub const Shard = struct {
+    // base URL of a remote server, null for local indexes
+    url: ?[]const u8 = null,
+    index: []const u8,
+    // range partitioning only
+    first_doc_id: u32 = 0,
+};
+
+pub const ShardedIndex = struct {
+    name: []const u8,
+    partitioning: Partitioning,
+    shards: []const Shard,
+
+    pub fn getShard(self: ShardedIndex, doc_id: u32) usize {
+        switch (self.partitioning) {
+            .hash => {
+                return std.hash.Murmur2_32.hashUint32(doc_id) % self.shards.len;
+            },
+            .range => {
+                var result: usize = 0;
+                for (self.shards, 0..) |shard, i| {
+                    if (doc_id >= shard.first_doc_id) {
+                        result = i;
+                    }
+                }
+                return result;
+            },
+        }
+    }
+};
+
+pub const ShardStatus = enum {
+    ok,
+    timed_out,
+    failed,
+};
+
+pub const SearchResponse = struct {
+    results: []const SearchResult,
+    // some shards didn't respond in time or failed
+    partial: bool = false,
+};
+
+const max_response_size = 16 * 1024 * 1024;
+const max_header_size = 4096;
+// extra time for the remote server to send the response after its own deadline
+const remote_timeout_grace_ms = 100;
+// updates have no deadline of their own, but a stuck shard must not block the caller forever
+const remote_update_timeout_ms = 30 * std.time.ms_per_s;
+
+allocator: std.mem.Allocator,
+arena: std.heap.ArenaAllocator,
+indexes: *MultiIndex,
+// shard searches run here, without a pool the shards are searched one by one
+search_pool: ?*std.Thread.Pool,
+sharded_indexes: std.StringHashMapUnmanaged(ShardedIndex) = .{},
+client: std.http.Client,
+
+pub fn init(allocator: std.mem.Allocator, indexes: *MultiIndex, search_pool: ?*std.Thread.Pool) Self {
+    return .{
+        .allocator = allocator,
+        .arena = std.heap.ArenaAllocator.init(allocator),
+        .indexes = indexes,
+        .search_pool = search_pool,
+        .client = .{ .allocator = allocator },
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.client.deinit();
+    self.sharded_indexes.deinit(self.allocator);
+    self.arena.deinit();
+}
+
+// Adds sharded indexes from the spec, see above for the format.
+pub fn addIndexes(self: *Self, spec: []const u8) !void {
+    var iter = std.mem.tokenizeScalar(u8, spec, ';');
+    while (iter.next()) |index_spec| {
+        const sharded_index = try parseIndexSpec(self.arena.allocator(), index_spec);
+        if (self.sharded_indexes.contains(sharded_index.name)) {
+            return error.DuplicateShardedIndex;
+        }
+        try self.sharded_indexes.put(self.allocator, sharded_index.name, sharded_index);
+        log.info("sharded index {s} with {} shards ({s} partitioning)", .{ sharded_index.name, sharded_index.shards.len, @tagName(sharded_index.partitioning) });
+    }
+}
+
+fn parseIndexSpec(allocator: std.mem.Allocator, spec: []const u8) !ShardedIndex {
+    const eq = std.mem.indexOfScalar(u8, spec, '=') orelse return error.InvalidShardSpec;
+    const name = std.mem.trim(u8, spec[0..eq], " ");
+    const rest = spec[eq + 1 ..];
+
+    const colon = std.mem.indexOfScalar(u8, rest, ':') orelse return error.InvalidShardSpec;
+    const partitioning = std.meta.stringToEnum(Partitioning, rest[0..colon]) orelse return error.InvalidShardSpec;
+
+    var shards = std.ArrayList(Shard).init(allocator);
+    var iter = std.mem.tokenizeScalar(u8, rest[colon + 1 ..], ',');
+    while (iter.next()) |shard_spec| {
+        try shards.append(try parseShardSpec(std.mem.trim(u8, shard_spec, " "), partitioning));
+    }
+
+    if (name.len == 0 or shards.items.len == 0) {
+        return error.InvalidShardSpec;
+    }
+    if (partitioning == .range and shards.items.len > 1) {
+        for (shards.items[1..], 1..) |shard, i| {
+            if (shard.first_doc_id <= shards.items[i - 1].first_doc_id) {
+                return error.InvalidShardSpec;
+            }
+        }
+    }
+
+    return .{
+        .name = try allocator.dupe(u8, name),
+        .partitioning = partitioning,
+        .shards = try shards.toOwnedSlice(),
+    };
+}
+
+fn parseShardSpec(spec: []const u8, partitioning: Partitioning) !Shard {
+    var target = spec;
+    var shard = Shard{ .index = undefined };
+
+    if (partitioning == .range) {
+        const at = std.mem.lastIndexOfScalar(u8, spec, '@') orelse return error.InvalidShardSpec;
+        shard.first_doc_id = try std.fmt.parseInt(u32, spec[at + 1 ..], 10);
+        target = spec[0..at];
+    }
+
+    if (std.mem.indexOf(u8, target, "://") != null) {
+        const slash = std.mem.lastIndexOfScalar(u8, target, '/') orelse unreachable;
+        shard.url = target[0..slash];
+        shard.index = target[slash + 1 ..];
+    } else {
+        shard.index = target;
+    }
+
+    if (shard.index.len == 0) {
+        return error.InvalidShardSpec;
+    }
+    return shard;
+}
+
+pub fn getIndex(self: *Self, name: []const u8) ?ShardedIndex {
+    return self.sharded_indexes.get(name);
+}
+
+// Each shard gets its changes in one update. If some shard fails, the previous ones
+// already have their changes, the whole update can be safely retried.
+pub fn update(self: *Self, sharded_index: ShardedIndex, changes: []const Change) !void {
+    var arena = std.heap.ArenaAllocator.init(self.allocator);
+    defer arena.deinit();
+
+    const shard_changes = try arena.allocator().alloc(std.ArrayListUnmanaged(Change), sharded_index.shards.len);
+    @memset(shard_changes, .{});
+
+    for (changes) |change| {
+        switch (change) {
+            .insert => |insert| {
+                try shard_changes[sharded_index.getShard(insert.id)].append(arena.allocator(), change);
+            },
+            .delete => |delete| {
+                try shard_changes[sharded_index.getShard(delete.id)].append(arena.allocator(), change);
+            },
+            .set_attribute => {
+                for (shard_changes) |*list| {
+                    try list.append(arena.allocator(), change);
+                }
+            },
+        }
+    }
+
+    for (sharded_index.shards, shard_changes) |shard, list| {
+        if (list.items.len == 0) {
+            continue;
+        }
+        if (shard.url) |url| {
+            try self.updateRemote(arena.allocator(), url, shard.index, list.items);
+        } else {
+            const index = try self.indexes.getIndex(shard.index);
+            defer self.indexes.releaseIndex(index);
+
+            try index.update(list.items);
+        }
+    }
+}
+
+const RemoteUpdateRequest = struct {
+    changes: []const Change,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+fn updateRemote(self: *Self, arena: std.mem.Allocator, url: []const u8, index_name: []const u8, changes: []const Change) !void {
+    var body = std.ArrayList(u8).init(arena);
+    try msgpack.encode(RemoteUpdateRequest{ .changes = changes }, body.writer());
+
+    const full_url = try std.fmt.allocPrint(arena, "{s}/{s}/_update", .{ url, index_name });
+
+    const status = try self.post(arena, full_url, body.items, remote_update_timeout_ms, null);
+    if (status.code != .ok) {
+        log.warn("shard {s} returned status {d} for update", .{ full_url, @intFromEnum(status.code) });
+        return error.ShardRequestFailed;
+    }
+}
+
+const RemoteSearchRequest = struct {
+    query: []const u32,
+    timeout: u32,
+    limit: u32,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const RemoteSearchResult = struct {
+    id: u32,
+    score: u32,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const RemoteSearchResults = struct {
+    results: []const RemoteSearchResult,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const PostResult = struct {
+    code: std.http.Status,
+    body: []const u8 = "",
+};
+
+// Sends a msgpack request. With a timeout, the socket reads fail once it's reached,
+// so that a stuck server doesn't block the caller. Connections are reused, so the
+// timeout is always set, zero disables it.
+fn post(self: *Self, arena: std.mem.Allocator, url: []const u8, body: []const u8, timeout_ms: ?i64, max_body_size: ?usize) !PostResult {
+    var header_buf: [max_header_size]u8 = undefined;
+    var req = try self.client.open(.POST, try std.Uri.parse(url), .{
+        .server_header_buffer = &header_buf,
+        .extra_headers = &.{
+            .{ .name = "content-type", .value = "application/vnd.msgpack" },
+            .{ .name = "accept", .value = "application/vnd.msgpack" },
+        },
+    });
+    defer req.deinit();
+
+    if (req.connection) |conn| {
+        const ms = timeout_ms orelse 0;
+        const timeout = std.posix.timeval{
+            .tv_sec = @intCast(@divTrunc(ms, std.time.ms_per_s)),
+            .tv_usec = @intCast(@mod(ms, std.time.ms_per_s) * std.time.us_per_ms),
+        };
+        try std.posix.setsockopt(conn.stream.handle, std.posix.SOL.SOCKET, std.posix.SO.RCVTIMEO, std.mem.asBytes(&timeout));
+    }
+
+    req.transfer_encoding = .{ .content_length = body.len };
+    try req.send();
+    try req.writeAll(body);
+    try req.finish();
+    try req.wait();
+
+    var result = PostResult{ .code = req.response.status };
+    if (max_body_size) |size| {
+        if (result.code == .ok) {
+            result.body = try req.reader().readAllAlloc(arena, size);
+        }
+    }
+    return result;
+}
+
+const ShardSearch = struct {
+    router: *Self,
+    shard: Shard,
+    hashes: []const u32,
+    options: SearchOptions,
+    deadline: Deadline,
+    arena: std.heap.ArenaAllocator,
+    results: []const SearchResult = &.{},
+    status: ShardStatus = .ok,
+
+    fn run(self: *ShardSearch) void {
+        self.results = self.search() catch |err| {
+            // a read timeout on the socket also comes after the deadline
+            if (err == error.Timeout or self.deadline.isExpired()) {
+                self.status = .timed_out;
+            } else {
+                log.warn("search in shard {s} failed: {}", .{ self.shard.index, err });
+                self.status = .failed;
+            }
+            metrics.shardSearchFailure(self.status);
+            return;
+        };
+    }
+
+    fn runInPool(self: *ShardSearch, wait_group: *std.Thread.WaitGroup) void {
+        defer wait_group.finish();
+        self.run();
+    }
+
+    fn search(self: *ShardSearch) ![]const SearchResult {
+        const allocator = self.arena.allocator();
+
+        if (self.shard.url) |url| {
+            var timeout_ms: ?i64 = null;
+            var timeout: u32 = 0;
+            if (self.deadline.getRemainingMs()) |remaining_ms| {
+                if (remaining_ms == 0) {
+                    return error.Timeout;
+                }
+                timeout = @intCast(@min(remaining_ms, std.math.maxInt(u32)));
+                timeout_ms = remaining_ms + remote_timeout_grace_ms;
+            }
+
+            var body = std.ArrayList(u8).init(allocator);
+            try msgpack.encode(RemoteSearchRequest{
+                .query = self.hashes,
+                .timeout = timeout,
+                .limit = self.options.max_results,
+            }, body.writer());
+
+            const full_url = try std.fmt.allocPrint(allocator, "{s}/{s}/_search", .{ url, self.shard.index });
+
+            const response = try self.router.post(allocator, full_url, body.items, timeout_ms, max_response_size);
+            if (response.code != .ok) {
+                log.warn("shard {s} returned status {d} for search", .{ full_url, @intFromEnum(response.code) });
+                return error.ShardRequestFailed;
+            }
+
+            const decoded = try msgpack.decodeFromSliceLeaky(RemoteSearchResults, allocator, response.body);
+            const results = try allocator.alloc(SearchResult, decoded.results.len);
+            for (decoded.results, results) |r, *result| {
+                result.* = .{ .id = r.id, .score = r.score };
+            }
+            return results;
+        }
+
+        const index = try self.router.indexes.getIndex(self.shard.index);
+        defer self.router.indexes.releaseIndex(index);
+
+        // the search sorts the hashes in place, other shards are using them too
+        const hashes = try allocator.dupe(u32, self.hashes);
+
+        var collector = SearchResults.init(allocator, self.options);
+        try index.search(hashes, &collector, self.deadline);
+        return collector.getResults();
+    }
+};
+
+// Searches all shards in parallel, each of them gets what's left of the deadline.
+// Shards that fail or don't finish in time are left out of the results.
+pub fn search(self: *Self, arena: std.mem.Allocator, sharded_index: ShardedIndex, hashes: []const u32, options: SearchOptions, deadline: Deadline) !SearchResponse {
+    const searches = try arena.alloc(ShardSearch, sharded_index.shards.len);
+    for (searches, sharded_index.shards) |*shard_search, shard| {
+        shard_search.* = .{
+            .router = self,
+            .shard = shard,
+            .hashes = hashes,
+            .options = options,
+            .deadline = deadline,
+            .arena = std.heap.ArenaAllocator.init(self.allocator),
+        };
+    }
+    defer {
+        for (searches) |*shard_search| {
+            shard_search.arena.deinit();
+        }
+    }
+
+    // the first shard is searched on the current thread, which then helps with the rest
+    if (self.search_pool) |pool| {
+        var wait_group: std.Thread.WaitGroup = .{};
+        for (searches[1..]) |*shard_search| {
+            wait_group.start();
+            pool.spawn(ShardSearch.runInPool, .{ shard_search, &wait_group }) catch {
+                wait_group.finish();
+                shard_search.run();
+            };
+        }
+        searches[0].run();
+        pool.waitAndWork(&wait_group);
+    } else {
+        for (searches) |*shard_search| {
+            shard_search.run();
+        }
+    }
+
+    var partial = false;
+    const shard_results = try arena.alloc([]const SearchResult, searches.len);
+    for (searches, shard_results) |shard_search, *results| {
+        results.* = shard_search.results;
+        if (shard_search.status != .ok) {
+            partial = true;
+        }
+    }
+
+    return .{
+        .results = try mergeResults(arena, shard_results, options),
+        .partial = partial,
+    };
+}
+
+// Each shard filtered its results by min_score_pct of its own best score, which can't be
+// higher than the best score overall, so filtering again after merging gives the same
+// results as searching a single index.
+pub fn mergeResults(allocator: std.mem.Allocator, shard_results: []const []const SearchResult, options: SearchOptions) ![]SearchResult {
+    var results = std.ArrayList(SearchResult).init(allocator);
+    for (shard_results) |list| {
+        try results.appendSlice(list);
+    }
+
+    std.sort.pdq(SearchResult, results.items, {}, compareResults);
+
+    var min_score = options.min_score;
+    if (results.items.len > 0) {
+        min_score = @max(min_score, results.items[0].score * options.min_score_pct / 100);
+    }
+
+    var count: usize = 0;
+    while (count < results.items.len and count < options.max_results) : (count += 1) {
+        if (results.items[count].score < min_score) {
+            break;
+        }
+    }
+    results.shrinkRetainingCapacity(count);
+
+    return results.toOwnedSlice();
+}
+
+fn compareResults(_: void, a: SearchResult, b: SearchResult) bool {
+    if (a.score != b.score) {
+        return a.score > b.score;
+    }
+    return a.id < b.id;
+}
+
+test "parse shard spec" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const hash_index = try parseIndexSpec(arena.allocator(), "catalog=hash:catalog_0,http://10.0.0.2:6081/catalog_1");
+    try std.testing.expectEqualStrings("catalog", hash_index.name);
+    try std.testing.expectEqual(.hash, hash_index.partitioning);
+    try std.testing.expectEqual(2, hash_index.shards.len);
+    try std.testing.expectEqual(null, hash_index.shards[0].url);
+    try std.testing.expectEqualStrings("catalog_0", hash_index.shards[0].index);
+    try std.testing.expectEqualStrings("http://10.0.0.2:6081", hash_index.shards[1].url.?);
+    try std.testing.expectEqualStrings("catalog_1", hash_index.shards[1].index);
+
+    const range_index = try parseIndexSpec(arena.allocator(), "catalog=range:catalog_0@1,catalog_1@1000");
+    try std.testing.expectEqual(0, range_index.getShard(1));
+    try std.testing.expectEqual(0, range_index.getShard(999));
+    try std.testing.expectEqual(1, range_index.getShard(1000));
+    try std.testing.expectEqual(1, range_index.getShard(std.math.maxInt(u32)));
+
+    try std.testing.expectError(error.InvalidShardSpec, parseIndexSpec(arena.allocator(), "catalog=range:catalog_0@1000,catalog_1@1"));
+    try std.testing.expectError(error.InvalidShardSpec, parseIndexSpec(arena.allocator(), "catalog=range:catalog_0"));
+    try std.testing.expectError(error.InvalidShardSpec, parseIndexSpec(arena.allocator(), "catalog=modulo:catalog_0"));
+    try std.testing.expectError(error.InvalidShardSpec, parseIndexSpec(arena.allocator(), "catalog=hash:"));
+}
+
+test "hash partitioning is stable" {
+    const index = ShardedIndex{
+        .name = "catalog",
+        .partitioning = .hash,
+        .shards = &.{ .{ .index = "a" }, .{ .index = "b" }, .{ .index = "c" } },
+    };
+
+    var counts = [_]usize{0} ** 3;
+    for (1..3001) |id| {
+        const shard = index.getShard(@intCast(id));
+        try std.testing.expectEqual(shard, index.getShard(@intCast(id)));
+        counts[shard] += 1;
+    }
+    for (counts) |count| {
+        try std.testing.expect(count > 800);
+    }
+}
+
+test "merge shard results" {
+    const shard1 = [_]SearchResult{ .{ .id = 1, .score = 100 }, .{ .id = 3, .score = 12 } };
+    // this shard's own min_score_pct cut-off was lower
+    const shard2 = [_]SearchResult{ .{ .id = 2, .score = 50 }, .{ .id = 4, .score = 8 } };
+
+    const results = try mergeResults(std.testing.allocator, &.{ &shard1, &shard2 }, .{ .max_results = 10, .min_score_pct = 10 });
+    defer std.testing.allocator.free(results);
+
+    try std.testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 1, .score = 100 },
+        .{ .id = 2, .score = 50 },
+        .{ .id = 3, .score = 12 },
+    }, results);
+
+    const limited = try mergeResults(std.testing.allocator, &.{ &shard1, &shard2 }, .{ .max_results = 1 });
+    defer std.testing.allocator.free(limited);
+
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = 100 }}, limited);
+}
+
+test "search with a failing shard" {
+    const Scheduler = @import("utils/Scheduler.zig");
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var indexes = MultiIndex.init(std.testing.allocator, &scheduler, tmp_dir.dir, .{}, .{});
+    defer indexes.deinit();
+
+    try indexes.createIndex("catalog_0");
+
+    var hashes = [_]u32{ 1, 2, 3 };
+
+    {
+        const index = try indexes.getIndex("catalog_0");
+        defer indexes.releaseIndex(index);
+
+        try index.waitForReady(10_000);
+        try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = &hashes } }});
+    }
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = std.testing.allocator, .n_jobs = 2 });
+    defer pool.deinit();
+
+    var router = Self.init(std.testing.allocator, &indexes, &pool);
+    defer router.deinit();
+
+    // nothing listens on port 1, so the connection is refused
+    const sharded_index = ShardedIndex{
+        .name = "catalog",
+        .partitioning = .hash,
+        .shards = &.{ .{ .index = "catalog_0" }, .{ .url = "http://127.0.0.1:1", .index = "catalog_1" } },
+    };
+
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const response = try router.search(arena.allocator(), sharded_index, &hashes, .{}, .{});
+    try std.testing.expect(response.partial);
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = 3 }}, response.results);
+
+    var failed = ShardSearch{
+        .router = &router,
+        .shard = sharded_index.shards[1],
+        .hashes = &hashes,
+        .options = .{},
+        .deadline = .{},
+        .arena = std.heap.ArenaAllocator.init(std.testing.allocator),
+    };
+    defer failed.arena.deinit();
+    failed.run();
+    try std.testing.expectEqual(.failed, failed.status);
+
+    // the deadline has already passed, the shard isn't even asked
+    var timed_out = ShardSearch{
+        .router = &router,
+        .shard = sharded_index.shards[1],
+        .hashes = &hashes,
+        .options = .{},
+        .deadline = .{ .deadline_ms = 1 },
+        .arena = std.heap.ArenaAllocator.init(std.testing.allocator),
+    };
+    defer timed_out.arena.deinit();
+    timed_out.run();
+    try std.testing.expectEqual(.timed_out, timed_out.status);
+
+    const expired = try router.search(arena.allocator(), sharded_index, &hashes, .{}, .{ .deadline_ms = 1 });
+    try std.testing.expect(expired.partial);
+}
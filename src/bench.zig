@@ -0,0 +1,783 @@
+const std = @import("std");
+
+const BlockIndex = @import("BlockIndex.zig");
+const BlockCache = @import("BlockCache.zig");
+const Corpus = @import("bench/Corpus.zig");
+const Change = @import("change.zig").Change;
+const common = @import("common.zig");
+const SearchResults = common.SearchResults;
+const filefmt = @import("filefmt.zig");
+const Item = @import("segment.zig").Item;
+const MemorySegment = @import("MemorySegment.zig");
+const FileSegment = @import("FileSegment.zig");
+const SegmentList = @import("segment_list.zig").SegmentList;
+const SegmentMerger = @import("segment_merger.zig").SegmentMerger;
+const Oplog = @import("Oplog.zig");
+const Index = @import("Index.zig");
+const Scheduler = @import("utils/Scheduler.zig");
+
+// Benchmarks print one JSON object per line:
+//
+//   {"label":"...","bench":"...","params":{...},"results":{...}}
+//
+// so that runs from different commits can be collected and compared. All inputs
+// are generated from fixed seeds, the results only depend on the code and the machine.
+
+pub const std_options: std.Options = .{
+    .log_level = .warn,
+};
+
+const Config = struct {
+    // smaller inputs, for a quick check that nothing regressed badly
+    quick: bool = false,
+    // free-form label included in every result, e.g. a commit id
+    label: []const u8 = "",
+    // only run benchmarks whose name contains one of the filters
+    filters: []const []const u8 = &.{},
+
+    fn isEnabled(self: Config, name: []const u8) bool {
+        if (self.filters.len == 0) {
+            return true;
+        }
+        for (self.filters) |filter| {
+            if (std.mem.indexOf(u8, name, filter) != null) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+const Reporter = struct {
+    writer: std.fs.File.Writer,
+    label: []const u8,
+
+    fn report(self: Reporter, bench: []const u8, params: anytype, results: anytype) !void {
+        try std.json.stringify(.{
+            .label = self.label,
+            .bench = bench,
+            .params = params,
+            .results = results,
+        }, .{}, self.writer);
+        try self.writer.writeByte('\n');
+    }
+};
+
+fn nsPer(elapsed_ns: u64, count: usize) f64 {
+    return @as(f64, @floatFromInt(elapsed_ns)) / @as(f64, @floatFromInt(@max(count, 1)));
+}
+
+fn perSecond(elapsed_ns: u64, count: usize) f64 {
+    return @as(f64, @floatFromInt(count)) * std.time.ns_per_s / @as(f64, @floatFromInt(@max(elapsed_ns, 1)));
+}
+
+fn toMs(elapsed_ns: u64) f64 {
+    return @as(f64, @floatFromInt(elapsed_ns)) / std.time.ns_per_ms;
+}
+
+const Latency = struct {
+    p50_us: f64,
+    p90_us: f64,
+    p99_us: f64,
+    max_us: f64,
+
+    fn percentile(sorted: []const u64, p: usize) f64 {
+        const i = @min(sorted.len - 1, sorted.len * p / 100);
+        return @as(f64, @floatFromInt(sorted[i])) / std.time.ns_per_us;
+    }
+
+    // Sorts the samples in place.
+    fn compute(samples_ns: []u64) Latency {
+        if (samples_ns.len == 0) {
+            return .{ .p50_us = 0, .p90_us = 0, .p99_us = 0, .max_us = 0 };
+        }
+        std.sort.pdq(u64, samples_ns, {}, std.sort.asc(u64));
+        return .{
+            .p50_us = percentile(samples_ns, 50),
+            .p90_us = percentile(samples_ns, 90),
+            .p99_us = percentile(samples_ns, 99),
+            .max_us = percentile(samples_ns, 100),
+        };
+    }
+};
+
+// Nothing is ever updated in the benchmarks, so no hit needs to be filtered out.
+const NoNewerVersions = struct {
+    pub fn hasNewerVersion(self: NoNewerVersions, doc_id: u32, version: u64) bool {
+        _ = self;
+        _ = doc_id;
+        _ = version;
+        return false;
+    }
+};
+
+fn buildMemorySegment(segment: *MemorySegment, corpus: Corpus, start: usize, end: usize, version: u64) !void {
+    const changes = try corpus.getChanges(segment.allocator, start, end);
+    defer segment.allocator.free(changes);
+
+    segment.info = .{ .version = version };
+    segment.status.frozen = true;
+    try segment.build(changes);
+}
+
+// Block index
+
+const block_index_num_queries = 10_000;
+const block_index_hashes_per_query = 120;
+
+const LookupMethod = enum {
+    binary_search,
+    sampled,
+    galloping,
+};
+
+fn buildBlockIndex(allocator: std.mem.Allocator, rand: std.Random, num_blocks: usize) !BlockIndex {
+    var index: BlockIndex = .{};
+    errdefer index.deinit(allocator);
+
+    try index.ensureTotalCapacity(allocator, num_blocks);
+    const max_step = std.math.maxInt(u32) / num_blocks;
+    var hash: u32 = 0;
+    for (0..num_blocks) |_| {
+        hash += rand.intRangeAtMost(u32, 0, @intCast(max_step));
+        index.appendAssumeCapacity(hash);
+    }
+    try index.build(allocator);
+    return index;
+}
+
+fn runLookups(index: *const BlockIndex, queries: []const u32, method: LookupMethod) u64 {
+    var checksum: u64 = 0;
+    var i: usize = 0;
+    while (i < queries.len) : (i += block_index_hashes_per_query) {
+        var pos: usize = 0;
+        for (queries[i..][0..block_index_hashes_per_query]) |hash| {
+            pos = switch (method) {
+                .binary_search => std.sort.lowerBound(u32, hash, index.items.items[pos..], {}, std.sort.asc(u32)) + pos,
+                .sampled => index.lookup(hash),
+                .galloping => index.lookupFrom(pos, hash),
+            };
+            checksum +%= pos;
+        }
+    }
+    return checksum;
+}
+
+fn benchBlockIndex(allocator: std.mem.Allocator, reporter: Reporter, num_blocks: usize) !void {
+    var prng = std.Random.DefaultPrng.init(num_blocks);
+    const rand = prng.random();
+
+    var index = try buildBlockIndex(allocator, rand, num_blocks);
+    defer index.deinit(allocator);
+
+    const queries = try allocator.alloc(u32, block_index_num_queries * block_index_hashes_per_query);
+    defer allocator.free(queries);
+
+    var i: usize = 0;
+    while (i < queries.len) : (i += block_index_hashes_per_query) {
+        const query = queries[i..][0..block_index_hashes_per_query];
+        for (query) |*hash| {
+            hash.* = rand.int(u32);
+        }
+        std.sort.pdq(u32, query, {}, std.sort.asc(u32));
+    }
+
+    var expected_checksum: ?u64 = null;
+    inline for (comptime std.enums.values(LookupMethod)) |method| {
+        var timer = try std.time.Timer.start();
+        const checksum = runLookups(&index, queries, method);
+        const elapsed = timer.read();
+
+        if (expected_checksum) |expected| {
+            if (checksum != expected) {
+                return error.ChecksumMismatch;
+            }
+        } else {
+            expected_checksum = checksum;
+        }
+
+        try reporter.report("block_index", .{
+            .num_blocks = num_blocks,
+            .method = @tagName(method),
+        }, .{
+            .ns_per_lookup = nsPer(elapsed, queries.len),
+        });
+    }
+}
+
+// Block encoding and decoding
+
+const ItemSliceReader = struct {
+    items: []const Item,
+    pos: usize = 0,
+
+    pub fn read(self: *ItemSliceReader) !?Item {
+        if (self.pos < self.items.len) {
+            return self.items[self.pos];
+        }
+        return null;
+    }
+
+    pub fn advance(self: *ItemSliceReader) void {
+        if (self.pos < self.items.len) {
+            self.pos += 1;
+        }
+    }
+};
+
+fn collectItems(allocator: std.mem.Allocator, corpus: Corpus) ![]Item {
+    const items = try allocator.alloc(Item, corpus.numHashes());
+    var i: usize = 0;
+    for (corpus.docs) |doc| {
+        for (doc.hashes) |hash| {
+            items[i] = .{ .id = doc.id, .hash = hash };
+            i += 1;
+        }
+    }
+    std.sort.pdq(Item, items, {}, Item.cmp);
+    return items;
+}
+
+fn benchBlockCodec(allocator: std.mem.Allocator, reporter: Reporter, corpus: Corpus, format: filefmt.BlockFormat, block_size: usize) !void {
+    const items = try collectItems(allocator, corpus);
+    defer allocator.free(items);
+
+    const min_doc_id = 1;
+
+    var blocks = std.ArrayList(u8).init(allocator);
+    defer blocks.deinit();
+
+    var reader = ItemSliceReader{ .items = items };
+    var timer = try std.time.Timer.start();
+    while (reader.pos < items.len) {
+        const block = try blocks.addManyAsSlice(block_size);
+        const num_items = try filefmt.encodeBlock(format, block, &reader, min_doc_id);
+        if (num_items == 0) {
+            return error.ItemTooLarge;
+        }
+    }
+    const encode_ns = timer.read();
+
+    var decoded = std.ArrayList(Item).init(allocator);
+    defer decoded.deinit();
+
+    var checksum: u64 = 0;
+    var num_decoded: usize = 0;
+    timer.reset();
+    var offset: usize = 0;
+    while (offset < blocks.items.len) : (offset += block_size) {
+        decoded.clearRetainingCapacity();
+        try filefmt.readBlock(format, blocks.items[offset..][0..block_size], &decoded, min_doc_id);
+        for (decoded.items) |item| {
+            checksum +%= item.id;
+        }
+        num_decoded += decoded.items.len;
+    }
+    const decode_ns = timer.read();
+
+    if (num_decoded != items.len) {
+        return error.ItemCountMismatch;
+    }
+    std.mem.doNotOptimizeAway(checksum);
+
+    try reporter.report("block_codec", .{
+        .format = @tagName(format),
+        .block_size = block_size,
+        .num_items = items.len,
+    }, .{
+        .encode_ns_per_item = nsPer(encode_ns, items.len),
+        .decode_ns_per_item = nsPer(decode_ns, items.len),
+        .bytes_per_item = @as(f64, @floatFromInt(blocks.items.len)) / @as(f64, @floatFromInt(items.len)),
+    });
+}
+
+// Hit accumulation
+
+fn benchSearchResults(allocator: std.mem.Allocator, reporter: Reporter, num_docs: u32, dense: bool, num_queries: usize) !void {
+    var prng = std.Random.DefaultPrng.init(num_docs);
+    const rand = prng.random();
+
+    // most hits from common hashes are spread over the whole index, a few docs match many hashes
+    const hits_per_query = 20_000;
+    const hits = try allocator.alloc(u32, num_queries * hits_per_query);
+    defer allocator.free(hits);
+
+    for (hits, 0..) |*id, i| {
+        if (rand.uintLessThan(u32, 10) == 0) {
+            id.* = @intCast(1 + (i / hits_per_query) % num_docs);
+        } else {
+            id.* = rand.intRangeAtMost(u32, 1, num_docs);
+        }
+    }
+
+    var results = SearchResults.init(allocator, .{});
+    defer results.deinit();
+
+    var incr_ns: u64 = 0;
+    var finish_ns: u64 = 0;
+    var timer = try std.time.Timer.start();
+    for (0..num_queries) |i| {
+        timer.reset();
+        results.reset(.{});
+        if (dense) {
+            try results.setDocIdRange(1, num_docs);
+        }
+        for (hits[i * hits_per_query ..][0..hits_per_query]) |id| {
+            try results.incr(id, 1);
+        }
+        incr_ns += timer.lap();
+        try results.finish(NoNewerVersions{});
+        finish_ns += timer.read();
+    }
+
+    // the dense accumulator is only used if the doc id range is small enough
+    try reporter.report("search_results", .{
+        .num_docs = num_docs,
+        .accumulator = if (results.dense != null) "dense" else "hash",
+        .hits_per_query = hits_per_query,
+    }, .{
+        .incr_ns_per_hit = nsPer(incr_ns, hits.len),
+        .finish_us_per_query = nsPer(finish_ns, num_queries) / std.time.ns_per_us,
+    });
+}
+
+// Searching a single file segment
+
+const SearchStats = struct {
+    qps: f64,
+    latency: Latency,
+    // fraction of queries from the corpus with the source doc as the top result
+    recall: f64,
+};
+
+fn runSearches(allocator: std.mem.Allocator, searcher: anytype, queries: Corpus.Queries) !SearchStats {
+    const samples = try allocator.alloc(u64, queries.queries.len);
+    defer allocator.free(samples);
+
+    var buf: [1024]u32 = undefined;
+
+    var results = SearchResults.init(allocator, .{});
+    defer results.deinit();
+
+    var num_expected: usize = 0;
+    var num_found: usize = 0;
+
+    var total_timer = try std.time.Timer.start();
+    for (queries.queries, samples, 0..) |query, *sample, i| {
+        const hashes = queries.copy(i, &buf);
+
+        var timer = try std.time.Timer.start();
+        try searcher.search(hashes, &results);
+        sample.* = timer.read();
+
+        if (query.doc_id != 0) {
+            num_expected += 1;
+            const top = results.getResults();
+            if (top.len > 0 and top[0].id == query.doc_id) {
+                num_found += 1;
+            }
+        }
+    }
+    const total_ns = total_timer.read();
+
+    return .{
+        .qps = perSecond(total_ns, queries.queries.len),
+        .latency = Latency.compute(samples),
+        .recall = @as(f64, @floatFromInt(num_found)) / @as(f64, @floatFromInt(@max(num_expected, 1))),
+    };
+}
+
+const FileSegmentSearcher = struct {
+    segment: *const FileSegment,
+
+    fn search(self: FileSegmentSearcher, hashes: []u32, results: *SearchResults) !void {
+        std.sort.pdq(u32, hashes, {}, std.sort.asc(u32));
+        results.reset(.{});
+        try self.segment.search(hashes, results, .{});
+        try results.finish(NoNewerVersions{});
+    }
+};
+
+fn benchFileSegmentSearch(allocator: std.mem.Allocator, reporter: Reporter, num_docs: usize, num_queries: usize, use_block_cache: bool) !void {
+    var corpus = try Corpus.init(allocator, .{ .num_docs = num_docs });
+    defer corpus.deinit();
+
+    var queries = try corpus.generateQueries(allocator, .{ .num_queries = num_queries });
+    defer queries.deinit();
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var block_cache: ?BlockCache = if (use_block_cache) try BlockCache.init(allocator, .{ .max_size = 256 * 1024 * 1024 }) else null;
+    defer if (block_cache) |*cache| cache.deinit();
+
+    var source = MemorySegment.init(allocator, .{});
+    defer source.deinit(.delete);
+
+    try buildMemorySegment(&source, corpus, 0, corpus.docs.len, 1);
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    var segment = FileSegment.init(allocator, .{
+        .dir = tmp_dir.dir,
+        .block_cache = if (block_cache) |*cache| cache else null,
+    });
+    defer segment.deinit(.delete);
+
+    try segment.build(&source_reader);
+
+    const searcher = FileSegmentSearcher{ .segment = &segment };
+    if (use_block_cache) {
+        // measure the steady state, not the cache warm-up
+        _ = try runSearches(allocator, searcher, queries);
+    }
+    const stats = try runSearches(allocator, searcher, queries);
+
+    try reporter.report("file_segment_search", .{
+        .num_docs = num_docs,
+        .num_queries = num_queries,
+        .block_cache = use_block_cache,
+    }, stats);
+}
+
+// Checkpoints and merges
+
+fn benchCheckpoint(allocator: std.mem.Allocator, reporter: Reporter, num_docs: usize) !void {
+    var corpus = try Corpus.init(allocator, .{ .num_docs = num_docs });
+    defer corpus.deinit();
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var timer = try std.time.Timer.start();
+
+    var source = MemorySegment.init(allocator, .{});
+    defer source.deinit(.delete);
+
+    try buildMemorySegment(&source, corpus, 0, corpus.docs.len, 1);
+    const build_ns = timer.lap();
+
+    var source_reader = source.reader();
+    defer source_reader.close();
+
+    var segment = FileSegment.init(allocator, .{ .dir = tmp_dir.dir });
+    defer segment.deinit(.delete);
+
+    try segment.build(&source_reader);
+    const checkpoint_ns = timer.read();
+
+    try reporter.report("checkpoint", .{
+        .num_docs = num_docs,
+        .num_items = corpus.numHashes(),
+    }, .{
+        .memory_build_ms = toMs(build_ns),
+        .file_build_ms = toMs(checkpoint_ns),
+        .items_per_second = perSecond(checkpoint_ns, corpus.numHashes()),
+        .file_size = segment.getSize(),
+    });
+}
+
+fn benchMerge(comptime Segment: type, allocator: std.mem.Allocator, reporter: Reporter, num_sources: usize, docs_per_source: usize) !void {
+    const List = SegmentList(Segment);
+
+    var corpus = try Corpus.init(allocator, .{ .num_docs = num_sources * docs_per_source });
+    defer corpus.deinit();
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    const options: Segment.Options = if (Segment == FileSegment) .{ .dir = tmp_dir.dir } else .{};
+
+    var collection = try List.init(allocator, num_sources);
+    defer collection.deinit(allocator, .delete);
+
+    for (0..num_sources) |i| {
+        const node = try List.createSegment(allocator, options);
+        collection.nodes.appendAssumeCapacity(node);
+
+        const start = i * docs_per_source;
+        if (Segment == FileSegment) {
+            var source = MemorySegment.init(allocator, .{});
+            defer source.deinit(.delete);
+
+            try buildMemorySegment(&source, corpus, start, start + docs_per_source, i + 1);
+
+            var source_reader = source.reader();
+            defer source_reader.close();
+
+            try node.value.build(&source_reader);
+        } else {
+            try buildMemorySegment(node.value, corpus, start, start + docs_per_source, i + 1);
+        }
+    }
+
+    var target = try List.createSegment(allocator, options);
+    defer List.destroySegment(allocator, &target);
+
+    var timer = try std.time.Timer.start();
+
+    var merger = try SegmentMerger(Segment).init(allocator, &collection, num_sources);
+    defer merger.deinit();
+
+    for (collection.nodes.items) |node| {
+        merger.addSource(node.value);
+    }
+    try merger.prepare();
+
+    try target.value.merge(&merger);
+    const merge_ns = timer.read();
+
+    try reporter.report("merge", .{
+        .segment = if (Segment == FileSegment) "file" else "memory",
+        .num_sources = num_sources,
+        .docs_per_source = docs_per_source,
+    }, .{
+        .merge_ms = toMs(merge_ns),
+        .items_per_second = perSecond(merge_ns, corpus.numHashes()),
+    });
+}
+
+// Oplog
+
+const NoopReceiver = struct {
+    pub fn receive(self: *NoopReceiver, changes: []const Change, commit_id: u64) !void {
+        _ = self;
+        _ = changes;
+        _ = commit_id;
+    }
+};
+
+fn benchOplogWrite(allocator: std.mem.Allocator, reporter: Reporter, num_threads: usize, writes_per_thread: usize) !void {
+    var corpus = try Corpus.init(allocator, .{ .num_docs = num_threads * writes_per_thread });
+    defer corpus.deinit();
+
+    const changes = try corpus.getChanges(allocator, 0, corpus.docs.len);
+    defer allocator.free(changes);
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var oplog = try Oplog.init(allocator, tmp_dir.dir, .{});
+    defer oplog.deinit();
+
+    var receiver: NoopReceiver = .{};
+    try oplog.open(1, NoopReceiver.receive, &receiver);
+
+    const Writer = struct {
+        fn run(target: *Oplog, thread_changes: []const Change, failed: *std.atomic.Value(bool)) void {
+            for (0..thread_changes.len) |i| {
+                _ = target.write(thread_changes[i..][0..1]) catch {
+                    failed.store(true, .monotonic);
+                    return;
+                };
+            }
+        }
+    };
+
+    var failed = std.atomic.Value(bool).init(false);
+
+    const threads = try allocator.alloc(std.Thread, num_threads);
+    defer allocator.free(threads);
+
+    var timer = try std.time.Timer.start();
+    for (threads, 0..) |*thread, i| {
+        thread.* = try std.Thread.spawn(.{}, Writer.run, .{ &oplog, changes[i * writes_per_thread ..][0..writes_per_thread], &failed });
+    }
+    for (threads) |thread| {
+        thread.join();
+    }
+    const elapsed = timer.read();
+
+    if (failed.load(.monotonic)) {
+        return error.WriteFailed;
+    }
+
+    try reporter.report("oplog_write", .{
+        .num_threads = num_threads,
+        .num_writes = changes.len,
+    }, .{
+        .writes_per_second = perSecond(elapsed, changes.len),
+        .hashes_per_second = perSecond(elapsed, corpus.numHashes()),
+    });
+}
+
+// End-to-end index
+
+const IndexSearcher = struct {
+    index: *Index,
+
+    fn search(self: IndexSearcher, hashes: []u32, results: *SearchResults) !void {
+        results.reset(.{});
+        try self.index.search(hashes, results, .{});
+    }
+};
+
+fn benchIndex(allocator: std.mem.Allocator, reporter: Reporter, num_docs: usize, num_queries: usize) !void {
+    var corpus = try Corpus.init(allocator, .{ .num_docs = num_docs });
+    defer corpus.deinit();
+
+    var queries = try corpus.generateQueries(allocator, .{ .num_queries = num_queries });
+    defer queries.deinit();
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(4);
+
+    var index = try Index.init(allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(true);
+
+    const batch_size = 100;
+    const num_batches = std.math.divCeil(usize, num_docs, batch_size) catch unreachable;
+    const batch_samples = try allocator.alloc(u64, num_batches);
+    defer allocator.free(batch_samples);
+
+    var timer = try std.time.Timer.start();
+    for (batch_samples, 0..) |*sample, i| {
+        const start = i * batch_size;
+        const changes = try corpus.getChanges(allocator, start, @min(start + batch_size, num_docs));
+        defer allocator.free(changes);
+
+        var batch_timer = try std.time.Timer.start();
+        try index.update(changes);
+        sample.* = batch_timer.read();
+    }
+    const ingest_ns = timer.read();
+
+    var num_file_segments: usize = 0;
+    var num_memory_segments: usize = 0;
+    {
+        var reader = try index.acquireReader();
+        defer index.releaseReader(&reader);
+
+        num_file_segments = reader.file_segments.value.nodes.items.len;
+        num_memory_segments = reader.memory_segments.value.nodes.items.len;
+    }
+
+    const stats = try runSearches(allocator, IndexSearcher{ .index = &index }, queries);
+
+    try reporter.report("index", .{
+        .num_docs = num_docs,
+        .num_queries = num_queries,
+        .batch_size = batch_size,
+    }, .{
+        .ingest_docs_per_second = perSecond(ingest_ns, num_docs),
+        .ingest_batch_latency = Latency.compute(batch_samples),
+        .file_segments = num_file_segments,
+        .memory_segments = num_memory_segments,
+        .search = stats,
+    });
+}
+
+fn run(allocator: std.mem.Allocator, config: Config, reporter: Reporter) !void {
+    if (config.isEnabled("block_index")) {
+        const sizes: []const usize = if (config.quick) &.{1_000_000} else &.{ 1_000_000, 10_000_000, 100_000_000 };
+        for (sizes) |num_blocks| {
+            try benchBlockIndex(allocator, reporter, num_blocks);
+        }
+    }
+
+    if (config.isEnabled("block_codec")) {
+        var corpus = try Corpus.init(allocator, .{ .num_docs = if (config.quick) 1_000 else 10_000 });
+        defer corpus.deinit();
+
+        for (std.enums.values(filefmt.BlockFormat)) |format| {
+            try benchBlockCodec(allocator, reporter, corpus, format, filefmt.default_block_size);
+        }
+    }
+
+    if (config.isEnabled("search_results")) {
+        const num_queries: usize = if (config.quick) 100 else 1_000;
+        for ([_]u32{ 100_000, 10_000_000 }) |num_docs| {
+            try benchSearchResults(allocator, reporter, num_docs, false, num_queries);
+            try benchSearchResults(allocator, reporter, num_docs, true, num_queries);
+        }
+    }
+
+    const sizes: []const usize = if (config.quick) &.{ 1_000, 10_000 } else &.{ 10_000, 100_000 };
+    const num_queries: usize = if (config.quick) 1_000 else 10_000;
+
+    if (config.isEnabled("file_segment_search")) {
+        for (sizes) |num_docs| {
+            try benchFileSegmentSearch(allocator, reporter, num_docs, num_queries, false);
+            try benchFileSegmentSearch(allocator, reporter, num_docs, num_queries, true);
+        }
+    }
+
+    if (config.isEnabled("checkpoint")) {
+        for (sizes) |num_docs| {
+            try benchCheckpoint(allocator, reporter, num_docs);
+        }
+    }
+
+    if (config.isEnabled("merge")) {
+        const docs_per_source: usize = if (config.quick) 1_000 else 10_000;
+        try benchMerge(MemorySegment, allocator, reporter, 4, docs_per_source / 10);
+        try benchMerge(FileSegment, allocator, reporter, 4, docs_per_source);
+    }
+
+    if (config.isEnabled("oplog_write")) {
+        const num_writes: usize = if (config.quick) 200 else 2_000;
+        try benchOplogWrite(allocator, reporter, 1, num_writes);
+        try benchOplogWrite(allocator, reporter, 8, num_writes / 8);
+    }
+
+    if (config.isEnabled("index")) {
+        for (sizes) |num_docs| {
+            try benchIndex(allocator, reporter, num_docs, num_queries);
+        }
+    }
+}
+
+pub fn main() !void {
+    var gpa: std.heap.GeneralPurposeAllocator(.{}) = .{};
+    defer _ = gpa.deinit();
+
+    const allocator = gpa.allocator();
+
+    const args = try std.process.argsAlloc(allocator);
+    defer std.process.argsFree(allocator, args);
+
+    var filters = std.ArrayList([]const u8).init(allocator);
+    defer filters.deinit();
+
+    var config: Config = .{};
+
+    var i: usize = 1;
+    while (i < args.len) : (i += 1) {
+        const arg = args[i];
+        if (std.mem.eql(u8, arg, "--quick")) {
+            config.quick = true;
+        } else if (std.mem.eql(u8, arg, "--label")) {
+            i += 1;
+            if (i >= args.len) {
+                std.log.err("missing value for --label", .{});
+                return error.InvalidArgument;
+            }
+            config.label = args[i];
+        } else if (std.mem.startsWith(u8, arg, "--")) {
+            std.log.err("unknown option {s}", .{arg});
+            return error.InvalidArgument;
+        } else {
+            try filters.append(arg);
+        }
+    }
+    config.filters = filters.items;
+
+    const reporter = Reporter{
+        .writer = std.io.getStdOut().writer(),
+        .label = config.label,
+    };
+
+    try run(allocator, config, reporter);
+}
+
+test {
+    _ = Corpus;
+}
@@ -0,0 +1,218 @@
+const std = @import("std");
+
+const Change = @import("../change.zig").Change;
+
+const Self = @This();
+
+// Synthetic fingerprint corpus for benchmarks.
+//
+// Real fingerprints are not random. Consecutive hashes differ only in a few bits,
+// lengths vary with the track duration and some hashes, e.g. from silence, are
+// shared by many fingerprints. The generator mimics all three, so that blocks,
+// merges and searches see roughly the distributions from a production index.
+// The corpus is fully determined by the options, including the seed.
+
+pub const Options = struct {
+    num_docs: usize,
+    seed: u64 = 0,
+    // Fingerprints have about 8 hashes per second, up to 120 seconds.
+    mean_length: f64 = 700,
+    stddev_length: f64 = 250,
+    min_length: usize = 50,
+    max_length: usize = 950,
+    // Probability of a hash being replaced with one of the common hashes.
+    common_hash_rate: f64 = 0.02,
+    num_common_hashes: u32 = 1024,
+};
+
+pub const Doc = struct {
+    id: u32,
+    hashes: []u32,
+};
+
+allocator: std.mem.Allocator,
+options: Options,
+hashes: []u32,
+docs: []Doc,
+
+fn nextHash(rand: std.Random, prev: u32) u32 {
+    // flip 1-4 bits, most of the time just one or two
+    var hash = prev;
+    const num_bits = 1 + @min(3, @ctz(rand.int(u32) | 0x8));
+    for (0..num_bits) |_| {
+        hash ^= @as(u32, 1) << rand.int(u5);
+    }
+    return hash;
+}
+
+fn commonHash(rand: std.Random, num_common_hashes: u32) u32 {
+    // log-uniform rank, a few hashes are much more common than the rest
+    const rank: u32 = @intFromFloat(std.math.pow(f64, @floatFromInt(num_common_hashes), rand.float(f64)) - 1);
+    return std.hash.uint32(rank);
+}
+
+pub fn generateHashes(rand: std.Random, options: Options, hashes: []u32) void {
+    var hash = rand.int(u32);
+    for (hashes) |*h| {
+        hash = nextHash(rand, hash);
+        if (rand.float(f64) < options.common_hash_rate) {
+            h.* = commonHash(rand, options.num_common_hashes);
+        } else {
+            h.* = hash;
+        }
+    }
+}
+
+fn randomLength(rand: std.Random, options: Options) usize {
+    const length = options.mean_length + rand.floatNorm(f64) * options.stddev_length;
+    const min_length: f64 = @floatFromInt(options.min_length);
+    const max_length: f64 = @floatFromInt(options.max_length);
+    return @intFromFloat(std.math.clamp(length, min_length, max_length));
+}
+
+pub fn init(allocator: std.mem.Allocator, options: Options) !Self {
+    var prng = std.Random.DefaultPrng.init(options.seed);
+    const rand = prng.random();
+
+    const docs = try allocator.alloc(Doc, options.num_docs);
+    errdefer allocator.free(docs);
+
+    const lengths = try allocator.alloc(usize, options.num_docs);
+    defer allocator.free(lengths);
+
+    var total_hashes: usize = 0;
+    for (lengths) |*length| {
+        length.* = randomLength(rand, options);
+        total_hashes += length.*;
+    }
+
+    const hashes = try allocator.alloc(u32, total_hashes);
+    errdefer allocator.free(hashes);
+
+    var offset: usize = 0;
+    for (docs, lengths, 0..) |*doc, length, i| {
+        doc.* = .{
+            .id = @intCast(i + 1),
+            .hashes = hashes[offset .. offset + length],
+        };
+        generateHashes(rand, options, doc.hashes);
+        offset += length;
+    }
+
+    return .{
+        .allocator = allocator,
+        .options = options,
+        .hashes = hashes,
+        .docs = docs,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    self.allocator.free(self.hashes);
+    self.allocator.free(self.docs);
+}
+
+pub fn numHashes(self: Self) usize {
+    return self.hashes.len;
+}
+
+// Returns insert changes for docs in the given range, the hashes are not copied.
+pub fn getChanges(self: Self, allocator: std.mem.Allocator, start: usize, end: usize) ![]Change {
+    const changes = try allocator.alloc(Change, end - start);
+    for (self.docs[start..end], changes) |doc, *change| {
+        change.* = .{ .insert = .{ .id = doc.id, .hashes = doc.hashes } };
+    }
+    return changes;
+}
+
+pub const Query = struct {
+    // id of the doc the query was taken from, zero if it's not in the corpus
+    doc_id: u32,
+    hashes: []u32,
+};
+
+pub const QueryOptions = struct {
+    num_queries: usize,
+    seed: u64 = 1,
+    length: usize = 120,
+    // Probability of a one bit error in a query hash, e.g. from a different encoding.
+    error_rate: f64 = 0.1,
+    // Fraction of queries for fingerprints that are not in the corpus.
+    miss_rate: f64 = 0.1,
+};
+
+pub const Queries = struct {
+    allocator: std.mem.Allocator,
+    hashes: []u32,
+    queries: []Query,
+
+    pub fn deinit(self: *Queries) void {
+        self.allocator.free(self.hashes);
+        self.allocator.free(self.queries);
+    }
+
+    // Search sorts query hashes in place, so each run needs a fresh copy.
+    pub fn copy(self: Queries, query_no: usize, buf: []u32) []u32 {
+        const hashes = self.queries[query_no].hashes;
+        @memcpy(buf[0..hashes.len], hashes);
+        return buf[0..hashes.len];
+    }
+};
+
+// Generates queries from random windows of corpus docs, with bit errors.
+pub fn generateQueries(self: Self, allocator: std.mem.Allocator, options: QueryOptions) !Queries {
+    var prng = std.Random.DefaultPrng.init(options.seed);
+    const rand = prng.random();
+
+    const hashes = try allocator.alloc(u32, options.num_queries * options.length);
+    errdefer allocator.free(hashes);
+
+    const queries = try allocator.alloc(Query, options.num_queries);
+    errdefer allocator.free(queries);
+
+    for (queries, 0..) |*query, i| {
+        var buf = hashes[i * options.length ..][0..options.length];
+        if (self.docs.len == 0 or rand.float(f64) < options.miss_rate) {
+            generateHashes(rand, self.options, buf);
+            query.* = .{ .doc_id = 0, .hashes = buf };
+            continue;
+        }
+        const doc = self.docs[rand.uintLessThan(usize, self.docs.len)];
+        const length = @min(options.length, doc.hashes.len);
+        const offset = rand.uintAtMost(usize, doc.hashes.len - length);
+        buf = buf[0..length];
+        @memcpy(buf, doc.hashes[offset .. offset + length]);
+        for (buf) |*h| {
+            if (rand.float(f64) < options.error_rate) {
+                h.* ^= @as(u32, 1) << rand.int(u5);
+            }
+        }
+        query.* = .{ .doc_id = doc.id, .hashes = buf };
+    }
+
+    return .{
+        .allocator = allocator,
+        .hashes = hashes,
+        .queries = queries,
+    };
+}
+
+test "Corpus is deterministic" {
+    var corpus1 = try Self.init(std.testing.allocator, .{ .num_docs = 100, .seed = 42 });
+    defer corpus1.deinit();
+
+    var corpus2 = try Self.init(std.testing.allocator, .{ .num_docs = 100, .seed = 42 });
+    defer corpus2.deinit();
+
+    try std.testing.expectEqualSlices(u32, corpus1.hashes, corpus2.hashes);
+
+    for (corpus1.docs) |doc| {
+        try std.testing.expect(doc.hashes.len >= corpus1.options.min_length);
+        try std.testing.expect(doc.hashes.len <= corpus1.options.max_length);
+    }
+
+    var queries = try corpus1.generateQueries(std.testing.allocator, .{ .num_queries = 10 });
+    defer queries.deinit();
+
+    try std.testing.expectEqual(10, queries.queries.len);
+}
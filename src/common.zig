@@ -3,6 +3,7 @@ const testing = std.testing;
 
 const msgpack = @import("msgpack");
 const SegmentInfo = @import("segment.zig").SegmentInfo;
+const SearchProfile = @import("SearchProfile.zig");
 
 pub const DocInfo = struct {
     version: u64,
@@ -19,10 +20,42 @@ pub const SearchResult = struct {
     score: u32,
 };
 
+// Estimated memory usage of an index by component, in bytes.
+pub const MemoryUsage = struct {
+    // write buffers, only freed by checkpoints
+    memtable: usize = 0,
+    memory_segment_items: usize = 0,
+    memory_segment_docs: usize = 0,
+    // mapped segment files are counted as if they were all in the page cache
+    file_segment_blocks: usize = 0,
+    file_segment_docs: usize = 0,
+    block_index: usize = 0,
+    result_cache: usize = 0,
+
+    pub fn getWriteBufferSize(self: MemoryUsage) usize {
+        return self.memtable + self.memory_segment_items + self.memory_segment_docs;
+    }
+
+    pub fn getTotal(self: MemoryUsage) usize {
+        var total: usize = 0;
+        inline for (std.meta.fields(MemoryUsage)) |field| {
+            total += @field(self, field.name);
+        }
+        return total;
+    }
+};
+
 pub const SearchOptions = struct {
     max_results: u32 = 10,
     min_score: u32 = 1,
     min_score_pct: u32 = 10,
+    // Stop scanning a hash in a file segment after this many matching items. Very common
+    // hashes don't help to tell fingerprints apart, but they can take most of the search time.
+    max_docs_per_hash: u32 = 1000,
+    // Drop query hashes that are in more than this many items in all file segments, before
+    // scanning any blocks, zero disables it. Only counts of frequent hashes are stored
+    // in segments, see HashStats.
+    max_hash_frequency: u32 = 0,
 };
 
 pub const SearchResults = struct {
@@ -30,12 +63,170 @@ pub const SearchResults = struct {
     options: SearchOptions,
     results: std.ArrayListUnmanaged(SearchResult) = .{},
     hits: std.AutoHashMapUnmanaged(u32, Hit) = .{},
+    dense: ?DenseHits = null,
+    // optional breakdown of the search, filled by segments and finish
+    profile: ?*SearchProfile = null,
 
     const Hit = packed struct {
         version: u64,
         score: u32,
     };
 
+    const HitEntry = struct {
+        hit: *Hit,
+        found_existing: bool,
+    };
+
+    // Dense accumulator is only used if the directory of chunks is at most this big (128KiB,
+    // for 2^30 doc ids), for wider doc id ranges we fall back to the hash map.
+    const max_dense_chunks = 1 << 14;
+
+    // Score table indexed by doc_id - min_doc_id, split into chunks of pages. The directory
+    // of chunks is sized from the doc id range, a few KiB for tens of millions of ids.
+    // Chunks and pages are allocated on the first hit, so the memory use depends on the
+    // number of pages touched, not on the width of the id range. Ids of all hits are kept
+    // in order to iterate them quickly. If the hits turn out to be scattered, with only a
+    // few hits per page, no new pages are allocated and the remaining hits go to the hash map.
+    const DenseHits = struct {
+        min_doc_id: u32,
+        chunks: []?*Chunk,
+        ids: std.ArrayListUnmanaged(u32) = .{},
+        num_pages: usize = 0,
+        sparse: bool = false,
+
+        const page_bits = 6;
+        const page_size = 1 << page_bits;
+
+        const chunk_bits = 10;
+        const chunk_size = 1 << chunk_bits;
+
+        // Pages are always allocated for the first few pages, after that only
+        // if the pages are on average filled at least this much.
+        const min_pages = 16;
+        const min_hits_per_page = page_size / 8;
+
+        const Page = struct {
+            used: std.StaticBitSet(page_size),
+            hits: [page_size]Hit,
+        };
+
+        const Chunk = struct {
+            pages: [chunk_size]?*Page,
+        };
+
+        fn init(allocator: std.mem.Allocator, min_doc_id: u32, num_chunks: usize) !DenseHits {
+            const chunks = try allocator.alloc(?*Chunk, num_chunks);
+            @memset(chunks, null);
+            return .{
+                .min_doc_id = min_doc_id,
+                .chunks = chunks,
+            };
+        }
+
+        fn deinit(self: *DenseHits, allocator: std.mem.Allocator) void {
+            for (self.chunks) |maybe_chunk| {
+                if (maybe_chunk) |chunk| {
+                    for (chunk.pages) |maybe_page| {
+                        if (maybe_page) |page| {
+                            allocator.destroy(page);
+                        }
+                    }
+                    allocator.destroy(chunk);
+                }
+            }
+            allocator.free(self.chunks);
+            self.ids.deinit(allocator);
+        }
+
+        fn contains(self: *const DenseHits, id: u32) bool {
+            return id >= self.min_doc_id and ((id - self.min_doc_id) >> (page_bits + chunk_bits)) < self.chunks.len;
+        }
+
+        fn getPage(self: *const DenseHits, offset: u32) ?*Page {
+            const chunk = self.chunks[offset >> (page_bits + chunk_bits)] orelse return null;
+            return chunk.pages[(offset >> page_bits) & (chunk_size - 1)];
+        }
+
+        // Returns true if the hit for this id is stored here and not in the hash map.
+        fn owns(self: *const DenseHits, id: u32) bool {
+            return self.contains(id) and self.getPage(id - self.min_doc_id) != null;
+        }
+
+        fn canAllocatePage(self: *DenseHits) bool {
+            if (!self.sparse and self.num_pages >= min_pages and self.ids.items.len < self.num_pages * min_hits_per_page) {
+                self.sparse = true;
+            }
+            return !self.sparse;
+        }
+
+        // Returns null if the id's page is not allocated and the hits are too sparse
+        // to allocate it, the caller should then use the hash map.
+        fn getOrPut(self: *DenseHits, allocator: std.mem.Allocator, id: u32) !?HitEntry {
+            const offset = id - self.min_doc_id;
+            if (self.getPage(offset) == null and !self.canAllocatePage()) {
+                return null;
+            }
+            const chunk_ptr = &self.chunks[offset >> (page_bits + chunk_bits)];
+            const chunk = chunk_ptr.* orelse blk: {
+                const new_chunk = try allocator.create(Chunk);
+                @memset(&new_chunk.pages, null);
+                chunk_ptr.* = new_chunk;
+                break :blk new_chunk;
+            };
+            const page_ptr = &chunk.pages[(offset >> page_bits) & (chunk_size - 1)];
+            const page = page_ptr.* orelse blk: {
+                const new_page = try allocator.create(Page);
+                new_page.used = std.StaticBitSet(page_size).initEmpty();
+                page_ptr.* = new_page;
+                self.num_pages += 1;
+                break :blk new_page;
+            };
+            const i = offset & (page_size - 1);
+            if (page.used.isSet(i)) {
+                return .{ .hit = &page.hits[i], .found_existing = true };
+            }
+            try self.ids.append(allocator, id);
+            page.used.set(i);
+            return .{ .hit = &page.hits[i], .found_existing = false };
+        }
+
+        fn clear(self: *DenseHits) void {
+            for (self.ids.items) |id| {
+                const offset = id - self.min_doc_id;
+                const page = self.getPage(offset) orelse unreachable;
+                page.used.unset(offset & (page_size - 1));
+            }
+            self.ids.clearRetainingCapacity();
+            self.sparse = false;
+        }
+
+        fn get(self: *const DenseHits, id: u32) ?*Hit {
+            if (!self.contains(id)) {
+                return null;
+            }
+            const offset = id - self.min_doc_id;
+            const page = self.getPage(offset) orelse return null;
+            const i = offset & (page_size - 1);
+            if (!page.used.isSet(i)) {
+                return null;
+            }
+            return &page.hits[i];
+        }
+    };
+
+    const Candidate = struct {
+        id: u32,
+        score: u32,
+        version: u64,
+
+        fn compare(_: void, a: Candidate, b: Candidate) std.math.Order {
+            if (a.score != b.score) {
+                return std.math.order(b.score, a.score);
+            }
+            return std.math.order(a.id, b.id);
+        }
+    };
+
     pub fn init(allocator: std.mem.Allocator, options: SearchOptions) SearchResults {
         return SearchResults{
             .allocator = allocator,
@@ -44,75 +235,320 @@ pub const SearchResults = struct {
     }
 
     pub fn deinit(self: *SearchResults) void {
+        if (self.dense) |*dense| {
+            dense.deinit(self.allocator);
+        }
         self.hits.deinit(self.allocator);
         self.results.deinit(self.allocator);
     }
 
-    pub fn incr(self: *SearchResults, id: u32, version: u64) !void {
+    // Clears all hits and results, but keeps the allocated memory, including
+    // the dense accumulator, so that it can be reused for the next query.
+    pub fn reset(self: *SearchResults, options: SearchOptions) void {
+        self.options = options;
+        if (self.dense) |*dense| {
+            dense.clear();
+        }
+        self.hits.clearRetainingCapacity();
+        self.results.clearRetainingCapacity();
+    }
+
+    // Enables the dense accumulator, if the doc id range is narrow enough.
+    // Has no effect once hits were added.
+    pub fn setDocIdRange(self: *SearchResults, min_doc_id: u32, max_doc_id: u32) !void {
+        if (self.dense != null or self.hits.count() > 0 or max_doc_id < min_doc_id) {
+            return;
+        }
+        const num_chunks = ((max_doc_id - min_doc_id) >> (DenseHits.page_bits + DenseHits.chunk_bits)) + 1;
+        if (num_chunks > max_dense_chunks) {
+            return;
+        }
+        self.dense = try DenseHits.init(self.allocator, min_doc_id, num_chunks);
+    }
+
+    pub fn count(self: *const SearchResults) usize {
+        var result: usize = self.hits.count();
+        if (self.dense) |*dense| {
+            result += dense.ids.items.len;
+        }
+        return result;
+    }
+
+    fn getOrPutHit(self: *SearchResults, id: u32) !HitEntry {
+        if (self.dense) |*dense| {
+            if (dense.contains(id)) {
+                if (try dense.getOrPut(self.allocator, id)) |entry| {
+                    return entry;
+                }
+            }
+        }
         const r = try self.hits.getOrPut(self.allocator, id);
-        if (!r.found_existing or r.value_ptr.version < version) {
-            r.value_ptr.score = 1;
-            r.value_ptr.version = version;
-        } else if (r.value_ptr.version == version) {
-            r.value_ptr.score += 1;
+        return .{ .hit = r.value_ptr, .found_existing = r.found_existing };
+    }
+
+    fn getHit(self: *const SearchResults, id: u32) ?Hit {
+        if (self.dense) |*dense| {
+            if (dense.owns(id)) {
+                const hit = dense.get(id) orelse return null;
+                return hit.*;
+            }
+        }
+        return self.hits.get(id);
+    }
+
+    fn addHit(self: *SearchResults, id: u32, hit: Hit) !void {
+        const r = try self.getOrPutHit(id);
+        if (!r.found_existing or r.hit.version < hit.version) {
+            r.hit.* = hit;
+        } else if (r.hit.version == hit.version) {
+            r.hit.score += hit.score;
+        }
+    }
+
+    pub fn incr(self: *SearchResults, id: u32, version: u64) !void {
+        return self.addHit(id, .{ .version = version, .score = 1 });
+    }
+
+    // Merges partial results collected from a disjoint set of segments.
+    pub fn merge(self: *SearchResults, other: *const SearchResults) !void {
+        if (other.dense) |*dense| {
+            for (dense.ids.items) |id| {
+                const hit = dense.get(id) orelse unreachable;
+                try self.addHit(id, hit.*);
+            }
+        }
+        var iter = other.hits.iterator();
+        while (iter.next()) |entry| {
+            try self.addHit(entry.key_ptr.*, entry.value_ptr.*);
         }
     }
 
     pub fn get(self: SearchResults, id: u32) ?SearchResult {
-        const hit = self.hits.get(id) orelse return null;
+        const hit = self.getHit(id) orelse return null;
         return .{
             .id = id,
             .score = hit.score,
-            .version = hit.version,
         };
     }
 
     pub fn finish(self: *SearchResults, collection: anytype) !void {
-        var ids = try std.ArrayListUnmanaged(u32).initCapacity(self.allocator, self.hits.count());
-        defer ids.deinit(self.allocator);
+        var timer: std.time.Timer = undefined;
+        if (self.profile) |profile| {
+            timer = std.time.Timer.start() catch unreachable;
+            profile.candidates = self.count();
+            profile.dense_accumulator = self.dense != null;
+        }
+        defer {
+            if (self.profile) |profile| {
+                profile.finish_ns = timer.read();
+            }
+        }
 
         var min_score = self.options.min_score;
 
+        var candidates = try std.ArrayListUnmanaged(Candidate).initCapacity(self.allocator, self.count());
+        defer candidates.deinit(self.allocator);
+
+        if (self.dense) |*dense| {
+            for (dense.ids.items) |id| {
+                const hit = dense.get(id) orelse unreachable;
+                if (hit.score >= min_score) {
+                    candidates.appendAssumeCapacity(.{ .id = id, .score = hit.score, .version = hit.version });
+                }
+            }
+        }
+
         var iter = self.hits.iterator();
         while (iter.next()) |entry| {
-            if (entry.value_ptr.*.score >= min_score) {
-                ids.appendAssumeCapacity(entry.key_ptr.*);
+            const hit = entry.value_ptr.*;
+            if (hit.score >= min_score) {
+                candidates.appendAssumeCapacity(.{ .id = entry.key_ptr.*, .score = hit.score, .version = hit.version });
             }
         }
 
-        std.sort.pdq(u32, ids.items, self, compareResults);
+        // Build a heap in O(n) and only pop as many candidates as we need,
+        // instead of sorting all of them.
+        var queue = std.PriorityQueue(Candidate, void, Candidate.compare).fromOwnedSlice(self.allocator, try candidates.toOwnedSlice(self.allocator), {});
+        defer queue.deinit();
 
         self.results.clearRetainingCapacity();
         try self.results.ensureTotalCapacity(self.allocator, self.options.max_results);
 
-        for (ids.items) |id| {
-            if (self.results.items.len == self.options.max_results) {
+        while (self.results.items.len < self.options.max_results) {
+            const candidate = queue.removeOrNull() orelse break;
+            if (candidate.score < min_score) {
                 break;
             }
-            const hit = self.hits.get(id) orelse unreachable;
-            if (collection.hasNewerVersion(id, hit.version)) {
+            if (collection.hasNewerVersion(candidate.id, candidate.version)) {
                 continue;
             }
-            if (hit.score < min_score) {
-                break;
-            }
             if (self.results.items.len == 0) {
-                min_score = @max(min_score, hit.score * self.options.min_score_pct / 100);
+                min_score = @max(min_score, candidate.score * self.options.min_score_pct / 100);
             }
             self.results.appendAssumeCapacity(.{
-                .id = id,
-                .score = hit.score,
+                .id = candidate.id,
+                .score = candidate.score,
             });
         }
     }
 
-    pub fn compareResults(self: *SearchResults, a: u32, b: u32) bool {
-        const a_hit = self.hits.get(a) orelse unreachable;
-        const b_hit = self.hits.get(b) orelse unreachable;
-        return a_hit.score > b_hit.score or (a_hit.score == b_hit.score and a < b);
+    // Replaces the final results, e.g. with previously cached ones.
+    pub fn setResults(self: *SearchResults, results: []const SearchResult) !void {
+        self.results.clearRetainingCapacity();
+        try self.results.appendSlice(self.allocator, results);
     }
 
     pub fn getResults(self: *SearchResults) []SearchResult {
         return self.results.items;
     }
 };
+
+const MockCollection = struct {
+    newer: []const u32 = &.{},
+
+    pub fn hasNewerVersion(self: MockCollection, doc_id: u32, version: u64) bool {
+        _ = version;
+        return std.mem.indexOfScalar(u32, self.newer, doc_id) != null;
+    }
+};
+
+test "SearchResults hash map" {
+    var results = SearchResults.init(testing.allocator, .{ .max_results = 2, .min_score_pct = 0 });
+    defer results.deinit();
+
+    try results.incr(100, 1);
+    try results.incr(100, 1);
+    try results.incr(200, 1);
+    try results.incr(300, 1);
+    try results.incr(300, 2);
+    try results.incr(300, 2);
+    try results.incr(300, 2);
+
+    try results.finish(MockCollection{});
+
+    try testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 300, .score = 3 },
+        .{ .id = 100, .score = 2 },
+    }, results.getResults());
+}
+
+test "SearchResults dense" {
+    var results = SearchResults.init(testing.allocator, .{ .max_results = 3, .min_score_pct = 0 });
+    defer results.deinit();
+
+    try results.setDocIdRange(100, 10000);
+    try testing.expect(results.dense != null);
+
+    try results.incr(100, 1);
+    try results.incr(5000, 1);
+    try results.incr(5000, 1);
+    try results.incr(10000, 1);
+    try results.incr(100000, 1); // out of range, ends up in the hash map
+    try results.incr(100000, 1);
+    try results.incr(100000, 1);
+
+    try testing.expectEqual(4, results.count());
+
+    try results.finish(MockCollection{ .newer = &.{5000} });
+
+    try testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 100000, .score = 3 },
+        .{ .id = 100, .score = 1 },
+        .{ .id = 10000, .score = 1 },
+    }, results.getResults());
+}
+
+test "SearchResults dense with a production-size id range" {
+    var results = SearchResults.init(testing.allocator, .{ .min_score_pct = 0 });
+    defer results.deinit();
+
+    try results.setDocIdRange(1, 50_000_000);
+    try testing.expect(results.dense != null);
+    try testing.expect(results.dense.?.chunks.len * @sizeOf(?*anyopaque) <= 8 * 1024);
+
+    try results.incr(1, 1);
+    try results.incr(50_000_000, 1);
+    try results.incr(50_000_000, 1);
+    try testing.expect(results.dense.?.contains(50_000_000));
+    try testing.expectEqual(0, results.hits.count());
+
+    try results.finish(MockCollection{});
+
+    try testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 50_000_000, .score = 2 },
+        .{ .id = 1, .score = 1 },
+    }, results.getResults());
+}
+
+test "SearchResults dense with scattered hits" {
+    var results = SearchResults.init(testing.allocator, .{ .min_score_pct = 0 });
+    defer results.deinit();
+
+    try results.setDocIdRange(0, 50_000_000);
+
+    var id: u32 = 0;
+    while (id < 1000) : (id += 1) {
+        try results.incr(id * 40_000, 1);
+    }
+    try results.incr(0, 1);
+    try results.incr(999 * 40_000, 1);
+
+    try testing.expect(results.dense.?.sparse);
+    try testing.expectEqual(SearchResults.DenseHits.min_pages, results.dense.?.num_pages);
+    try testing.expectEqual(1000, results.count());
+    try testing.expectEqual(SearchResult{ .id = 0, .score = 2 }, results.get(0).?);
+    try testing.expectEqual(SearchResult{ .id = 999 * 40_000, .score = 2 }, results.get(999 * 40_000).?);
+    try testing.expectEqual(SearchResult{ .id = 500 * 40_000, .score = 1 }, results.get(500 * 40_000).?);
+
+    results.reset(.{ .min_score_pct = 0 });
+    try testing.expect(!results.dense.?.sparse);
+    try testing.expectEqual(null, results.get(999 * 40_000));
+}
+
+test "SearchResults merge" {
+    var results1 = SearchResults.init(testing.allocator, .{});
+    defer results1.deinit();
+
+    var results2 = SearchResults.init(testing.allocator, .{});
+    defer results2.deinit();
+
+    try results1.setDocIdRange(1, 100);
+
+    try results1.incr(1, 1);
+    try results2.incr(1, 2);
+    try results2.incr(1, 2);
+    try results1.incr(2, 1);
+    try results2.incr(2, 1);
+
+    try results1.merge(&results2);
+
+    try testing.expectEqual(SearchResult{ .id = 1, .score = 2 }, results1.get(1).?);
+    try testing.expectEqual(SearchResult{ .id = 2, .score = 2 }, results1.get(2).?);
+}
+
+test "SearchResults reset" {
+    var results = SearchResults.init(testing.allocator, .{ .min_score_pct = 0 });
+    defer results.deinit();
+
+    try results.setDocIdRange(1, 100);
+
+    try results.incr(1, 1);
+    try results.incr(1000, 1);
+    try results.finish(MockCollection{});
+    try testing.expectEqual(2, results.getResults().len);
+
+    results.reset(.{ .max_results = 1, .min_score_pct = 0 });
+    try testing.expectEqual(0, results.count());
+    try testing.expectEqual(0, results.getResults().len);
+    try testing.expect(results.dense != null);
+    try testing.expectEqual(null, results.get(1));
+
+    try results.incr(2, 1);
+    try results.incr(2, 1);
+    try results.incr(1, 1);
+    try results.finish(MockCollection{});
+
+    try testing.expectEqualSlices(SearchResult, &.{
+        .{ .id = 2, .score = 2 },
+    }, results.getResults());
+}
@@ -1,4 +1,5 @@
 const std = @import("std");
+const builtin = @import("builtin");
 const testing = std.testing;
 const assert = std.debug.assert;
 const math = std.math;
@@ -12,11 +13,22 @@ const Item = @import("segment.zig").Item;
 const SegmentInfo = @import("segment.zig").SegmentInfo;
 const MemorySegment = @import("MemorySegment.zig");
 const FileSegment = @import("FileSegment.zig");
+const DocTable = @import("DocTable.zig");
+const HashStats = @import("HashStats.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
+const mapped_memory = @import("utils/mapped_memory.zig");
 
 pub const default_block_size = 1024;
 pub const min_block_size = 256;
 pub const max_block_size = 4096;
 
+pub const BlockFormat = enum {
+    // varint encoded (hash, doc id) deltas, interleaved
+    v1,
+    // bit-packed hash deltas and doc ids, in separate streams
+    v2,
+};
+
 pub fn maxItemsPerBlock(block_size: usize) usize {
     return (block_size - 2) / (2 * min_varint32_size);
 }
@@ -103,7 +115,7 @@ const BlockHeader = struct {
     first_item: Item,
 };
 
-pub fn decodeBlockHeader(data: []const u8, min_doc_id: u32) !BlockHeader {
+pub fn decodeBlockHeaderV1(data: []const u8, min_doc_id: u32) !BlockHeader {
     assert(data.len >= min_block_size);
 
     const num_items = std.mem.readInt(u16, data[0..2], .little);
@@ -123,7 +135,7 @@ pub fn decodeBlockHeader(data: []const u8, min_doc_id: u32) !BlockHeader {
     };
 }
 
-pub fn readBlock(data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32) !void {
+pub fn readBlockV1(data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32) !void {
     var ptr: usize = 0;
 
     if (data.len < 2) {
@@ -161,7 +173,7 @@ pub fn readBlock(data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32)
     }
 }
 
-pub fn encodeBlock(data: []u8, reader: anytype, min_doc_id: u32) !u16 {
+pub fn encodeBlockV1(data: []u8, reader: anytype, min_doc_id: u32) !u16 {
     assert(data.len >= 2);
 
     var ptr: usize = 2;
@@ -196,7 +208,372 @@ pub fn encodeBlock(data: []u8, reader: anytype, min_doc_id: u32) !u16 {
     return num_items;
 }
 
-test "writeBlock/readBlock/readFirstItemFromBlock" {
+// Block format v2:
+//
+//   u16 num_items
+//   u8 hash_bits
+//   u8 id_bits
+//   u32 first_hash
+//   u32 min_id
+//   num_items * hash_bits bits, hash deltas, first one is always zero
+//   num_items * id_bits bits, doc ids relative to min_id
+//
+// All values in a stream have the same width, so they can be unpacked
+// without any data-dependent branches, several values at a time. The last
+// bytes of the block are reserved, so that we can always load a full u64
+// when unpacking a value.
+const block_header_size_v2 = 12;
+const block_tail_size_v2 = @sizeOf(u64);
+
+// Items in v2 blocks can be encoded in less than two bytes, but we keep the
+// same limit as in v1, so that decode buffers can stay on the stack.
+const max_items_per_block_v2 = maxItemsPerBlock(max_block_size);
+
+fn bitWidth(value: u32) u8 {
+    return 32 - @clz(value);
+}
+
+fn packedSize(num_items: usize, bits: u8) usize {
+    return (num_items * bits + 7) / 8;
+}
+
+fn blockSizeV2(num_items: usize, hash_bits: u8, id_bits: u8) usize {
+    return block_header_size_v2 + packedSize(num_items, hash_bits) + packedSize(num_items, id_bits) + block_tail_size_v2;
+}
+
+fn packBits(data: []u8, values: []const u32, bits: u8) void {
+    if (bits == 0) {
+        return;
+    }
+    for (values, 0..) |value, i| {
+        const bit = i * bits;
+        const ptr = data[bit / 8 ..][0..8];
+        const word = std.mem.readInt(u64, ptr, .little);
+        std.mem.writeInt(u64, ptr, word | (@as(u64, value) << @intCast(bit % 8)), .little);
+    }
+}
+
+const unpack_lanes = 8;
+
+fn unpackBits(data: []const u8, values: []u32, bits: u8) void {
+    if (bits == 0) {
+        @memset(values, 0);
+        return;
+    }
+    const mask: u64 = (@as(u64, 1) << @intCast(bits)) - 1;
+    var i: usize = 0;
+    while (i + unpack_lanes <= values.len) : (i += unpack_lanes) {
+        var words: @Vector(unpack_lanes, u64) = undefined;
+        var shifts: @Vector(unpack_lanes, u6) = undefined;
+        inline for (0..unpack_lanes) |k| {
+            const bit = (i + k) * bits;
+            words[k] = std.mem.readInt(u64, data[bit / 8 ..][0..8], .little);
+            shifts[k] = @intCast(bit % 8);
+        }
+        const result: @Vector(unpack_lanes, u32) = @truncate((words >> shifts) & @as(@Vector(unpack_lanes, u64), @splat(mask)));
+        values[i..][0..unpack_lanes].* = result;
+    }
+    while (i < values.len) : (i += 1) {
+        const bit = i * bits;
+        const word = std.mem.readInt(u64, data[bit / 8 ..][0..8], .little);
+        values[i] = @truncate((word >> @intCast(bit % 8)) & mask);
+    }
+}
+
+pub fn decodeBlockHeaderV2(data: []const u8) !BlockHeader {
+    assert(data.len >= min_block_size);
+
+    const num_items = std.mem.readInt(u16, data[0..2], .little);
+    if (num_items == 0) {
+        return .{ .num_items = 0, .first_item = .{ .hash = 0, .id = 0 } };
+    }
+
+    // the header is read when loading the segment, reject corrupted blocks early,
+    // so that nothing reads past the block later
+    const hash_bits = data[2];
+    const id_bits = data[3];
+    if (num_items > max_items_per_block_v2 or hash_bits > 32 or id_bits > 32 or blockSizeV2(num_items, hash_bits, id_bits) > data.len) {
+        return error.InvalidSegment;
+    }
+
+    const first_hash = std.mem.readInt(u32, data[4..8], .little);
+    const min_id = std.mem.readInt(u32, data[8..12], .little);
+
+    var first_id: [1]u32 = undefined;
+    unpackBits(data[block_header_size_v2 + packedSize(num_items, hash_bits) ..], &first_id, id_bits);
+
+    return .{
+        .num_items = num_items,
+        .first_item = Item{ .hash = first_hash, .id = first_id[0] + min_id },
+    };
+}
+
+pub fn readBlockV2(data: []const u8, items: *std.ArrayList(Item)) !void {
+    if (data.len < block_header_size_v2 + block_tail_size_v2) {
+        return error.InvalidBlock;
+    }
+
+    const num_items = std.mem.readInt(u16, data[0..2], .little);
+    if (num_items == 0) {
+        return;
+    }
+
+    const hash_bits = data[2];
+    const id_bits = data[3];
+    if (num_items > max_items_per_block_v2 or hash_bits > 32 or id_bits > 32 or blockSizeV2(num_items, hash_bits, id_bits) > data.len) {
+        return error.InvalidBlock;
+    }
+
+    const first_hash = std.mem.readInt(u32, data[4..8], .little);
+    const min_id = std.mem.readInt(u32, data[8..12], .little);
+
+    var hashes_buf: [max_items_per_block_v2]u32 = undefined;
+    var ids_buf: [max_items_per_block_v2]u32 = undefined;
+    const hashes = hashes_buf[0..num_items];
+    const ids = ids_buf[0..num_items];
+
+    const hashes_start = block_header_size_v2;
+    const ids_start = hashes_start + packedSize(num_items, hash_bits);
+    unpackBits(data[hashes_start..], hashes, hash_bits);
+    unpackBits(data[ids_start..], ids, id_bits);
+
+    const out = try items.addManyAsSlice(num_items);
+    var hash = first_hash;
+    for (out, hashes, ids) |*item, diff_hash, id| {
+        hash +%= diff_hash;
+        item.* = .{ .hash = hash, .id = id +% min_id };
+    }
+}
+
+pub fn encodeBlockV2(data: []u8, reader: anytype) !u16 {
+    assert(data.len >= min_block_size);
+
+    const max_items = maxItemsPerBlock(data.len);
+
+    var hashes_buf: [max_items_per_block_v2]u32 = undefined;
+    var ids_buf: [max_items_per_block_v2]u32 = undefined;
+
+    var num_items: usize = 0;
+    var first_hash: u32 = 0;
+    var last_hash: u32 = 0;
+    var last_doc_id: u32 = 0;
+    var min_id: u32 = 0;
+    var max_id: u32 = 0;
+    var hash_bits: u8 = 0;
+
+    while (num_items < max_items) {
+        const item = try reader.read() orelse break;
+        assert(num_items == 0 or item.hash > last_hash or (item.hash == last_hash and item.id >= last_doc_id));
+
+        const new_min_id = if (num_items == 0) item.id else @min(min_id, item.id);
+        const new_max_id = if (num_items == 0) item.id else @max(max_id, item.id);
+        const diff_hash = if (num_items == 0) 0 else item.hash - last_hash;
+        const new_hash_bits = @max(hash_bits, bitWidth(diff_hash));
+        const new_id_bits = bitWidth(new_max_id - new_min_id);
+
+        if (blockSizeV2(num_items + 1, new_hash_bits, new_id_bits) > data.len) {
+            break;
+        }
+
+        if (num_items == 0) {
+            first_hash = item.hash;
+        }
+        hashes_buf[num_items] = diff_hash;
+        ids_buf[num_items] = item.id;
+        min_id = new_min_id;
+        max_id = new_max_id;
+        hash_bits = new_hash_bits;
+        last_hash = item.hash;
+        last_doc_id = item.id;
+
+        num_items += 1;
+        reader.advance();
+    }
+
+    @memset(data, 0);
+
+    if (num_items == 0) {
+        return 0;
+    }
+
+    const id_bits = bitWidth(max_id - min_id);
+    for (ids_buf[0..num_items]) |*id| {
+        id.* -= min_id;
+    }
+
+    std.mem.writeInt(u16, data[0..2], @intCast(num_items), .little);
+    data[2] = hash_bits;
+    data[3] = id_bits;
+    std.mem.writeInt(u32, data[4..8], first_hash, .little);
+    std.mem.writeInt(u32, data[8..12], min_id, .little);
+
+    const hashes_start = block_header_size_v2;
+    const ids_start = hashes_start + packedSize(num_items, hash_bits);
+    packBits(data[hashes_start..], hashes_buf[0..num_items], hash_bits);
+    packBits(data[ids_start..], ids_buf[0..num_items], id_bits);
+
+    return @intCast(num_items);
+}
+
+pub fn decodeBlockHeader(format: BlockFormat, data: []const u8, min_doc_id: u32) !BlockHeader {
+    return switch (format) {
+        .v1 => decodeBlockHeaderV1(data, min_doc_id),
+        .v2 => decodeBlockHeaderV2(data),
+    };
+}
+
+pub fn readBlock(format: BlockFormat, data: []const u8, items: *std.ArrayList(Item), min_doc_id: u32) !void {
+    return switch (format) {
+        .v1 => readBlockV1(data, items, min_doc_id),
+        .v2 => readBlockV2(data, items),
+    };
+}
+
+pub fn encodeBlock(format: BlockFormat, data: []u8, reader: anytype, min_doc_id: u32) !u16 {
+    return switch (format) {
+        .v1 => encodeBlockV1(data, reader, min_doc_id),
+        .v2 => encodeBlockV2(data, reader),
+    };
+}
+
+fn unpackOne(data: []const u8, index: usize, bits: u8) u32 {
+    if (bits == 0) {
+        return 0;
+    }
+    const mask: u64 = (@as(u64, 1) << @intCast(bits)) - 1;
+    const bit = index * bits;
+    const word = std.mem.readInt(u64, data[bit / 8 ..][0..8], .little);
+    return @truncate((word >> @intCast(bit % 8)) & mask);
+}
+
+// Decodes block items one by one, so that search can stop as soon as it
+// passes the hash it's looking for, and continue from there with the next
+// (greater) hash.
+pub const BlockCursor = struct {
+    format: BlockFormat,
+    data: []const u8,
+    min_doc_id: u32,
+    num_items: u16,
+    // number of items before the current one
+    index: u16 = 0,
+    current: Item = .{ .hash = 0, .id = 0 },
+    // v1 only
+    ptr: usize = 2,
+    // v2 only
+    id_bits: u8 = 0,
+    hash_bits: u8 = 0,
+    ids_start: usize = 0,
+
+    pub fn init(format: BlockFormat, data: []const u8, min_doc_id: u32) !BlockCursor {
+        if (data.len < block_header_size_v2 + block_tail_size_v2) {
+            return error.InvalidBlock;
+        }
+        var self = BlockCursor{
+            .format = format,
+            .data = data,
+            .min_doc_id = min_doc_id,
+            .num_items = std.mem.readInt(u16, data[0..2], .little),
+        };
+        if (self.num_items == 0) {
+            return self;
+        }
+        switch (format) {
+            .v1 => {},
+            .v2 => {
+                self.hash_bits = data[2];
+                self.id_bits = data[3];
+                if (self.hash_bits > 32 or self.id_bits > 32 or blockSizeV2(self.num_items, self.hash_bits, self.id_bits) > data.len) {
+                    return error.InvalidBlock;
+                }
+                self.ids_start = block_header_size_v2 + packedSize(self.num_items, self.hash_bits);
+                self.min_doc_id = std.mem.readInt(u32, data[8..12], .little);
+                self.current.hash = std.mem.readInt(u32, data[4..8], .little);
+            },
+        }
+        try self.decodeCurrent();
+        return self;
+    }
+
+    fn decodeCurrent(self: *BlockCursor) !void {
+        switch (self.format) {
+            .v1 => {
+                if (self.ptr + 2 * min_varint32_size > self.data.len) {
+                    return error.InvalidBlock;
+                }
+                const diff_hash = readVarint32(self.data[self.ptr..]);
+                self.ptr += diff_hash.size;
+                const diff_doc_id = readVarint32(self.data[self.ptr..]);
+                self.ptr += diff_doc_id.size;
+                self.current.hash += diff_hash.value;
+                self.current.id = if (diff_hash.value > 0) diff_doc_id.value + self.min_doc_id else self.current.id + diff_doc_id.value;
+            },
+            .v2 => {
+                self.current.hash +%= unpackOne(self.data[block_header_size_v2..], self.index, self.hash_bits);
+                self.current.id = unpackOne(self.data[self.ids_start..], self.index, self.id_bits) +% self.min_doc_id;
+            },
+        }
+    }
+
+    pub fn peek(self: *const BlockCursor) ?Item {
+        if (self.index < self.num_items) {
+            return self.current;
+        }
+        return null;
+    }
+
+    pub fn advance(self: *BlockCursor) !void {
+        if (self.index >= self.num_items) {
+            return;
+        }
+        self.index += 1;
+        if (self.index < self.num_items) {
+            try self.decodeCurrent();
+        }
+    }
+
+    // Skips all items with a smaller hash.
+    pub fn skipTo(self: *BlockCursor, hash: u32) !void {
+        while (self.peek()) |item| {
+            if (item.hash >= hash) {
+                break;
+            }
+            try self.advance();
+        }
+    }
+};
+
+test "BlockCursor" {
+    inline for (.{ BlockFormat.v1, BlockFormat.v2 }) |format| {
+        var segment = MemorySegment.init(std.testing.allocator, .{});
+        defer segment.deinit(.delete);
+
+        try segment.items.appendSlice(std.testing.allocator, &.{
+            .{ .hash = 1, .id = 11 },
+            .{ .hash = 3, .id = 10 },
+            .{ .hash = 3, .id = 12 },
+            .{ .hash = 5, .id = 10 },
+        });
+
+        var block_data: [min_block_size]u8 = undefined;
+        var reader = segment.reader();
+        _ = try encodeBlock(format, block_data[0..], &reader, 10);
+
+        var cursor = try BlockCursor.init(format, block_data[0..], 10);
+
+        try cursor.skipTo(2);
+        try testing.expectEqual(Item{ .hash = 3, .id = 10 }, cursor.peek().?);
+        try cursor.advance();
+        try testing.expectEqual(Item{ .hash = 3, .id = 12 }, cursor.peek().?);
+
+        try cursor.skipTo(4);
+        try testing.expectEqual(Item{ .hash = 5, .id = 10 }, cursor.peek().?);
+
+        try cursor.skipTo(6);
+        try testing.expectEqual(null, cursor.peek());
+    }
+}
+
+fn testBlockRoundTrip(format: BlockFormat) !void {
     var segment = MemorySegment.init(std.testing.allocator, .{});
     defer segment.deinit(.delete);
 
@@ -211,13 +588,13 @@ test "writeBlock/readBlock/readFirstItemFromBlock" {
     var block_data: [block_size]u8 = undefined;
 
     var reader = segment.reader();
-    const num_items = try encodeBlock(block_data[0..], &reader, 0);
+    const num_items = try encodeBlock(format, block_data[0..], &reader, 0);
     try testing.expectEqual(segment.items.items.len, num_items);
 
     var items = std.ArrayList(Item).init(std.testing.allocator);
     defer items.deinit();
 
-    try readBlock(block_data[0..], &items, 0);
+    try readBlock(format, block_data[0..], &items, 0);
     try testing.expectEqualSlices(
         Item,
         &[_]Item{
@@ -230,20 +607,165 @@ test "writeBlock/readBlock/readFirstItemFromBlock" {
         items.items,
     );
 
-    const header = try decodeBlockHeader(block_data[0..], 0);
+    const header = try decodeBlockHeader(format, block_data[0..], 0);
     try testing.expectEqual(items.items.len, header.num_items);
     try testing.expectEqual(items.items[0], header.first_item);
 }
 
+test "writeBlock/readBlock/readFirstItemFromBlock v1" {
+    try testBlockRoundTrip(.v1);
+}
+
+test "writeBlock/readBlock/readFirstItemFromBlock v2" {
+    try testBlockRoundTrip(.v2);
+}
+
+test "encodeBlockV2 splits items into blocks" {
+    var segment = MemorySegment.init(std.testing.allocator, .{});
+    defer segment.deinit(.delete);
+
+    var prng = std.Random.DefaultPrng.init(0);
+    const rand = prng.random();
+
+    const num_items = 10000;
+    try segment.items.ensureTotalCapacity(std.testing.allocator, num_items);
+    for (0..num_items) |_| {
+        segment.items.appendAssumeCapacity(.{ .hash = rand.int(u32), .id = rand.intRangeAtMost(u32, 1, 100000) });
+    }
+    std.sort.pdq(Item, segment.items.items, {}, Item.cmp);
+
+    var reader = segment.reader();
+
+    var items = std.ArrayList(Item).init(std.testing.allocator);
+    defer items.deinit();
+
+    var block_data: [min_block_size]u8 = undefined;
+    while (true) {
+        const n = try encodeBlockV2(block_data[0..], &reader);
+        if (n == 0) {
+            break;
+        }
+        const header = try decodeBlockHeaderV2(block_data[0..]);
+        try testing.expectEqual(n, header.num_items);
+        try testing.expectEqual(segment.items.items[items.items.len], header.first_item);
+        try readBlockV2(block_data[0..], &items);
+    }
+
+    try testing.expectEqualSlices(Item, segment.items.items, items.items);
+}
+
+test "decodeBlockHeaderV2 rejects corrupted headers" {
+    var block_data: [min_block_size]u8 = undefined;
+    @memset(&block_data, 0);
+    std.mem.writeInt(u16, block_data[0..2], 10, .little);
+
+    block_data[2] = 33;
+    try testing.expectError(error.InvalidSegment, decodeBlockHeaderV2(&block_data));
+
+    block_data[2] = 0;
+    block_data[3] = 200;
+    try testing.expectError(error.InvalidSegment, decodeBlockHeaderV2(&block_data));
+
+    // packed data longer than the block
+    block_data[2] = 32;
+    block_data[3] = 32;
+    std.mem.writeInt(u16, block_data[0..2], min_block_size / 8, .little);
+    try testing.expectError(error.InvalidSegment, decodeBlockHeaderV2(&block_data));
+
+    // more items than fit into decode buffers
+    block_data[2] = 0;
+    block_data[3] = 0;
+    std.mem.writeInt(u16, block_data[0..2], max_items_per_block_v2 + 1, .little);
+    try testing.expectError(error.InvalidSegment, decodeBlockHeaderV2(&block_data));
+
+    std.mem.writeInt(u16, block_data[0..2], 10, .little);
+    const header = try decodeBlockHeaderV2(&block_data);
+    try testing.expectEqual(10, header.num_items);
+}
+
+// Segment file versions:
+//   v1 - varint blocks, docs as a msgpack map
+//   v2 - bit-packed blocks, docs as a msgpack map
+//   v3 - bit-packed blocks, docs as a table that can be used directly from the mmaped file
+//   v4 - same as v3, with a table of frequent hashes after the blocks
+pub const SegmentFileVersion = enum {
+    v1,
+    v2,
+    v3,
+    v4,
+
+    pub fn blockFormat(self: SegmentFileVersion) BlockFormat {
+        return switch (self) {
+            .v1 => .v1,
+            .v2, .v3, .v4 => .v2,
+        };
+    }
+
+    pub fn hasDocTable(self: SegmentFileVersion) bool {
+        return self == .v3 or self == .v4;
+    }
+
+    pub fn hasHashStats(self: SegmentFileVersion) bool {
+        return self == .v4;
+    }
+};
+
+pub const default_segment_file_version: SegmentFileVersion = .v4;
+
 const segment_file_header_magic_v1: u32 = 0x53474D31; // "SGM1" in big endian
 const segment_file_footer_magic_v1: u32 = @byteSwap(segment_file_header_magic_v1);
 
+const segment_file_header_magic_v2: u32 = 0x53474D32; // "SGM2" in big endian
+const segment_file_footer_magic_v2: u32 = @byteSwap(segment_file_header_magic_v2);
+
+const segment_file_header_magic_v3: u32 = 0x53474D33; // "SGM3" in big endian
+const segment_file_footer_magic_v3: u32 = @byteSwap(segment_file_header_magic_v3);
+
+const segment_file_header_magic_v4: u32 = 0x53474D34; // "SGM4" in big endian
+const segment_file_footer_magic_v4: u32 = @byteSwap(segment_file_header_magic_v4);
+
+fn segmentFileHeaderMagic(version: SegmentFileVersion) u32 {
+    return switch (version) {
+        .v1 => segment_file_header_magic_v1,
+        .v2 => segment_file_header_magic_v2,
+        .v3 => segment_file_header_magic_v3,
+        .v4 => segment_file_header_magic_v4,
+    };
+}
+
+fn segmentFileFooterMagic(version: SegmentFileVersion) u32 {
+    return switch (version) {
+        .v1 => segment_file_footer_magic_v1,
+        .v2 => segment_file_footer_magic_v2,
+        .v3 => segment_file_footer_magic_v3,
+        .v4 => segment_file_footer_magic_v4,
+    };
+}
+
+fn segmentFileVersionFromHeaderMagic(magic: u32) ?SegmentFileVersion {
+    return switch (magic) {
+        segment_file_header_magic_v1 => .v1,
+        segment_file_header_magic_v2 => .v2,
+        segment_file_header_magic_v3 => .v3,
+        segment_file_header_magic_v4 => .v4,
+        else => null,
+    };
+}
+
+// The doc table is aligned, so that we can read doc ids directly from the mmaped file.
+const doc_table_alignment = @alignOf(u32);
+
 pub const SegmentFileHeader = struct {
     magic: u32,
     info: SegmentInfo,
     has_attributes: bool,
     has_docs: bool,
     block_size: u32,
+    has_doc_table: bool = false,
+    num_docs: u32 = 0,
+    min_doc_id: u32 = 0,
+    max_doc_id: u32 = 0,
+    has_hash_stats: bool = false,
 
     pub fn msgpackFormat() msgpack.StructFormat {
         return .{
@@ -262,6 +784,11 @@ pub const SegmentFileHeader = struct {
             .has_attributes => 0x02,
             .has_docs => 0x03,
             .block_size => 0x04,
+            .has_doc_table => 0x05,
+            .num_docs => 0x06,
+            .min_doc_id => 0x07,
+            .max_doc_id => 0x08,
+            .has_hash_stats => 0x09,
         };
     }
 };
@@ -301,7 +828,78 @@ pub fn deleteSegmentFile(dir: std.fs.Dir, info: SegmentInfo) !void {
     try dir.deleteFile(file_name);
 }
 
-pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
+pub const WriteSegmentFileOptions = struct {
+    version: SegmentFileVersion = default_segment_file_version,
+    // Throttle writes, used for background checkpoints and merges.
+    rate_limiter: ?*RateLimiter = null,
+    // Periodically flush written data to disk and drop it from the page cache,
+    // so that writing a big segment doesn't evict pages used by searches.
+    drop_cache: bool = false,
+};
+
+const drop_cache_interval = 8 * 1024 * 1024;
+
+const SegmentFileWriter = struct {
+    file: fs.File,
+    options: WriteSegmentFileOptions,
+    bytes_written: u64 = 0,
+    bytes_synced: u64 = 0,
+
+    pub const Error = fs.File.WriteError || std.posix.SyncError;
+    pub const Writer = io.Writer(*SegmentFileWriter, Error, write);
+
+    fn write(self: *SegmentFileWriter, bytes: []const u8) Error!usize {
+        if (self.options.rate_limiter) |limiter| {
+            limiter.acquire(bytes.len);
+        }
+        const n = try self.file.write(bytes);
+        self.bytes_written += n;
+        if (self.options.drop_cache and self.bytes_written - self.bytes_synced >= drop_cache_interval) {
+            try self.dropCache();
+        }
+        return n;
+    }
+
+    fn dropCache(self: *SegmentFileWriter) !void {
+        // only clean pages can be dropped
+        try std.posix.fdatasync(self.file.handle);
+        if (builtin.os.tag == .linux) {
+            _ = std.os.linux.fadvise(self.file.handle, 0, @intCast(self.bytes_written), std.os.linux.POSIX_FADV.DONTNEED);
+        }
+        self.bytes_synced = self.bytes_written;
+    }
+
+    fn writer(self: *SegmentFileWriter) Writer {
+        return .{ .context = self };
+    }
+};
+
+// Passes items to the block encoder and counts each of them once in the hash stats.
+// The encoder can read an item that doesn't fit in the current block, it's then
+// read again for the next block, but only counted after the first read.
+fn HashCountingReader(comptime Reader: type) type {
+    return struct {
+        reader: Reader,
+        stats: *HashStats.Builder,
+        counted: bool = false,
+
+        pub fn read(self: *@This()) !?Item {
+            const item = try self.reader.read() orelse return null;
+            if (!self.counted) {
+                try self.stats.add(item.hash);
+                self.counted = true;
+            }
+            return item;
+        }
+
+        pub fn advance(self: *@This()) void {
+            self.reader.advance();
+            self.counted = false;
+        }
+    };
+}
+
+pub fn writeSegmentFile(allocator: std.mem.Allocator, dir: std.fs.Dir, reader: anytype, options: WriteSegmentFileOptions) !void {
     const segment = reader.segment;
 
     var file_name_buf: [max_file_name_size]u8 = undefined;
@@ -313,24 +911,43 @@ pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
     defer file.deinit();
 
     const block_size = default_block_size;
+    const version = options.version;
+    const block_format = version.blockFormat();
 
-    var buffered_writer = std.io.bufferedWriter(file.file.writer());
+    var file_writer = SegmentFileWriter{ .file = file.file, .options = options };
+    var buffered_writer = std.io.bufferedWriter(file_writer.writer());
     var counting_writer = std.io.countingWriter(buffered_writer.writer());
     const writer = counting_writer.writer();
 
     const packer = msgpack.packer(writer);
 
     const header = SegmentFileHeader{
-        .magic = segment_file_header_magic_v1,
+        .magic = segmentFileHeaderMagic(version),
         .block_size = block_size,
         .info = segment.info,
         .has_attributes = true,
-        .has_docs = true,
+        .has_docs = !version.hasDocTable(),
+        .has_doc_table = version.hasDocTable(),
+        .num_docs = segment.docs.count(),
+        .min_doc_id = segment.min_doc_id,
+        .max_doc_id = segment.max_doc_id,
+        .has_hash_stats = version.hasHashStats(),
     };
     try packer.write(SegmentFileHeader, header);
 
     try packer.writeMap(segment.attributes);
-    try packer.writeMap(segment.docs);
+
+    if (header.has_docs) {
+        try packer.writeMap(segment.docs);
+    }
+
+    if (header.has_doc_table) {
+        const misalignment = counting_writer.bytes_written % doc_table_alignment;
+        if (misalignment > 0) {
+            try writer.writeByteNTimes(0, doc_table_alignment - misalignment);
+        }
+        try DocTable.encode(allocator, segment.docs, writer);
+    }
 
     try buffered_writer.flush();
 
@@ -341,9 +958,14 @@ pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
     var num_blocks: u32 = 0;
     var crc = std.hash.crc.Crc64Xz.init();
 
+    var hash_stats = HashStats.Builder.init(allocator);
+    defer hash_stats.deinit();
+
+    var counting_reader = HashCountingReader(@TypeOf(reader)){ .reader = reader, .stats = &hash_stats };
+
     var block_data: [block_size]u8 = undefined;
     while (true) {
-        const n = try encodeBlock(block_data[0..], reader, segment.min_doc_id);
+        const n = try encodeBlock(block_format, block_data[0..], &counting_reader, segment.min_doc_id);
         try writer.writeAll(block_data[0..]);
         if (n == 0) {
             break;
@@ -353,8 +975,13 @@ pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
         crc.update(block_data[0..]);
     }
 
+    if (header.has_hash_stats) {
+        try writer.writeInt(u32, try hash_stats.finish(), .little);
+        try hash_stats.encode(writer);
+    }
+
     const footer = SegmentFileFooter{
-        .magic = segment_file_footer_magic_v1,
+        .magic = segmentFileFooterMagic(version),
         .num_items = num_items,
         .num_blocks = num_blocks,
         .checksum = crc.final(),
@@ -367,15 +994,28 @@ pub fn writeSegmentFile(dir: std.fs.Dir, reader: anytype) !void {
 
     try file.finish();
 
-    log.info("wrote segment file {s} (blocks = {}, items = {}, checksum = {})", .{
+    log.info("wrote segment file {s} (version = {s}, blocks = {}, items = {}, checksum = {})", .{
         file_name,
+        @tagName(version),
         footer.num_blocks,
         footer.num_items,
         footer.checksum,
     });
 }
 
-pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !void {
+pub const ReadSegmentFileOptions = struct {
+    // Compute the checksum of all blocks while loading. If disabled, the checksum from
+    // the footer is only stored in the segment and can be verified later, and the file
+    // is not pre-faulted into memory. With release_blocks, the mapping is never pre-faulted,
+    // the checksum is computed while the block headers are read with pread.
+    verify_checksum: bool = true,
+    // Ask for transparent huge pages for the mapping, see mapped_memory.adviseHugePages.
+    huge_pages: bool = false,
+    // Blocks are read explicitly, not from the mapping, so drop them from it after loading.
+    release_blocks: bool = false,
+};
+
+pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment, options: ReadSegmentFileOptions) !void {
     var file_name_buf: [max_file_name_size]u8 = undefined;
     const file_name = buildSegmentFileName(&file_name_buf, info);
 
@@ -386,11 +1026,14 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
 
     const file_size = try file.getEndPos();
 
+    // with release_blocks, the blocks are read with pread below
+    const verify_mapped_blocks = options.verify_checksum and !options.release_blocks;
+
     var raw_data = try std.posix.mmap(
         null,
         file_size,
         std.posix.PROT.READ,
-        .{ .TYPE = .PRIVATE, .POPULATE = true },
+        .{ .TYPE = .PRIVATE, .POPULATE = verify_mapped_blocks },
         file.handle,
         0,
     );
@@ -399,9 +1042,13 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
     try std.posix.madvise(
         raw_data.ptr,
         raw_data.len,
-        std.posix.MADV.RANDOM | std.posix.MADV.WILLNEED,
+        if (verify_mapped_blocks) std.posix.MADV.RANDOM | std.posix.MADV.WILLNEED else std.posix.MADV.RANDOM,
     );
 
+    if (options.huge_pages) {
+        mapped_memory.adviseHugePages(raw_data);
+    }
+
     var fixed_buffer_stream = std.io.fixedBufferStream(raw_data[0..]);
     const reader = fixed_buffer_stream.reader();
 
@@ -409,15 +1056,17 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
 
     const header = try unpacker.read(SegmentFileHeader);
 
-    if (header.magic != segment_file_header_magic_v1) {
+    const version = segmentFileVersionFromHeaderMagic(header.magic) orelse {
         return error.InvalidSegment;
-    }
+    };
+    const block_format = version.blockFormat();
     if (header.block_size < min_block_size or header.block_size > max_block_size) {
         return error.InvalidSegment;
     }
 
     segment.info = header.info;
     segment.block_size = header.block_size;
+    segment.block_format = block_format;
 
     if (header.has_attributes) {
         // FIXME nicer api in msgpack.zig
@@ -434,19 +1083,26 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
         defer docs.deinit();
         try unpacker.readMapInto(&docs);
         segment.docs.deinit(segment.allocator);
-        segment.docs = docs.unmanaged.move();
-
-        var iter = segment.docs.keyIterator();
-        segment.min_doc_id = 0;
-        segment.max_doc_id = 0;
-        while (iter.next()) |key_ptr| {
-            if (segment.min_doc_id == 0 or key_ptr.* < segment.min_doc_id) {
-                segment.min_doc_id = key_ptr.*;
-            }
-            if (segment.max_doc_id == 0 or key_ptr.* > segment.max_doc_id) {
-                segment.max_doc_id = key_ptr.*;
-            }
+        segment.docs = try DocTable.fromHashMap(segment.allocator, docs.unmanaged);
+        segment.min_doc_id = segment.docs.getMinDocId();
+        segment.max_doc_id = segment.docs.getMaxDocId();
+    }
+
+    if (header.has_doc_table) {
+        const misalignment = fixed_buffer_stream.pos % doc_table_alignment;
+        if (misalignment > 0) {
+            try fixed_buffer_stream.seekBy(@intCast(doc_table_alignment - misalignment));
+        }
+        const doc_table_size = DocTable.encodedSize(header.num_docs);
+        const doc_table_start = fixed_buffer_stream.pos;
+        if (doc_table_start + doc_table_size > raw_data.len) {
+            return error.InvalidSegment;
         }
+        segment.docs.deinit(segment.allocator);
+        segment.docs = try DocTable.fromBytes(raw_data[doc_table_start .. doc_table_start + doc_table_size], header.num_docs);
+        segment.min_doc_id = header.min_doc_id;
+        segment.max_doc_id = header.max_doc_id;
+        try fixed_buffer_stream.seekBy(@intCast(doc_table_size));
     }
 
     const block_size = header.block_size;
@@ -462,26 +1118,65 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
     var num_blocks: u32 = 0;
     var crc = std.hash.crc.Crc64Xz.init();
 
+    // In pread mode, the blocks are not pre-faulted, so reading the headers from the mapping
+    // would fault in one page at a time. They are read in sequential chunks instead.
+    var chunk: []u8 = &.{};
+    defer segment.allocator.free(chunk);
+    if (options.release_blocks) {
+        chunk = try segment.allocator.alloc(u8, FileSegment.read_ahead_blocks * block_size);
+    }
+    var chunk_start: usize = 0;
+    var chunk_end: usize = 0;
+
     var ptr = blocks_data_start;
     while (ptr + block_size <= raw_data.len) {
-        const block_data = raw_data[ptr .. ptr + block_size];
+        var block_data: []const u8 = undefined;
+        if (options.release_blocks) {
+            if (ptr + block_size > chunk_end) {
+                const len = @min(chunk.len, (raw_data.len - ptr) / block_size * block_size);
+                if (try file.preadAll(chunk[0..len], ptr) < len) {
+                    return error.InvalidSegment;
+                }
+                chunk_start = ptr;
+                chunk_end = ptr + len;
+            }
+            block_data = chunk[ptr - chunk_start ..][0..block_size];
+        } else {
+            block_data = raw_data[ptr .. ptr + block_size];
+        }
         ptr += block_size;
-        const block_header = try decodeBlockHeader(block_data, segment.min_doc_id);
+        const block_header = try decodeBlockHeader(block_format, block_data, segment.min_doc_id);
         if (block_header.num_items == 0) {
             break;
         }
         segment.index.appendAssumeCapacity(block_header.first_item.hash);
         num_items += block_header.num_items;
         num_blocks += 1;
-        crc.update(block_data);
+        if (options.verify_checksum) {
+            crc.update(block_data);
+        }
     }
     const blocks_data_end = ptr;
     segment.blocks = raw_data[blocks_data_start..blocks_data_end];
+    segment.blocks_offset = blocks_data_start;
+
+    try segment.index.build(segment.allocator);
 
     try fixed_buffer_stream.seekBy(@intCast(segment.blocks.len));
 
+    if (header.has_hash_stats) {
+        const num_hashes = try reader.readInt(u32, .little);
+        const hash_stats_size = HashStats.encodedSize(num_hashes);
+        const hash_stats_start = fixed_buffer_stream.pos;
+        if (hash_stats_start + hash_stats_size > raw_data.len) {
+            return error.InvalidSegment;
+        }
+        segment.hash_stats = try HashStats.fromBytes(raw_data[hash_stats_start .. hash_stats_start + hash_stats_size], num_hashes);
+        try fixed_buffer_stream.seekBy(@intCast(hash_stats_size));
+    }
+
     const footer = try unpacker.read(SegmentFileFooter);
-    if (footer.magic != segment_file_footer_magic_v1) {
+    if (footer.magic != segmentFileFooterMagic(version)) {
         return error.InvalidSegment;
     }
     if (footer.num_items != num_items) {
@@ -492,14 +1187,22 @@ pub fn readSegmentFile(dir: fs.Dir, info: SegmentInfo, segment: *FileSegment) !v
     if (footer.num_blocks != num_blocks) {
         return error.InvalidSegment;
     }
-    if (footer.checksum != crc.final()) {
-        return error.InvalidSegment;
+    if (options.verify_checksum) {
+        if (footer.checksum != crc.final()) {
+            return error.InvalidSegment;
+        }
+    }
+    segment.checksum = footer.checksum;
+    segment.verified.store(options.verify_checksum, .release);
+
+    if (options.release_blocks) {
+        mapped_memory.release(segment.blocks);
     }
 
     segment.mmaped_file = file;
 }
 
-test "writeFile/readFile" {
+fn testWriteReadFile(version: SegmentFileVersion) !void {
     var tmp = testing.tmpDir(.{});
     defer tmp.cleanup();
 
@@ -518,24 +1221,29 @@ test "writeFile/readFile" {
         var reader = in_memory_segment.reader();
         defer reader.close();
 
-        try writeSegmentFile(tmp.dir, &reader);
+        try writeSegmentFile(testing.allocator, tmp.dir, &reader, .{ .version = version });
     }
 
     {
         var segment = FileSegment.init(testing.allocator, .{ .dir = tmp.dir });
         defer segment.deinit(.delete);
 
-        try readSegmentFile(tmp.dir, info, &segment);
+        try readSegmentFile(tmp.dir, info, &segment, .{});
 
+        try testing.expectEqual(version.blockFormat(), segment.block_format);
         try testing.expectEqualDeep(info, segment.info);
         try testing.expectEqual(1, segment.docs.count());
-        try testing.expectEqual(1, segment.index.items.len);
-        try testing.expectEqual(1, segment.index.items[0]);
+        try testing.expectEqual(true, segment.docs.get(1));
+        try testing.expectEqual(1, segment.min_doc_id);
+        try testing.expectEqual(1, segment.max_doc_id);
+        try testing.expectEqual(1, segment.index.count());
+        try testing.expectEqual(1, segment.index.get(0));
+        try testing.expectEqual(0, segment.hash_stats.count());
 
         var items = std.ArrayList(Item).init(testing.allocator);
         defer items.deinit();
 
-        try readBlock(segment.getBlockData(0), &items, segment.min_doc_id);
+        try readBlock(segment.block_format, segment.getBlockData(0), &items, segment.min_doc_id);
         try std.testing.expectEqualSlices(Item, &[_]Item{
             Item{ .hash = 1, .id = 1 },
             Item{ .hash = 2, .id = 1 },
@@ -543,6 +1251,22 @@ test "writeFile/readFile" {
     }
 }
 
+test "writeFile/readFile v1" {
+    try testWriteReadFile(.v1);
+}
+
+test "writeFile/readFile v2" {
+    try testWriteReadFile(.v2);
+}
+
+test "writeFile/readFile v3" {
+    try testWriteReadFile(.v3);
+}
+
+test "writeFile/readFile v4" {
+    try testWriteReadFile(.v4);
+}
+
 const manifest_header_magic_v1: u32 = 0x49445831; // "IDX1" in big endian
 
 const ManifestFileHeader = struct {
@@ -22,7 +22,7 @@ test "index does not exist" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
 
-    var scheduler = Scheduler.init(std.testing.allocator);
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
     defer scheduler.deinit();
 
     var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
@@ -36,7 +36,7 @@ test "index create, update and search" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
 
-    var scheduler = Scheduler.init(std.testing.allocator);
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
     defer scheduler.deinit();
 
     var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
@@ -74,7 +74,7 @@ test "index create, update, reopen and search" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
 
-    var scheduler = Scheduler.init(std.testing.allocator);
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
     defer scheduler.deinit();
 
     try scheduler.start(2);
@@ -113,7 +113,7 @@ test "index many updates" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
 
-    var scheduler = Scheduler.init(std.testing.allocator);
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
     defer scheduler.deinit();
 
     try scheduler.start(2);
@@ -163,7 +163,7 @@ test "index, multiple fingerprints with the same hashes" {
     var tmp_dir = std.testing.tmpDir(.{});
     defer tmp_dir.cleanup();
 
-    var scheduler = Scheduler.init(std.testing.allocator);
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
     defer scheduler.deinit();
 
     var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
@@ -199,3 +199,541 @@ test "index, multiple fingerprints with the same hashes" {
         },
     }, collector.getResults());
 }
+
+test "index parallel search" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    var search_pool: std.Thread.Pool = undefined;
+    try search_pool.init(.{ .allocator = std.testing.allocator, .n_jobs = 2 });
+    defer search_pool.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{
+        .search_pool = &search_pool,
+        .max_search_parallelism = 3,
+    });
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    for (0..10) |i| {
+        try index.update(&[_]Change{.{ .insert = .{
+            .id = @as(u32, @intCast(i)) + 1,
+            .hashes = generateRandomHashes(&hashes, i),
+        } }});
+    }
+
+    var collector = SearchResults.init(std.testing.allocator, .{});
+    defer collector.deinit();
+
+    try index.search(generateRandomHashes(&hashes, 5), &collector, .{});
+
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 6, .score = hashes.len }}, collector.getResults());
+}
+
+test "index doc versions" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    for ([_]bool{ true, false }) |doc_version_table| {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, if (doc_version_table) "idx1" else "idx2", .{
+            .doc_version_table = doc_version_table,
+        });
+        defer index.deinit();
+
+        try index.open(true);
+
+        var hashes: [100]u32 = undefined;
+
+        try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 1) } }});
+        try index.update(&[_]Change{.{ .insert = .{ .id = 2, .hashes = generateRandomHashes(&hashes, 2) } }});
+        try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 3) } }});
+        try index.update(&[_]Change{.{ .delete = .{ .id = 2 } }});
+
+        var reader = try index.acquireReader();
+        defer index.releaseReader(&reader);
+
+        try std.testing.expectEqual(common.DocInfo{ .version = 3, .deleted = false }, (try reader.getDocInfo(1)).?);
+        try std.testing.expectEqual(null, try reader.getDocInfo(2));
+
+        try std.testing.expect(reader.hasNewerVersion(1, 1));
+        try std.testing.expect(!reader.hasNewerVersion(1, 3));
+        try std.testing.expect(reader.hasNewerVersion(2, 2));
+
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, 1), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{}, collector.getResults());
+    }
+}
+
+test "index replay oplog" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var hashes: [100]u32 = undefined;
+    var hashes2: [100]u32 = undefined;
+
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+        defer index.deinit();
+
+        try index.open(true);
+
+        try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 1) } }});
+        try index.update(&[_]Change{
+            .{ .insert = .{ .id = 2, .hashes = generateRandomHashes(&hashes, 2) } },
+            .{ .delete = .{ .id = 1 } },
+        });
+        try index.update(&[_]Change{
+            .{ .insert = .{ .id = 3, .hashes = generateRandomHashes(&hashes, 3) } },
+            .{ .insert = .{ .id = 3, .hashes = generateRandomHashes(&hashes2, 4) } },
+        });
+    }
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(false);
+    try index.waitForReady(10000);
+
+    var reader = try index.acquireReader();
+    defer index.releaseReader(&reader);
+
+    try std.testing.expectEqual(null, try reader.getDocInfo(1));
+    try std.testing.expectEqual(common.DocInfo{ .version = 3, .deleted = false }, (try reader.getDocInfo(3)).?);
+
+    for ([_]u64{ 1, 3 }) |seed| {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, seed), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{}, collector.getResults());
+    }
+
+    {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, 4), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 3, .score = hashes.len }}, collector.getResults());
+    }
+
+    // new commits continue after the replayed ones
+    try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 5) } }});
+    var reader2 = try index.acquireReader();
+    defer index.releaseReader(&reader2);
+    try std.testing.expectEqual(common.DocInfo{ .version = 4, .deleted = false }, (try reader2.getDocInfo(1)).?);
+}
+
+test "index multi search" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    for (0..3) |i| {
+        try index.update(&[_]Change{.{ .insert = .{
+            .id = @as(u32, @intCast(i)) + 1,
+            .hashes = generateRandomHashes(&hashes, i),
+        } }});
+    }
+
+    var query_hashes: [3][100]u32 = undefined;
+    var queries = [_]Index.MultiSearchQuery{
+        .{ .hashes = generateRandomHashes(&query_hashes[0], 2), .options = .{} },
+        .{ .hashes = generateRandomHashes(&query_hashes[1], 999), .options = .{} },
+        .{ .hashes = generateRandomHashes(&query_hashes[2], 0), .options = .{} },
+    };
+
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    try index.multiSearch(arena.allocator(), &queries);
+
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 3, .score = hashes.len }}, queries[0].results);
+    try std.testing.expectEqualSlices(SearchResult, &.{}, queries[1].results);
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = hashes.len }}, queries[2].results);
+    for (queries) |query| {
+        try std.testing.expect(!query.timed_out);
+    }
+}
+
+test "index result cache" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{
+        .result_cache_size = 1024 * 1024,
+    });
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 1) } }});
+
+    for (0..2) |_| {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, 1), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = hashes.len }}, collector.getResults());
+    }
+    try std.testing.expectEqual(1, index.result_cache.?.count());
+
+    // unrelated update, the cached results are still valid
+    try index.update(&[_]Change{.{ .insert = .{ .id = 2, .hashes = generateRandomHashes(&hashes, 2) } }});
+
+    {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, 1), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = hashes.len }}, collector.getResults());
+    }
+
+    // the found doc was changed
+    try index.update(&[_]Change{.{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 3) } }});
+
+    {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, 1), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{}, collector.getResults());
+    }
+
+    // a new doc matches the query
+    try index.update(&[_]Change{.{ .insert = .{ .id = 4, .hashes = generateRandomHashes(&hashes, 1) } }});
+
+    {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, 1), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 4, .score = hashes.len }}, collector.getResults());
+    }
+}
+
+test "index result cache with pruned hashes" {
+    const ResultCache = @import("ResultCache.zig");
+
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    // hash 1000 is in all docs, only file segments have hash stats
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+        defer index.deinit();
+
+        try index.open(true);
+
+        try index.update(&[_]Change{
+            .{ .insert = .{ .id = 1, .hashes = &.{ 1000, 1, 2, 3 } } },
+            .{ .insert = .{ .id = 2, .hashes = &.{ 1000, 4, 5, 6 } } },
+            .{ .insert = .{ .id = 3, .hashes = &.{ 1000, 7, 8, 9 } } },
+        });
+
+        try index.shutdown();
+    }
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{
+        .result_cache_size = 1024 * 1024,
+    });
+    defer index.deinit();
+
+    try index.open(false);
+    try index.waitForReady(10000);
+
+    const options = common.SearchOptions{ .max_hash_frequency = 2 };
+
+    for (0..2) |_| {
+        var collector = SearchResults.init(std.testing.allocator, options);
+        defer collector.deinit();
+
+        var query = [_]u32{ 3, 1000, 2, 1 };
+        try index.search(&query, &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = 3 }}, collector.getResults());
+    }
+    try std.testing.expectEqual(1, index.result_cache.?.count());
+
+    // cached under the original sorted query, not the pruned one
+    var collector = SearchResults.init(std.testing.allocator, options);
+    defer collector.deinit();
+
+    var reader = try index.acquireReader();
+    defer index.releaseReader(&reader);
+
+    const key: ResultCache.Key = .{ .hashes = &.{ 1, 2, 3, 1000 }, .options = options };
+    try std.testing.expectEqual(.hit, try index.result_cache.?.get(key, reader.getVersion(), &collector));
+}
+
+test "index memtable" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    // room for 10 docs with 100 hashes
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{
+        .memtable_size = 1000,
+        .memtable_max_age_ms = std.math.maxInt(i32),
+    });
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    for (0..25) |i| {
+        try index.update(&[_]Change{.{ .insert = .{
+            .id = @as(u32, @intCast(i)) + 1,
+            .hashes = generateRandomHashes(&hashes, i),
+        } }});
+
+        // read your writes
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, i), &collector, .{});
+
+        try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = @as(u32, @intCast(i)) + 1, .score = hashes.len }}, collector.getResults());
+    }
+
+    {
+        var reader = try index.acquireReader();
+        defer index.releaseReader(&reader);
+
+        // two frozen memtables and the current one
+        try std.testing.expectEqual(2, reader.memory_segments.value.count());
+        try std.testing.expectEqual(3, reader.getNumSegments());
+        try std.testing.expectEqual(25, reader.getNumDocs());
+        try std.testing.expectEqual(25, reader.getVersion());
+    }
+
+    // attributes don't go to the memtable, it's frozen before the new segment is added
+    try index.update(&[_]Change{
+        .{ .insert = .{ .id = 1, .hashes = generateRandomHashes(&hashes, 100) } },
+        .{ .set_attribute = .{ .name = "foo", .value = 1 } },
+    });
+
+    {
+        var reader = try index.acquireReader();
+        defer index.releaseReader(&reader);
+
+        try std.testing.expectEqual(4, reader.memory_segments.value.count());
+        try std.testing.expectEqual(4, reader.getNumSegments());
+        try std.testing.expectEqual(26, reader.getVersion());
+        try std.testing.expectEqual(common.DocInfo{ .version = 26, .deleted = false }, (try reader.getDocInfo(1)).?);
+    }
+
+    for ([_]u64{ 0, 100 }) |seed| {
+        var collector = SearchResults.init(std.testing.allocator, .{});
+        defer collector.deinit();
+
+        try index.search(generateRandomHashes(&hashes, seed), &collector, .{});
+
+        const expected: []const SearchResult = if (seed == 0) &.{} else &.{.{ .id = 1, .score = hashes.len }};
+        try std.testing.expectEqualSlices(SearchResult, expected, collector.getResults());
+    }
+}
+
+test "index snapshot" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var hashes: [100]u32 = undefined;
+
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+        defer index.deinit();
+
+        try index.open(true);
+
+        try index.update(&[_]Change{.{ .insert = .{
+            .id = 1,
+            .hashes = generateRandomHashes(&hashes, 1),
+        } }});
+
+        // moves everything to file segments
+        try index.shutdown();
+    }
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+    defer index.deinit();
+
+    try index.open(false);
+    try index.waitForReady(10000);
+
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+
+    const snapshot = try index.createSnapshot(arena.allocator());
+    try std.testing.expectEqual(1, snapshot.last_commit_id);
+    try std.testing.expectEqual(1, snapshot.files.len);
+    try std.testing.expect(index.hasPinnedSnapshots());
+
+    {
+        var segment = try index.acquireSnapshotSegment(snapshot.id, snapshot.files[0].name);
+        defer index.releaseSnapshotSegment(&segment);
+
+        try std.testing.expectEqual(snapshot.files[0].size, segment.value.getFileData().?.len);
+    }
+
+    try std.testing.expectError(error.SegmentNotFound, index.acquireSnapshotSegment(snapshot.id, "manifest"));
+
+    try index.releaseSnapshot(snapshot.id);
+    try std.testing.expect(!index.hasPinnedSnapshots());
+    try std.testing.expectError(error.SnapshotNotFound, index.acquireSnapshotSegment(snapshot.id, snapshot.files[0].name));
+}
+
+test "index memory locked segments" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    try scheduler.start(2);
+
+    var hashes: [100]u32 = undefined;
+
+    {
+        var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{});
+        defer index.deinit();
+
+        try index.open(true);
+
+        try index.update(&[_]Change{.{ .insert = .{
+            .id = 1,
+            .hashes = generateRandomHashes(&hashes, 1),
+        } }});
+
+        try index.shutdown();
+    }
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{
+        .mlock_newest_segments = 1,
+    });
+    defer index.deinit();
+
+    try index.open(false);
+    try index.waitForReady(10000);
+
+    {
+        var reader = try index.acquireReader();
+        defer index.releaseReader(&reader);
+
+        const nodes = reader.file_segments.value.nodes.items;
+        try std.testing.expectEqual(1, nodes.len);
+        const segment = nodes[0].value;
+
+        // locking fails if RLIMIT_MEMLOCK is too low, there is nothing to test then
+        const limit = try std.posix.getrlimit(.MEMLOCK);
+        if (limit.cur < segment.getFileData().?.len) {
+            return error.SkipZigTest;
+        }
+        try std.testing.expect(segment.isMemoryLocked());
+
+        index.memory_locks_lock.lock();
+        defer index.memory_locks_lock.unlock();
+        try std.testing.expect(segment.setMemoryLocked(true));
+    }
+
+    const stats = try index.getResidencyStats();
+    try std.testing.expect(stats.locked.total_size > 0);
+    try std.testing.expectEqual(0, stats.unlocked.total_size);
+    try std.testing.expectEqual(stats.locked.total_size, stats.locked.resident_size);
+}
+
+test "index memory limit" {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var scheduler = Scheduler.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    var index = try Index.init(std.testing.allocator, &scheduler, tmp_dir.dir, "idx", .{
+        .memtable_size = 0,
+        .memory_limit = .{ .soft_limit = 1, .hard_limit = 1, .max_wait_ms = 5000 },
+    });
+    defer index.deinit();
+
+    try index.open(true);
+
+    var hashes: [100]u32 = undefined;
+
+    try index.update(&[_]Change{.{ .insert = .{
+        .id = 1,
+        .hashes = generateRandomHashes(&hashes, 1),
+    } }});
+    try std.testing.expect(index.memory_limit.getUsed() > 0);
+
+    // nothing can be checkpointed without scheduler threads
+    index.memory_limit.options.max_wait_ms = 10;
+    try std.testing.expectError(error.MemoryLimitExceeded, index.update(&[_]Change{.{ .insert = .{
+        .id = 2,
+        .hashes = generateRandomHashes(&hashes, 2),
+    } }}));
+
+    // the small memory segment is checkpointed early, and the update goes through
+    try scheduler.start(2);
+    index.memory_limit.options.max_wait_ms = 5000;
+    try index.update(&[_]Change{.{ .insert = .{
+        .id = 2,
+        .hashes = generateRandomHashes(&hashes, 2),
+    } }});
+
+    var collector = SearchResults.init(std.testing.allocator, .{});
+    defer collector.deinit();
+
+    try index.search(generateRandomHashes(&hashes, 1), &collector, .{});
+
+    try std.testing.expectEqualSlices(SearchResult, &.{.{ .id = 1, .score = hashes.len }}, collector.getResults());
+}
@@ -7,6 +7,17 @@ const Scheduler = @import("utils/Scheduler.zig");
 const MultiIndex = @import("MultiIndex.zig");
 const server = @import("server.zig");
 const metrics = @import("metrics.zig");
+const BlockCache = @import("BlockCache.zig");
+const FileSegment = @import("FileSegment.zig");
+const ConcurrencyLimit = @import("utils/ConcurrencyLimit.zig");
+const RateLimiter = @import("utils/RateLimiter.zig");
+const MemoryLimit = @import("utils/MemoryLimit.zig");
+const BatchReader = @import("utils/BatchReader.zig");
+const Replica = @import("Replica.zig");
+const ShardRouter = @import("ShardRouter.zig");
+const BulkImport = @import("BulkImport.zig");
+const LegacyServer = @import("LegacyServer.zig");
+const AdmissionController = @import("utils/AdmissionController.zig");
 
 pub const std_options = .{
     .log_level = .debug,
@@ -76,18 +87,291 @@ pub fn main() !void {
     }
     log.info("using {} threads", .{threads});
 
+    const search_threads_str = args.get("search-threads") orelse "0";
+    const search_threads = try std.fmt.parseInt(u16, search_threads_str, 10);
+
+    const search_parallelism_str = args.get("search-parallelism") orelse "4";
+    const search_parallelism = try std.fmt.parseInt(u16, search_parallelism_str, 10);
+
+    const block_cache_size_str = args.get("block-cache-size") orelse "0";
+    const block_cache_size = try std.fmt.parseInt(usize, block_cache_size_str, 10);
+
+    const result_cache_size_str = args.get("result-cache-size") orelse "0";
+    const result_cache_size = try std.fmt.parseInt(usize, result_cache_size_str, 10);
+
+    const max_docs_per_hash_str = args.get("max-docs-per-hash") orelse "1000";
+    const max_docs_per_hash = try std.fmt.parseInt(u32, max_docs_per_hash_str, 10);
+
+    const max_hash_frequency_str = args.get("max-hash-frequency") orelse "0";
+    const max_hash_frequency = try std.fmt.parseInt(u32, max_hash_frequency_str, 10);
+
+    const oplog_max_batch_size_str = args.get("oplog-max-batch-size") orelse "1000";
+    const oplog_max_batch_size = try std.fmt.parseInt(usize, oplog_max_batch_size_str, 10);
+
+    const oplog_max_batch_delay_str = args.get("oplog-max-batch-delay") orelse "0";
+    const oplog_max_batch_delay = try std.fmt.parseInt(u64, oplog_max_batch_delay_str, 10);
+
+    const load_parallelism_str = args.get("load-parallelism") orelse "4";
+    const load_parallelism = try std.fmt.parseInt(u16, load_parallelism_str, 10);
+
+    const SegmentVerification = enum { load, background };
+    const segment_verification_str = args.get("segment-verification") orelse "load";
+    const segment_verification = std.meta.stringToEnum(SegmentVerification, segment_verification_str) orelse {
+        return error.InvalidSegmentVerification;
+    };
+
+    const index_merges_str = args.get("index-merges") orelse "2";
+    const index_merges = try std.fmt.parseInt(u16, index_merges_str, 10);
+
+    const max_merges_str = args.get("max-merges") orelse "0";
+    const max_merges = try std.fmt.parseInt(u16, max_merges_str, 10);
+
+    const scheduler_policy_str = args.get("scheduler-policy") orelse "strict";
+    const scheduler_policy = std.meta.stringToEnum(Scheduler.Policy, scheduler_policy_str) orelse {
+        return error.InvalidSchedulerPolicy;
+    };
+
+    const low_priority_threads_str = args.get("low-priority-threads") orelse "0";
+    const low_priority_threads = try std.fmt.parseInt(u32, low_priority_threads_str, 10);
+
+    const max_write_rate_str = args.get("max-write-rate") orelse "0";
+    const max_write_rate = try std.fmt.parseInt(u64, max_write_rate_str, 10);
+
+    const index_write_rate_str = args.get("index-write-rate") orelse "0";
+    const index_write_rate = try std.fmt.parseInt(u64, index_write_rate_str, 10);
+
+    const write_rate_search_latency_str = args.get("write-rate-search-latency") orelse "0";
+    const write_rate_search_latency = try std.fmt.parseInt(u64, write_rate_search_latency_str, 10);
+
+    // zero means the number of threads that can run searches
+    const write_rate_max_searches_str = args.get("write-rate-max-searches") orelse "0";
+    var write_rate_max_searches = try std.fmt.parseInt(usize, write_rate_max_searches_str, 10);
+    if (write_rate_max_searches == 0) {
+        write_rate_max_searches = if (search_threads > 0) search_threads else threads;
+    }
+
+    const max_idle_time_str = args.get("max-idle-time") orelse "0";
+    const max_idle_time = try std.fmt.parseInt(i64, max_idle_time_str, 10);
+
+    const max_memory_usage_str = args.get("max-memory-usage") orelse "0";
+    const max_memory_usage = try std.fmt.parseInt(usize, max_memory_usage_str, 10);
+
+    // memory used by memtables and memory segments, before they are checkpointed
+    const write_buffer_soft_limit_str = args.get("write-buffer-soft-limit") orelse "0";
+    const write_buffer_soft_limit = try std.fmt.parseInt(usize, write_buffer_soft_limit_str, 10);
+
+    const write_buffer_hard_limit_str = args.get("write-buffer-hard-limit") orelse "0";
+    const write_buffer_hard_limit = try std.fmt.parseInt(usize, write_buffer_hard_limit_str, 10);
+
+    const index_write_buffer_soft_limit_str = args.get("index-write-buffer-soft-limit") orelse "0";
+    const index_write_buffer_soft_limit = try std.fmt.parseInt(usize, index_write_buffer_soft_limit_str, 10);
+
+    const index_write_buffer_hard_limit_str = args.get("index-write-buffer-hard-limit") orelse "0";
+    const index_write_buffer_hard_limit = try std.fmt.parseInt(usize, index_write_buffer_hard_limit_str, 10);
+
+    const drop_write_cache = std.mem.eql(u8, args.get("drop-write-cache") orelse "false", "true");
+
+    const mlock_newest_segments_str = args.get("mlock-newest-segments") orelse "0";
+    const mlock_newest_segments = try std.fmt.parseInt(usize, mlock_newest_segments_str, 10);
+
+    const mlock_max_segment_size_str = args.get("mlock-max-segment-size") orelse "0";
+    const mlock_max_segment_size = try std.fmt.parseInt(usize, mlock_max_segment_size_str, 10);
+
+    const huge_pages = std.mem.eql(u8, args.get("huge-pages") orelse "false", "true");
+
+    const segment_io_str = args.get("segment-io") orelse "mmap";
+    const segment_io = std.meta.stringToEnum(FileSegment.IoMode, segment_io_str) orelse {
+        return error.InvalidSegmentIo;
+    };
+
+    const residency_sample_interval_str = args.get("residency-sample-interval") orelse "0";
+    const residency_sample_interval = try std.fmt.parseInt(u64, residency_sample_interval_str, 10);
+
+    // replica mode, comma-separated list of indexes to replicate from the primary
+    const primary_url = args.get("primary");
+    const replicate_indexes = args.get("replicate") orelse "";
+
+    const max_concurrent_searches_str = args.get("max-concurrent-searches") orelse "0";
+    const max_concurrent_searches = try std.fmt.parseInt(usize, max_concurrent_searches_str, 10);
+
+    const max_concurrent_updates_str = args.get("max-concurrent-updates") orelse "0";
+    const max_concurrent_updates = try std.fmt.parseInt(usize, max_concurrent_updates_str, 10);
+
+    const max_queued_requests_str = args.get("max-queued-requests") orelse "64";
+    const max_queued_requests = try std.fmt.parseInt(usize, max_queued_requests_str, 10);
+
+    // sharded indexes, e.g. "catalog=hash:catalog_0,http://10.0.0.2:6081/catalog_1"
+    const shards_spec = args.get("shards");
+
+    // line-based protocol of the old server, for clients that used legacy-proxy, zero disables it
+    const legacy_port_str = args.get("legacy-port") orelse "0";
+    const legacy_port = try std.fmt.parseInt(u16, legacy_port_str, 10);
+    const legacy_index = args.get("legacy-index") orelse "main";
+
+    // offline import of JSON lines into an index, the server is not started
+    const import_index = args.get("import");
+    const import_input = args.get("input");
+
+    const import_memory_str = args.get("import-memory") orelse "1024";
+    const import_memory = try std.fmt.parseInt(usize, import_memory_str, 10);
+
     try metrics.initializeMetrics(allocator, .{ .prefix = "aindex_" });
     defer metrics.deinitMetrics();
 
-    var scheduler = Scheduler.init(allocator);
+    // file segment merges use low priority, memory segment merges and checkpoints are more urgent
+    var scheduler = Scheduler.init(allocator, .{
+        .policy = scheduler_policy,
+        .max_threads = .{ 0, 0, low_priority_threads },
+    });
     defer scheduler.deinit();
 
-    var indexes = MultiIndex.init(allocator, &scheduler, dir);
+    // sharded searches fan out to the shards on the search pool, so it's always started for them
+    const search_pool_threads = if (search_threads > 0) search_threads else if (shards_spec != null) threads else 0;
+
+    var search_pool: std.Thread.Pool = undefined;
+    if (search_pool_threads > 0) {
+        try search_pool.init(.{ .allocator = allocator, .n_jobs = search_pool_threads });
+        log.info("using {} search threads", .{search_pool_threads});
+    }
+    defer if (search_pool_threads > 0) search_pool.deinit();
+
+    var block_cache: BlockCache = undefined;
+    if (block_cache_size > 0) {
+        block_cache = try BlockCache.init(allocator, .{ .max_size = block_cache_size * 1024 * 1024 });
+        log.info("using {} MiB block cache", .{block_cache_size});
+    }
+    defer if (block_cache_size > 0) block_cache.deinit();
+
+    var batch_reader = BatchReader.init(allocator, .{});
+    defer batch_reader.deinit();
+
+    if (segment_io == .pread) {
+        log.info("reading segment blocks with pread", .{});
+        if (block_cache_size == 0) {
+            log.warn("segment blocks are read from disk on every search, use --block-cache-size", .{});
+        }
+    }
+
+    var file_merge_limit = ConcurrencyLimit.init(max_merges);
+
+    var write_rate_limiter = RateLimiter.init(.{ .bytes_per_second = max_write_rate * 1024 * 1024 }, null);
+
+    var global_memory_limit = MemoryLimit.init(.{
+        .soft_limit = write_buffer_soft_limit * 1024 * 1024,
+        .hard_limit = write_buffer_hard_limit * 1024 * 1024,
+    }, null);
+
+    var indexes = MultiIndex.init(allocator, &scheduler, dir, .{
+        .search_pool = if (search_threads > 0) &search_pool else null,
+        .max_search_parallelism = search_parallelism,
+        .block_cache = if (block_cache_size > 0) &block_cache else null,
+        .oplog = .{
+            .max_batch_size = @max(oplog_max_batch_size, 1),
+            .max_batch_delay_us = oplog_max_batch_delay,
+        },
+        .max_load_parallelism = @max(load_parallelism, 1),
+        .verify_segments_on_load = segment_verification == .load,
+        .max_concurrent_file_merges = @max(index_merges, 1),
+        .file_merge_limit = if (max_merges > 0) &file_merge_limit else null,
+        .write_rate = .{
+            .bytes_per_second = index_write_rate * 1024 * 1024,
+            .target_search_latency_ms = write_rate_search_latency,
+            .max_active_searches = write_rate_max_searches,
+        },
+        .global_write_rate_limiter = if (max_write_rate > 0) &write_rate_limiter else null,
+        .drop_cache_on_write = drop_write_cache,
+        .memory_limit = .{
+            .soft_limit = index_write_buffer_soft_limit * 1024 * 1024,
+            .hard_limit = index_write_buffer_hard_limit * 1024 * 1024,
+        },
+        .global_memory_limit = if (write_buffer_soft_limit > 0 or write_buffer_hard_limit > 0) &global_memory_limit else null,
+        .mlock_newest_segments = mlock_newest_segments,
+        .mlock_max_segment_size = mlock_max_segment_size * 1024 * 1024,
+        .huge_pages = huge_pages,
+        .segment_io = segment_io,
+        .batch_reader = &batch_reader,
+        .result_cache_size = result_cache_size * 1024 * 1024,
+        .max_docs_per_hash = max_docs_per_hash,
+        .max_hash_frequency = max_hash_frequency,
+    }, .{
+        .max_idle_time_ms = max_idle_time * std.time.ms_per_s,
+        .max_memory_usage = max_memory_usage * 1024 * 1024,
+        .residency_sample_interval_ms = residency_sample_interval * std.time.ms_per_s,
+    });
     defer indexes.deinit();
 
+    try indexes.start();
+
     try scheduler.start(threads);
 
-    try server.run(allocator, &indexes, address, port, threads);
+    if (import_index) |name| {
+        if (!MultiIndex.isValidName(name)) {
+            return error.InvalidIndexName;
+        }
+        // a replica only gets its data from the primary's oplog
+        if (primary_url != null) {
+            return error.CannotImportIntoReplica;
+        }
+
+        const input_file = if (import_input) |path| try std.fs.cwd().openFile(path, .{}) else std.io.getStdIn();
+        defer if (import_input != null) input_file.close();
+
+        var input = std.io.bufferedReader(input_file.reader());
+
+        _ = try BulkImport.importIndex(allocator, &scheduler, dir, name, indexes.index_options, .{
+            .max_memory = import_memory * 1024 * 1024,
+            .max_segment_size = indexes.index_options.max_segment_size,
+            .threads = threads,
+        }, input.reader());
+        return;
+    }
+
+    var replica: ?Replica = null;
+    defer if (replica) |*r| r.deinit();
+
+    if (primary_url) |url| {
+        replica = Replica.init(allocator, &indexes, .{ .primary_url = url });
+        var iter = std.mem.tokenizeScalar(u8, replicate_indexes, ',');
+        while (iter.next()) |name| {
+            try replica.?.addIndex(name);
+        }
+        try replica.?.start();
+    }
+
+    var shard_router: ?ShardRouter = null;
+    defer if (shard_router) |*r| r.deinit();
+
+    if (shards_spec) |spec| {
+        shard_router = ShardRouter.init(allocator, &indexes, &search_pool);
+        try shard_router.?.addIndexes(spec);
+    }
+
+    const admission = server.limitAdmissionQueues(.{
+        .search = .{ .max_concurrent = max_concurrent_searches, .max_queue_size = max_queued_requests },
+        .update = .{ .max_concurrent = max_concurrent_updates, .max_queue_size = max_queued_requests },
+    }, threads);
+
+    var search_admission = AdmissionController.init("search", admission.search);
+    var update_admission = AdmissionController.init("update", admission.update);
+    const admission_controllers = server.AdmissionControllers{
+        .search = if (admission.search.max_concurrent > 0) &search_admission else null,
+        .update = if (admission.update.max_concurrent > 0) &update_admission else null,
+    };
+
+    var legacy_server: ?LegacyServer = null;
+    defer if (legacy_server) |*s| s.deinit();
+
+    if (legacy_port > 0) {
+        legacy_server = LegacyServer.init(allocator, &indexes, admission_controllers, .{
+            .address = address,
+            .port = legacy_port,
+            .index_name = legacy_index,
+            .read_only = primary_url != null,
+        });
+        try legacy_server.?.start();
+    }
+
+    try server.run(allocator, &indexes, if (replica) |*r| r else null, if (shard_router) |*r| r else null, admission_controllers, address, port, threads);
 }
 
 test {
@@ -1,10 +1,21 @@
 const std = @import("std");
 const m = @import("metrics");
 
+const BlockFormat = @import("filefmt.zig").BlockFormat;
+const Priority = @import("utils/Scheduler.zig").Priority;
+const ShardStatus = @import("ShardRouter.zig").ShardStatus;
+const MemoryUsage = @import("common.zig").MemoryUsage;
+
 var metrics = m.initializeNoop(Metrics);
 var arena: ?std.heap.ArenaAllocator = null;
 
 const WithIndex = struct { index: []const u8 };
+const WithPriority = struct { priority: []const u8 };
+const WithStatus = struct { status: []const u8 };
+const WithIndexAndTier = struct { index: []const u8, tier: []const u8 };
+const WithIndexAndComponent = struct { index: []const u8, component: []const u8 };
+const WithEndpoint = struct { endpoint: []const u8 };
+const WithEndpointAndReason = struct { endpoint: []const u8, reason: []const u8 };
 
 const SearchDuration = m.Histogram(
     f64,
@@ -21,6 +32,28 @@ const ScannedBlocksPerHash = m.Histogram(
     &.{ 1, 2, 3, 5, 10 },
 );
 
+const OplogBatchSize = m.Histogram(
+    u64,
+    &.{ 1, 2, 5, 10, 20, 50, 100, 500, 1000 },
+);
+
+const OplogSyncDuration = m.Histogram(
+    f64,
+    &.{ 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.5 },
+);
+
+const SchedulerWaitTime = m.HistogramVec(
+    f64,
+    WithPriority,
+    &.{ 0.001, 0.01, 0.1, 1, 10, 60, 600 },
+);
+
+const AdmissionQueueWait = m.HistogramVec(
+    f64,
+    WithEndpoint,
+    &.{ 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1 },
+);
+
 const Metrics = struct {
     search_hits: m.Counter(u64),
     search_misses: m.Counter(u64),
@@ -29,10 +62,50 @@ const Metrics = struct {
     updates: m.Counter(u64),
     checkpoints: m.Counter(u64),
     memory_segment_merges: m.Counter(u64),
+    memtable_freezes: m.Counter(u64),
     file_segment_merges: m.Counter(u64),
     docs: m.GaugeVec(u32, WithIndex),
     scanned_docs_per_hash: ScannedDocsPerHash,
     scanned_blocks_per_hash: ScannedBlocksPerHash,
+    search_pruned_hashes: m.Counter(u64),
+    decoded_block_items_v1: m.Counter(u64),
+    decoded_block_items_v2: m.Counter(u64),
+    // only counted for profiled searches, see FileSegment.BlockSearcher, divide by the timed
+    // items, not by all decoded items
+    timed_decoded_block_items_v1: m.Counter(u64),
+    timed_decoded_block_items_v2: m.Counter(u64),
+    block_decode_nanoseconds_v1: m.Counter(u64),
+    block_decode_nanoseconds_v2: m.Counter(u64),
+    block_cache_hits: m.Counter(u64),
+    block_cache_misses: m.Counter(u64),
+    block_cache_evictions: m.Counter(u64),
+    segment_block_reads: m.Counter(u64),
+    segment_blocks_read: m.Counter(u64),
+    result_cache_hits: m.Counter(u64),
+    result_cache_misses: m.Counter(u64),
+    result_cache_refreshes: m.Counter(u64),
+    result_cache_evictions: m.Counter(u64),
+    oplog_batch_size: OplogBatchSize,
+    oplog_sync_duration: OplogSyncDuration,
+    oplog_replay_transactions: m.Counter(u64),
+    oplog_replay_changes: m.Counter(u64),
+    index_load_duration: m.GaugeVec(f64, WithIndex),
+    segments_quarantined: m.Counter(u64),
+    index_evictions: m.Counter(u64),
+    // set to 1 if the index stopped accepting updates, see Index.apply_error
+    index_failed: m.GaugeVec(u32, WithIndex),
+    replication_lag_commits: m.GaugeVec(u64, WithIndex),
+    replication_lag_seconds: m.GaugeVec(f64, WithIndex),
+    scheduler_queue_length: m.GaugeVec(u64, WithPriority),
+    scheduler_wait_time: SchedulerWaitTime,
+    shard_search_failures: m.CounterVec(u64, WithStatus),
+    segment_resident_bytes: m.GaugeVec(u64, WithIndexAndTier),
+    segment_mapped_bytes: m.GaugeVec(u64, WithIndexAndTier),
+    admission_queue_wait: AdmissionQueueWait,
+    admission_rejections: m.CounterVec(u64, WithEndpointAndReason),
+    memory_usage_bytes: m.GaugeVec(u64, WithIndexAndComponent),
+    memory_limit_waits: m.Counter(u64),
+    memory_limit_rejections: m.Counter(u64),
 };
 
 pub fn search() void {
@@ -59,6 +132,152 @@ pub fn scannedBlocksPerHash(num_blocks: u64) void {
     metrics.scanned_blocks_per_hash.observe(num_blocks);
 }
 
+// Collected locally while searching a segment and reported once at the end,
+// so that we don't touch the shared counters for every block.
+pub const BlockDecodeStats = struct {
+    items: u64 = 0,
+    // items for which the decoding was timed
+    timed_items: u64 = 0,
+    nanoseconds: u64 = 0,
+
+    pub fn add(self: *BlockDecodeStats, items: usize, nanoseconds: ?u64) void {
+        self.items += items;
+        if (nanoseconds) |ns| {
+            self.timed_items += items;
+            self.nanoseconds += ns;
+        }
+    }
+};
+
+pub fn searchPrunedHashes(num_hashes: usize) void {
+    metrics.search_pruned_hashes.incrBy(num_hashes);
+}
+
+pub fn blockDecode(format: BlockFormat, stats: BlockDecodeStats) void {
+    if (stats.items == 0) {
+        return;
+    }
+    switch (format) {
+        .v1 => {
+            metrics.decoded_block_items_v1.incrBy(stats.items);
+            metrics.timed_decoded_block_items_v1.incrBy(stats.timed_items);
+            metrics.block_decode_nanoseconds_v1.incrBy(stats.nanoseconds);
+        },
+        .v2 => {
+            metrics.decoded_block_items_v2.incrBy(stats.items);
+            metrics.timed_decoded_block_items_v2.incrBy(stats.timed_items);
+            metrics.block_decode_nanoseconds_v2.incrBy(stats.nanoseconds);
+        },
+    }
+}
+
+pub fn blockCacheHit() void {
+    metrics.block_cache_hits.incr();
+}
+
+pub fn blockCacheMiss() void {
+    metrics.block_cache_misses.incr();
+}
+
+pub fn blockCacheEviction() void {
+    metrics.block_cache_evictions.incr();
+}
+
+// Explicit reads of file segment blocks, contiguous blocks are read at once.
+pub fn segmentBlockReads(num_reads: usize, num_blocks: usize) void {
+    metrics.segment_block_reads.incrBy(num_reads);
+    metrics.segment_blocks_read.incrBy(num_blocks);
+}
+
+pub fn resultCacheHit() void {
+    metrics.result_cache_hits.incr();
+}
+
+pub fn resultCacheMiss() void {
+    metrics.result_cache_misses.incr();
+}
+
+pub fn resultCacheRefresh() void {
+    metrics.result_cache_refreshes.incr();
+}
+
+pub fn resultCacheEviction() void {
+    metrics.result_cache_evictions.incr();
+}
+
+pub fn oplogBatch(num_transactions: usize) void {
+    metrics.oplog_batch_size.observe(num_transactions);
+}
+
+pub fn oplogSyncDuration(duration_ns: u64) void {
+    metrics.oplog_sync_duration.observe(@as(f64, @floatFromInt(duration_ns)) / std.time.ns_per_s);
+}
+
+pub fn oplogReplay(num_changes: usize) void {
+    metrics.oplog_replay_transactions.incr();
+    metrics.oplog_replay_changes.incrBy(num_changes);
+}
+
+pub fn indexLoadDuration(index_name: []const u8, duration_ns: u64) void {
+    metrics.index_load_duration.set(.{ .index = index_name }, @as(f64, @floatFromInt(duration_ns)) / std.time.ns_per_s) catch {};
+}
+
+pub fn segmentQuarantined() void {
+    metrics.segments_quarantined.incr();
+}
+
+pub fn indexEviction() void {
+    metrics.index_evictions.incr();
+}
+
+pub fn indexFailed(index_name: []const u8, failed: bool) void {
+    metrics.index_failed.set(.{ .index = index_name }, @intFromBool(failed)) catch {};
+}
+
+pub fn replicationLag(index_name: []const u8, lag_commits: u64, lag_ms: i64) void {
+    metrics.replication_lag_commits.set(.{ .index = index_name }, lag_commits) catch {};
+    metrics.replication_lag_seconds.set(.{ .index = index_name }, @as(f64, @floatFromInt(lag_ms)) / std.time.ms_per_s) catch {};
+}
+
+pub fn schedulerQueueLength(priority: Priority, length: usize) void {
+    metrics.scheduler_queue_length.set(.{ .priority = @tagName(priority) }, length) catch {};
+}
+
+pub fn schedulerWaitTime(priority: Priority, wait_ns: u64) void {
+    metrics.scheduler_wait_time.observe(.{ .priority = @tagName(priority) }, @as(f64, @floatFromInt(wait_ns)) / std.time.ns_per_s) catch {};
+}
+
+pub fn shardSearchFailure(status: ShardStatus) void {
+    metrics.shard_search_failures.incr(.{ .status = @tagName(status) }) catch {};
+}
+
+pub fn segmentResidency(index_name: []const u8, tier: []const u8, resident_size: usize, total_size: usize) void {
+    metrics.segment_resident_bytes.set(.{ .index = index_name, .tier = tier }, resident_size) catch {};
+    metrics.segment_mapped_bytes.set(.{ .index = index_name, .tier = tier }, total_size) catch {};
+}
+
+pub fn memoryUsage(index_name: []const u8, usage: MemoryUsage) void {
+    inline for (std.meta.fields(MemoryUsage)) |field| {
+        metrics.memory_usage_bytes.set(.{ .index = index_name, .component = field.name }, @field(usage, field.name)) catch {};
+    }
+}
+
+pub fn memoryLimitWait() void {
+    metrics.memory_limit_waits.incr();
+}
+
+pub fn memoryLimitRejection() void {
+    metrics.memory_limit_rejections.incr();
+}
+
+pub fn admissionQueueWait(endpoint: []const u8, wait_ns: u64) void {
+    metrics.admission_queue_wait.observe(.{ .endpoint = endpoint }, @as(f64, @floatFromInt(wait_ns)) / std.time.ns_per_s) catch {};
+}
+
+pub fn admissionRejection(endpoint: []const u8, reason: anyerror) void {
+    metrics.admission_rejections.incr(.{ .endpoint = endpoint, .reason = @errorName(reason) }) catch {};
+}
+
 pub fn update(count: usize) void {
     metrics.updates.incrBy(@intCast(count));
 }
@@ -71,6 +290,10 @@ pub fn memorySegmentMerge() void {
     metrics.memory_segment_merges.incr();
 }
 
+pub fn memtableFreeze() void {
+    metrics.memtable_freezes.incr();
+}
+
 pub fn fileSegmentMerge() void {
     metrics.file_segment_merges.incr();
 }
@@ -91,10 +314,47 @@ pub fn initializeMetrics(allocator: std.mem.Allocator, comptime opts: m.Registry
         .updates = m.Counter(u64).init("updates_total", .{}, opts),
         .checkpoints = m.Counter(u64).init("checkpoints_total", .{}, opts),
         .memory_segment_merges = m.Counter(u64).init("memory_segment_merges_total", .{}, opts),
+        .memtable_freezes = m.Counter(u64).init("memtable_freezes_total", .{}, opts),
         .file_segment_merges = m.Counter(u64).init("file_segment_merges_total", .{}, opts),
         .docs = try m.GaugeVec(u32, WithIndex).init(alloc, "docs", .{}, opts),
         .scanned_docs_per_hash = ScannedDocsPerHash.init("scanned_docs_per_hash", .{}, opts),
         .scanned_blocks_per_hash = ScannedBlocksPerHash.init("scanned_blocks_per_hash", .{}, opts),
+        .search_pruned_hashes = m.Counter(u64).init("search_pruned_hashes_total", .{}, opts),
+        .decoded_block_items_v1 = m.Counter(u64).init("decoded_block_items_v1_total", .{}, opts),
+        .decoded_block_items_v2 = m.Counter(u64).init("decoded_block_items_v2_total", .{}, opts),
+        .timed_decoded_block_items_v1 = m.Counter(u64).init("timed_decoded_block_items_v1_total", .{}, opts),
+        .timed_decoded_block_items_v2 = m.Counter(u64).init("timed_decoded_block_items_v2_total", .{}, opts),
+        .block_decode_nanoseconds_v1 = m.Counter(u64).init("block_decode_nanoseconds_v1_total", .{}, opts),
+        .block_decode_nanoseconds_v2 = m.Counter(u64).init("block_decode_nanoseconds_v2_total", .{}, opts),
+        .block_cache_hits = m.Counter(u64).init("block_cache_hits_total", .{}, opts),
+        .block_cache_misses = m.Counter(u64).init("block_cache_misses_total", .{}, opts),
+        .block_cache_evictions = m.Counter(u64).init("block_cache_evictions_total", .{}, opts),
+        .segment_block_reads = m.Counter(u64).init("segment_block_reads_total", .{}, opts),
+        .segment_blocks_read = m.Counter(u64).init("segment_blocks_read_total", .{}, opts),
+        .result_cache_hits = m.Counter(u64).init("result_cache_hits_total", .{}, opts),
+        .result_cache_misses = m.Counter(u64).init("result_cache_misses_total", .{}, opts),
+        .result_cache_refreshes = m.Counter(u64).init("result_cache_refreshes_total", .{}, opts),
+        .result_cache_evictions = m.Counter(u64).init("result_cache_evictions_total", .{}, opts),
+        .oplog_batch_size = OplogBatchSize.init("oplog_batch_size", .{}, opts),
+        .oplog_sync_duration = OplogSyncDuration.init("oplog_sync_duration_seconds", .{}, opts),
+        .oplog_replay_transactions = m.Counter(u64).init("oplog_replay_transactions_total", .{}, opts),
+        .oplog_replay_changes = m.Counter(u64).init("oplog_replay_changes_total", .{}, opts),
+        .index_load_duration = try m.GaugeVec(f64, WithIndex).init(alloc, "index_load_duration_seconds", .{}, opts),
+        .segments_quarantined = m.Counter(u64).init("segments_quarantined_total", .{}, opts),
+        .index_evictions = m.Counter(u64).init("index_evictions_total", .{}, opts),
+        .index_failed = try m.GaugeVec(u32, WithIndex).init(alloc, "index_failed", .{}, opts),
+        .replication_lag_commits = try m.GaugeVec(u64, WithIndex).init(alloc, "replication_lag_commits", .{}, opts),
+        .replication_lag_seconds = try m.GaugeVec(f64, WithIndex).init(alloc, "replication_lag_seconds", .{}, opts),
+        .scheduler_queue_length = try m.GaugeVec(u64, WithPriority).init(alloc, "scheduler_queue_length", .{}, opts),
+        .scheduler_wait_time = try SchedulerWaitTime.init(alloc, "scheduler_wait_time_seconds", .{}, opts),
+        .shard_search_failures = try m.CounterVec(u64, WithStatus).init(alloc, "shard_search_failures_total", .{}, opts),
+        .segment_resident_bytes = try m.GaugeVec(u64, WithIndexAndTier).init(alloc, "segment_resident_bytes", .{}, opts),
+        .segment_mapped_bytes = try m.GaugeVec(u64, WithIndexAndTier).init(alloc, "segment_mapped_bytes", .{}, opts),
+        .admission_queue_wait = try AdmissionQueueWait.init(alloc, "admission_queue_wait_seconds", .{}, opts),
+        .admission_rejections = try m.CounterVec(u64, WithEndpointAndReason).init(alloc, "admission_rejections_total", .{}, opts),
+        .memory_usage_bytes = try m.GaugeVec(u64, WithIndexAndComponent).init(alloc, "memory_usage_bytes", .{}, opts),
+        .memory_limit_waits = m.Counter(u64).init("memory_limit_waits_total", .{}, opts),
+        .memory_limit_rejections = m.Counter(u64).init("memory_limit_rejections_total", .{}, opts),
     };
 }
 
@@ -67,6 +67,8 @@ pub const Item = packed struct(u64) {
 
 pub const SegmentStatus = struct {
     frozen: bool = false,
+    // the segment is a source of a merge that is in progress
+    merging: bool = false,
 };
 
 test "Item binary" {
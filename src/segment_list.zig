@@ -110,6 +110,15 @@ pub fn SegmentList(Segment: type) type {
             }
         }
 
+        // Sums hash frequencies stored in the segments, used for pruning query hashes.
+        pub fn getHashFrequency(self: Self, hash: u32) u64 {
+            var result: u64 = 0;
+            for (self.nodes.items) |node| {
+                result += node.value.getHashFrequency(hash);
+            }
+            return result;
+        }
+
         pub fn getNumDocs(self: Self) u32 {
             var result: u32 = 0;
             for (self.nodes.items) |node| {
@@ -142,15 +151,26 @@ pub fn SegmentList(Segment: type) type {
             var result: ?DocInfo = null;
             for (self.nodes.items) |node| {
                 const active = node.value.docs.get(doc_id) orelse continue;
-                result = .{ .version = node.value.info.version, .deleted = !active };
+                result = .{ .version = node.value.info.getLastCommitId(), .deleted = !active };
             }
             return result;
         }
 
         pub fn search(self: Self, hashes: []const u32, results: *SearchResults, deadline: Deadline) !void {
+            return self.searchStriped(hashes, results, deadline, 0, 1);
+        }
+
+        // Searches every stride-th segment, starting at offset, from the newest one.
+        // Used to split the list between multiple search threads.
+        pub fn searchStriped(self: Self, hashes: []const u32, results: *SearchResults, deadline: Deadline, offset: usize, stride: usize) !void {
+            std.debug.assert(offset < stride);
             var i: usize = self.nodes.items.len;
-            while (i > 0) {
+            var j: usize = 0;
+            while (i > 0) : (j += 1) {
                 i -= 1;
+                if (j % stride != offset) {
+                    continue;
+                }
                 const node = self.nodes.items[i];
                 try deadline.check();
                 try node.value.search(hashes, results, deadline);
@@ -211,11 +231,20 @@ fn isFrozenFn(comptime T: type) fn (SharedPtr(T)) bool {
     return tmp.isFrozen;
 }
 
+fn isMergingFn(comptime T: type) fn (SharedPtr(T)) bool {
+    const tmp = struct {
+        fn isMerging(segment: SharedPtr(T)) bool {
+            return segment.value.status.merging;
+        }
+    };
+    return tmp.isMerging;
+}
+
 pub fn SegmentListManager(Segment: type) type {
     return struct {
         pub const Self = @This();
         pub const List = SegmentList(Segment);
-        pub const MergePolicy = TieredMergePolicy(List.Node, getSizeFn(Segment), isFrozenFn(Segment));
+        pub const MergePolicy = TieredMergePolicy(List.Node, getSizeFn(Segment), isFrozenFn(Segment), isMergingFn(Segment));
 
         options: Segment.Options,
         segments: SharedPtr(List),
@@ -275,7 +304,39 @@ pub fn SegmentListManager(Segment: type) type {
             return null;
         }
 
-        pub fn prepareMerge(self: *Self, allocator: Allocator) !?Update {
+        // Marks all current segments as frozen, so that they are checkpointed one by one
+        // instead of being merged. Merges must not be running.
+        pub fn freezeAll(self: *Self) void {
+            self.update_lock.lock();
+            defer self.update_lock.unlock();
+
+            self.status_update_lock.lock();
+            defer self.status_update_lock.unlock();
+
+            for (self.segments.value.nodes.items) |node| {
+                node.value.status.frozen = true;
+            }
+        }
+
+        // Marks the oldest segment as frozen, so that it's checkpointed even if it's still small.
+        // Returns false if there is no segment, or it's being merged.
+        pub fn freezeFirst(self: *Self) bool {
+            self.update_lock.lock();
+            defer self.update_lock.unlock();
+
+            self.status_update_lock.lock();
+            defer self.status_update_lock.unlock();
+
+            const node = self.segments.value.getFirst() orelse return false;
+            if (node.value.status.merging) {
+                return false;
+            }
+            node.value.status.frozen = true;
+            return true;
+        }
+
+        // The checker, unless it's void, gets each source before the merge, with checkMergeSource.
+        pub fn prepareMerge(self: *Self, allocator: Allocator, checker: anytype) !?Update {
             var segments = self.acquireSegments();
             defer destroySegments(allocator, &segments);
 
@@ -296,14 +357,38 @@ pub fn SegmentListManager(Segment: type) type {
                     }
                 }
 
+                // quarantined segments must never be merged, the merge would fail again and again
+                if (@hasField(Segment, "quarantined")) {
+                    for (segments.value.nodes.items) |node| {
+                        if (node.value.quarantined.load(.acquire)) {
+                            node.value.status.frozen = true;
+                        }
+                    }
+                }
+
                 self.num_allowed_segments.store(self.merge_policy.calculateBudget(segments.value.nodes.items), .release);
                 if (!self.needsMerge()) {
                     return null;
                 }
 
-                break :blk self.merge_policy.findSegmentsToMerge(segments.value.nodes.items) orelse return null;
+                const result = self.merge_policy.findSegmentsToMerge(segments.value.nodes.items) orelse return null;
+
+                // multiple merges can run at the same time, but their sources must not overlap
+                for (segments.value.nodes.items[result.start..result.end]) |node| {
+                    node.value.status.merging = true;
+                }
+                break :blk result;
             };
 
+            const sources = segments.value.nodes.items[candidate.start..candidate.end];
+            errdefer self.finishMerge(sources);
+
+            if (@TypeOf(checker) != void) {
+                for (sources) |node| {
+                    try checker.checkMergeSource(node);
+                }
+            }
+
             var target = try List.createSegment(allocator, self.options);
             defer List.destroySegment(allocator, &target);
 
@@ -319,15 +404,32 @@ pub fn SegmentListManager(Segment: type) type {
             errdefer target.value.cleanup();
 
             var update = try self.beginUpdate(allocator);
+            errdefer self.cleanupAfterUpdate(allocator, &update);
+
+            try update.merge_sources.ensureTotalCapacity(allocator, sources.len);
+            for (sources) |node| {
+                update.merge_sources.appendAssumeCapacity(node.acquire());
+            }
             update.replaceMergedSegment(target);
 
             return update;
         }
 
+        fn finishMerge(self: *Self, sources: []const List.Node) void {
+            self.status_update_lock.lock();
+            defer self.status_update_lock.unlock();
+
+            for (sources) |node| {
+                node.value.status.merging = false;
+            }
+        }
+
         pub const Update = struct {
             manager: *Self,
             segments: SharedPtr(List),
             committed: bool = false,
+            // sources of a merge, they are released from the merge after the update is finished
+            merge_sources: List.List = .{},
 
             pub fn removeSegment(self: *@This(), node: List.Node) void {
                 self.manager.segments.value.removeSegmentInto(self.segments.value, node);
@@ -348,6 +450,15 @@ pub fn SegmentListManager(Segment: type) type {
             }
         };
 
+        // Appends a segment directly to the current list, without the copy-and-swap update.
+        // Only safe while the index is being loaded, when there are no readers or other writers.
+        pub fn appendSegmentOnLoad(self: *Self, allocator: Allocator, node: List.Node) !void {
+            if (node.value.getSize() > self.merge_policy.max_segment_size) {
+                node.value.status.frozen = true;
+            }
+            try self.segments.value.nodes.append(allocator, node);
+        }
+
         pub fn beginUpdate(self: *Self, allocator: Allocator) !Update {
             self.update_lock.lock();
             errdefer self.update_lock.unlock();
@@ -375,6 +486,14 @@ pub fn SegmentListManager(Segment: type) type {
                 self.update_lock.unlock();
             }
             destroySegments(allocator, &update.segments);
+
+            if (update.merge_sources.items.len > 0) {
+                self.finishMerge(update.merge_sources.items);
+                for (update.merge_sources.items) |*node| {
+                    List.destroySegment(allocator, node);
+                }
+            }
+            update.merge_sources.deinit(allocator);
         }
     };
 }
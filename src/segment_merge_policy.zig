@@ -44,7 +44,12 @@ pub fn IsFrozenFn(comptime S: type) type {
     return fn (S) bool;
 }
 
-pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(Segment), comptime isFrozenFn: IsFrozenFn(Segment)) type {
+pub fn IsMergingFn(comptime S: type) type {
+    return fn (S) bool;
+}
+
+// Segments that are being merged count towards the budget, but can't be part of another merge.
+pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(Segment), comptime isFrozenFn: IsFrozenFn(Segment), comptime isMergingFn: IsMergingFn(Segment)) type {
     return struct {
         max_segments: ?usize = null,
 
@@ -108,8 +113,8 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
 
             var start: usize = 0;
             while (start + 1 < segments.len) : (start += 1) {
-                if (isFrozenFn(segments[start])) {
-                    // Skip frozen segments
+                if (isFrozenFn(segments[start]) or isMergingFn(segments[start])) {
+                    // Skip frozen segments and segments that are already being merged
                     continue;
                 }
                 const start_size = getSizeFn(segments[start]);
@@ -125,8 +130,8 @@ pub fn TieredMergePolicy(comptime Segment: type, comptime getSizeFn: GetSizeFn(S
                 };
 
                 while (candidate.end < segments.len) {
-                    if (isFrozenFn(segments[candidate.end])) {
-                        // Can't include frozen segments
+                    if (isFrozenFn(segments[candidate.end]) or isMergingFn(segments[candidate.end])) {
+                        // Can't include frozen segments or segments that are already being merged
                         break;
                     }
                     const size = getSizeFn(segments[candidate.end]);
@@ -201,6 +206,11 @@ const MockSegment = struct {
         _ = self;
         return false;
     }
+
+    pub fn isMerging(self: @This()) bool {
+        _ = self;
+        return false;
+    }
 };
 
 fn applyMerge(segments: *std.ArrayList(MockSegment), merge: MergeCandidate) !void {
@@ -214,7 +224,7 @@ test "TieredMergePolicy" {
     var segments = std.ArrayList(MockSegment).init(std.testing.allocator);
     defer segments.deinit();
 
-    const policy = TieredMergePolicy(MockSegment, MockSegment.getSize, MockSegment.isFrozen){
+    const policy = TieredMergePolicy(MockSegment, MockSegment.getSize, MockSegment.isFrozen, MockSegment.isMerging){
         .min_segment_size = 100,
         .max_segment_size = 100000,
         .segments_per_merge = 10,
@@ -28,26 +28,50 @@ pub fn SegmentMerger(comptime Segment: type) type {
 
         const Source = struct {
             reader: Segment.Reader,
-            skip_docs: std.AutoHashMapUnmanaged(u32, void) = .{},
+            // current batch of decoded items, owned by the reader
+            batch: []const Item = &.{},
+            pos: usize = 0,
+            current: ?Item = null,
+            // docs that have a newer version in another segment, bitmap over the segment's doc id range
+            skip_docs: std.DynamicBitSetUnmanaged = .{},
+            skip_docs_base: u32 = 0,
 
             pub fn deinit(self: *Source, allocator: std.mem.Allocator) void {
                 self.reader.close();
                 self.skip_docs.deinit(allocator);
             }
 
-            pub fn read(self: *Source) !?Item {
-                while (true) {
-                    const item = try self.reader.read() orelse return null;
-                    if (self.skip_docs.contains(item.id)) {
-                        self.reader.advance();
-                        continue;
-                    }
-                    return item;
+            fn skipDoc(self: *Source, allocator: std.mem.Allocator, doc_id: u32) !void {
+                if (self.skip_docs.bit_length == 0) {
+                    const segment = self.reader.segment;
+                    self.skip_docs_base = segment.min_doc_id;
+                    self.skip_docs = try std.DynamicBitSetUnmanaged.initEmpty(allocator, segment.max_doc_id - segment.min_doc_id + 1);
                 }
+                self.skip_docs.set(doc_id - self.skip_docs_base);
             }
 
-            pub fn advance(self: *Source) void {
-                self.reader.advance();
+            inline fn isSkipped(self: *const Source, doc_id: u32) bool {
+                const offset = doc_id -% self.skip_docs_base;
+                return offset < self.skip_docs.bit_length and self.skip_docs.isSet(offset);
+            }
+
+            // Moves to the next item that is not skipped.
+            fn next(self: *Source) !void {
+                while (true) {
+                    while (self.pos < self.batch.len) {
+                        const item = self.batch[self.pos];
+                        self.pos += 1;
+                        if (!self.isSkipped(item.id)) {
+                            self.current = item;
+                            return;
+                        }
+                    }
+                    self.batch = try self.reader.readBatch() orelse {
+                        self.current = null;
+                        return;
+                    };
+                    self.pos = 0;
+                }
             }
         };
 
@@ -57,7 +81,10 @@ pub fn SegmentMerger(comptime Segment: type) type {
         segment: MergedSegmentInfo = .{},
         estimated_size: usize = 0,
 
-        current_item: ?Item = null,
+        // Loser tree over the sources, tree[0] is the source with the smallest current item,
+        // the other nodes hold the source that lost the match at that node.
+        tree: []usize = &.{},
+        needs_advance: bool = false,
 
         pub fn init(allocator: std.mem.Allocator, collection: *SegmentList(Segment), num_sources: usize) !Self {
             return .{
@@ -73,6 +100,7 @@ pub fn SegmentMerger(comptime Segment: type) type {
             }
             self.sources.deinit(self.allocator);
             self.segment.deinit(self.allocator);
+            self.allocator.free(self.tree);
             self.* = undefined;
         }
 
@@ -138,7 +166,7 @@ pub fn SegmentMerger(comptime Segment: type) type {
                             self.segment.max_doc_id = doc_id;
                         }
                     } else {
-                        try source.skip_docs.put(self.allocator, doc_id, {});
+                        try source.skipDoc(self.allocator, doc_id);
                     }
                 }
                 if (docs_found > 0) {
@@ -146,32 +174,58 @@ pub fn SegmentMerger(comptime Segment: type) type {
                     self.estimated_size += segment.getSize() * @min(100, ratio + 10) / 100;
                 }
             }
+
+            for (sources) |*source| {
+                try source.next();
+            }
+
+            self.tree = try self.allocator.alloc(usize, sources.len);
+            // start with a virtual source that wins all matches, then replay each real source
+            @memset(self.tree, sources.len);
+            var i = sources.len;
+            while (i > 0) {
+                i -= 1;
+                self.replay(i);
+            }
         }
 
-        pub fn read(self: *Self) !?Item {
-            if (self.current_item == null) {
-                var min_item: ?Item = null;
-                var min_item_index: usize = 0;
-
-                for (self.sources.items, 0..) |*source, i| {
-                    if (try source.read()) |item| {
-                        if (min_item == null or Item.cmp({}, item, min_item.?)) {
-                            min_item = item;
-                            min_item_index = i;
-                        }
-                    }
-                }
+        // Returns true if source a has a smaller current item than source b,
+        // index sources.len is the virtual source used while building the tree.
+        inline fn beats(self: *const Self, a: usize, b: usize) bool {
+            const k = self.sources.items.len;
+            if (a == k) return true;
+            if (b == k) return false;
+            const item_a = self.sources.items[a].current orelse return false;
+            const item_b = self.sources.items[b].current orelse return true;
+            const xa: u64 = @bitCast(item_a);
+            const xb: u64 = @bitCast(item_b);
+            return xa < xb or (xa == xb and a < b);
+        }
 
-                if (min_item) |item| {
-                    self.sources.items[min_item_index].advance();
-                    self.current_item = item;
+        // Moves source s from its leaf up to the root, after its current item changed.
+        fn replay(self: *Self, source_index: usize) void {
+            var winner = source_index;
+            var node = (source_index + self.tree.len) / 2;
+            while (node > 0) : (node /= 2) {
+                if (self.beats(self.tree[node], winner)) {
+                    std.mem.swap(usize, &self.tree[node], &winner);
                 }
             }
-            return self.current_item;
+            self.tree[0] = winner;
+        }
+
+        pub fn read(self: *Self) !?Item {
+            const winner = self.tree[0];
+            if (self.needs_advance) {
+                self.needs_advance = false;
+                try self.sources.items[winner].next();
+                self.replay(winner);
+            }
+            return self.sources.items[self.tree[0]].current;
         }
 
         pub fn advance(self: *Self) void {
-            self.current_item = null;
+            self.needs_advance = true;
         }
     };
 }
@@ -213,3 +267,56 @@ test "merge segments" {
         }
     }
 }
+
+test "merge segments with items" {
+    const MemorySegment = @import("MemorySegment.zig");
+    const Change = @import("change.zig").Change;
+
+    var collection = try SegmentList(MemorySegment).init(std.testing.allocator, 3);
+    defer collection.deinit(std.testing.allocator, .delete);
+
+    const changes = [_][]const Change{
+        &.{
+            .{ .insert = .{ .id = 1, .hashes = &.{ 1, 5, 9 } } },
+            .{ .insert = .{ .id = 2, .hashes = &.{ 2, 5 } } },
+        },
+        &.{
+            .{ .insert = .{ .id = 3, .hashes = &.{ 3, 5, 7 } } },
+            .{ .insert = .{ .id = 1, .hashes = &.{4} } },
+        },
+        &.{
+            .{ .insert = .{ .id = 4, .hashes = &.{ 1, 6 } } },
+            .{ .delete = .{ .id = 2 } },
+        },
+    };
+
+    var merger = try SegmentMerger(MemorySegment).init(std.testing.allocator, &collection, changes.len);
+    defer merger.deinit();
+
+    for (changes, 1..) |segment_changes, version| {
+        const node = try SegmentList(MemorySegment).createSegment(std.testing.allocator, .{});
+        collection.nodes.appendAssumeCapacity(node);
+        node.value.info = .{ .version = version };
+        try node.value.build(segment_changes);
+        merger.addSource(node.value);
+    }
+
+    try merger.prepare();
+
+    var items = std.ArrayList(Item).init(std.testing.allocator);
+    defer items.deinit();
+
+    while (try merger.read()) |item| {
+        try items.append(item);
+        merger.advance();
+    }
+
+    try std.testing.expectEqualSlices(Item, &.{
+        .{ .hash = 1, .id = 4 },
+        .{ .hash = 3, .id = 3 },
+        .{ .hash = 4, .id = 1 },
+        .{ .hash = 5, .id = 3 },
+        .{ .hash = 6, .id = 4 },
+        .{ .hash = 7, .id = 3 },
+    }, items.items);
+}
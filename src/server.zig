@@ -9,13 +9,48 @@ const MultiIndex = @import("MultiIndex.zig");
 const Index = @import("Index.zig");
 const common = @import("common.zig");
 const SearchResults = common.SearchResults;
+const SearchOptions = common.SearchOptions;
 const Change = @import("change.zig").Change;
 const Deadline = @import("utils/Deadline.zig");
+const SearchProfile = @import("SearchProfile.zig");
+const Replica = @import("Replica.zig");
+const ShardRouter = @import("ShardRouter.zig");
+const AdmissionController = @import("utils/AdmissionController.zig");
+const mapped_memory = @import("utils/mapped_memory.zig");
 
 const metrics = @import("metrics.zig");
 
 const Context = struct {
     indexes: *MultiIndex,
+    // set in replica mode, the indexes are then read-only
+    replica: ?*Replica = null,
+    // sharded indexes, routed to local or remote shards
+    shard_router: ?*ShardRouter = null,
+    // concurrency limits, unset if unlimited
+    search_admission: ?*AdmissionController = null,
+    update_admission: ?*AdmissionController = null,
+    // replication long-polls hold a worker thread while waiting, so only a few can wait at once
+    max_long_polls: usize = 1,
+    long_polls: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+
+    fn tryStartLongPoll(self: *Context) bool {
+        const prev = self.long_polls.fetchAdd(1, .acquire);
+        if (prev >= self.max_long_polls) {
+            _ = self.long_polls.fetchSub(1, .release);
+            return false;
+        }
+        return true;
+    }
+
+    fn finishLongPoll(self: *Context) void {
+        _ = self.long_polls.fetchSub(1, .release);
+    }
+
+    fn getShardedIndex(self: *Context, req: *httpz.Request) ?ShardRouter.ShardedIndex {
+        const shard_router = self.shard_router orelse return null;
+        const index_name = req.param("index") orelse return null;
+        return shard_router.getIndex(index_name);
+    }
 };
 
 const Server = httpz.ServerApp(*Context);
@@ -46,8 +81,36 @@ fn installSignalHandlers(server: *Server) !void {
     }, null);
 }
 
-pub fn run(allocator: std.mem.Allocator, indexes: *MultiIndex, address: []const u8, port: u16, threads: u16) !void {
-    var ctx = Context{ .indexes = indexes };
+pub const AdmissionOptions = struct {
+    search: AdmissionController.Options = .{},
+    update: AdmissionController.Options = .{},
+};
+
+// Concurrency limits, shared by the HTTP and the legacy protocol servers, unset if unlimited.
+pub const AdmissionControllers = struct {
+    search: ?*AdmissionController = null,
+    update: ?*AdmissionController = null,
+};
+
+// Waiting requests must not take all server threads, so the queues are shortened if needed.
+pub fn limitAdmissionQueues(admission: AdmissionOptions, threads: u16) AdmissionOptions {
+    var limits = admission;
+    AdmissionController.limitQueueSizes(&.{ &limits.search, &limits.update }, threads);
+    if (limits.search.max_queue_size < admission.search.max_queue_size or limits.update.max_queue_size < admission.update.max_queue_size) {
+        log.warn("admission queues limited to {} searches and {} updates, there are only {} threads", .{ limits.search.max_queue_size, limits.update.max_queue_size, threads });
+    }
+    return limits;
+}
+
+pub fn run(allocator: std.mem.Allocator, indexes: *MultiIndex, replica: ?*Replica, shard_router: ?*ShardRouter, admission: AdmissionControllers, address: []const u8, port: u16, threads: u16) !void {
+    var ctx = Context{
+        .indexes = indexes,
+        .replica = replica,
+        .shard_router = shard_router,
+        .search_admission = admission.search,
+        .update_admission = admission.update,
+        .max_long_polls = @max(threads / 4, 1),
+    };
 
     const config = httpz.Config{
         .address = address,
@@ -81,10 +144,17 @@ pub fn run(allocator: std.mem.Allocator, indexes: *MultiIndex, address: []const
 
     // Search API
     router.post("/:index/_search", handleSearch);
+    router.post("/:index/_msearch", handleMultiSearch);
 
     // Bulk API
     router.post("/:index/_update", handleUpdate);
 
+    // Replication API
+    router.get("/:index/_replicate", handleReplicate);
+    router.post("/:index/_snapshot", handleCreateSnapshot);
+    router.get("/:index/_snapshot/:snapshot/:file", handleGetSnapshotFile);
+    router.delete("/:index/_snapshot/:snapshot", handleDeleteSnapshot);
+
     // Fingerprint API
     router.head("/:index/:id", handleHeadFingerprint);
     router.get("/:index/:id", handleGetFingerprint);
@@ -101,17 +171,28 @@ pub fn run(allocator: std.mem.Allocator, indexes: *MultiIndex, address: []const
     try server.listen();
 }
 
-const default_search_timeout = 500;
+pub const default_search_timeout = 500;
 const max_search_timeout = 10000;
 
-const default_search_limit = 40;
+pub const default_search_limit = 40;
 const min_search_limit = 1;
 const max_search_limit = 100;
 
+const max_multi_search_queries = 100;
+
+const default_replication_limit = 1000;
+const max_replication_limit = 10000;
+const max_replication_wait = 30000;
+const snapshot_chunk_size = 1024 * 1024;
+
 const SearchRequestJSON = struct {
     query: []u32,
     timeout: u32 = default_search_timeout,
     limit: u32 = default_search_limit,
+    // set to false to bypass the result cache
+    cache: bool = true,
+    // return a breakdown of the search time, implies cache = false
+    profile: bool = false,
 
     pub fn msgpackFormat() msgpack.StructFormat {
         return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
@@ -127,8 +208,94 @@ const SearchResultJSON = struct {
     }
 };
 
+const SearchProfileSegmentJSON = struct {
+    type: []const u8,
+    version: u64,
+    merges: u64,
+    duration_us: u64,
+    hashes: u64,
+    hashes_cut_off: u64,
+    blocks: u64,
+    postings: u64,
+    decoded_items: u64,
+    decode_us: u64,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const SearchProfileJSON = struct {
+    duration_us: u64,
+    segments: []SearchProfileSegmentJSON,
+    hashes_pruned: u64,
+    candidates: u64,
+    dense_accumulator: bool,
+    finish_us: u64,
+    timed_out: bool,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+
+    fn init(allocator: std.mem.Allocator, profile: *const SearchProfile, duration_ns: u64) !SearchProfileJSON {
+        const segments = try allocator.alloc(SearchProfileSegmentJSON, profile.segments.items.len);
+        for (profile.segments.items, 0..) |segment, i| {
+            segments[i] = .{
+                .type = @tagName(segment.type),
+                .version = segment.info.version,
+                .merges = segment.info.merges,
+                .duration_us = segment.duration_ns / std.time.ns_per_us,
+                .hashes = segment.hashes,
+                .hashes_cut_off = segment.hashes_cut_off,
+                .blocks = segment.blocks,
+                .postings = segment.postings,
+                .decoded_items = segment.decoded_items,
+                .decode_us = segment.decode_ns / std.time.ns_per_us,
+            };
+        }
+        return .{
+            .duration_us = duration_ns / std.time.ns_per_us,
+            .segments = segments,
+            .hashes_pruned = profile.hashes_pruned,
+            .candidates = profile.candidates,
+            .dense_accumulator = profile.dense_accumulator,
+            .finish_us = profile.finish_ns / std.time.ns_per_us,
+            .timed_out = profile.timed_out,
+        };
+    }
+};
+
 const SearchResultsJSON = struct {
     results: []SearchResultJSON,
+    profile: ?SearchProfileJSON = null,
+    // set for sharded indexes, if some shards were too slow or failed
+    partial: ?bool = null,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 }, .omit_nulls = true } };
+    }
+};
+
+const MultiSearchRequestJSON = struct {
+    queries: []SearchRequestJSON,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const MultiSearchResponseJSON = struct {
+    results: []SearchResultJSON,
+    timed_out: bool = false,
+
+    pub fn msgpackFormat() msgpack.StructFormat {
+        return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
+    }
+};
+
+const MultiSearchResultsJSON = struct {
+    responses: []MultiSearchResponseJSON,
 
     pub fn msgpackFormat() msgpack.StructFormat {
         return .{ .as_map = .{ .key = .{ .field_name_prefix = 1 } } };
@@ -166,6 +333,11 @@ fn getIndex(ctx: *Context, req: *httpz.Request, res: *httpz.Response, send_body:
         }
         return null;
     };
+    if (ctx.replica) |replica| {
+        if (!replica.isIndexReady(index_name)) {
+            return error.IndexNotReady;
+        }
+    }
     const index = ctx.indexes.getIndex(index_name) catch |err| {
         log.warn("error during getIndex: {}", .{err});
         if (err == error.IndexNotFound) {
@@ -217,7 +389,7 @@ fn writeResponse(value: anytype, req: *httpz.Request, res: *httpz.Response) !voi
     const content_type = parseAcceptHeader(req);
 
     switch (content_type) {
-        .json => try res.json(value, .{}),
+        .json => try res.json(value, .{ .emit_null_optional_fields = false }),
         .msgpack => {
             res.header("content-type", "application/vnd.msgpack");
             try msgpack.encode(value, res.writer());
@@ -245,6 +417,21 @@ fn handleError(_: *Context, req: *httpz.Request, res: *httpz.Response, err: anye
                 res.body = "not ready yet";
             };
         },
+        error.IndexFailed => {
+            // an update could not be applied, the index needs to be reopened
+            writeErrorResponse(503, err, req, res) catch {
+                res.status = 503;
+                res.body = "index failed";
+            };
+        },
+        error.MemoryLimitExceeded => {
+            // checkpoints are behind, the client can retry soon
+            res.header("retry-after", "1");
+            writeErrorResponse(503, err, req, res) catch {
+                res.status = 503;
+                res.body = "memory limit exceeded";
+            };
+        },
         else => {
             log.err("unhandled error in {s}: {any}", .{ req.url.raw, err });
             writeErrorResponse(500, err, req, res) catch {
@@ -292,15 +479,84 @@ fn getRequestBody(comptime T: type, req: *httpz.Request, res: *httpz.Response) !
     unreachable;
 }
 
+fn parseQueryParam(comptime T: type, value: ?[]const u8, default: T) !T {
+    return std.fmt.parseInt(T, value orelse return default, 10);
+}
+
+// Replicas only get changes from the primary.
+fn checkWritable(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !bool {
+    if (ctx.replica != null) {
+        try writeErrorResponse(405, error.ReadOnlyReplica, req, res);
+        return false;
+    }
+    return true;
+}
+
+pub const Admission = struct {
+    controller: ?*AdmissionController = null,
+    permit: AdmissionController.Permit = undefined,
+
+    // Waits for a slot, without a controller there is no limit.
+    pub fn acquire(controller: ?*AdmissionController, deadline: Deadline) AdmissionController.Error!Admission {
+        const c = controller orelse return .{};
+        return .{ .controller = c, .permit = try c.acquire(deadline) };
+    }
+
+    pub fn release(self: *Admission) void {
+        if (self.controller) |controller| {
+            controller.release(&self.permit);
+        }
+    }
+};
+
+// Waits for the request's turn, before it takes any index resources. If the request is shed,
+// writes the error response and returns null.
+fn admitRequest(controller: ?*AdmissionController, deadline: Deadline, req: *httpz.Request, res: *httpz.Response) !?Admission {
+    return Admission.acquire(controller, deadline) catch |err| {
+        res.header("retry-after", "1");
+        try writeErrorResponse(if (err == error.TooManyRequests) 429 else 503, err, req, res);
+        return null;
+    };
+}
+
+pub fn getSearchOptions(index_options: Index.Options, query_len: usize, limit: u32) SearchOptions {
+    return .{
+        .max_results = limit,
+        .min_score = @intCast((query_len + 19) / 20),
+        .min_score_pct = 10,
+        .max_docs_per_hash = index_options.max_docs_per_hash,
+        .max_hash_frequency = index_options.max_hash_frequency,
+    };
+}
+
+fn handleShardedSearch(ctx: *Context, sharded_index: ShardRouter.ShardedIndex, body: SearchRequestJSON, limit: u32, deadline: Deadline, req: *httpz.Request, res: *httpz.Response) !void {
+    metrics.search();
+
+    const options = getSearchOptions(ctx.indexes.index_options, body.query.len, limit);
+    const response = try ctx.shard_router.?.search(req.arena, sharded_index, body.query, options, deadline);
+
+    if (response.results.len == 0) {
+        metrics.searchMiss();
+    } else {
+        metrics.searchHit();
+    }
+
+    var results_json = SearchResultsJSON{
+        .results = try req.arena.alloc(SearchResultJSON, response.results.len),
+        .partial = response.partial,
+    };
+    for (response.results, 0..) |r, i| {
+        results_json.results[i] = SearchResultJSON{ .id = r.id, .score = r.score };
+    }
+    return writeResponse(results_json, req, res);
+}
+
 fn handleSearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
     const start_time = std.time.milliTimestamp();
     defer metrics.searchDuration(std.time.milliTimestamp() - start_time);
 
     const body = try getRequestBody(SearchRequestJSON, req, res) orelse return;
 
-    const index = try getIndex(ctx, req, res, true) orelse return;
-    defer releaseIndex(ctx, index);
-
     const limit = @max(@min(body.limit, max_search_limit), min_search_limit);
 
     var timeout = body.timeout;
@@ -309,15 +565,34 @@ fn handleSearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void
     }
     const deadline = Deadline.init(timeout);
 
+    var admission = try admitRequest(ctx.search_admission, deadline, req, res) orelse return;
+    defer admission.release();
+
+    if (ctx.getShardedIndex(req)) |sharded_index| {
+        return handleShardedSearch(ctx, sharded_index, body, limit, deadline, req, res);
+    }
+
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
     metrics.search();
 
-    var collector = SearchResults.init(req.arena, .{
-        .max_results = limit,
-        .min_score = @intCast((body.query.len + 19) / 20),
-        .min_score_pct = 10,
-    });
+    var collector = SearchResults.init(req.arena, getSearchOptions(index.options, body.query.len, limit));
 
-    try index.search(body.query, &collector, deadline);
+    var profile = SearchProfile.init(req.arena);
+    if (body.profile) {
+        collector.profile = &profile;
+    }
+
+    var timer = std.time.Timer.start() catch unreachable;
+    index.searchWithCache(body.query, &collector, deadline, body.cache and !body.profile) catch |err| {
+        // with profiling, a timeout is reported in the profile
+        if (err != error.Timeout or !body.profile) {
+            return err;
+        }
+        profile.timed_out = true;
+    };
+    const duration_ns = timer.read();
 
     const results = collector.getResults();
 
@@ -333,6 +608,68 @@ fn handleSearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void
     for (results, 0..) |r, i| {
         results_json.results[i] = SearchResultJSON{ .id = r.id, .score = r.score };
     }
+    if (body.profile) {
+        results_json.profile = try SearchProfileJSON.init(req.arena, &profile, duration_ns);
+    }
+    return writeResponse(results_json, req, res);
+}
+
+fn handleMultiSearch(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const start_time = std.time.milliTimestamp();
+    defer metrics.searchDuration(std.time.milliTimestamp() - start_time);
+
+    const body = try getRequestBody(MultiSearchRequestJSON, req, res) orelse return;
+
+    if (body.queries.len > max_multi_search_queries) {
+        try writeErrorResponse(400, error.TooManyQueries, req, res);
+        return;
+    }
+
+    var max_timeout: u32 = 0;
+    for (body.queries) |query| {
+        max_timeout = @max(max_timeout, @min(query.timeout, max_search_timeout));
+    }
+
+    var admission = try admitRequest(ctx.search_admission, Deadline.init(max_timeout), req, res) orelse return;
+    defer admission.release();
+
+    // the batch must not look like one slow search to the admission of single searches
+    admission.permit.num_requests = body.queries.len;
+
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const queries = try req.arena.alloc(Index.MultiSearchQuery, body.queries.len);
+    for (body.queries, 0..) |query, i| {
+        queries[i] = .{
+            .hashes = query.query,
+            .options = getSearchOptions(index.options, query.query.len, @max(@min(query.limit, max_search_limit), min_search_limit)),
+            .timeout_ms = @min(query.timeout, max_search_timeout),
+            .use_cache = query.cache,
+        };
+        metrics.search();
+    }
+
+    try index.multiSearch(req.arena, queries);
+
+    var results_json = MultiSearchResultsJSON{
+        .responses = try req.arena.alloc(MultiSearchResponseJSON, queries.len),
+    };
+    for (queries, 0..) |query, i| {
+        if (query.results.len == 0) {
+            metrics.searchMiss();
+        } else {
+            metrics.searchHit();
+        }
+        const response = &results_json.responses[i];
+        response.* = .{
+            .results = try req.arena.alloc(SearchResultJSON, query.results.len),
+            .timed_out = query.timed_out,
+        };
+        for (query.results, 0..) |r, j| {
+            response.results[j] = SearchResultJSON{ .id = r.id, .score = r.score };
+        }
+    }
     return writeResponse(results_json, req, res);
 }
 
@@ -345,8 +682,19 @@ const UpdateRequestJSON = struct {
 };
 
 fn handleUpdate(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    if (!try checkWritable(ctx, req, res)) return;
+
     const body = try getRequestBody(UpdateRequestJSON, req, res) orelse return;
 
+    var admission = try admitRequest(ctx.update_admission, .{}, req, res) orelse return;
+    defer admission.release();
+
+    if (ctx.getShardedIndex(req)) |sharded_index| {
+        metrics.update(body.changes.len);
+        try ctx.shard_router.?.update(sharded_index, body.changes);
+        return writeResponse(EmptyResponse{}, req, res);
+    }
+
     const index = try getIndex(ctx, req, res, true) orelse return;
     defer releaseIndex(ctx, index);
 
@@ -357,6 +705,156 @@ fn handleUpdate(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void
     return writeResponse(EmptyResponse{}, req, res);
 }
 
+// Returns committed transactions, starting at the `from` commit id. If there are none yet,
+// the request waits up to `wait` milliseconds for new ones, so replicas can long-poll it.
+fn handleReplicate(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const query = try req.query();
+    const from = parseQueryParam(u64, query.get("from"), 1) catch |err| {
+        return writeErrorResponse(400, err, req, res);
+    };
+    const limit = parseQueryParam(usize, query.get("limit"), default_replication_limit) catch |err| {
+        return writeErrorResponse(400, err, req, res);
+    };
+    const wait = parseQueryParam(u64, query.get("wait"), 0) catch |err| {
+        return writeErrorResponse(400, err, req, res);
+    };
+
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    // if too many replicas are already waiting, only return what's there now
+    const long_poll = wait > 0 and ctx.tryStartLongPoll();
+    defer if (long_poll) ctx.finishLongPoll();
+
+    const result = index.readTransactions(req.arena, @max(from, 1), .{
+        .max_transactions = @max(@min(limit, max_replication_limit), 1),
+        .timeout_ns = if (long_poll) @as(u64, @min(wait, max_replication_wait)) * std.time.ns_per_ms else 0,
+    }) catch |err| {
+        // the oplog was already truncated, the replica needs a copy of the segments
+        if (err == error.CommitNotAvailable) {
+            return writeErrorResponse(410, err, req, res);
+        }
+        return err;
+    };
+
+    // don't let the replica poll again right away
+    if (wait > 0 and !long_poll and result.transactions.len == 0) {
+        res.header("retry-after", "1");
+        return writeErrorResponse(503, error.TooManyLongPolls, req, res);
+    }
+
+    return writeResponse(result, req, res);
+}
+
+fn getSnapshotId(req: *httpz.Request, res: *httpz.Response) !?u64 {
+    const snapshot_id_str = req.param("snapshot") orelse {
+        try writeErrorResponse(400, error.MissingSnapshotId, req, res);
+        return null;
+    };
+    return std.fmt.parseInt(u64, snapshot_id_str, 10) catch |err| {
+        try writeErrorResponse(400, err, req, res);
+        return null;
+    };
+}
+
+// Pins the current segment files, so that they can be downloaded by a new replica.
+fn handleCreateSnapshot(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    const snapshot = try index.createSnapshot(req.arena);
+
+    return writeResponse(snapshot, req, res);
+}
+
+const ByteRange = struct {
+    start: u64,
+    end: u64,
+};
+
+// Only a single range is supported, e.g. "bytes=100-" or "bytes=100-199".
+fn parseRangeHeader(value: []const u8, size: u64) !ByteRange {
+    const prefix = "bytes=";
+    if (!std.mem.startsWith(u8, value, prefix)) {
+        return error.InvalidRange;
+    }
+    const spec = value[prefix.len..];
+    const sep = std.mem.indexOfScalar(u8, spec, '-') orelse return error.InvalidRange;
+    const start = try std.fmt.parseInt(u64, spec[0..sep], 10);
+    var end = size;
+    if (sep + 1 < spec.len) {
+        end = @min(size, try std.fmt.parseInt(u64, spec[sep + 1 ..], 10) + 1);
+    }
+    if (start >= end) {
+        return error.InvalidRange;
+    }
+    return .{ .start = start, .end = end };
+}
+
+// Sends a segment file straight from the mapped memory, the segment is referenced until
+// the whole response is written.
+fn handleGetSnapshotFile(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const snapshot_id = try getSnapshotId(req, res) orelse return;
+    const file_name = req.param("file") orelse {
+        return writeErrorResponse(400, error.MissingFileName, req, res);
+    };
+
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    var segment = index.acquireSnapshotSegment(snapshot_id, file_name) catch |err| {
+        if (err == error.SnapshotNotFound or err == error.SegmentNotFound) {
+            return writeErrorResponse(404, err, req, res);
+        }
+        return err;
+    };
+    defer index.releaseSnapshotSegment(&segment);
+
+    const data = segment.value.getFileData() orelse return error.SegmentNotMapped;
+
+    var range = ByteRange{ .start = 0, .end = data.len };
+    if (req.header("range")) |range_header| {
+        range = parseRangeHeader(range_header, data.len) catch |err| {
+            res.header("content-range", try std.fmt.allocPrint(req.arena, "bytes */{d}", .{data.len}));
+            return writeErrorResponse(416, err, req, res);
+        };
+        res.status = 206;
+        res.header("content-range", try std.fmt.allocPrint(req.arena, "bytes {d}-{d}/{d}", .{ range.start, range.end - 1, data.len }));
+    }
+    res.header("accept-ranges", "bytes");
+    res.header("content-type", "application/octet-stream");
+
+    // The response is written by httpz, which owns the socket and the chunked framing,
+    // so there is no sendfile here. We copy from the mapping instead, and read the next
+    // chunk ahead while the current one is being sent, so the copy rarely waits for disk.
+    var offset = range.start;
+    mapped_memory.prefetch(data[offset..@min(offset + snapshot_chunk_size, range.end)]);
+    while (offset < range.end) {
+        const chunk_end = @min(offset + snapshot_chunk_size, range.end);
+        if (chunk_end < range.end) {
+            mapped_memory.prefetch(data[chunk_end..@min(chunk_end + snapshot_chunk_size, range.end)]);
+        }
+        try res.chunk(data[offset..chunk_end]);
+        offset = chunk_end;
+    }
+}
+
+fn handleDeleteSnapshot(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    const snapshot_id = try getSnapshotId(req, res) orelse return;
+
+    const index = try getIndex(ctx, req, res, true) orelse return;
+    defer releaseIndex(ctx, index);
+
+    index.releaseSnapshot(snapshot_id) catch |err| {
+        if (err == error.SnapshotNotFound) {
+            return writeErrorResponse(404, err, req, res);
+        }
+        return err;
+    };
+
+    return writeResponse(EmptyResponse{}, req, res);
+}
+
 fn handleHeadFingerprint(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
     const index = try getIndex(ctx, req, res, false) orelse return;
     defer releaseIndex(ctx, index);
@@ -402,6 +900,8 @@ const PutFingerprintRequest = struct {
 };
 
 fn handlePutFingerprint(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    if (!try checkWritable(ctx, req, res)) return;
+
     const body = try getRequestBody(PutFingerprintRequest, req, res) orelse return;
 
     const index = try getIndex(ctx, req, res, true) orelse return;
@@ -421,6 +921,8 @@ fn handlePutFingerprint(ctx: *Context, req: *httpz.Request, res: *httpz.Response
 }
 
 fn handleDeleteFingerprint(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    if (!try checkWritable(ctx, req, res)) return;
+
     const index = try getIndex(ctx, req, res, true) orelse return;
     defer releaseIndex(ctx, index);
 
@@ -491,6 +993,8 @@ fn handleGetIndex(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !voi
 const EmptyResponse = struct {};
 
 fn handlePutIndex(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    if (!try checkWritable(ctx, req, res)) return;
+
     const index_name = req.param("index") orelse return;
 
     try ctx.indexes.createIndex(index_name);
@@ -499,6 +1003,8 @@ fn handlePutIndex(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !voi
 }
 
 fn handleDeleteIndex(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
+    if (!try checkWritable(ctx, req, res)) return;
+
     const index_name = req.param("index") orelse return;
 
     try ctx.indexes.deleteIndex(index_name);
@@ -516,8 +1022,18 @@ fn handleIndexHealth(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !
     defer releaseIndex(ctx, index);
 
     try index.checkReady();
+    try index.checkNotFailed();
 
     try res.writer().writeAll("OK\n");
+
+    if (ctx.replica) |replica| {
+        if (replica.getIndexStatus(req.param("index").?)) |status| {
+            try res.writer().print("replication_lag_commits {d}\nreplication_lag_seconds {d:.3}\n", .{
+                status.lag_commits,
+                @as(f64, @floatFromInt(status.lag_ms)) / std.time.ms_per_s,
+            });
+        }
+    }
 }
 
 fn handleHealth(ctx: *Context, req: *httpz.Request, res: *httpz.Response) !void {
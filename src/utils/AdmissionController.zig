@@ -0,0 +1,244 @@
+const std = @import("std");
+
+const Deadline = @import("Deadline.zig");
+const metrics = @import("../metrics.zig");
+
+const Self = @This();
+
+// Admission control for one kind of requests. At most max_concurrent requests run at the
+// same time, others wait in a bounded queue. Requests are shed instead of queued when the
+// queue is full, or when their deadline leaves less time than requests usually take.
+// Requests whose deadline expires while waiting are dropped before doing any work.
+
+pub const Options = struct {
+    // Zero means unlimited, requests are then never queued.
+    max_concurrent: usize = 0,
+    max_queue_size: usize = 64,
+    // How long requests without a deadline can wait in the queue.
+    max_queue_wait_ms: u64 = 1000,
+};
+
+pub const Error = error{
+    // the queue is full
+    TooManyRequests,
+    // the deadline would expire before the request could finish
+    DeadlineTooShort,
+    // the deadline expired while waiting in the queue
+    DeadlineExpired,
+    QueueTimeout,
+};
+
+// weight of the older requests in the moving average of service time, the last one has 0.1
+const service_time_decay = 0.9;
+
+name: []const u8,
+options: Options,
+
+lock: std.Thread.Mutex = .{},
+slot_released: std.Thread.Condition = .{},
+running: usize = 0,
+queued: usize = 0,
+
+// exponential moving average of how long admitted requests take, in microseconds
+service_time_us: std.atomic.Value(u64) = std.atomic.Value(u64).init(0),
+
+pub const Permit = struct {
+    timer: std.time.Timer,
+    // The permit can be used for a batch of requests run one by one, e.g. a multi-search,
+    // the service time is then recorded per request.
+    num_requests: usize = 1,
+};
+
+pub fn init(name: []const u8, options: Options) Self {
+    return .{ .name = name, .options = options };
+}
+
+// Running and queued requests each block a server thread. Lowers the queue sizes, so that
+// together with the running requests, they always leave a quarter of the threads (at least one)
+// for other requests, e.g. health checks and metrics, or requests of another controller.
+pub fn limitQueueSizes(controllers: []const *Options, threads: usize) void {
+    var available = threads -| @max(threads / 4, 1);
+    var limited: usize = 0;
+    for (controllers) |options| {
+        if (options.max_concurrent > 0) {
+            available -|= options.max_concurrent;
+            limited += 1;
+        }
+    }
+    if (limited == 0) {
+        return;
+    }
+    for (controllers) |options| {
+        if (options.max_concurrent > 0) {
+            options.max_queue_size = @min(options.max_queue_size, available / limited);
+        }
+    }
+}
+
+pub fn getExpectedServiceTimeMs(self: *const Self) i64 {
+    return @intCast(self.service_time_us.load(.monotonic) / std.time.us_per_ms);
+}
+
+// Waits for a free slot, the permit then needs to be released.
+pub fn acquire(self: *Self, deadline: Deadline) Error!Permit {
+    const wait_start = std.time.Instant.now() catch unreachable;
+
+    self.acquireSlot(deadline) catch |err| {
+        metrics.admissionRejection(self.name, err);
+        return err;
+    };
+
+    const wait_end = std.time.Instant.now() catch unreachable;
+    metrics.admissionQueueWait(self.name, wait_end.since(wait_start));
+
+    return .{ .timer = std.time.Timer.start() catch unreachable };
+}
+
+fn acquireSlot(self: *Self, deadline: Deadline) Error!void {
+    if (self.options.max_concurrent == 0) {
+        return;
+    }
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    if (self.running < self.options.max_concurrent and self.queued == 0) {
+        self.running += 1;
+        return;
+    }
+
+    if (self.queued >= self.options.max_queue_size) {
+        return error.TooManyRequests;
+    }
+
+    const remaining_ms = deadline.getRemainingMs();
+    if (remaining_ms) |ms| {
+        if (ms < self.getExpectedServiceTimeMs()) {
+            return error.DeadlineTooShort;
+        }
+    }
+
+    var queue_deadline = Deadline.init(@intCast(self.options.max_queue_wait_ms));
+    if (remaining_ms) |ms| {
+        queue_deadline = deadline;
+        if (ms == 0) {
+            return error.DeadlineExpired;
+        }
+    }
+
+    self.queued += 1;
+    defer self.queued -= 1;
+
+    while (self.running >= self.options.max_concurrent) {
+        const wait_ms = queue_deadline.getRemainingMs() orelse unreachable;
+        if (wait_ms == 0) {
+            // someone else can use the slot we might have been woken up for
+            self.slot_released.signal();
+            return if (remaining_ms != null) error.DeadlineExpired else error.QueueTimeout;
+        }
+        self.slot_released.timedWait(&self.lock, @as(u64, @intCast(wait_ms)) * std.time.ns_per_ms) catch {};
+    }
+
+    self.running += 1;
+}
+
+pub fn release(self: *Self, permit: *Permit) void {
+    const duration_us = permit.timer.read() / std.time.ns_per_us / @max(permit.num_requests, 1);
+
+    // races between concurrent updates only lose a sample, that's fine for an average
+    const prev: f64 = @floatFromInt(self.service_time_us.load(.monotonic));
+    const next = prev * service_time_decay + @as(f64, @floatFromInt(duration_us)) * (1 - service_time_decay);
+    self.service_time_us.store(@intFromFloat(next), .monotonic);
+
+    if (self.options.max_concurrent == 0) {
+        return;
+    }
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    std.debug.assert(self.running > 0);
+    self.running -= 1;
+    self.slot_released.signal();
+}
+
+test "AdmissionController limits concurrency" {
+    var controller = Self.init("test", .{ .max_concurrent = 1, .max_queue_size = 0 });
+
+    var permit = try controller.acquire(.{});
+    try std.testing.expectError(error.TooManyRequests, controller.acquire(.{}));
+
+    controller.release(&permit);
+
+    var permit2 = try controller.acquire(.{});
+    controller.release(&permit2);
+}
+
+test "AdmissionController queues leave threads for other requests" {
+    var search = Options{ .max_concurrent = 8, .max_queue_size = 64 };
+    var update = Options{ .max_concurrent = 2, .max_queue_size = 64 };
+    var unlimited = Options{ .max_queue_size = 64 };
+
+    limitQueueSizes(&.{ &search, &update, &unlimited }, 32);
+    // 32 threads, 8 reserved, 10 running, the remaining 14 split between the queues
+    try std.testing.expectEqual(7, search.max_queue_size);
+    try std.testing.expectEqual(7, update.max_queue_size);
+    try std.testing.expectEqual(64, unlimited.max_queue_size);
+
+    // more running requests than threads, nothing can be queued
+    limitQueueSizes(&.{ &search, &update }, 8);
+    try std.testing.expectEqual(0, search.max_queue_size);
+    try std.testing.expectEqual(0, update.max_queue_size);
+}
+
+test "AdmissionController records service time per request of a batch" {
+    var controller = Self.init("test", .{ .max_concurrent = 1 });
+
+    var permit = try controller.acquire(.{});
+    permit.num_requests = 10;
+    std.time.sleep(20 * std.time.ns_per_ms);
+    controller.release(&permit);
+
+    // 0.1 of the ~2ms per request, the whole batch would be over 2ms
+    try std.testing.expect(controller.service_time_us.load(.monotonic) < 2 * std.time.us_per_ms);
+}
+
+test "AdmissionController drops requests that can't finish in time" {
+    var controller = Self.init("test", .{ .max_concurrent = 1, .max_queue_size = 10, .max_queue_wait_ms = 10 });
+
+    var permit = try controller.acquire(.{});
+    defer controller.release(&permit);
+
+    // waits in the queue until the deadline
+    try std.testing.expectError(error.DeadlineExpired, controller.acquire(Deadline.init(10)));
+    // no deadline, waits up to max_queue_wait_ms
+    try std.testing.expectError(error.QueueTimeout, controller.acquire(.{}));
+
+    controller.service_time_us.store(1000 * std.time.us_per_ms, .monotonic);
+    try std.testing.expectError(error.DeadlineTooShort, controller.acquire(Deadline.init(100)));
+}
+
+test "AdmissionController wakes up queued requests" {
+    var controller = Self.init("test", .{ .max_concurrent = 1, .max_queue_size = 10 });
+
+    var permit = try controller.acquire(.{});
+
+    const Waiter = struct {
+        fn run(c: *Self, admitted: *std.atomic.Value(bool)) void {
+            var p = c.acquire(Deadline.init(5000)) catch return;
+            admitted.store(true, .release);
+            c.release(&p);
+        }
+    };
+
+    var admitted = std.atomic.Value(bool).init(false);
+    const thread = try std.Thread.spawn(.{}, Waiter.run, .{ &controller, &admitted });
+
+    std.time.sleep(10 * std.time.ns_per_ms);
+    try std.testing.expect(!admitted.load(.acquire));
+
+    controller.release(&permit);
+    thread.join();
+
+    try std.testing.expect(admitted.load(.acquire));
+}
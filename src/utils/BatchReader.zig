@@ -0,0 +1,220 @@
+const std = @import("std");
+const log = std.log.scoped(.batch_reader);
+const linux = std.os.linux;
+const IoUring = linux.IoUring;
+
+const Self = @This();
+
+// Reads many ranges of files at once. With io_uring, all reads of a batch are submitted together,
+// so the disk can work on them in parallel, instead of waiting for one pread at a time.
+// Rings are reused by later batches, each batch uses its own ring while it runs.
+
+pub const Options = struct {
+    // Maximum number of reads in flight per batch, larger batches are submitted in parts.
+    queue_depth: u16 = 64,
+    // Use plain pread, e.g. if io_uring is blocked by seccomp.
+    use_io_uring: bool = true,
+};
+
+pub const Request = struct {
+    file: std.fs.File,
+    offset: u64,
+    buffer: []u8,
+};
+
+allocator: std.mem.Allocator,
+options: Options,
+
+lock: std.Thread.Mutex = .{},
+free_rings: std.ArrayListUnmanaged(*IoUring) = .{},
+io_uring_unavailable: std.atomic.Value(bool) = std.atomic.Value(bool).init(false),
+
+pub fn init(allocator: std.mem.Allocator, options: Options) Self {
+    return .{
+        .allocator = allocator,
+        .options = options,
+    };
+}
+
+pub fn deinit(self: *Self) void {
+    for (self.free_rings.items) |ring| {
+        self.destroyRing(ring);
+    }
+    self.free_rings.deinit(self.allocator);
+}
+
+fn destroyRing(self: *Self, ring: *IoUring) void {
+    ring.deinit();
+    self.allocator.destroy(ring);
+}
+
+fn acquireRing(self: *Self) ?*IoUring {
+    if (!self.options.use_io_uring or self.io_uring_unavailable.load(.monotonic)) {
+        return null;
+    }
+
+    {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        if (self.free_rings.popOrNull()) |ring| {
+            return ring;
+        }
+    }
+
+    const ring = self.allocator.create(IoUring) catch return null;
+    ring.* = IoUring.init(self.options.queue_depth, 0) catch |err| {
+        self.allocator.destroy(ring);
+        if (!self.io_uring_unavailable.swap(true, .monotonic)) {
+            log.warn("io_uring is not available, using pread: {}", .{err});
+        }
+        return null;
+    };
+    return ring;
+}
+
+fn releaseRing(self: *Self, ring: *IoUring) void {
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    self.free_rings.append(self.allocator, ring) catch {
+        self.destroyRing(ring);
+    };
+}
+
+// Fills all request buffers, fails if any of the reads fails or the file is too short.
+pub fn readAll(self: *Self, requests: []const Request) !void {
+    if (requests.len > 1) {
+        if (self.acquireRing()) |ring| {
+            var read_error: ?anyerror = null;
+            var in_flight: usize = 0;
+            readAllWithRing(ring, requests, &read_error, &in_flight) catch |err| {
+                // the kernel can still write into the buffers, the reads must finish before we return
+                drainRing(ring, in_flight) catch |drain_err| {
+                    // closing the ring doesn't stop the reads, so it's better to keep it open
+                    log.err("failed to wait for {} reads in flight, leaking the ring: {}", .{ in_flight, drain_err });
+                    return err;
+                };
+                // there can be unsubmitted reads left, so the ring can't be reused
+                self.destroyRing(ring);
+                return err;
+            };
+            self.releaseRing(ring);
+            if (read_error) |err| {
+                return err;
+            }
+            return;
+        }
+    }
+    return readAllWithPread(requests);
+}
+
+pub fn readAllWithPread(requests: []const Request) !void {
+    for (requests) |request| {
+        try readOne(request);
+    }
+}
+
+fn readOne(request: Request) !void {
+    const n = try request.file.preadAll(request.buffer, request.offset);
+    if (n < request.buffer.len) {
+        return error.EndOfStream;
+    }
+}
+
+// Failed reads are reported in read_error, errors of the ring itself are returned,
+// with the number of reads that the kernel already has in in_flight.
+fn readAllWithRing(ring: *IoUring, requests: []const Request, read_error: *?anyerror, in_flight: *usize) !void {
+    var cqes: [16]linux.io_uring_cqe = undefined;
+    var submitted: usize = 0;
+    var completed: usize = 0;
+    // reads that are still in the submission queue are not in flight
+    errdefer in_flight.* = submitted - completed - ring.sq_ready();
+
+    // Submitted buffers are owned by the kernel until their completion, so after an error
+    // we stop submitting, but still wait for everything in flight.
+    while (completed < submitted or (submitted < requests.len and read_error.* == null)) {
+        while (submitted < requests.len and read_error.* == null) {
+            const request = requests[submitted];
+            _ = ring.read(submitted, request.file.handle, .{ .buffer = request.buffer }, request.offset) catch break;
+            submitted += 1;
+        }
+
+        _ = ring.submit() catch |err| switch (err) {
+            error.SignalInterrupt => continue,
+            else => return err,
+        };
+
+        const n = ring.copy_cqes(&cqes, 1) catch |err| switch (err) {
+            error.SignalInterrupt => continue,
+            else => return err,
+        };
+        for (cqes[0..n]) |cqe| {
+            completed += 1;
+            const request = requests[@intCast(cqe.user_data)];
+            // errors and short reads are retried with pread, which also reports them properly
+            if (cqe.res < 0 or @as(usize, @intCast(cqe.res)) < request.buffer.len) {
+                readOne(request) catch |err| {
+                    if (read_error.* == null) {
+                        read_error.* = err;
+                    }
+                };
+            }
+        }
+    }
+}
+
+fn drainRing(ring: *IoUring, in_flight: usize) !void {
+    var cqes: [16]linux.io_uring_cqe = undefined;
+    var remaining = in_flight;
+    while (remaining > 0) {
+        const n = ring.copy_cqes(cqes[0..@min(remaining, cqes.len)], 1) catch |err| switch (err) {
+            error.SignalInterrupt => continue,
+            else => return err,
+        };
+        remaining -= n;
+    }
+}
+
+fn testReadAll(options: Options) !void {
+    var tmp_dir = std.testing.tmpDir(.{});
+    defer tmp_dir.cleanup();
+
+    var file = try tmp_dir.dir.createFile("data", .{ .read = true });
+    defer file.close();
+
+    var data: [1000]u8 = undefined;
+    for (&data, 0..) |*b, i| {
+        b.* = @truncate(i);
+    }
+    try file.writeAll(&data);
+
+    var reader = Self.init(std.testing.allocator, options);
+    defer reader.deinit();
+
+    // more reads than the queue depth
+    var buffers: [10][50]u8 = undefined;
+    var requests: [10]Request = undefined;
+    for (&requests, &buffers, 0..) |*request, *buffer, i| {
+        request.* = .{ .file = file, .offset = i * 90, .buffer = buffer };
+    }
+
+    for (0..2) |_| {
+        try reader.readAll(&requests);
+        for (&buffers, 0..) |*buffer, i| {
+            try std.testing.expectEqualSlices(u8, data[i * 90 .. i * 90 + 50], buffer);
+        }
+    }
+
+    var past_end_buffer: [50]u8 = undefined;
+    const past_end = Request{ .file = file, .offset = 990, .buffer = &past_end_buffer };
+    try std.testing.expectError(error.EndOfStream, reader.readAll(&.{ requests[0], past_end }));
+}
+
+test "readAll" {
+    try testReadAll(.{ .queue_depth = 4 });
+}
+
+test "readAll without io_uring" {
+    try testReadAll(.{ .use_io_uring = false });
+}
@@ -0,0 +1,117 @@
+const std = @import("std");
+
+const Self = @This();
+
+// Non-blocking limit on the number of operations running at the same time,
+// shared between indexes. Callers that don't get a slot skip the work and try later,
+// they can ask to be notified when a slot is released, see tryAcquireOrNotify.
+
+// Called with the limit's lock held, so it must not use the limit.
+pub const Waiter = struct {
+    callback: *const fn (ctx: *anyopaque) void,
+    ctx: *anyopaque,
+    queued: bool = false,
+    cancelled: bool = false,
+};
+
+const WaiterList = std.DoublyLinkedList(Waiter);
+pub const WaiterNode = WaiterList.Node;
+
+max: usize,
+current: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+
+waiters_lock: std.Thread.Mutex = .{},
+waiters: WaiterList = .{},
+
+pub fn init(max: usize) Self {
+    return .{ .max = max };
+}
+
+pub fn tryAcquire(self: *Self) bool {
+    var current = self.current.load(.monotonic);
+    while (current < self.max) {
+        current = self.current.cmpxchgWeak(current, current + 1, .acquire, .monotonic) orelse return true;
+    }
+    return false;
+}
+
+// Same as tryAcquire, but if there is no free slot, the waiter is called once one is released.
+pub fn tryAcquireOrNotify(self: *Self, waiter: *WaiterNode) bool {
+    self.waiters_lock.lock();
+    defer self.waiters_lock.unlock();
+
+    if (self.tryAcquire()) {
+        return true;
+    }
+    if (!waiter.data.queued and !waiter.data.cancelled) {
+        waiter.data.queued = true;
+        self.waiters.append(waiter);
+    }
+    return false;
+}
+
+// After this returns, the waiter is not going to be called anymore.
+pub fn cancelNotify(self: *Self, waiter: *WaiterNode) void {
+    self.waiters_lock.lock();
+    defer self.waiters_lock.unlock();
+
+    if (waiter.data.queued) {
+        waiter.data.queued = false;
+        self.waiters.remove(waiter);
+    }
+    waiter.data.cancelled = true;
+}
+
+pub fn release(self: *Self) void {
+    const prev = self.current.fetchSub(1, .release);
+    std.debug.assert(prev > 0);
+
+    self.waiters_lock.lock();
+    defer self.waiters_lock.unlock();
+
+    while (self.waiters.popFirst()) |waiter| {
+        waiter.data.queued = false;
+        waiter.data.callback(waiter.data.ctx);
+    }
+}
+
+test "ConcurrencyLimit" {
+    var limit = Self.init(2);
+
+    try std.testing.expect(limit.tryAcquire());
+    try std.testing.expect(limit.tryAcquire());
+    try std.testing.expect(!limit.tryAcquire());
+
+    limit.release();
+    try std.testing.expect(limit.tryAcquire());
+}
+
+test "ConcurrencyLimit notify" {
+    var limit = Self.init(1);
+
+    const Counter = struct {
+        calls: usize = 0,
+
+        fn callback(ctx: *anyopaque) void {
+            const self: *@This() = @ptrCast(@alignCast(ctx));
+            self.calls += 1;
+        }
+    };
+
+    var counter: Counter = .{};
+    var waiter = WaiterNode{ .data = .{ .callback = Counter.callback, .ctx = &counter } };
+
+    try std.testing.expect(limit.tryAcquireOrNotify(&waiter));
+    try std.testing.expect(!limit.tryAcquireOrNotify(&waiter));
+    try std.testing.expect(!limit.tryAcquireOrNotify(&waiter));
+
+    // notified only once, even if it was skipped twice
+    limit.release();
+    try std.testing.expectEqual(1, counter.calls);
+
+    try std.testing.expect(limit.tryAcquireOrNotify(&waiter));
+    try std.testing.expect(!limit.tryAcquireOrNotify(&waiter));
+    limit.cancelNotify(&waiter);
+    limit.release();
+    try std.testing.expectEqual(1, counter.calls);
+}
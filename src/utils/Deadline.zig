@@ -17,6 +17,14 @@ pub fn isExpired(self: *const Self) bool {
     return self.deadline_ms > 0 and time.milliTimestamp() >= self.deadline_ms;
 }
 
+// Time left until the deadline, or null if there is no deadline.
+pub fn getRemainingMs(self: *const Self) ?i64 {
+    if (self.deadline_ms == 0) {
+        return null;
+    }
+    return @max(0, self.deadline_ms - time.milliTimestamp());
+}
+
 pub fn check(self: Self) !void {
     if (self.isExpired()) {
         return error.Timeout;
@@ -0,0 +1,126 @@
+const std = @import("std");
+
+const Self = @This();
+
+// Accounting of memory used by write buffers (memtables and memory segments), which is only
+// freed by checkpoints. Above the soft limit, checkpoints should start early. Above the hard
+// limit, updates wait until checkpoints catch up.
+//
+// A limit can have a parent, e.g. one per index and one global, usage is then counted in both.
+
+pub const Options = struct {
+    // Bytes, zero disables the limit.
+    soft_limit: usize = 0,
+    hard_limit: usize = 0,
+    // How long updates wait for memory to drop below the hard limit, before they fail.
+    max_wait_ms: u64 = 1000,
+};
+
+// how often waiting updates check the parent's usage
+const poll_interval_ms = 10;
+
+options: Options,
+parent: ?*Self = null,
+
+used: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+
+lock: std.Thread.Mutex = .{},
+released: std.Thread.Condition = .{},
+
+pub fn init(options: Options, parent: ?*Self) Self {
+    return .{
+        .options = options,
+        .parent = parent,
+    };
+}
+
+pub fn getUsed(self: *const Self) usize {
+    return self.used.load(.monotonic);
+}
+
+// Replaces previously reported usage with the current one.
+pub fn update(self: *Self, old_size: usize, new_size: usize) void {
+    if (new_size >= old_size) {
+        _ = self.used.fetchAdd(new_size - old_size, .monotonic);
+    } else {
+        _ = self.used.fetchSub(old_size - new_size, .monotonic);
+
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        self.released.broadcast();
+    }
+    if (self.parent) |parent| {
+        parent.update(old_size, new_size);
+    }
+}
+
+pub fn isOverSoftLimit(self: *const Self) bool {
+    if (self.options.soft_limit > 0 and self.getUsed() > self.options.soft_limit) {
+        return true;
+    }
+    if (self.parent) |parent| {
+        return parent.isOverSoftLimit();
+    }
+    return false;
+}
+
+pub fn isOverHardLimit(self: *const Self) bool {
+    if (self.options.hard_limit > 0 and self.getUsed() > self.options.hard_limit) {
+        return true;
+    }
+    if (self.parent) |parent| {
+        return parent.isOverHardLimit();
+    }
+    return false;
+}
+
+// Waits until the usage is below the hard limit, in this limit and all parents.
+pub fn waitForMemory(self: *Self) error{MemoryLimitExceeded}!void {
+    if (!self.isOverHardLimit()) {
+        return;
+    }
+
+    var timer = std.time.Timer.start() catch unreachable;
+    const max_wait_ns = self.options.max_wait_ms * std.time.ns_per_ms;
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    while (self.isOverHardLimit()) {
+        const elapsed = timer.read();
+        if (elapsed >= max_wait_ns) {
+            return error.MemoryLimitExceeded;
+        }
+        // parents are not signaling us, so don't wait on the condition for too long
+        const wait_ns = @min(max_wait_ns - elapsed, poll_interval_ms * std.time.ns_per_ms);
+        self.released.timedWait(&self.lock, wait_ns) catch {};
+    }
+}
+
+test "MemoryLimit" {
+    var global = Self.init(.{ .hard_limit = 1000 }, null);
+    var limit = Self.init(.{ .soft_limit = 100, .hard_limit = 200, .max_wait_ms = 10 }, &global);
+
+    limit.update(0, 150);
+    try std.testing.expect(limit.isOverSoftLimit());
+    try std.testing.expect(!limit.isOverHardLimit());
+    try std.testing.expectEqual(150, global.getUsed());
+
+    limit.update(150, 250);
+    try std.testing.expect(limit.isOverHardLimit());
+    try std.testing.expectError(error.MemoryLimitExceeded, limit.waitForMemory());
+
+    limit.update(250, 50);
+    try std.testing.expect(!limit.isOverSoftLimit());
+    try limit.waitForMemory();
+
+    // the global limit applies as well
+    var other = Self.init(.{}, &global);
+    other.update(0, 2000);
+    try std.testing.expect(limit.isOverHardLimit());
+    try std.testing.expectError(error.MemoryLimitExceeded, limit.waitForMemory());
+
+    other.update(2000, 0);
+    try std.testing.expectEqual(50, global.getUsed());
+}
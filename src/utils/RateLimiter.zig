@@ -0,0 +1,179 @@
+const std = @import("std");
+
+const Self = @This();
+
+// Token bucket limiting background writes (checkpoints and merges) to a number of bytes per second.
+//
+// A limiter can have a parent, e.g. one per index and one global, writes then need to
+// fit into both budgets. The rate adapts to search load, it goes down when the
+// average search latency is above the target, or when too many searches are running.
+
+pub const Options = struct {
+    // Bytes per second, zero means unlimited.
+    bytes_per_second: u64 = 0,
+    // Back off when the average search latency is above this, zero disables it.
+    target_search_latency_ms: u64 = 0,
+    // Back off when more searches than this are running, zero disables it.
+    max_active_searches: usize = 0,
+    // Never go below this fraction of the configured rate.
+    min_rate_factor: f64 = 0.1,
+};
+
+const max_burst_seconds = 0.1;
+const latency_decay = 0.9;
+// With no searches running, the average latency halves every this many milliseconds,
+// so that writes are not throttled forever after a burst of slow searches.
+const idle_latency_half_life_ms = 1000;
+
+options: Options,
+parent: ?*Self = null,
+
+lock: std.Thread.Mutex = .{},
+available: f64 = 0,
+timer: std.time.Timer,
+last_refill: u64 = 0,
+
+// exponential moving average of search latency, in microseconds
+search_latency_us: std.atomic.Value(u64) = std.atomic.Value(u64).init(0),
+active_searches: std.atomic.Value(usize) = std.atomic.Value(usize).init(0),
+// wall clock time when the last search finished, in milliseconds
+last_search_end_ms: std.atomic.Value(i64) = std.atomic.Value(i64).init(0),
+
+pub fn init(options: Options, parent: ?*Self) Self {
+    return .{
+        .options = options,
+        .parent = parent,
+        .timer = std.time.Timer.start() catch unreachable,
+        .last_search_end_ms = std.atomic.Value(i64).init(std.time.milliTimestamp()),
+    };
+}
+
+pub fn beginSearch(self: *Self) void {
+    _ = self.active_searches.fetchAdd(1, .monotonic);
+}
+
+pub fn endSearch(self: *Self, duration_us: u64) void {
+    _ = self.active_searches.fetchSub(1, .monotonic);
+
+    // races between concurrent updates only lose a sample, that's fine for an average
+    const prev: f64 = @floatFromInt(self.search_latency_us.load(.monotonic));
+    const next = prev * latency_decay + @as(f64, @floatFromInt(duration_us)) * (1 - latency_decay);
+    self.search_latency_us.store(@intFromFloat(next), .monotonic);
+    self.last_search_end_ms.store(std.time.milliTimestamp(), .monotonic);
+}
+
+// Returns the average search latency, decayed by the time since the last search
+// finished if there are no searches running.
+fn getSearchLatencyAt(self: *const Self, now_ms: i64) f64 {
+    const latency: f64 = @floatFromInt(self.search_latency_us.load(.monotonic));
+    if (self.active_searches.load(.monotonic) > 0) {
+        return latency;
+    }
+    const idle_ms = now_ms - self.last_search_end_ms.load(.monotonic);
+    if (idle_ms <= 0) {
+        return latency;
+    }
+    const half_lives = @as(f64, @floatFromInt(idle_ms)) / idle_latency_half_life_ms;
+    return latency * std.math.pow(f64, 0.5, half_lives);
+}
+
+// Returns the fraction of the configured rate that can be used now.
+pub fn getRateFactor(self: *const Self) f64 {
+    return self.getRateFactorAt(std.time.milliTimestamp());
+}
+
+fn getRateFactorAt(self: *const Self, now_ms: i64) f64 {
+    var factor: f64 = 1.0;
+    if (self.options.target_search_latency_ms > 0) {
+        const latency = self.getSearchLatencyAt(now_ms);
+        const target: f64 = @floatFromInt(self.options.target_search_latency_ms * std.time.us_per_ms);
+        if (latency > target) {
+            factor = target / latency;
+        }
+    }
+    if (self.options.max_active_searches > 0) {
+        if (self.active_searches.load(.monotonic) > self.options.max_active_searches) {
+            factor /= 2;
+        }
+    }
+    return @max(factor, self.options.min_rate_factor);
+}
+
+// Takes the bytes from the budget and returns how long the caller needs to wait, in nanoseconds.
+fn reserve(self: *Self, num_bytes: usize) u64 {
+    if (self.options.bytes_per_second == 0) {
+        return 0;
+    }
+
+    self.lock.lock();
+    defer self.lock.unlock();
+
+    const rate = @as(f64, @floatFromInt(self.options.bytes_per_second)) * self.getRateFactor();
+
+    const now = self.timer.read();
+    const elapsed = @as(f64, @floatFromInt(now - self.last_refill)) / std.time.ns_per_s;
+    self.last_refill = now;
+    self.available = @min(self.available + elapsed * rate, rate * max_burst_seconds);
+
+    // go into debt, the caller pays it off by sleeping
+    self.available -= @floatFromInt(num_bytes);
+    if (self.available >= 0) {
+        return 0;
+    }
+    return @intFromFloat(-self.available / rate * std.time.ns_per_s);
+}
+
+// Blocks until the bytes fit into the budget of this limiter and all its parents.
+pub fn acquire(self: *Self, num_bytes: usize) void {
+    var wait: u64 = 0;
+    var limiter: ?*Self = self;
+    while (limiter) |l| : (limiter = l.parent) {
+        wait = @max(wait, l.reserve(num_bytes));
+    }
+    if (wait > 0) {
+        std.time.sleep(wait);
+    }
+}
+
+test "unlimited" {
+    var limiter = Self.init(.{}, null);
+    try std.testing.expectEqual(0, limiter.reserve(1_000_000_000));
+}
+
+test "limited" {
+    var limiter = Self.init(.{ .bytes_per_second = 1000 }, null);
+    // the bucket starts empty, so one second worth of bytes needs about one second of waiting
+    const wait = limiter.reserve(1000);
+    try std.testing.expect(wait > std.time.ns_per_s / 2 and wait <= std.time.ns_per_s);
+}
+
+test "adaptive rate" {
+    var limiter = Self.init(.{ .bytes_per_second = 1000, .target_search_latency_ms = 10, .max_active_searches = 1 }, null);
+    try std.testing.expectEqual(1.0, limiter.getRateFactor());
+
+    limiter.search_latency_us.store(40 * std.time.us_per_ms, .monotonic);
+    try std.testing.expectApproxEqAbs(0.25, limiter.getRateFactor(), 0.001);
+
+    limiter.beginSearch();
+    limiter.beginSearch();
+    try std.testing.expectApproxEqAbs(0.125, limiter.getRateFactor(), 0.001);
+
+    limiter.search_latency_us.store(1000 * std.time.us_per_ms, .monotonic);
+    try std.testing.expectApproxEqAbs(0.1, limiter.getRateFactor(), 0.001);
+}
+
+test "search latency decays when idle" {
+    var limiter = Self.init(.{ .bytes_per_second = 1000, .target_search_latency_ms = 10 }, null);
+
+    limiter.beginSearch();
+    limiter.endSearch(1000 * std.time.us_per_ms);
+    limiter.search_latency_us.store(40 * std.time.us_per_ms, .monotonic);
+    const end = limiter.last_search_end_ms.load(.monotonic);
+    try std.testing.expectApproxEqAbs(0.25, limiter.getRateFactorAt(end), 0.001);
+    try std.testing.expectApproxEqAbs(0.5, limiter.getRateFactorAt(end + idle_latency_half_life_ms), 0.001);
+    try std.testing.expectEqual(1.0, limiter.getRateFactorAt(end + 10 * idle_latency_half_life_ms));
+
+    // running searches keep the latency
+    limiter.beginSearch();
+    try std.testing.expectApproxEqAbs(0.25, limiter.getRateFactorAt(end + 10 * idle_latency_half_life_ms), 0.001);
+}
@@ -1,19 +1,39 @@
 const std = @import("std");
 const log = std.log.scoped(.scheduler);
 
-const Priority = enum(u8) {
+const metrics = @import("../metrics.zig");
+
+pub const Priority = enum(u8) {
     high = 0,
     medium = 1,
     low = 2,
     do_not_run = 3,
 };
 
+// do_not_run tasks are never queued
+const num_priorities = @intFromEnum(Priority.do_not_run);
+
+pub const Policy = enum {
+    // always run the highest priority task that is allowed to run
+    strict,
+    // run up to `weights[p]` tasks of each priority in turn, so that lower priorities are not starved
+    weighted,
+};
+
+pub const Options = struct {
+    policy: Policy = .strict,
+    weights: [num_priorities]u32 = .{ 8, 4, 1 },
+    // maximum number of worker threads running tasks of each priority, zero means no limit
+    max_threads: [num_priorities]u32 = .{ 0, 0, 0 },
+};
+
 const TaskStatus = struct {
     reschedule: usize = 0,
     scheduled: bool = false,
     running: bool = false,
     done: std.Thread.ResetEvent = .{},
     priority: Priority,
+    queued_at: i128 = 0,
     ctx: *anyopaque,
     runFn: *const fn (ctx: *anyopaque) void,
     deinitFn: *const fn (ctx: *anyopaque, allocator: std.mem.Allocator) void,
@@ -25,18 +45,25 @@ pub const Task = *Queue.Node;
 const Self = @This();
 
 allocator: std.mem.Allocator,
+options: Options,
 threads: std.ArrayListUnmanaged(std.Thread) = .{},
 
-queue: Queue = .{},
+// one FIFO queue per priority, all protected by queue_mutex
+queues: [num_priorities]Queue = [_]Queue{.{}} ** num_priorities,
+queue_lengths: [num_priorities]usize = [_]usize{0} ** num_priorities,
+running: [num_priorities]usize = [_]usize{0} ** num_priorities,
+credits: [num_priorities]u32,
 queue_not_empty: std.Thread.Condition = .{},
 queue_mutex: std.Thread.Mutex = .{},
 stopping: bool = false,
 
 num_tasks: usize = 0,
 
-pub fn init(allocator: std.mem.Allocator) Self {
+pub fn init(allocator: std.mem.Allocator, options: Options) Self {
     return .{
         .allocator = allocator,
+        .options = options,
+        .credits = options.weights,
     };
 }
 
@@ -94,10 +121,12 @@ fn dequeue(self: *Self, task: Task) void {
     defer self.queue_mutex.unlock();
 
     if (task.data.scheduled) {
-        self.queue.remove(task);
+        const p = @intFromEnum(task.data.priority);
+        self.queues[p].remove(task);
         task.next = null;
         task.prev = null;
         task.data.scheduled = false;
+        self.updateQueueLength(p, -1);
     }
 
     task.data.reschedule = 0;
@@ -119,6 +148,10 @@ pub fn scheduleTask(self: *Self, task: Task) void {
     self.queue_mutex.lock();
     defer self.queue_mutex.unlock();
 
+    if (task.data.priority == .do_not_run) {
+        return;
+    }
+
     if (task.data.scheduled or task.data.running) {
         task.data.reschedule += 1;
     } else {
@@ -126,26 +159,66 @@ pub fn scheduleTask(self: *Self, task: Task) void {
     }
 }
 
+fn updateQueueLength(self: *Self, p: usize, delta: isize) void {
+    self.queue_lengths[p] = @intCast(@as(isize, @intCast(self.queue_lengths[p])) + delta);
+    metrics.schedulerQueueLength(@enumFromInt(p), self.queue_lengths[p]);
+}
+
 fn enqueue(self: *Self, task: *Queue.Node) void {
+    const p = @intFromEnum(task.data.priority);
     task.data.scheduled = true;
-    self.queue.prepend(task);
+    task.data.queued_at = std.time.nanoTimestamp();
+    self.queues[p].append(task);
+    self.updateQueueLength(p, 1);
     self.queue_not_empty.signal();
 }
 
+fn canRun(self: *const Self, p: usize) bool {
+    const max_threads = self.options.max_threads[p];
+    return self.queues[p].first != null and (max_threads == 0 or self.running[p] < max_threads);
+}
+
+// Picks the queue to take the next task from, null if there is nothing we can run now.
+fn pickQueue(self: *Self) ?usize {
+    var first_runnable: ?usize = null;
+    for (0..num_priorities) |p| {
+        if (!self.canRun(p)) {
+            continue;
+        }
+        if (self.options.policy == .strict or self.credits[p] > 0) {
+            return p;
+        }
+        if (first_runnable == null) {
+            first_runnable = p;
+        }
+    }
+    // all runnable priorities used up their turn, start a new round
+    if (first_runnable) |p| {
+        self.credits = self.options.weights;
+        return p;
+    }
+    return null;
+}
+
 fn getTaskToRun(self: *Self) ?*Queue.Node {
     self.queue_mutex.lock();
     defer self.queue_mutex.unlock();
 
     while (!self.stopping) {
-        const task = self.queue.popFirst() orelse {
+        const p = self.pickQueue() orelse {
             self.queue_not_empty.timedWait(&self.queue_mutex, std.time.us_per_min) catch {};
             continue;
         };
+        const task = self.queues[p].popFirst().?;
         task.prev = null;
         task.next = null;
         task.data.scheduled = false;
         task.data.running = true;
         task.data.done.reset();
+        self.credits[p] -|= 1;
+        self.running[p] += 1;
+        self.updateQueueLength(p, -1);
+        metrics.schedulerWaitTime(task.data.priority, @intCast(@max(0, std.time.nanoTimestamp() - task.data.queued_at)));
         return task;
     }
     return null;
@@ -155,9 +228,15 @@ fn markAsDone(self: *Self, task: *Queue.Node) void {
     self.queue_mutex.lock();
     defer self.queue_mutex.unlock();
 
+    const p = @intFromEnum(task.data.priority);
+    self.running[p] -= 1;
+
     if (task.data.reschedule > 0) {
         task.data.reschedule -= 1;
         self.enqueue(task);
+    } else if (self.queues[p].first != null) {
+        // a thread slot for this priority is free again
+        self.queue_not_empty.signal();
     }
 
     task.data.running = false;
@@ -206,7 +285,7 @@ pub fn stop(self: *Self) void {
 }
 
 test "Scheduler: smoke test" {
-    var scheduler = Self.init(std.testing.allocator);
+    var scheduler = Self.init(std.testing.allocator, .{});
     defer scheduler.deinit();
 
     const Counter = struct {
@@ -231,3 +310,102 @@ test "Scheduler: smoke test" {
 
     try std.testing.expect(counter.count == 3);
 }
+
+const TestRecorder = struct {
+    lock: std.Thread.Mutex = .{},
+    order: std.BoundedArray(Priority, 16) = .{},
+    running: usize = 0,
+    max_running: usize = 0,
+    done: std.Thread.ResetEvent = .{},
+    expected: usize,
+
+    fn run(self: *@This(), priority: Priority) void {
+        {
+            self.lock.lock();
+            defer self.lock.unlock();
+            self.order.appendAssumeCapacity(priority);
+            self.running += 1;
+            self.max_running = @max(self.max_running, self.running);
+        }
+
+        std.time.sleep(10 * std.time.ns_per_ms);
+
+        self.lock.lock();
+        defer self.lock.unlock();
+        self.running -= 1;
+        if (self.order.len == self.expected) {
+            self.done.set();
+        }
+    }
+};
+
+test "Scheduler: strict priority" {
+    var scheduler = Self.init(std.testing.allocator, .{});
+    defer scheduler.deinit();
+
+    var recorder = TestRecorder{ .expected = 3 };
+
+    var tasks: [3]Task = undefined;
+    for (&tasks, [_]Priority{ .low, .medium, .high }) |*task, priority| {
+        task.* = try scheduler.createTask(priority, TestRecorder.run, .{ &recorder, priority });
+    }
+    defer for (tasks) |task| scheduler.destroyTask(task);
+
+    for (tasks) |task| {
+        scheduler.scheduleTask(task);
+    }
+
+    try scheduler.start(1);
+    try recorder.done.timedWait(10 * std.time.ns_per_s);
+    scheduler.stop();
+
+    try std.testing.expectEqualSlices(Priority, &.{ .high, .medium, .low }, recorder.order.slice());
+}
+
+test "Scheduler: weighted priority" {
+    var scheduler = Self.init(std.testing.allocator, .{ .policy = .weighted, .weights = .{ 2, 1, 1 } });
+    defer scheduler.deinit();
+
+    var recorder = TestRecorder{ .expected = 8 };
+
+    var tasks: [8]Task = undefined;
+    for (&tasks, 0..) |*task, i| {
+        const priority: Priority = if (i < 6) .high else .low;
+        task.* = try scheduler.createTask(priority, TestRecorder.run, .{ &recorder, priority });
+    }
+    defer for (tasks) |task| scheduler.destroyTask(task);
+
+    for (tasks) |task| {
+        scheduler.scheduleTask(task);
+    }
+
+    try scheduler.start(1);
+    try recorder.done.timedWait(10 * std.time.ns_per_s);
+    scheduler.stop();
+
+    // the low priority tasks get their turn before all the high priority ones are done
+    try std.testing.expectEqualSlices(Priority, &.{ .high, .high, .low, .high, .high, .low, .high, .high }, recorder.order.slice());
+}
+
+test "Scheduler: max threads per priority" {
+    var scheduler = Self.init(std.testing.allocator, .{ .max_threads = .{ 0, 0, 1 } });
+    defer scheduler.deinit();
+
+    var recorder = TestRecorder{ .expected = 4 };
+
+    var tasks: [4]Task = undefined;
+    for (&tasks) |*task| {
+        task.* = try scheduler.createTask(.low, TestRecorder.run, .{ &recorder, .low });
+    }
+    defer for (tasks) |task| scheduler.destroyTask(task);
+
+    for (tasks) |task| {
+        scheduler.scheduleTask(task);
+    }
+
+    try scheduler.start(4);
+    try recorder.done.timedWait(10 * std.time.ns_per_s);
+    scheduler.stop();
+
+    try std.testing.expectEqual(1, recorder.max_running);
+}
@@ -0,0 +1,91 @@
+const std = @import("std");
+const linux = std.os.linux;
+
+// Helpers for memory mapped segment files, which are not all exposed by std.posix.
+
+pub const LockError = error{ PermissionDenied, SystemResources, Unexpected };
+
+// Locks the pages in memory, faulting them in first. Fails if it would go over RLIMIT_MEMLOCK.
+pub fn lock(data: []align(std.mem.page_size) const u8) LockError!void {
+    const rc = linux.syscall2(.mlock, @intFromPtr(data.ptr), data.len);
+    switch (std.posix.errno(rc)) {
+        .SUCCESS => {},
+        .PERM => return error.PermissionDenied,
+        .NOMEM, .AGAIN => return error.SystemResources,
+        else => |err| return std.posix.unexpectedErrno(err),
+    }
+}
+
+pub fn unlock(data: []align(std.mem.page_size) const u8) void {
+    _ = linux.syscall2(.munlock, @intFromPtr(data.ptr), data.len);
+}
+
+// Transparent huge pages for file mappings need CONFIG_READ_ONLY_THP_FOR_FS, the hint
+// is ignored by kernels that can't use them.
+pub fn adviseHugePages(data: []align(std.mem.page_size) const u8) void {
+    std.posix.madvise(@constCast(data.ptr), data.len, linux.MADV.HUGEPAGE) catch {};
+}
+
+// Starts reading the pages of data in the background, so that the next access doesn't
+// need to wait for a page fault.
+pub fn prefetch(data: []const u8) void {
+    const page_size = std.mem.page_size;
+    const start = std.mem.alignBackward(usize, @intFromPtr(data.ptr), page_size);
+    const end = @intFromPtr(data.ptr) + data.len;
+    if (start >= end) {
+        return;
+    }
+    std.posix.madvise(@ptrFromInt(start), end - start, linux.MADV.WILLNEED) catch {};
+}
+
+// Drops the pages that are fully inside data from the mapping, they are read from the file
+// again on the next access.
+pub fn release(data: []const u8) void {
+    const page_size = std.mem.page_size;
+    const start = std.mem.alignForward(usize, @intFromPtr(data.ptr), page_size);
+    const end = std.mem.alignBackward(usize, @intFromPtr(data.ptr) + data.len, page_size);
+    if (start >= end) {
+        return;
+    }
+    std.posix.madvise(@ptrFromInt(start), end - start, linux.MADV.DONTNEED) catch {};
+}
+
+// Number of bytes that are currently in memory, according to mincore.
+pub fn getResidentSize(data: []align(std.mem.page_size) const u8) !usize {
+    const page_size = std.mem.page_size;
+
+    var pages: [4096]u8 = undefined;
+    var resident: usize = 0;
+
+    var offset: usize = 0;
+    while (offset < data.len) {
+        const len = @min(data.len - offset, pages.len * page_size);
+        const rc = linux.syscall3(.mincore, @intFromPtr(data.ptr) + offset, len, @intFromPtr(&pages));
+        switch (std.posix.errno(rc)) {
+            .SUCCESS => {},
+            .NOMEM => return error.InvalidAddress,
+            else => |err| return std.posix.unexpectedErrno(err),
+        }
+        const num_pages = (len + page_size - 1) / page_size;
+        for (pages[0..num_pages], 0..) |page, i| {
+            if (page & 1 != 0) {
+                resident += @min(page_size, len - i * page_size);
+            }
+        }
+        offset += len;
+    }
+    return resident;
+}
+
+test "getResidentSize" {
+    const page_size = std.mem.page_size;
+
+    const data = try std.posix.mmap(null, 10 * page_size, std.posix.PROT.READ | std.posix.PROT.WRITE, .{ .TYPE = .PRIVATE, .ANONYMOUS = true }, -1, 0);
+    defer std.posix.munmap(data);
+
+    try std.testing.expectEqual(0, try getResidentSize(data));
+
+    data[0] = 1;
+    data[5 * page_size] = 1;
+    try std.testing.expectEqual(2 * page_size, try getResidentSize(data));
+}
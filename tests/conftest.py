@@ -1,5 +1,6 @@
 import requests
 import pytest
+import socket
 import subprocess
 import time
 from urllib.parse import urljoin
@@ -15,10 +16,11 @@ class ServerDied(Exception):
 
 class ServerManager:
 
-    def __init__(self, base_dir, port):
+    def __init__(self, base_dir, port, extra_args=()):
         self.data_dir = base_dir / 'data'
         self.log_file = base_dir / 'server.log'
         self.port = port
+        self.extra_args = list(extra_args)
         self.process = None
 
     def start(self):
@@ -27,7 +29,7 @@ class ServerManager:
             '--dir', str(self.data_dir),
             '--port', str(self.port),
             '--log-level', 'debug',
-        ]
+        ] + self.extra_args
         self.process = subprocess.Popen(
             command,
             stdin=subprocess.DEVNULL,
@@ -87,7 +89,34 @@ class ServerManager:
 
 @pytest.fixture(scope='session')
 def server(tmp_path_factory):
-    srv = ServerManager(base_dir=tmp_path_factory.mktemp('srv'), port=26081)
+    srv = ServerManager(
+        base_dir=tmp_path_factory.mktemp('srv'),
+        port=26081,
+        extra_args=['--legacy-port', str(legacy_port)],
+    )
+    srv.start()
+    try:
+        yield srv
+    finally:
+        srv.stop()
+        srv.print_error_log()
+
+
+legacy_port = 26080
+
+replicated_index_name = 'replicated'
+
+
+@pytest.fixture(scope='session')
+def replica_server(tmp_path_factory, server):
+    srv = ServerManager(
+        base_dir=tmp_path_factory.mktemp('replica'),
+        port=26082,
+        extra_args=[
+            '--primary', f'http://localhost:{server.port}',
+            '--replicate', replicated_index_name,
+        ],
+    )
     srv.start()
     try:
         yield srv
@@ -143,6 +172,35 @@ def client(session, server):
     return Client(session, f'http://localhost:{server.port}')
 
 
+@pytest.fixture
+def replica_client(session, replica_server):
+    return Client(session, f'http://localhost:{replica_server.port}')
+
+
+class LegacyClient:
+    def __init__(self, sock):
+        self.sock = sock
+        self.reader = sock.makefile('rb')
+
+    def send(self, *commands):
+        self.sock.sendall(b''.join(c.encode('ascii') + b'\n' for c in commands))
+
+    def receive(self):
+        return self.reader.readline().decode('ascii').rstrip('\r\n')
+
+    def request(self, command):
+        self.send(command)
+        return self.receive()
+
+
+@pytest.fixture
+def legacy_client(server):
+    with socket.create_connection(('localhost', legacy_port), timeout=1) as sock:
+        client = LegacyClient(sock)
+        yield client
+        client.reader.close()
+
+
 @pytest.fixture()
 def create_index(client, index_name):
     req = client.put(f'/{index_name}')
@@ -61,6 +61,56 @@ def test_insert_multi(client, index_name, create_index):
     }
 
 
+def test_search_profile(client, index_name, create_index):
+    req = client.put(f'/{index_name}/1', json={'hashes': [101, 201, 301]})
+    assert req.status_code == 200, req.content
+
+    req = client.post(f'/{index_name}/_search', json={
+        'query': [101, 201, 301],
+        'profile': True,
+    })
+    assert req.status_code == 200, req.content
+    body = json.loads(req.content)
+    assert body['results'] == [{'id': 1, 'score': 3}]
+    profile = body['profile']
+    assert profile['timed_out'] is False
+    assert profile['candidates'] == 1
+    assert sum(s['postings'] for s in profile['segments']) == 3
+
+    req = client.post(f'/{index_name}/_search', json={
+        'query': [101, 201, 301],
+    })
+    assert req.status_code == 200, req.content
+    assert 'profile' not in json.loads(req.content)
+
+
+def test_multi_search(client, index_name, create_index):
+    req = client.post(f'/{index_name}/_update', json={
+        'changes': [
+            {'insert': {'id': 1, 'hashes': [101, 201, 301]}},
+            {'insert': {'id': 2, 'hashes': [102, 202, 302]}},
+        ],
+    })
+    assert req.status_code == 200, req.content
+    assert json.loads(req.content) == {}
+
+    req = client.post(f'/{index_name}/_msearch', json={
+        'queries': [
+            {'query': [102, 202, 302]},
+            {'query': [1000, 2000, 3000]},
+            {'query': [101, 201, 301, 102], 'limit': 1},
+        ],
+    })
+    assert req.status_code == 200, req.content
+    assert json.loads(req.content) == {
+        'responses': [
+            {'results': [{'id': 2, 'score': 3}], 'timed_out': False},
+            {'results': [], 'timed_out': False},
+            {'results': [{'id': 1, 'score': 3}], 'timed_out': False},
+        ],
+    }
+
+
 def test_update_full(client, index_name, create_index):
     # insert fingerprint
     req = client.post(f'/{index_name}/_update', json={
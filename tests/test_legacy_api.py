@@ -0,0 +1,50 @@
+def test_echo(legacy_client):
+    assert legacy_client.request('echo hello  world') == 'OK hello world'
+
+
+def test_invalid_command(legacy_client):
+    assert legacy_client.request('foo') == 'ERR invalid command'
+    assert legacy_client.request('search 1,x,3') == 'ERR invalid command'
+    # the connection is still usable
+    assert legacy_client.request('echo ok') == 'OK ok'
+
+
+def test_insert_and_search(legacy_client):
+    assert legacy_client.request('begin') == 'OK '
+    assert legacy_client.request('insert 101 1001,1002,1003') == 'OK '
+    assert legacy_client.request('insert 102 1004,1005,-1') == 'OK '
+    assert legacy_client.request('commit') == 'OK '
+
+    assert legacy_client.request('search 1001,1002,1003') == 'OK 101:3'
+    # negative values are the signed representation of the hash
+    assert legacy_client.request('search 1004,1005,4294967295') == 'OK 102:3'
+    assert legacy_client.request('search 999999') == 'OK '
+
+
+def test_rollback(legacy_client):
+    assert legacy_client.request('begin') == 'OK '
+    assert legacy_client.request('insert 111 2001,2002,2003') == 'OK '
+    assert legacy_client.request('rollback') == 'OK '
+    assert legacy_client.request('commit') == 'OK '
+
+    assert legacy_client.request('search 2001,2002,2003') == 'OK '
+
+
+def test_attributes(legacy_client):
+    assert legacy_client.request('get attribute legacy_test') == 'OK 0'
+    assert legacy_client.request('set attribute legacy_test 42') == 'OK '
+    assert legacy_client.request('get attribute legacy_test') == 'OK 42'
+    assert legacy_client.request('set legacy_test 43') == 'OK '
+    assert legacy_client.request('get legacy_test') == 'OK 43'
+
+
+def test_pipelining(legacy_client):
+    legacy_client.send(
+        'begin',
+        'insert 121 3001,3002,3003',
+        'commit',
+        'search 3001,3002,3003',
+        'echo done',
+    )
+    responses = [legacy_client.receive() for i in range(5)]
+    assert responses == ['OK ', 'OK ', 'OK ', 'OK 121:3', 'OK done']
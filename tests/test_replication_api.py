@@ -0,0 +1,194 @@
+import time
+
+from conftest import ServerManager, replicated_index_name
+
+
+def test_replicate(client, index_name, create_index):
+    req = client.put(f'/{index_name}/1', json={'hashes': [101, 201, 301]})
+    assert req.status_code == 200, req.content
+
+    req = client.get(f'/{index_name}/_replicate', params={'from': 1})
+    assert req.status_code == 200, req.content
+    assert req.json() == {
+        'transactions': [
+            {'id': 1, 'changes': [{'insert': {'id': 1, 'hashes': [101, 201, 301]}}]},
+        ],
+        'last_commit_id': 1,
+    }
+
+    # nothing new, returns after waiting
+    req = client.get(f'/{index_name}/_replicate', params={'from': 2, 'wait': 100})
+    assert req.status_code == 200, req.content
+    assert req.json() == {'transactions': [], 'last_commit_id': 1}
+
+
+def test_replicate_not_found(client, index_name):
+    req = client.get(f'/{index_name}/_replicate')
+    assert req.status_code == 404, req.content
+
+
+def test_snapshot(client, index_name, create_index):
+    req = client.put(f'/{index_name}/1', json={'hashes': [101, 201, 301]})
+    assert req.status_code == 200, req.content
+
+    req = client.post(f'/{index_name}/_snapshot')
+    assert req.status_code == 200, req.content
+    snapshot = req.json()
+    # the update is still only in memory
+    assert snapshot['last_commit_id'] == 0
+    assert snapshot['segments'] == []
+    assert snapshot['files'] == []
+
+    # not a file from the snapshot
+    req = client.get(f'/{index_name}/_snapshot/{snapshot["id"]}/manifest')
+    assert req.status_code == 404, req.content
+
+    # the oplog is not truncated past the snapshot
+    req = client.get(f'/{index_name}/_replicate', params={'from': 1})
+    assert req.status_code == 200, req.content
+    assert [txn['id'] for txn in req.json()['transactions']] == [1]
+
+    req = client.delete(f'/{index_name}/_snapshot/{snapshot["id"]}')
+    assert req.status_code == 200, req.content
+
+    req = client.delete(f'/{index_name}/_snapshot/{snapshot["id"]}')
+    assert req.status_code == 404, req.content
+
+
+def test_snapshot_not_found(client, index_name):
+    req = client.post(f'/{index_name}/_snapshot')
+    assert req.status_code == 404, req.content
+
+
+def wait_for_fingerprint(client, url, timeout=10.0):
+    deadline = time.time() + timeout
+    while True:
+        req = client.get(url)
+        if req.status_code == 200 or time.time() > deadline:
+            return req
+        time.sleep(0.1)
+
+
+def test_replica(client, replica_client):
+    index_name = replicated_index_name
+
+    req = client.put(f'/{index_name}')
+    assert req.status_code == 200, req.content
+    try:
+        req = client.put(f'/{index_name}/1', json={'hashes': [101, 201, 301]})
+        assert req.status_code == 200, req.content
+
+        req = wait_for_fingerprint(replica_client, f'/{index_name}/1')
+        assert req.status_code == 200, req.content
+
+        req = replica_client.post(f'/{index_name}/_search', json={'query': [101, 201, 301]})
+        assert req.status_code == 200, req.content
+        assert req.json() == {'results': [{'id': 1, 'score': 3}]}
+
+        # replicas are read-only
+        req = replica_client.put(f'/{index_name}/2', json={'hashes': [101, 201, 301]})
+        assert req.status_code == 405, req.content
+        assert req.json() == {'error': 'ReadOnlyReplica'}
+
+        req = replica_client.get(f'/{index_name}/_health')
+        assert req.status_code == 200, req.content
+        assert 'replication_lag_commits' in req.text
+
+        req = replica_client.get('/_metrics')
+        assert req.status_code == 200, req.content
+        assert 'aindex_replication_lag_seconds' in req.text
+    finally:
+        client.delete(f'/{index_name}')
+
+
+def create_file_segment(client, index_name, timeout=10.0):
+    # enough items for the first memory segment to be checkpointed
+    hashes_per_doc = 1000
+    for batch in range(6):
+        changes = []
+        for i in range(100):
+            doc_id = batch * 100 + i + 1
+            changes.append({'insert': {'id': doc_id, 'hashes': list(range(doc_id, doc_id + hashes_per_doc))}})
+        req = client.post(f'/{index_name}/_update', json={'changes': changes}, timeout=10)
+        assert req.status_code == 200, req.content
+
+    deadline = time.time() + timeout
+    while True:
+        req = client.post(f'/{index_name}/_snapshot')
+        assert req.status_code == 200, req.content
+        snapshot = req.json()
+        if snapshot['files'] or time.time() > deadline:
+            return snapshot
+        client.delete(f'/{index_name}/_snapshot/{snapshot["id"]}')
+        time.sleep(0.1)
+
+
+def test_snapshot_file(client, index_name, create_index):
+    snapshot = create_file_segment(client, index_name)
+    assert len(snapshot['files']) > 0, snapshot
+    file = snapshot['files'][0]
+
+    url = f'/{index_name}/_snapshot/{snapshot["id"]}/{file["name"]}'
+
+    req = client.get(url, timeout=10)
+    assert req.status_code == 200, req.status_code
+    assert req.headers['accept-ranges'] == 'bytes'
+    data = req.content
+    assert len(data) == file['size']
+
+    # resuming an interrupted download
+    offset = len(data) // 2
+    req = client.get(url, headers={'range': f'bytes={offset}-'}, timeout=10)
+    assert req.status_code == 206, req.status_code
+    assert req.headers['content-range'] == f'bytes {offset}-{len(data) - 1}/{len(data)}'
+    assert req.content == data[offset:]
+
+    req = client.get(url, headers={'range': f'bytes={len(data)}-'})
+    assert req.status_code == 416, req.status_code
+    assert req.headers['content-range'] == f'bytes */{len(data)}'
+
+    req = client.delete(f'/{index_name}/_snapshot/{snapshot["id"]}')
+    assert req.status_code == 200, req.content
+
+    req = client.get(url)
+    assert req.status_code == 404, req.status_code
+
+
+def test_replica_copy_resume(client, server, index_name, create_index, tmp_path):
+    snapshot = create_file_segment(client, index_name)
+    assert len(snapshot['files']) > 0, snapshot
+    file = snapshot['files'][0]
+
+    req = client.get(f'/{index_name}/_snapshot/{snapshot["id"]}/{file["name"]}', timeout=10)
+    assert req.status_code == 200, req.status_code
+    data = req.content
+
+    req = client.delete(f'/{index_name}/_snapshot/{snapshot["id"]}')
+    assert req.status_code == 200, req.content
+
+    # a copy that was interrupted in the middle of the first file
+    replica = ServerManager(
+        base_dir=tmp_path,
+        port=26083,
+        extra_args=[
+            '--primary', f'http://localhost:{server.port}',
+            '--replicate', index_name,
+        ],
+    )
+    index_dir = replica.data_dir / index_name
+    index_dir.mkdir(parents=True)
+    (index_dir / f'{file["name"]}.part').write_bytes(data[:len(data) // 2])
+
+    replica.start()
+    try:
+        # not ready until the copy is finished
+        replica.wait_for_ready(index_name)
+
+        assert (index_dir / file['name']).read_bytes() == data
+        assert not (index_dir / f'{file["name"]}.part').exists()
+
+        replica_client = type(client)(client.session, f'http://localhost:{replica.port}')
+        req = wait_for_fingerprint(replica_client, f'/{index_name}/600')
+        assert req.status_code == 200, req.content
+    finally:
+        replica.stop()